@@ -13,14 +13,13 @@
 int main() {
   // Init
   filesystem::Filesystem fsystem{"/tmp"};
-  rpc::server::Handlers handlers{fsystem.generateHandlers()};
   std::uint64_t token = 123;
   //   std::unordered_map<std::uint64_t, std::array<bool, 7>> users;
   std::array<bool, 8> perms;
   perms.fill(true);
   std::unordered_map<std::uint64_t, std::array<bool, 8>> users{{token, perms}};
   auto protoServ = std::make_shared<rpc::udp::Server>();
-  rpc::server::Server serv{handlers, protoServ, users};
+  rpc::server::TypedServer serv{fsystem, protoServ, users, 4};
 
   rpc::client::Client client{123,
                              std::make_shared<rpc::udp::Client>("localhost")};
@@ -56,4 +55,7 @@ int main() {
   std::cout << "rename\n";
   client.unlink("newfile");
   std::cout << "unlink\n";
+
+  // Callback is destroyed before the thread, so stop has to be requested here
+  thread.request_stop();
 }
\ No newline at end of file
@@ -0,0 +1,100 @@
+#ifndef FILESYSTEM_CACHE_HPP
+#define FILESYSTEM_CACHE_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace filesystem {
+
+// Files are cached in aligned blocks of this size
+constexpr std::size_t blockSize = 64 << 10;
+constexpr std::size_t cacheShards = 16;
+
+struct CacheStats {
+  std::uint64_t hits;
+  std::uint64_t misses;
+};
+
+using Block = std::shared_ptr<const std::vector<std::uint8_t>>;
+
+// Device and inode of a file, the same whichever path it is opened by
+struct FileId {
+  std::uint64_t device;
+  std::uint64_t inode;
+
+  bool operator==(const FileId&) const = default;
+};
+
+// Sharded cache of file blocks keyed by FileId, evicting with the CLOCK
+// algorithm. Invalidating a file bumps its generation, blocks cached under
+// an older one are not hit anymore and age out. A block shorter than
+// blockSize ends the file. Thread safe.
+class BlockCache {
+public:
+  // Capacity in bytes, at least one block per shard is kept
+  BlockCache(std::size_t capacity);
+
+  // Generation blocks read from now on are cached under
+  std::uint64_t generation(FileId file);
+  void invalidate(FileId file);
+
+  // Returns nullptr on a miss
+  Block find(FileId file, std::uint64_t generation,
+             std::uint64_t block);
+  void insert(FileId file, std::uint64_t generation,
+              std::uint64_t block, Block data);
+
+  CacheStats stats() const {
+    return {.hits = this->hits.load(std::memory_order_relaxed),
+            .misses = this->misses.load(std::memory_order_relaxed)};
+  }
+
+private:
+  struct Key {
+    FileId file;
+    std::uint64_t generation;
+    std::uint64_t block;
+
+    bool operator==(const Key&) const = default;
+  };
+  struct KeyHash {
+    std::size_t operator()(const Key& key) const;
+  };
+  struct Slot {
+    Key key;
+    Block data;
+    // Cleared when the hand passes, set again by hits
+    bool referenced;
+  };
+  struct Shard {
+    std::mutex mutex;
+    std::vector<Slot> slots{};
+    std::unordered_map<Key, std::size_t, KeyHash> index{};
+    std::size_t hand{0};
+  };
+  struct FileIdHash {
+    std::size_t operator()(const FileId& file) const;
+  };
+  struct Generations {
+    std::mutex mutex;
+    std::unordered_map<FileId, std::uint64_t, FileIdHash> files{};
+  };
+
+  Shard& shard(const Key& key);
+  Generations& generations(FileId file);
+
+  const std::size_t slotsPerShard;
+  std::unique_ptr<Shard[]> shards;
+  std::unique_ptr<Generations[]> files;
+  std::atomic<std::uint64_t> hits{0};
+  std::atomic<std::uint64_t> misses{0};
+};
+
+} // namespace filesystem
+
+#endif // FILESYSTEM_CACHE_HPP
@@ -0,0 +1,106 @@
+#ifndef FILESYSTEM_DESCRIPTORS_HPP
+#define FILESYSTEM_DESCRIPTORS_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <shared_mutex>
+#include <utility>
+#include <vector>
+
+#include "schema.hpp"
+
+namespace filesystem {
+
+// Descriptors are generation << descriptorIndexBits | index. Generations
+// start at 1, so no descriptor is 0, and bit 31 is left to schema::batchRef.
+constexpr unsigned descriptorIndexBits = 20;
+constexpr unsigned descriptorGenerationBits = 11;
+constexpr std::size_t maxDescriptors = std::size_t{1} << descriptorIndexBits;
+
+static_assert(rpc::schema::batchRefFlag ==
+              rpc::schema::File{1}
+                  << (descriptorIndexBits + descriptorGenerationBits));
+
+// Dense table of open files. Every reuse of a slot bumps its generation, so
+// a descriptor closed earlier does not reach the file now in its slot.
+// Slots are reused oldest first, the generation of one wraps around only
+// after 2047 reuses of every freed slot. Values are empty for no file,
+// like a null shared_ptr. Thread safe.
+template <typename T> class DescriptorTable {
+public:
+  // Returns 0 when every slot is taken
+  rpc::schema::File insert(T value) {
+    std::unique_lock lock{this->mutex};
+    std::uint32_t index;
+    if (!this->unused.empty()) {
+      index = this->unused.front();
+      this->unused.pop_front();
+    } else if (this->slots.size() < maxDescriptors) {
+      index = this->slots.size();
+      this->slots.push_back(Slot{.generation = 1, .value = {}});
+    } else {
+      return 0;
+    }
+    auto& slot = this->slots[index];
+    slot.value = std::move(value);
+    return slot.generation << descriptorIndexBits | index;
+  }
+
+  // Empty for descriptors not open
+  T find(rpc::schema::File desc) {
+    std::shared_lock lock{this->mutex};
+    auto slot = this->slot(desc);
+    return slot ? slot->value : T{};
+  }
+
+  // Returns the value the descriptor had, empty if it was not open
+  T erase(rpc::schema::File desc) {
+    std::unique_lock lock{this->mutex};
+    auto slot = this->slot(desc);
+    if (!slot) {
+      return T{};
+    }
+    auto value = std::exchange(slot->value, T{});
+    slot->generation = slot->generation % maxGeneration + 1;
+    this->unused.push_back(desc & indexMask);
+    return value;
+  }
+
+  std::size_t size() {
+    std::shared_lock lock{this->mutex};
+    return this->slots.size() - this->unused.size();
+  }
+
+private:
+  static constexpr rpc::schema::File indexMask = maxDescriptors - 1;
+  static constexpr std::uint32_t maxGeneration =
+      (std::uint32_t{1} << descriptorGenerationBits) - 1;
+
+  struct Slot {
+    std::uint32_t generation;
+    T value;
+  };
+
+  // Caller holds the lock
+  Slot* slot(rpc::schema::File desc) {
+    auto index = desc & indexMask;
+    if ((desc & rpc::schema::batchRefFlag) || index >= this->slots.size()) {
+      return nullptr;
+    }
+    auto& slot = this->slots[index];
+    if (slot.generation != desc >> descriptorIndexBits || !slot.value) {
+      return nullptr;
+    }
+    return &slot;
+  }
+
+  std::shared_mutex mutex;
+  std::vector<Slot> slots{};
+  std::deque<std::uint32_t> unused{};
+};
+
+} // namespace filesystem
+
+#endif // FILESYSTEM_DESCRIPTORS_HPP
@@ -0,0 +1,56 @@
+#ifndef FILESYSTEM_ENGINE_HPP
+#define FILESYSTEM_ENGINE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+
+#include <sys/types.h>
+
+namespace filesystem {
+
+// Called with what the system call returned, or -errno when it failed
+using Completion = std::function<void(std::int64_t result)>;
+
+// Operations in flight, further submissions wait for a free slot
+constexpr unsigned defaultQueueDepth = 256;
+// Threads of the fallback engine, each runs one blocking call at a time
+constexpr std::size_t defaultEngineThreads = 16;
+
+// Runs file system calls asynchronously. Every completion is called exactly
+// once, on a thread of the engine. Buffers have to stay valid until then.
+// Destructor waits for operations in flight. Thread safe.
+class Engine {
+public:
+  virtual ~Engine() = default;
+
+  virtual void read(int fd, std::uint8_t* data, std::size_t count,
+                    ::off_t offset, Completion done) = 0;
+  virtual void write(int fd, const std::uint8_t* data, std::size_t count,
+                     ::off_t offset, Completion done) = 0;
+  // Result is the new descriptor
+  virtual void open(std::string path, int flags, ::mode_t mode,
+                    Completion done) = 0;
+  virtual void rename(std::string oldpath, std::string newpath,
+                      Completion done) = 0;
+  virtual void unlink(std::string path, Completion done) = 0;
+  // posix_fadvise, result is 0 or -errno
+  virtual void advise(int fd, ::off_t offset, std::uint64_t count, int advice,
+                      Completion done) = 0;
+
+  virtual const char* name() const = 0;
+};
+
+// io_uring engine, or a pool of threads making blocking calls when the
+// kernel does not provide io_uring or the operations above
+std::unique_ptr<Engine> makeEngine(unsigned queueDepth = defaultQueueDepth);
+// The pool of threads alone, even where io_uring is available
+std::unique_ptr<Engine>
+makeThreadEngine(unsigned queueDepth = defaultQueueDepth,
+                 std::size_t threads = defaultEngineThreads);
+
+} // namespace filesystem
+
+#endif // FILESYSTEM_ENGINE_HPP
@@ -1,20 +1,40 @@
 #ifndef FILESYSTEM_HPP
 #define FILESYSTEM_HPP
 
+#include "descriptors.hpp"
 #include "schema.hpp"
+#include <atomic>
+#include <cstddef>
 #include <cstdint>
 #include <filesystem>
 #include <fstream>
-#include <unordered_map>
+#include <ios>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
 
 #include <server.hpp>
+#include <workers.hpp>
 
 namespace filesystem {
 
+// Streams kept open when the limit on descriptors cannot be read
+constexpr std::size_t defaultOpenStreams = 1024;
+
+// Safe to use from many threads. Operations on distinct descriptors and on
+// paths run in parallel, operations on the same descriptor are serialized.
+// Descriptors stay valid however many are open, while only some of their
+// streams are: idle ones are closed and reopened at the same position when
+// used again. Renames move the descriptors of renamed files along. Streams of
+// files unlinked or replaced by a rename while open are reopened if needed
+// and then never evicted, so they keep the file they were opened with.
 class Filesystem {
 
 public:
-  Filesystem(std::filesystem::path root) : root{root} {};
+  // Up to maxStreams streams are open at once, 0 takes three quarters of
+  // RLIMIT_NOFILE
+  Filesystem(std::filesystem::path root, std::size_t maxStreams = 0);
 
   rpc::schema::File open(std::string pathname, rpc::schema::mode_t mode);
   std::int64_t read(rpc::schema::File desc, std::uint64_t count,
@@ -27,15 +47,67 @@ public:
   std::int64_t unlink(std::string pathname);
   std::int64_t rename(std::string oldpath, std::string newpath);
   std::int64_t close(rpc::schema::File desc);
+  // Stream position is restored afterwards
+  std::int64_t pread(rpc::schema::File desc, rpc::schema::off_t offset,
+                     std::uint64_t count, std::vector<std::uint8_t>& v);
+  std::int64_t pwrite(rpc::schema::File desc, rpc::schema::off_t offset,
+                      std::uint64_t count, std::vector<std::uint8_t>& v);
 
   rpc::server::Handlers generateHandlers();
+  // Descriptor operations run on transfers, in order per descriptor. Opens
+  // and path operations run on metadata, so they are not stuck behind long
+  // transfers. Pools have to outlive the handlers' callbacks.
+  rpc::server::AsyncHandlers
+  generateAsyncHandlers(rpc::workers::Pool& transfers,
+                        rpc::workers::Pool& metadata);
 
 private:
+  // Stream is locked separately, so table lock is not held during disk
+  // access
+  struct Entry {
+    Entry(std::filesystem::path file, std::ios_base::openmode mode)
+        : file{std::move(file)}, mode{mode} {}
+
+    std::mutex mutex;
+    std::fstream stream{};
+    // Changed by renames holding both mutex and pathsMutex
+    std::filesystem::path file;
+    const std::ios_base::openmode mode;
+    bool closed{false};
+    // Path no longer leads to the file, the stream is never reopened. Set
+    // holding mutex.
+    std::atomic<bool> detached{false};
+    // Saved when the stream is evicted, restored when it is reopened
+    std::fstream::pos_type position{-1};
+    std::ios_base::iostate state{};
+    // Set by operations, cleared when the eviction hand passes
+    std::atomic<bool> referenced{true};
+  };
+
+  std::shared_ptr<Entry> find(rpc::schema::File desc);
+  // Reopens the stream of a locked entry if it was evicted. False once the
+  // descriptor is closed or the file cannot be opened anymore.
+  bool resume(const std::shared_ptr<Entry>& entry);
+  // Counts the entry's stream as open, evicting idle ones over the limit
+  void admit(const std::shared_ptr<Entry>& entry);
+  void track(const std::shared_ptr<Entry>& entry);
+  void untrack(const std::shared_ptr<Entry>& entry);
+  // Keeps the streams of the file open before its path is taken from it.
+  // Caller holds pathsMutex.
+  void detach(const std::filesystem::path& file);
+
   const std::filesystem::path root;
+  const std::size_t maxStreams;
 
-  std::unordered_map<rpc::schema::File, std::fstream> files{};
-  // TODO: improve desc assignment
-  rpc::schema::File descCounter = 1;
+  DescriptorTable<std::shared_ptr<Entry>> files{};
+  // Entries by their normalized file path. Locked before an entry's mutex.
+  std::mutex pathsMutex;
+  std::multimap<std::filesystem::path, std::weak_ptr<Entry>> paths{};
+  // Entries with open streams, passed by the CLOCK hand like the blocks of
+  // BlockCache. Entries closed meanwhile are dropped when it reaches them.
+  std::mutex streamsMutex;
+  std::vector<std::weak_ptr<Entry>> streams{};
+  std::size_t hand{0};
 };
 }; // namespace filesystem
 
@@ -0,0 +1,188 @@
+#ifndef FILESYSTEM_POSIX_HPP
+#define FILESYSTEM_POSIX_HPP
+
+#include "cache.hpp"
+#include "descriptors.hpp"
+#include "engine.hpp"
+#include "schema.hpp"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace filesystem {
+
+// Offsets and sizes of O_DIRECT transfers have to be multiples of this
+constexpr std::size_t directAlignment = 4096;
+// Adjacent reads after which a descriptor is advised to be sequential
+constexpr unsigned sequentialReads = 4;
+
+struct PosixOptions {
+  // Bypass the page cache. Data goes through an aligned bounce buffer, reads
+  // and writes at unaligned offsets or of unaligned sizes fail.
+  bool direct = false;
+  // Do not update access times on reads
+  bool noAtime = false;
+  // Operations submitted to the engine at once
+  unsigned queueDepth = defaultQueueDepth;
+  // Run operations on the pool of threads even where io_uring is available
+  bool threadEngine = false;
+  // Capacity of the block cache in bytes, 0 disables it. Direct mode
+  // bypasses it.
+  std::size_t cacheBytes = 0;
+};
+
+// Backend on raw descriptors. Every descriptor keeps its own offset and
+// transfers use pread/pwrite, so operations on the same descriptor run in
+// parallel too. Modes are std::ios_base::openmode bits, like in Filesystem.
+class PosixFilesystem {
+public:
+  template <typename Response>
+  using Reply = std::function<void(Response)>;
+
+  PosixFilesystem(std::filesystem::path root, PosixOptions options = {})
+      : root{root}, options{options},
+        cache{options.cacheBytes > 0 && !options.direct
+                  ? std::make_unique<BlockCache>(options.cacheBytes)
+                  : nullptr},
+        engine{options.threadEngine ? makeThreadEngine(options.queueDepth)
+                                    : makeEngine(options.queueDepth)} {};
+
+  rpc::schema::File open(std::string pathname, rpc::schema::mode_t mode);
+  // Returns number of bytes read, less than count at the end of file
+  std::int64_t read(rpc::schema::File desc, std::uint64_t count,
+                    std::vector<std::uint8_t>& v);
+  std::int64_t write(rpc::schema::File desc, std::uint64_t count,
+                     std::vector<std::uint8_t>& v);
+  // Returns the resulting offset
+  rpc::schema::off_t lseek(rpc::schema::File desc, rpc::schema::off_t offset,
+                           std::uint32_t whence);
+  std::int64_t chmod(std::string pathname, std::uint32_t mode);
+  std::int64_t unlink(std::string pathname);
+  std::int64_t rename(std::string oldpath, std::string newpath);
+  std::int64_t close(rpc::schema::File desc);
+  // Offset of the descriptor is neither used nor moved
+  std::int64_t pread(rpc::schema::File desc, rpc::schema::off_t offset,
+                     std::uint64_t count, std::vector<std::uint8_t>& v);
+  std::int64_t pwrite(rpc::schema::File desc, rpc::schema::off_t offset,
+                      std::uint64_t count, std::vector<std::uint8_t>& v);
+  // posix_fadvise on the descriptor. Advising a pattern turns off its
+  // detection, reads are advised sequential once they follow each other.
+  std::int64_t advise(rpc::schema::File desc, rpc::schema::off_t offset,
+                      std::uint64_t count, std::uint32_t advice);
+
+  // Asynchronous variants, used by TypedServer. Replies come from the
+  // engine's threads, or right away when the request fails early. Read and
+  // write claim their range of the offset on submission, so they keep the
+  // order they were submitted in. O_DIRECT and append mode transfers run
+  // synchronously.
+  void submit(rpc::schema::OpenRequest req,
+              Reply<rpc::schema::OpenResponse> reply);
+  void submit(rpc::schema::ReadRequest req,
+              Reply<rpc::schema::ReadResponse> reply);
+  void submit(rpc::schema::WriteRequest req,
+              Reply<rpc::schema::WriteResponse> reply);
+  void submit(rpc::schema::UnlinkRequest req,
+              Reply<rpc::schema::UnlinkResponse> reply);
+  void submit(rpc::schema::RenameRequest req,
+              Reply<rpc::schema::RenameResponse> reply);
+  void submit(rpc::schema::PReadRequest req,
+              Reply<rpc::schema::PReadResponse> reply);
+  void submit(rpc::schema::PWriteRequest req,
+              Reply<rpc::schema::PWriteResponse> reply);
+  void submit(rpc::schema::AdviseRequest req,
+              Reply<rpc::schema::AdviseResponse> reply);
+
+  // Blocks counted by the cache, zeros when it is disabled
+  CacheStats cacheStats() const;
+
+private:
+  // Descriptor is closed once the last operation using it completes
+  struct Entry {
+    Entry(int fd, bool append, FileId file, BlockCache* cache)
+        : fd{fd}, append{append}, file{file}, cache{cache} {}
+    ~Entry();
+
+    const int fd;
+    const bool append;
+    // Key of the file's blocks in the cache, renames do not change it
+    const FileId file;
+    // Blocks of a file unlinked by then are invalidated on close, as its
+    // inode may be reused
+    BlockCache* const cache;
+    // Guards only the offset, not the transfers
+    std::mutex mutex;
+    rpc::schema::off_t offset{0};
+    // Where the last read ended and how many adjacent reads led there
+    std::atomic<rpc::schema::off_t> readEnd{-1};
+    std::atomic<unsigned> adjacent{0};
+    // Client declared the access pattern, it is not detected then
+    std::atomic<bool> declared{false};
+  };
+
+  // Transfer in progress on the engine, resubmitted until done
+  struct Transfer {
+    std::shared_ptr<Entry> entry;
+    bool write;
+    rpc::schema::off_t offset;
+    std::uint64_t count;
+    std::vector<std::uint8_t> bytes;
+    std::function<void(Transfer&, std::int64_t)> finish;
+    std::uint64_t done{0};
+  };
+
+  using Filled = std::function<void(std::int64_t, std::vector<std::uint8_t>)>;
+
+  std::string path(const std::string& pathname) const;
+  int openFlags(rpc::schema::mode_t mode) const;
+  // Closes fd and returns 0 if it cannot be identified
+  rpc::schema::File insert(int fd, rpc::schema::mode_t mode, bool truncated);
+  std::shared_ptr<Entry> find(rpc::schema::File desc);
+  // Claims count bytes at the offset of the entry
+  rpc::schema::off_t claim(Entry& entry, std::uint64_t count);
+  // Gives back the part of a claim that was not transferred
+  void unclaim(Entry& entry, rpc::schema::off_t offset, std::uint64_t count,
+               std::int64_t transferred);
+  std::int64_t transfer(Entry& entry, bool write, rpc::schema::off_t offset,
+                        std::uint8_t* data, std::uint64_t count);
+  void transferAsync(std::shared_ptr<Transfer> transfer);
+  // Advises the kernel when reads turn sequential or stop being so
+  void notice(Entry& entry, rpc::schema::off_t offset, std::uint64_t count);
+  // Reads at offset, through the cache when it is enabled
+  std::int64_t readAt(Entry& entry, rpc::schema::off_t offset,
+                      std::uint64_t count, std::vector<std::uint8_t>& v);
+  void readAsync(std::shared_ptr<Entry> entry, rpc::schema::off_t offset,
+                 std::uint64_t count, Filled done);
+  // Copies the range to v when all of its blocks are cached
+  bool cached(const Entry& entry, std::uint64_t generation,
+              rpc::schema::off_t offset, std::uint64_t count,
+              std::vector<std::uint8_t>& v);
+  // Caches blocks of n bytes read from the block aligned first, where n
+  // short of the requested size ends the file. Copies the range to v.
+  std::int64_t fill(const Entry& entry, std::uint64_t generation,
+                    rpc::schema::off_t first, std::uint64_t requested,
+                    const std::vector<std::uint8_t>& bytes,
+                    rpc::schema::off_t offset, std::uint64_t count,
+                    std::vector<std::uint8_t>& v);
+  // Empty when the cache is disabled or the path does not exist
+  std::optional<FileId> identify(const std::string& path) const;
+  void invalidate(std::optional<FileId> file);
+
+  const std::filesystem::path root;
+  const PosixOptions options;
+
+  DescriptorTable<std::shared_ptr<Entry>> files{};
+  std::unique_ptr<BlockCache> cache;
+  // Destroyed first, it waits for the operations in flight
+  std::unique_ptr<Engine> engine;
+};
+
+} // namespace filesystem
+
+#endif // FILESYSTEM_POSIX_HPP
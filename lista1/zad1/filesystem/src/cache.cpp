@@ -0,0 +1,107 @@
+#include <cache.hpp>
+
+#include <algorithm>
+#include <functional>
+#include <utility>
+
+namespace filesystem {
+
+BlockCache::BlockCache(std::size_t capacity)
+    : slotsPerShard{std::max<std::size_t>(
+          capacity / blockSize / cacheShards, 1)},
+      shards{std::make_unique<Shard[]>(cacheShards)},
+      files{std::make_unique<Generations[]>(cacheShards)} {
+  for (std::size_t i = 0; i < cacheShards; i++) {
+    this->shards[i].slots.reserve(this->slotsPerShard);
+    this->shards[i].index.reserve(this->slotsPerShard);
+  }
+}
+
+std::uint64_t BlockCache::generation(FileId file) {
+  auto& generations = this->generations(file);
+  std::lock_guard lock{generations.mutex};
+  auto it = generations.files.find(file);
+  return it == generations.files.end() ? 0 : it->second;
+}
+
+void BlockCache::invalidate(FileId file) {
+  auto& generations = this->generations(file);
+  std::lock_guard lock{generations.mutex};
+  generations.files[file]++;
+}
+
+Block BlockCache::find(FileId file, std::uint64_t generation,
+                       std::uint64_t block) {
+  Key key{file, generation, block};
+  auto& shard = this->shard(key);
+  {
+    std::lock_guard lock{shard.mutex};
+    auto it = shard.index.find(key);
+    if (it != shard.index.end()) {
+      auto& slot = shard.slots[it->second];
+      slot.referenced = true;
+      this->hits.fetch_add(1, std::memory_order_relaxed);
+      return slot.data;
+    }
+  }
+  this->misses.fetch_add(1, std::memory_order_relaxed);
+  return nullptr;
+}
+
+void BlockCache::insert(FileId file, std::uint64_t generation,
+                        std::uint64_t block, Block data) {
+  Key key{file, generation, block};
+  auto& shard = this->shard(key);
+  std::lock_guard lock{shard.mutex};
+  if (auto it = shard.index.find(key); it != shard.index.end()) {
+    shard.slots[it->second].data = std::move(data);
+    return;
+  }
+  if (shard.slots.size() < this->slotsPerShard) {
+    shard.index.emplace(key, shard.slots.size());
+    shard.slots.push_back(Slot{
+        .key = std::move(key), .data = std::move(data), .referenced = false});
+    return;
+  }
+
+  // Hand skips blocks hit since it last passed them
+  for (;; shard.hand = (shard.hand + 1) % shard.slots.size()) {
+    auto& slot = shard.slots[shard.hand];
+    if (slot.referenced) {
+      slot.referenced = false;
+      continue;
+    }
+    shard.index.erase(slot.key);
+    shard.index.emplace(key, shard.hand);
+    slot = Slot{.key = std::move(key), .data = std::move(data),
+                .referenced = false};
+    shard.hand = (shard.hand + 1) % shard.slots.size();
+    return;
+  }
+}
+
+std::size_t BlockCache::FileIdHash::operator()(const FileId& file) const {
+  auto hash = std::hash<std::uint64_t>{}(file.device);
+  hash ^= std::hash<std::uint64_t>{}(file.inode) + 0x9e3779b9 + (hash << 6) +
+          (hash >> 2);
+  return hash;
+}
+
+std::size_t BlockCache::KeyHash::operator()(const Key& key) const {
+  auto hash = FileIdHash{}(key.file);
+  hash ^= std::hash<std::uint64_t>{}(key.generation) + 0x9e3779b9 +
+          (hash << 6) + (hash >> 2);
+  hash ^= std::hash<std::uint64_t>{}(key.block) + 0x9e3779b9 + (hash << 6) +
+          (hash >> 2);
+  return hash;
+}
+
+BlockCache::Shard& BlockCache::shard(const Key& key) {
+  return this->shards[KeyHash{}(key) % cacheShards];
+}
+
+BlockCache::Generations& BlockCache::generations(FileId file) {
+  return this->files[FileIdHash{}(file) % cacheShards];
+}
+
+} // namespace filesystem
@@ -0,0 +1,458 @@
+#include <engine.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace filesystem {
+namespace {
+// Engine whose completion is being called on this thread. Submissions made
+// from completions do not wait for a free slot, only the same thread could
+// free it.
+thread_local const Engine* completing = nullptr;
+
+void complete(const Completion& done, std::int64_t result) {
+  try {
+    done(result);
+  } catch (std::exception& e) {
+    std::cerr << e.what() << std::endl;
+  }
+}
+
+std::int64_t result(std::int64_t n) { return n < 0 ? -errno : n; }
+
+// Operation a submission refers to through user_data, paths have to live as
+// long as it is in flight
+struct Operation {
+  Completion done;
+  std::string path{};
+  std::string newpath{};
+};
+
+class UringEngine : public Engine {
+public:
+  UringEngine(unsigned queueDepth);
+  ~UringEngine() override;
+
+  void read(int fd, std::uint8_t* data, std::size_t count, ::off_t offset,
+            Completion done) override {
+    io_uring_sqe sqe{};
+    sqe.opcode = IORING_OP_READ;
+    sqe.fd = fd;
+    sqe.addr = reinterpret_cast<std::uint64_t>(data);
+    sqe.len = count;
+    sqe.off = offset;
+    this->submit(sqe, std::make_unique<Operation>(std::move(done)));
+  }
+
+  void write(int fd, const std::uint8_t* data, std::size_t count,
+             ::off_t offset, Completion done) override {
+    io_uring_sqe sqe{};
+    sqe.opcode = IORING_OP_WRITE;
+    sqe.fd = fd;
+    sqe.addr = reinterpret_cast<std::uint64_t>(data);
+    sqe.len = count;
+    sqe.off = offset;
+    this->submit(sqe, std::make_unique<Operation>(std::move(done)));
+  }
+
+  void open(std::string path, int flags, ::mode_t mode,
+            Completion done) override {
+    auto op = std::make_unique<Operation>(std::move(done), std::move(path));
+    io_uring_sqe sqe{};
+    sqe.opcode = IORING_OP_OPENAT;
+    sqe.fd = AT_FDCWD;
+    sqe.addr = reinterpret_cast<std::uint64_t>(op->path.c_str());
+    sqe.len = mode;
+    sqe.open_flags = flags;
+    this->submit(sqe, std::move(op));
+  }
+
+  void rename(std::string oldpath, std::string newpath,
+              Completion done) override {
+    auto op = std::make_unique<Operation>(std::move(done), std::move(oldpath),
+                                          std::move(newpath));
+    io_uring_sqe sqe{};
+    sqe.opcode = IORING_OP_RENAMEAT;
+    sqe.fd = AT_FDCWD;
+    sqe.addr = reinterpret_cast<std::uint64_t>(op->path.c_str());
+    sqe.len = AT_FDCWD;
+    sqe.addr2 = reinterpret_cast<std::uint64_t>(op->newpath.c_str());
+    this->submit(sqe, std::move(op));
+  }
+
+  void unlink(std::string path, Completion done) override {
+    auto op = std::make_unique<Operation>(std::move(done), std::move(path));
+    io_uring_sqe sqe{};
+    sqe.opcode = IORING_OP_UNLINKAT;
+    sqe.fd = AT_FDCWD;
+    sqe.addr = reinterpret_cast<std::uint64_t>(op->path.c_str());
+    this->submit(sqe, std::move(op));
+  }
+
+  void advise(int fd, ::off_t offset, std::uint64_t count, int advice,
+              Completion done) override {
+    io_uring_sqe sqe{};
+    sqe.opcode = IORING_OP_FADVISE;
+    sqe.fd = fd;
+    sqe.off = offset;
+    // Length is 32 bit here, longer ranges are advised to the end of file
+    sqe.len = count > UINT32_MAX ? 0 : count;
+    sqe.fadvise_advice = advice;
+    this->submit(sqe, std::make_unique<Operation>(std::move(done)));
+  }
+
+  const char* name() const override { return "io_uring"; }
+
+private:
+  // Operation is owned by the ring until its completion, nullptr stops the
+  // reaper
+  void submit(io_uring_sqe sqe, std::unique_ptr<Operation> op);
+  void reap();
+  void unmap();
+
+  int ring = -1;
+  unsigned depth;
+  void* sqRing = MAP_FAILED;
+  std::size_t sqRingSize = 0;
+  void* cqRing = MAP_FAILED;
+  std::size_t cqRingSize = 0;
+  io_uring_sqe* sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+  std::size_t sqesSize = 0;
+
+  unsigned* sqHead;
+  unsigned* sqTail;
+  unsigned sqMask;
+  unsigned* sqArray;
+  unsigned* cqHead;
+  unsigned* cqTail;
+  unsigned cqMask;
+  io_uring_cqe* cqes;
+
+  std::mutex mutex;
+  std::condition_variable freed;
+  unsigned inflight{0};
+  std::thread reaper;
+};
+
+template <typename T> T* at(void* base, std::uint32_t offset) {
+  return reinterpret_cast<T*>(static_cast<char*>(base) + offset);
+}
+
+UringEngine::UringEngine(unsigned queueDepth) {
+  io_uring_params params{};
+  this->ring = syscall(__NR_io_uring_setup, queueDepth, &params);
+  if (this->ring < 0) {
+    throw std::system_error(errno, std::system_category(), "io_uring_setup");
+  }
+
+  this->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  this->cqRingSize =
+      params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single) {
+    this->sqRingSize = this->cqRingSize =
+        std::max(this->sqRingSize, this->cqRingSize);
+  }
+  this->sqRing =
+      mmap(nullptr, this->sqRingSize, PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_POPULATE, this->ring, IORING_OFF_SQ_RING);
+  if (!single && this->sqRing != MAP_FAILED) {
+    this->cqRing =
+        mmap(nullptr, this->cqRingSize, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, this->ring, IORING_OFF_CQ_RING);
+  }
+  this->sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+  this->sqes = static_cast<io_uring_sqe*>(
+      mmap(nullptr, this->sqesSize, PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_POPULATE, this->ring, IORING_OFF_SQES));
+  void* cq = single ? this->sqRing : this->cqRing;
+  if (this->sqRing == MAP_FAILED || cq == MAP_FAILED ||
+      this->sqes == MAP_FAILED) {
+    auto error = errno;
+    this->unmap();
+    throw std::system_error(error, std::system_category(), "io_uring mmap");
+  }
+
+  // Older kernels lack some of the operations
+  std::vector<std::uint8_t> buffer(sizeof(io_uring_probe) +
+                                   256 * sizeof(io_uring_probe_op));
+  auto probe = reinterpret_cast<io_uring_probe*>(buffer.data());
+  if (syscall(__NR_io_uring_register, this->ring, IORING_REGISTER_PROBE,
+              probe, 256) < 0) {
+    auto error = errno;
+    this->unmap();
+    throw std::system_error(error, std::system_category(), "io_uring probe");
+  }
+  for (auto op : {IORING_OP_NOP, IORING_OP_READ, IORING_OP_WRITE,
+                  IORING_OP_OPENAT, IORING_OP_RENAMEAT, IORING_OP_UNLINKAT,
+                  IORING_OP_FADVISE}) {
+    if (op > probe->last_op ||
+        !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+      this->unmap();
+      throw std::system_error(ENOSYS, std::system_category(),
+                              "io_uring operation");
+    }
+  }
+
+  this->sqHead = at<unsigned>(this->sqRing, params.sq_off.head);
+  this->sqTail = at<unsigned>(this->sqRing, params.sq_off.tail);
+  this->sqMask = *at<unsigned>(this->sqRing, params.sq_off.ring_mask);
+  this->sqArray = at<unsigned>(this->sqRing, params.sq_off.array);
+  this->cqHead = at<unsigned>(cq, params.cq_off.head);
+  this->cqTail = at<unsigned>(cq, params.cq_off.tail);
+  this->cqMask = *at<unsigned>(cq, params.cq_off.ring_mask);
+  this->cqes = at<io_uring_cqe>(cq, params.cq_off.cqes);
+  // Completion queue always has room for what is in flight
+  this->depth = std::min(params.sq_entries, params.cq_entries);
+
+  this->reaper = std::thread{[this]() { this->reap(); }};
+}
+
+UringEngine::~UringEngine() {
+  {
+    std::unique_lock lock{this->mutex};
+    this->freed.wait(lock, [this]() { return this->inflight == 0; });
+  }
+  io_uring_sqe nop{};
+  nop.opcode = IORING_OP_NOP;
+  this->submit(nop, nullptr);
+  this->reaper.join();
+  this->unmap();
+}
+
+void UringEngine::submit(io_uring_sqe sqe, std::unique_ptr<Operation> op) {
+  std::unique_lock lock{this->mutex};
+  if (completing != this) {
+    this->freed.wait(lock, [this]() { return this->inflight < this->depth; });
+  }
+
+  // Only submitters write the tail, under the mutex
+  unsigned tail = *this->sqTail;
+  unsigned index = tail & this->sqMask;
+  sqe.user_data = reinterpret_cast<std::uint64_t>(op.get());
+  this->sqes[index] = sqe;
+  this->sqArray[index] = index;
+  std::atomic_ref<unsigned>{*this->sqTail}.store(tail + 1,
+                                                 std::memory_order_release);
+  this->inflight++;
+  auto owned = op.release();
+
+  // Kernel consumes the entry during the call, unless it is out of memory
+  while (std::atomic_ref<unsigned>{*this->sqHead}.load(
+             std::memory_order_acquire) != tail + 1) {
+    if (syscall(__NR_io_uring_enter, this->ring, 1, 0, 0, nullptr, 0) < 0 &&
+        errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      auto error = errno;
+      if (std::atomic_ref<unsigned>{*this->sqHead}.load(
+              std::memory_order_acquire) == tail + 1) {
+        // Taken after all, it completes as usual
+        return;
+      }
+      // Entry is withdrawn, the caller keeps its completion
+      std::atomic_ref<unsigned>{*this->sqTail}.store(
+          tail, std::memory_order_release);
+      this->inflight--;
+      op.reset(owned);
+      throw std::system_error(error, std::system_category(), "io_uring_enter");
+    }
+  }
+}
+
+void UringEngine::reap() {
+  completing = this;
+  std::vector<std::pair<Operation*, std::int64_t>> done;
+  bool stopped = false;
+  while (!stopped) {
+    // Only this thread moves the head
+    unsigned head = *this->cqHead;
+    unsigned tail = std::atomic_ref<unsigned>{*this->cqTail}.load(
+        std::memory_order_acquire);
+    if (head == tail) {
+      syscall(__NR_io_uring_enter, this->ring, 0, 1, IORING_ENTER_GETEVENTS,
+              nullptr, 0);
+      continue;
+    }
+
+    done.clear();
+    for (; head != tail; head++) {
+      const auto& cqe = this->cqes[head & this->cqMask];
+      done.emplace_back(reinterpret_cast<Operation*>(cqe.user_data), cqe.res);
+    }
+    std::atomic_ref<unsigned>{*this->cqHead}.store(tail,
+                                                   std::memory_order_release);
+
+    for (auto [op, res] : done) {
+      if (op == nullptr) {
+        stopped = true;
+        continue;
+      }
+      complete(op->done, res);
+      delete op;
+    }
+    // Counted after the completions, they may submit follow ups
+    {
+      std::lock_guard lock{this->mutex};
+      this->inflight -= done.size();
+    }
+    this->freed.notify_all();
+  }
+}
+
+void UringEngine::unmap() {
+  if (this->sqes != MAP_FAILED) {
+    munmap(this->sqes, this->sqesSize);
+  }
+  if (this->cqRing != MAP_FAILED) {
+    munmap(this->cqRing, this->cqRingSize);
+  }
+  if (this->sqRing != MAP_FAILED) {
+    munmap(this->sqRing, this->sqRingSize);
+  }
+  ::close(this->ring);
+}
+
+// Makes the blocking calls on a pool of threads
+class ThreadEngine : public Engine {
+public:
+  ThreadEngine(std::size_t threads, unsigned queueDepth) : depth{queueDepth} {
+    for (std::size_t i = 0; i < threads; i++) {
+      this->workers.emplace_back([this]() { this->work(); });
+    }
+  }
+
+  ~ThreadEngine() override {
+    {
+      std::lock_guard lock{this->mutex};
+      this->stopping = true;
+    }
+    this->queued.notify_all();
+    for (auto& worker : this->workers) {
+      worker.join();
+    }
+  }
+
+  void read(int fd, std::uint8_t* data, std::size_t count, ::off_t offset,
+            Completion done) override {
+    this->submit([=]() { return result(::pread(fd, data, count, offset)); },
+                 std::move(done));
+  }
+
+  void write(int fd, const std::uint8_t* data, std::size_t count,
+             ::off_t offset, Completion done) override {
+    this->submit([=]() { return result(::pwrite(fd, data, count, offset)); },
+                 std::move(done));
+  }
+
+  void open(std::string path, int flags, ::mode_t mode,
+            Completion done) override {
+    this->submit(
+        [path = std::move(path), flags, mode]() {
+          return result(::open(path.c_str(), flags, mode));
+        },
+        std::move(done));
+  }
+
+  void rename(std::string oldpath, std::string newpath,
+              Completion done) override {
+    this->submit(
+        [oldpath = std::move(oldpath), newpath = std::move(newpath)]() {
+          return result(::rename(oldpath.c_str(), newpath.c_str()));
+        },
+        std::move(done));
+  }
+
+  void unlink(std::string path, Completion done) override {
+    this->submit(
+        [path = std::move(path)]() { return result(::unlink(path.c_str())); },
+        std::move(done));
+  }
+
+  void advise(int fd, ::off_t offset, std::uint64_t count, int advice,
+              Completion done) override {
+    // Returns the error number instead of setting errno
+    this->submit([=]() { return -::posix_fadvise(fd, offset, count, advice); },
+                 std::move(done));
+  }
+
+  const char* name() const override { return "threads"; }
+
+private:
+  struct Job {
+    std::function<std::int64_t()> call;
+    Completion done;
+  };
+
+  void submit(std::function<std::int64_t()> call, Completion done) {
+    {
+      std::unique_lock lock{this->mutex};
+      if (completing != this) {
+        this->freed.wait(lock,
+                         [this]() { return this->jobs.size() < this->depth; });
+      }
+      this->jobs.push_back({std::move(call), std::move(done)});
+    }
+    this->queued.notify_one();
+  }
+
+  // Queue is drained before the workers stop
+  void work() {
+    completing = this;
+    for (;;) {
+      Job job;
+      {
+        std::unique_lock lock{this->mutex};
+        this->queued.wait(
+            lock, [this]() { return this->stopping || !this->jobs.empty(); });
+        if (this->jobs.empty()) {
+          return;
+        }
+        job = std::move(this->jobs.front());
+        this->jobs.pop_front();
+      }
+      this->freed.notify_one();
+      complete(job.done, job.call());
+    }
+  }
+
+  const unsigned depth;
+  std::mutex mutex;
+  std::condition_variable queued;
+  std::condition_variable freed;
+  std::deque<Job> jobs{};
+  bool stopping{false};
+  std::vector<std::thread> workers{};
+};
+} // namespace
+
+std::unique_ptr<Engine> makeEngine(unsigned queueDepth) {
+  try {
+    return std::make_unique<UringEngine>(queueDepth);
+  } catch (std::system_error&) {
+    // Not compiled in, disabled by sysctl or seccomp, or too old
+    return makeThreadEngine(queueDepth);
+  }
+}
+
+std::unique_ptr<Engine> makeThreadEngine(unsigned queueDepth,
+                                         std::size_t threads) {
+  return std::make_unique<ThreadEngine>(threads, queueDepth);
+}
+
+} // namespace filesystem
@@ -1,47 +1,105 @@
+#include "pool.hpp"
 #include "schema.hpp"
 #include "server.hpp"
 #include <exception>
 #include <filesystem.hpp>
 
+#include <algorithm>
 #include <filesystem>
 #include <functional>
 #include <ios>
 #include <iostream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <utility>
 #include <vector>
 
+#include <sys/resource.h>
+
 namespace filesystem {
+namespace {
+// Leaves a quarter of the descriptors to sockets and the rest of the process
+std::size_t streamLimit() {
+  rlimit limit{};
+  if (::getrlimit(RLIMIT_NOFILE, &limit) != 0 ||
+      limit.rlim_cur == RLIM_INFINITY) {
+    return defaultOpenStreams;
+  }
+  return std::max<std::size_t>(limit.rlim_cur / 4 * 3, 1);
+}
+
+// Mode an evicted stream is reopened with, it must not truncate the file
+// again. Position is restored separately.
+std::ios_base::openmode reopenMode(std::ios_base::openmode mode) {
+  mode &= ~(std::ios_base::trunc | std::ios_base::ate);
+  if ((mode & std::ios_base::out) &&
+      !(mode & (std::ios_base::in | std::ios_base::app))) {
+    mode |= std::ios_base::in;
+  }
+  return mode;
+}
+
+// Whether file is dir or lies under it, both normalized
+bool within(const std::filesystem::path& file,
+            const std::filesystem::path& dir) {
+  auto [end, _] =
+      std::mismatch(dir.begin(), dir.end(), file.begin(), file.end());
+  return end == dir.end();
+}
+} // namespace
+
+Filesystem::Filesystem(std::filesystem::path root, std::size_t maxStreams)
+    : root{root}, maxStreams{maxStreams > 0 ? maxStreams : streamLimit()} {}
+
 rpc::schema::File Filesystem::open(std::string pathname,
                                    rpc::schema::mode_t mode) {
-  std::filesystem::path path{pathname};
-  std::filesystem::path file{this->root};
-  file /= path;
-  rpc::schema::File desc = this->descCounter;
-  descCounter++;
+  auto file = (this->root / pathname).lexically_normal();
   // Create file before access
   { std::ofstream stream{file}; }
-  // Open file
-  std::fstream stream{};
-  stream.open(file, static_cast<std::ios_base::openmode>(mode));
-
-  if (!stream.good()) {
+  auto entry = std::make_shared<Entry>(
+      file, static_cast<std::ios_base::openmode>(mode));
+  // Tracked before the stream is opened, so renames meanwhile move it along
+  this->track(entry);
+  bool good;
+  {
+    std::lock_guard lock{entry->mutex};
+    // Opened already if the file was unlinked meanwhile
+    if (!entry->stream.is_open()) {
+      this->admit(entry);
+      entry->stream.open(entry->file, entry->mode);
+    }
+    good = entry->stream.good();
+  }
+  if (!good) {
+    this->untrack(entry);
     return 0;
   }
 
-  this->files.insert(std::make_pair(desc, std::move(stream)));
-
+  // Stream is closed with the entry when the table is full
+  auto desc = this->files.insert(entry);
+  if (!desc) {
+    this->untrack(entry);
+  }
   return desc;
 }
 
 std::int64_t Filesystem::read(rpc::schema::File desc, std::uint64_t count,
                               std::vector<std::uint8_t>& v) {
-  if (!this->files.contains(desc)) {
+  auto entry = this->find(desc);
+  if (!entry) {
     return -1;
   }
 
   // TODO: add exception handling
 
-  std::fstream& file = this->files[desc];
-  v = std::vector<std::uint8_t>(count, 0);
+  std::lock_guard lock{entry->mutex};
+  if (!this->resume(entry)) {
+    return -1;
+  }
+  std::fstream& file = entry->stream;
+  // Keeps the capacity of a pooled buffer
+  v.assign(count, 0);
   file.read(reinterpret_cast<char*>(v.data()), count);
 
   return count;
@@ -49,13 +107,19 @@ std::int64_t Filesystem::read(rpc::schema::File desc, std::uint64_t count,
 
 std::int64_t Filesystem::write(rpc::schema::File desc, std::uint64_t count,
                                std::vector<std::uint8_t>& v) {
-  if (!this->files.contains(desc)) {
+  auto entry = this->find(desc);
+  if (!entry) {
     return -1;
   }
 
   // TODO: add exception handling
 
-  std::fstream& file = this->files[desc];
+  std::lock_guard lock{entry->mutex};
+  if (!this->resume(entry)) {
+    return -1;
+  }
+  count = std::min<std::uint64_t>(count, v.size());
+  std::fstream& file = entry->stream;
   file.write(reinterpret_cast<char*>(v.data()), count);
 
   return count;
@@ -64,13 +128,18 @@ std::int64_t Filesystem::write(rpc::schema::File desc, std::uint64_t count,
 rpc::schema::off_t Filesystem::lseek(rpc::schema::File desc,
                                      rpc::schema::off_t offset,
                                      std::uint32_t whence) {
-  if (!this->files.contains(desc)) {
+  auto entry = this->find(desc);
+  if (!entry) {
     return -1;
   }
 
   // TODO: add exception handling
 
-  std::fstream& file = this->files[desc];
+  std::lock_guard lock{entry->mutex};
+  if (!this->resume(entry)) {
+    return -1;
+  }
+  std::fstream& file = entry->stream;
   file.seekg(offset, static_cast<std::ios::seekdir>(whence));
   file.seekp(offset, static_cast<std::ios::seekdir>(whence));
 
@@ -90,35 +159,212 @@ std::int64_t Filesystem::chmod(std::string pathname, std::uint32_t mode) {
 }
 
 std::int64_t Filesystem::unlink(std::string pathname) {
+  auto file = (this->root / pathname).lexically_normal();
+  // Held until the path is gone, so no stream is opened by it meanwhile
+  std::lock_guard lock{this->pathsMutex};
+  this->detach(file);
 
   // TODO: add exception handling
 
-  std::filesystem::remove(this->root / pathname);
+  std::filesystem::remove(file);
   return 0;
 }
 
 std::int64_t Filesystem::rename(std::string oldpath, std::string newpath) {
+  auto from = (this->root / oldpath).lexically_normal();
+  auto to = (this->root / newpath).lexically_normal();
+  std::lock_guard lock{this->pathsMutex};
+  if (from != to) {
+    this->detach(to);
+  }
   try {
-    std::filesystem::rename(this->root / oldpath, this->root / newpath);
+    std::filesystem::rename(from, to);
   } catch (const std::exception& e) {
     return -1;
   }
 
+  // Files under a renamed directory move along with it
+  std::vector<std::shared_ptr<Entry>> moved;
+  for (auto it = this->paths.lower_bound(from);
+       it != this->paths.end() && within(it->first, from);) {
+    if (auto entry = it->second.lock()) {
+      moved.push_back(std::move(entry));
+    }
+    it = this->paths.erase(it);
+  }
+  for (auto& entry : moved) {
+    std::lock_guard entryLock{entry->mutex};
+    entry->file =
+        entry->file == from ? to : to / entry->file.lexically_relative(from);
+    this->paths.emplace(entry->file, entry);
+  }
   return 0;
 }
 
 std::int64_t Filesystem::close(rpc::schema::File desc) {
-  try {
-    auto& file = this->files.at(desc);
-    file.close();
-    this->files.erase(desc);
-  } catch (const std::exception& e) {
+  auto entry = this->files.erase(desc);
+  if (!entry) {
     return -1;
   }
 
+  {
+    // Waits for operations already in progress
+    std::lock_guard lock{entry->mutex};
+    entry->closed = true;
+    entry->stream.close();
+  }
+  this->untrack(entry);
+
   return 0;
 }
 
+std::int64_t Filesystem::pread(rpc::schema::File desc,
+                               rpc::schema::off_t offset, std::uint64_t count,
+                               std::vector<std::uint8_t>& v) {
+  auto entry = this->find(desc);
+  if (!entry) {
+    return -1;
+  }
+
+  std::lock_guard lock{entry->mutex};
+  if (!this->resume(entry)) {
+    return -1;
+  }
+  std::fstream& file = entry->stream;
+  auto position = file.tellg();
+  file.clear();
+  file.seekg(offset);
+  v.resize(count);
+  file.read(reinterpret_cast<char*>(v.data()), count);
+  v.resize(file.gcount());
+  // Reading past the end sets failbit
+  file.clear();
+  if (position != std::fstream::pos_type(-1)) {
+    file.seekg(position);
+  }
+
+  return v.size();
+}
+
+std::int64_t Filesystem::pwrite(rpc::schema::File desc,
+                                rpc::schema::off_t offset, std::uint64_t count,
+                                std::vector<std::uint8_t>& v) {
+  auto entry = this->find(desc);
+  if (!entry) {
+    return -1;
+  }
+
+  std::lock_guard lock{entry->mutex};
+  if (!this->resume(entry)) {
+    return -1;
+  }
+  count = std::min<std::uint64_t>(count, v.size());
+  std::fstream& file = entry->stream;
+  auto position = file.tellp();
+  file.clear();
+  file.seekp(offset);
+  file.write(reinterpret_cast<char*>(v.data()), count);
+  bool good = file.good();
+  file.clear();
+  if (position != std::fstream::pos_type(-1)) {
+    file.seekp(position);
+  }
+
+  return good ? count : -1;
+}
+
+std::shared_ptr<Filesystem::Entry> Filesystem::find(rpc::schema::File desc) {
+  return this->files.find(desc);
+}
+
+bool Filesystem::resume(const std::shared_ptr<Entry>& entry) {
+  entry->referenced.store(true, std::memory_order_relaxed);
+  if (entry->closed) {
+    return false;
+  }
+  if (entry->stream.is_open()) {
+    return true;
+  }
+  // Path leads to another file now, or to none
+  if (entry->detached) {
+    return false;
+  }
+
+  this->admit(entry);
+  entry->stream.open(entry->file, reopenMode(entry->mode));
+  if (!entry->stream.is_open()) {
+    return false;
+  }
+  if (entry->position != std::fstream::pos_type(-1)) {
+    entry->stream.seekg(entry->position);
+    entry->stream.seekp(entry->position);
+  }
+  entry->stream.setstate(entry->state);
+  return true;
+}
+
+void Filesystem::admit(const std::shared_ptr<Entry>& entry) {
+  std::lock_guard lock{this->streamsMutex};
+  auto& streams = this->streams;
+  // Hand passes every stream at most twice, clearing and then evicting.
+  // Streams busy with an operation are skipped, so the limit may be
+  // exceeded for a while.
+  for (std::size_t passed = 0;
+       streams.size() >= this->maxStreams && passed < 2 * streams.size();
+       passed++) {
+    this->hand %= streams.size();
+    auto other = streams[this->hand].lock();
+    // Detached streams stay open and are not counted anymore
+    bool drop = !other || other->detached;
+    if (!drop && other != entry &&
+        !other->referenced.exchange(false, std::memory_order_relaxed)) {
+      std::unique_lock busy{other->mutex, std::try_to_lock};
+      if (busy) {
+        if (other->stream.is_open() && !other->detached) {
+          other->position = other->stream.tellg();
+          other->state = other->stream.rdstate();
+          other->stream.close();
+        }
+        drop = true;
+      }
+    }
+    if (drop) {
+      streams[this->hand] = std::move(streams.back());
+      streams.pop_back();
+      continue;
+    }
+    this->hand++;
+  }
+  streams.push_back(entry);
+}
+
+void Filesystem::track(const std::shared_ptr<Entry>& entry) {
+  std::lock_guard lock{this->pathsMutex};
+  this->paths.emplace(entry->file, entry);
+}
+
+void Filesystem::untrack(const std::shared_ptr<Entry>& entry) {
+  std::lock_guard lock{this->pathsMutex};
+  auto [it, end] = this->paths.equal_range(entry->file);
+  while (it != end) {
+    auto other = it->second.lock();
+    it = !other || other == entry ? this->paths.erase(it) : std::next(it);
+  }
+}
+
+void Filesystem::detach(const std::filesystem::path& file) {
+  auto [it, end] = this->paths.equal_range(file);
+  while (it != end) {
+    if (auto entry = it->second.lock()) {
+      std::lock_guard lock{entry->mutex};
+      // Evicted stream is reopened while the path still leads to the file
+      this->resume(entry);
+      entry->detached = true;
+    }
+    it = this->paths.erase(it);
+  }
+}
+
 rpc::server::Handlers Filesystem::generateHandlers() {
   using namespace std::placeholders;
   return rpc::server::Handlers{
@@ -130,6 +376,106 @@ rpc::server::Handlers Filesystem::generateHandlers() {
       .UnlinkHandler = std::bind(&Filesystem::unlink, this, _1),
       .RenameHandler = std::bind(&Filesystem::rename, this, _1, _2),
       .CloseHandler = std::bind(&Filesystem::close, this, _1),
+      .PReadHandler = std::bind(&Filesystem::pread, this, _1, _2, _3, _4),
+      .PWriteHandler = std::bind(&Filesystem::pwrite, this, _1, _2, _3, _4),
+      // Hints are of no use to streams
+      .AdviseHandler = nullptr,
+  };
+}
+
+rpc::server::AsyncHandlers
+Filesystem::generateAsyncHandlers(rpc::workers::Pool& transfers,
+                                  rpc::workers::Pool& metadata) {
+  using rpc::schema::File;
+  using rpc::schema::off_t;
+  using rpc::server::Done;
+  using Bytes = std::vector<std::uint8_t>;
+  // Descriptors are spread over a fixed set of queues, as in TypedServer
+  auto serials = std::make_shared<std::vector<rpc::workers::Serial>>();
+  for (std::size_t i = 0; i < rpc::server::descriptorShards; i++) {
+    serials->emplace_back(transfers);
+  }
+  auto serial = [serials](File desc) -> rpc::workers::Serial& {
+    return (*serials)[desc % serials->size()];
+  };
+
+  return rpc::server::AsyncHandlers{
+      .OpenHandler =
+          [this, &metadata](std::string path, rpc::schema::mode_t mode,
+                            Done<File> done) {
+            metadata.post([this, path, mode, done]() {
+              done(this->open(path, mode));
+            });
+          },
+      .ReadHandler =
+          [this, serial](File desc, std::uint64_t count, Bytes v,
+                         Done<std::int64_t, Bytes> done) {
+            serial(desc).post([this, desc, count, v = std::move(v),
+                               done]() mutable {
+              auto read = this->read(desc, count, v);
+              done(read, std::move(v));
+            });
+          },
+      .WriteHandler =
+          [this, serial](File desc, std::uint64_t count, Bytes v,
+                         Done<std::int64_t> done) {
+            serial(desc).post([this, desc, count, v = std::move(v),
+                               done]() mutable {
+              auto written = this->write(desc, count, v);
+              rpc::pool::buffers().release(std::move(v));
+              done(written);
+            });
+          },
+      .LSeekHandler =
+          [this, serial](File desc, off_t offset, std::uint32_t whence,
+                         Done<off_t> done) {
+            serial(desc).post([this, desc, offset, whence, done]() {
+              done(this->lseek(desc, offset, whence));
+            });
+          },
+      .ChmodHandler =
+          [this, &metadata](std::string path, std::uint32_t mode,
+                            Done<std::int64_t> done) {
+            metadata.post([this, path, mode, done]() {
+              done(this->chmod(path, mode));
+            });
+          },
+      .UnlinkHandler =
+          [this, &metadata](std::string path, Done<std::int64_t> done) {
+            metadata.post([this, path, done]() { done(this->unlink(path)); });
+          },
+      .RenameHandler =
+          [this, &metadata](std::string oldpath, std::string newpath,
+                            Done<std::int64_t> done) {
+            metadata.post([this, oldpath, newpath, done]() {
+              done(this->rename(oldpath, newpath));
+            });
+          },
+      .CloseHandler =
+          [this, serial](File desc, Done<std::int64_t> done) {
+            serial(desc).post(
+                [this, desc, done]() { done(this->close(desc)); });
+          },
+      .PReadHandler =
+          [this, serial](File desc, off_t offset, std::uint64_t count, Bytes v,
+                         Done<std::int64_t, Bytes> done) {
+            serial(desc).post([this, desc, offset, count, v = std::move(v),
+                               done]() mutable {
+              auto read = this->pread(desc, offset, count, v);
+              done(read, std::move(v));
+            });
+          },
+      .PWriteHandler =
+          [this, serial](File desc, off_t offset, std::uint64_t count, Bytes v,
+                         Done<std::int64_t> done) {
+            serial(desc).post([this, desc, offset, count, v = std::move(v),
+                               done]() mutable {
+              auto written = this->pwrite(desc, offset, count, v);
+              rpc::pool::buffers().release(std::move(v));
+              done(written);
+            });
+          },
+      .AdviseHandler = nullptr,
   };
 }
 
@@ -0,0 +1,700 @@
+#include "schema.hpp"
+#include <pool.hpp>
+#include <posix.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <ios>
+#include <limits>
+#include <memory>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace filesystem {
+namespace {
+// Repeats op until count bytes are transferred, end of file or an error
+template <typename Op>
+std::int64_t full(Op op, std::uint8_t* data, std::uint64_t count,
+                  rpc::schema::off_t offset) {
+  std::uint64_t done = 0;
+  while (done < count) {
+    auto n = op(data + done, count - done, offset + done);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return done > 0 ? done : -1;
+    }
+    if (n == 0) {
+      break;
+    }
+    done += n;
+  }
+  return done;
+}
+
+// Advice is passed to posix_fadvise as is
+bool valid(std::uint32_t advice, rpc::schema::off_t offset) {
+  return advice <= static_cast<std::uint32_t>(rpc::schema::Advice::NOREUSE) &&
+         offset >= 0;
+}
+
+// Advice setting the access pattern of the descriptor, the rest act on the
+// page cache
+bool pattern(std::uint32_t advice) {
+  return advice == POSIX_FADV_NORMAL || advice == POSIX_FADV_RANDOM ||
+         advice == POSIX_FADV_SEQUENTIAL;
+}
+
+// Zero advises to the end of file, so does a length beyond off_t
+rpc::schema::off_t length(std::uint64_t count) {
+  return count > static_cast<std::uint64_t>(
+                     std::numeric_limits<rpc::schema::off_t>::max())
+             ? 0
+             : count;
+}
+
+static_assert(POSIX_FADV_NORMAL == 0 && POSIX_FADV_RANDOM == 1 &&
+              POSIX_FADV_SEQUENTIAL == 2 && POSIX_FADV_WILLNEED == 3 &&
+              POSIX_FADV_DONTNEED == 4 && POSIX_FADV_NOREUSE == 5);
+static_assert(SEEK_SET == std::ios::beg && SEEK_CUR == std::ios::cur &&
+              SEEK_END == std::ios::end);
+} // namespace
+
+PosixFilesystem::Entry::~Entry() {
+  struct stat st;
+  if (this->cache && ::fstat(this->fd, &st) == 0 && st.st_nlink == 0) {
+    this->cache->invalidate(this->file);
+  }
+  ::close(this->fd);
+}
+
+rpc::schema::File PosixFilesystem::open(std::string pathname,
+                                        rpc::schema::mode_t mode) {
+  auto file = this->path(pathname);
+  int flags = this->openFlags(mode);
+  int fd = ::open(file.c_str(), flags, 0666);
+  if (fd < 0 && errno == EPERM && (flags & O_NOATIME)) {
+    // Only the owner of a file may open it with O_NOATIME
+    fd = ::open(file.c_str(), flags & ~O_NOATIME, 0666);
+  }
+  if (fd < 0) {
+    return 0;
+  }
+  return this->insert(fd, mode, flags & O_TRUNC);
+}
+
+std::int64_t PosixFilesystem::read(rpc::schema::File desc,
+                                   std::uint64_t count,
+                                   std::vector<std::uint8_t>& v) {
+  auto entry = this->find(desc);
+  if (!entry) {
+    return -1;
+  }
+
+  // Range is claimed up front, so concurrent reads do not overlap
+  auto offset = this->claim(*entry, count);
+  auto n = this->readAt(*entry, offset, count, v);
+  this->unclaim(*entry, offset, count, n);
+  return n;
+}
+
+std::int64_t PosixFilesystem::write(rpc::schema::File desc,
+                                    std::uint64_t count,
+                                    std::vector<std::uint8_t>& v) {
+  auto entry = this->find(desc);
+  if (!entry) {
+    return -1;
+  }
+  count = std::min<std::uint64_t>(count, v.size());
+
+  if (entry->append) {
+    // Kernel picks the offset, it is read back afterwards
+    std::lock_guard lock{entry->mutex};
+    auto n = this->transfer(*entry, true, 0, v.data(), count);
+    entry->offset = ::lseek(entry->fd, 0, SEEK_CUR);
+    this->invalidate(entry->file);
+    return n;
+  }
+
+  auto offset = this->claim(*entry, count);
+  auto n = this->transfer(*entry, true, offset, v.data(), count);
+  this->unclaim(*entry, offset, count, n);
+  this->invalidate(entry->file);
+  return n;
+}
+
+rpc::schema::off_t PosixFilesystem::lseek(rpc::schema::File desc,
+                                          rpc::schema::off_t offset,
+                                          std::uint32_t whence) {
+  auto entry = this->find(desc);
+  if (!entry) {
+    return -1;
+  }
+
+  std::lock_guard lock{entry->mutex};
+  rpc::schema::off_t base;
+  switch (whence) {
+  case SEEK_SET:
+    base = 0;
+    break;
+  case SEEK_CUR:
+    base = entry->offset;
+    break;
+  case SEEK_END: {
+    struct stat st;
+    if (::fstat(entry->fd, &st) < 0) {
+      return -1;
+    }
+    base = st.st_size;
+    break;
+  }
+  default:
+    return -1;
+  }
+
+  if (base + offset < 0) {
+    return -1;
+  }
+  entry->offset = base + offset;
+  return entry->offset;
+}
+
+std::int64_t PosixFilesystem::chmod(std::string pathname, std::uint32_t mode) {
+  auto file = this->path(pathname);
+  return ::chmod(file.c_str(), mode);
+}
+
+std::int64_t PosixFilesystem::unlink(std::string pathname) {
+  auto file = this->path(pathname);
+  // Inode of a file nobody holds open may be reused right away
+  auto unlinked = this->identify(file);
+  auto result = ::unlink(file.c_str());
+  this->invalidate(unlinked);
+  return result;
+}
+
+std::int64_t PosixFilesystem::rename(std::string oldpath,
+                                     std::string newpath) {
+  auto from = this->path(oldpath);
+  auto to = this->path(newpath);
+  // Renamed file keeps its blocks, the one it replaces is unlinked
+  auto replaced = this->identify(to);
+  auto result = ::rename(from.c_str(), to.c_str());
+  this->invalidate(replaced);
+  return result;
+}
+
+std::int64_t PosixFilesystem::close(rpc::schema::File desc) {
+  // Operations still in progress keep the descriptor open
+  return this->files.erase(desc) ? 0 : -1;
+}
+
+std::int64_t PosixFilesystem::pread(rpc::schema::File desc,
+                                    rpc::schema::off_t offset,
+                                    std::uint64_t count,
+                                    std::vector<std::uint8_t>& v) {
+  auto entry = this->find(desc);
+  if (!entry || offset < 0) {
+    return -1;
+  }
+  return this->readAt(*entry, offset, count, v);
+}
+
+std::int64_t PosixFilesystem::pwrite(rpc::schema::File desc,
+                                     rpc::schema::off_t offset,
+                                     std::uint64_t count,
+                                     std::vector<std::uint8_t>& v) {
+  auto entry = this->find(desc);
+  if (!entry || offset < 0) {
+    return -1;
+  }
+  count = std::min<std::uint64_t>(count, v.size());
+  // As with pwrite(2), data of O_APPEND descriptors goes to the end
+  auto n = this->transfer(*entry, true, offset, v.data(), count);
+  this->invalidate(entry->file);
+  return n;
+}
+
+std::int64_t PosixFilesystem::advise(rpc::schema::File desc,
+                                     rpc::schema::off_t offset,
+                                     std::uint64_t count,
+                                     std::uint32_t advice) {
+  auto entry = this->find(desc);
+  if (!entry || !valid(advice, offset)) {
+    return -1;
+  }
+  if (pattern(advice)) {
+    entry->declared = true;
+  }
+  return ::posix_fadvise(entry->fd, offset, length(count), advice) == 0 ? 0
+                                                                        : -1;
+}
+
+void PosixFilesystem::submit(rpc::schema::OpenRequest req,
+                             Reply<rpc::schema::OpenResponse> reply) {
+  auto path = this->path(req.pathname);
+  int flags = this->openFlags(req.mode);
+  auto opened = [this, flags, mode = req.mode, reply](std::int64_t fd) {
+    reply({.file = fd < 0 ? 0 : this->insert(fd, mode, flags & O_TRUNC)});
+  };
+  this->engine->open(
+      path, flags, 0666, [this, path, flags, opened](std::int64_t fd) {
+        if (fd == -EPERM && (flags & O_NOATIME)) {
+          this->engine->open(path, flags & ~O_NOATIME, 0666, opened);
+          return;
+        }
+        opened(fd);
+      });
+}
+
+void PosixFilesystem::submit(rpc::schema::ReadRequest req,
+                             Reply<rpc::schema::ReadResponse> reply) {
+  auto entry = this->find(req.desc);
+  if (!entry || this->options.direct) {
+    rpc::schema::ReadResponse res{.read = 0,
+                                  .bytes = rpc::pool::buffers().acquire()};
+    res.read = this->read(req.desc, req.count, res.bytes);
+    reply(std::move(res));
+    return;
+  }
+
+  auto offset = this->claim(*entry, req.count);
+  this->readAsync(entry, offset, req.count,
+                  [this, entry, offset, count = req.count,
+                   reply](std::int64_t n, std::vector<std::uint8_t> bytes) {
+                    this->unclaim(*entry, offset, count, n);
+                    reply({.read = n, .bytes = std::move(bytes)});
+                  });
+}
+
+void PosixFilesystem::submit(rpc::schema::WriteRequest req,
+                             Reply<rpc::schema::WriteResponse> reply) {
+  auto entry = this->find(req.desc);
+  if (!entry || entry->append || this->options.direct) {
+    auto written = this->write(req.desc, req.count, req.bytes);
+    rpc::pool::buffers().release(std::move(req.bytes));
+    reply({.written = written});
+    return;
+  }
+
+  auto count = std::min<std::uint64_t>(req.count, req.bytes.size());
+  auto transfer = std::make_shared<Transfer>(Transfer{
+      .entry = entry,
+      .write = true,
+      .offset = this->claim(*entry, count),
+      .count = count,
+      .bytes = std::move(req.bytes),
+      .finish = [this, reply](Transfer& transfer, std::int64_t n) {
+        this->unclaim(*transfer.entry, transfer.offset, transfer.count, n);
+        this->invalidate(transfer.entry->file);
+        rpc::pool::buffers().release(std::move(transfer.bytes));
+        reply({.written = n});
+      }});
+  this->transferAsync(std::move(transfer));
+}
+
+void PosixFilesystem::submit(rpc::schema::UnlinkRequest req,
+                             Reply<rpc::schema::UnlinkResponse> reply) {
+  auto path = this->path(req.pathname);
+  auto unlinked = this->identify(path);
+  this->engine->unlink(path, [this, unlinked, reply](std::int64_t result) {
+    this->invalidate(unlinked);
+    reply({.result = result < 0 ? -1 : 0});
+  });
+}
+
+void PosixFilesystem::submit(rpc::schema::RenameRequest req,
+                             Reply<rpc::schema::RenameResponse> reply) {
+  auto from = this->path(req.oldpath);
+  auto to = this->path(req.newpath);
+  auto replaced = this->identify(to);
+  this->engine->rename(from, to, [this, replaced, reply](std::int64_t result) {
+    this->invalidate(replaced);
+    reply({.result = result < 0 ? -1 : 0});
+  });
+}
+
+void PosixFilesystem::submit(rpc::schema::PReadRequest req,
+                             Reply<rpc::schema::PReadResponse> reply) {
+  auto entry = this->find(req.desc);
+  if (!entry || req.offset < 0 || this->options.direct) {
+    rpc::schema::PReadResponse res{.read = 0,
+                                   .bytes = rpc::pool::buffers().acquire()};
+    res.read = this->pread(req.desc, req.offset, req.count, res.bytes);
+    reply(std::move(res));
+    return;
+  }
+
+  this->readAsync(entry, req.offset, req.count,
+                  [reply](std::int64_t n, std::vector<std::uint8_t> bytes) {
+                    reply({.read = n, .bytes = std::move(bytes)});
+                  });
+}
+
+void PosixFilesystem::submit(rpc::schema::PWriteRequest req,
+                             Reply<rpc::schema::PWriteResponse> reply) {
+  auto entry = this->find(req.desc);
+  if (!entry || req.offset < 0 || entry->append || this->options.direct) {
+    auto written = this->pwrite(req.desc, req.offset, req.count, req.bytes);
+    rpc::pool::buffers().release(std::move(req.bytes));
+    reply({.written = written});
+    return;
+  }
+
+  auto count = std::min<std::uint64_t>(req.count, req.bytes.size());
+  auto transfer = std::make_shared<Transfer>(Transfer{
+      .entry = entry,
+      .write = true,
+      .offset = req.offset,
+      .count = count,
+      .bytes = std::move(req.bytes),
+      .finish = [this, reply](Transfer& transfer, std::int64_t n) {
+        this->invalidate(transfer.entry->file);
+        rpc::pool::buffers().release(std::move(transfer.bytes));
+        reply({.written = n});
+      }});
+  this->transferAsync(std::move(transfer));
+}
+
+void PosixFilesystem::submit(rpc::schema::AdviseRequest req,
+                             Reply<rpc::schema::AdviseResponse> reply) {
+  auto entry = this->find(req.desc);
+  if (!entry || !valid(req.advice, req.offset)) {
+    reply({.result = -1});
+    return;
+  }
+  if (pattern(req.advice)) {
+    entry->declared = true;
+  }
+  // WILLNEED starts reading right away, so it does not run on the caller
+  this->engine->advise(entry->fd, req.offset, length(req.count), req.advice,
+                       [entry, reply](std::int64_t result) {
+                         reply({.result = result < 0 ? -1 : 0});
+                       });
+}
+
+CacheStats PosixFilesystem::cacheStats() const {
+  return this->cache ? this->cache->stats() : CacheStats{0, 0};
+}
+
+std::string PosixFilesystem::path(const std::string& pathname) const {
+  return (this->root / pathname).lexically_normal().string();
+}
+
+int PosixFilesystem::openFlags(rpc::schema::mode_t mode) const {
+  using std::ios_base;
+  auto openmode = static_cast<ios_base::openmode>(mode);
+  bool in = (openmode & ios_base::in) != 0;
+  bool append = (openmode & ios_base::app) != 0;
+  bool out = (openmode & ios_base::out) != 0 || append;
+
+  // Files are created before access, as in Filesystem
+  int flags = O_CREAT | O_CLOEXEC;
+  flags |= in && out ? O_RDWR : (out ? O_WRONLY : O_RDONLY);
+  // Plain output mode truncates, as std::fstream does
+  if ((openmode & ios_base::trunc) || (out && !in && !append)) {
+    flags |= O_TRUNC;
+  }
+  if (append) {
+    flags |= O_APPEND;
+  }
+  if (this->options.direct) {
+    flags |= O_DIRECT;
+  }
+  if (this->options.noAtime) {
+    flags |= O_NOATIME;
+  }
+  return flags;
+}
+
+rpc::schema::File PosixFilesystem::insert(int fd, rpc::schema::mode_t mode,
+                                          bool truncated) {
+  struct stat st;
+  if (::fstat(fd, &st) < 0) {
+    ::close(fd);
+    return 0;
+  }
+  FileId file{.device = st.st_dev, .inode = st.st_ino};
+  if (truncated) {
+    this->invalidate(file);
+  }
+  auto openmode = static_cast<std::ios_base::openmode>(mode);
+  auto entry = std::make_shared<Entry>(
+      fd, (openmode & std::ios_base::app) != 0, file, this->cache.get());
+  if (openmode & std::ios_base::ate) {
+    entry->offset = ::lseek(fd, 0, SEEK_END);
+  }
+  // Descriptor is closed with the entry when the table is full
+  return this->files.insert(std::move(entry));
+}
+
+std::shared_ptr<PosixFilesystem::Entry>
+PosixFilesystem::find(rpc::schema::File desc) {
+  return this->files.find(desc);
+}
+
+rpc::schema::off_t PosixFilesystem::claim(Entry& entry, std::uint64_t count) {
+  std::lock_guard lock{entry.mutex};
+  auto offset = entry.offset;
+  entry.offset += count;
+  return offset;
+}
+
+void PosixFilesystem::unclaim(Entry& entry, rpc::schema::off_t offset,
+                              std::uint64_t count, std::int64_t transferred) {
+  if (transferred == static_cast<std::int64_t>(count)) {
+    return;
+  }
+  // Unless the offset moved since
+  std::lock_guard lock{entry.mutex};
+  if (entry.offset == offset + static_cast<rpc::schema::off_t>(count)) {
+    entry.offset = offset + std::max<std::int64_t>(transferred, 0);
+  }
+}
+
+std::int64_t PosixFilesystem::transfer(Entry& entry, bool write,
+                                       rpc::schema::off_t offset,
+                                       std::uint8_t* data,
+                                       std::uint64_t count) {
+  auto op = [&entry, write](std::uint8_t* data, std::size_t count,
+                            rpc::schema::off_t offset) -> ssize_t {
+    if (!write) {
+      return ::pread(entry.fd, data, count, offset);
+    }
+    // pwrite ignores the offset of O_APPEND descriptors anyway
+    return entry.append ? ::write(entry.fd, data, count)
+                        : ::pwrite(entry.fd, data, count, offset);
+  };
+
+  if (!this->options.direct || count == 0) {
+    return full(op, data, count, offset);
+  }
+
+  if (offset % directAlignment != 0 || count % directAlignment != 0) {
+    return -1;
+  }
+  std::unique_ptr<std::uint8_t, decltype(&std::free)> buffer{
+      static_cast<std::uint8_t*>(std::aligned_alloc(directAlignment, count)),
+      &std::free};
+  if (!buffer) {
+    return -1;
+  }
+  if (write) {
+    std::memcpy(buffer.get(), data, count);
+  }
+  auto n = full(op, buffer.get(), count, offset);
+  if (!write && n > 0) {
+    std::memcpy(data, buffer.get(), n);
+  }
+  return n;
+}
+
+void PosixFilesystem::transferAsync(std::shared_ptr<Transfer> transfer) {
+  auto& t = *transfer;
+  if (t.done == t.count) {
+    t.finish(t, t.done);
+    return;
+  }
+  auto offset = t.offset + static_cast<rpc::schema::off_t>(t.done);
+  // Submissions carry 32 bit lengths, larger transfers take several
+  auto count = std::min<std::uint64_t>(t.count - t.done, 1 << 30);
+  auto completed = [this, transfer](std::int64_t n) {
+    auto& t = *transfer;
+    if (n == -EINTR || n == -EAGAIN) {
+      this->transferAsync(transfer);
+    } else if (n < 0) {
+      t.finish(t, t.done > 0 ? t.done : -1);
+    } else if (n == 0) {
+      // End of file
+      t.finish(t, t.done);
+    } else {
+      t.done += n;
+      this->transferAsync(transfer);
+    }
+  };
+  if (t.write) {
+    this->engine->write(t.entry->fd, t.bytes.data() + t.done, count, offset,
+                        completed);
+  } else {
+    this->engine->read(t.entry->fd, t.bytes.data() + t.done, count, offset,
+                       completed);
+  }
+}
+
+void PosixFilesystem::notice(Entry& entry, rpc::schema::off_t offset,
+                             std::uint64_t count) {
+  if (this->options.direct || entry.declared.load(std::memory_order_relaxed)) {
+    return;
+  }
+  // Races between concurrent reads only blur the heuristic
+  auto end = offset + static_cast<rpc::schema::off_t>(count);
+  if (entry.readEnd.exchange(end, std::memory_order_relaxed) != offset) {
+    if (entry.adjacent.exchange(0, std::memory_order_relaxed) >=
+        sequentialReads) {
+      ::posix_fadvise(entry.fd, 0, 0, POSIX_FADV_NORMAL);
+    }
+    return;
+  }
+  // Sequential advice widens the kernel's readahead window
+  if (entry.adjacent.fetch_add(1, std::memory_order_relaxed) + 1 ==
+      sequentialReads) {
+    ::posix_fadvise(entry.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+}
+
+std::int64_t PosixFilesystem::readAt(Entry& entry, rpc::schema::off_t offset,
+                                     std::uint64_t count,
+                                     std::vector<std::uint8_t>& v) {
+  this->notice(entry, offset, count);
+  if (!this->cache) {
+    v.resize(count);
+    auto n = this->transfer(entry, false, offset, v.data(), count);
+    v.resize(std::max<std::int64_t>(n, 0));
+    return n;
+  }
+
+  auto generation = this->cache->generation(entry.file);
+  if (this->cached(entry, generation, offset, count, v)) {
+    return v.size();
+  }
+  rpc::schema::off_t first = offset / blockSize * blockSize;
+  std::uint64_t requested =
+      (offset + count + blockSize - 1) / blockSize * blockSize - first;
+  auto bytes = rpc::pool::buffers().acquire();
+  bytes.resize(requested);
+  auto n = this->transfer(entry, false, first, bytes.data(), requested);
+  bytes.resize(std::max<std::int64_t>(n, 0));
+  auto result = n < 0 ? n
+                      : this->fill(entry, generation, first, requested,
+                                   bytes, offset, count, v);
+  rpc::pool::buffers().release(std::move(bytes));
+  return result;
+}
+
+void PosixFilesystem::readAsync(std::shared_ptr<Entry> entry,
+                                rpc::schema::off_t offset, std::uint64_t count,
+                                Filled done) {
+  this->notice(*entry, offset, count);
+  auto v = rpc::pool::buffers().acquire();
+  if (!this->cache) {
+    auto transfer = std::make_shared<Transfer>(Transfer{
+        .entry = std::move(entry),
+        .write = false,
+        .offset = offset,
+        .count = count,
+        .bytes = std::move(v),
+        .finish = [done](Transfer& transfer, std::int64_t n) {
+          transfer.bytes.resize(std::max<std::int64_t>(n, 0));
+          done(n, std::move(transfer.bytes));
+        }});
+    transfer->bytes.resize(count);
+    this->transferAsync(std::move(transfer));
+    return;
+  }
+
+  // Hits are answered without leaving the thread
+  auto generation = this->cache->generation(entry->file);
+  if (this->cached(*entry, generation, offset, count, v)) {
+    auto n = static_cast<std::int64_t>(v.size());
+    done(n, std::move(v));
+    return;
+  }
+  rpc::schema::off_t first = offset / blockSize * blockSize;
+  std::uint64_t requested =
+      (offset + count + blockSize - 1) / blockSize * blockSize - first;
+  auto transfer = std::make_shared<Transfer>(Transfer{
+      .entry = std::move(entry),
+      .write = false,
+      .offset = first,
+      .count = requested,
+      .bytes = rpc::pool::buffers().acquire(),
+      .finish = [this, generation, offset, count, v = std::move(v),
+                 done](Transfer& transfer, std::int64_t n) mutable {
+        if (n >= 0) {
+          transfer.bytes.resize(n);
+          n = this->fill(*transfer.entry, generation, transfer.offset,
+                         transfer.count, transfer.bytes, offset, count, v);
+        }
+        rpc::pool::buffers().release(std::move(transfer.bytes));
+        done(n, std::move(v));
+      }});
+  transfer->bytes.resize(requested);
+  this->transferAsync(std::move(transfer));
+}
+
+bool PosixFilesystem::cached(const Entry& entry, std::uint64_t generation,
+                             rpc::schema::off_t offset, std::uint64_t count,
+                             std::vector<std::uint8_t>& v) {
+  v.clear();
+  std::uint64_t end = offset + count;
+  for (std::uint64_t block = offset / blockSize; block * blockSize < end;
+       block++) {
+    auto data = this->cache->find(entry.file, generation, block);
+    if (!data) {
+      v.clear();
+      return false;
+    }
+    std::uint64_t start = block * blockSize;
+    auto begin = std::max<std::uint64_t>(offset, start) - start;
+    auto stop = std::min<std::uint64_t>(end - start, data->size());
+    if (begin < stop) {
+      v.insert(v.end(), data->begin() + begin, data->begin() + stop);
+    }
+    if (data->size() < blockSize) {
+      break;
+    }
+  }
+  return true;
+}
+
+std::int64_t PosixFilesystem::fill(const Entry& entry,
+                                   std::uint64_t generation,
+                                   rpc::schema::off_t first,
+                                   std::uint64_t requested,
+                                   const std::vector<std::uint8_t>& bytes,
+                                   rpc::schema::off_t offset,
+                                   std::uint64_t count,
+                                   std::vector<std::uint8_t>& v) {
+  std::uint64_t n = bytes.size();
+  // Short read ends the file, its last block is cached even if empty
+  bool end = n < requested;
+  for (std::uint64_t start = 0; start < n || (end && start <= n);
+       start += blockSize) {
+    auto stop = std::min<std::uint64_t>(start + blockSize, n);
+    auto block = std::make_shared<const std::vector<std::uint8_t>>(
+        bytes.begin() + start, bytes.begin() + stop);
+    this->cache->insert(entry.file, generation,
+                        (first + start) / blockSize, std::move(block));
+    if (stop - start < blockSize) {
+      break;
+    }
+  }
+
+  std::uint64_t begin = std::min<std::uint64_t>(offset - first, n);
+  std::uint64_t stop = std::min<std::uint64_t>(begin + count, n);
+  v.assign(bytes.begin() + begin, bytes.begin() + stop);
+  return v.size();
+}
+
+std::optional<FileId>
+PosixFilesystem::identify(const std::string& path) const {
+  struct stat st;
+  if (!this->cache || ::stat(path.c_str(), &st) < 0) {
+    return std::nullopt;
+  }
+  return FileId{.device = st.st_dev, .inode = st.st_ino};
+}
+
+void PosixFilesystem::invalidate(std::optional<FileId> file) {
+  if (this->cache && file) {
+    this->cache->invalidate(*file);
+  }
+}
+
+} // namespace filesystem
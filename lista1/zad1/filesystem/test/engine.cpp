@@ -0,0 +1,103 @@
+#include <cstring>
+#include <engine.hpp>
+#include <filesystem>
+#include <functional>
+#include <future>
+#include <gtest/gtest.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+// Waits for the completion of a single operation
+std::int64_t wait(std::function<void(filesystem::Completion)> submit) {
+  std::promise<std::int64_t> promise;
+  auto future = promise.get_future();
+  submit([&promise](std::int64_t result) { promise.set_value(result); });
+  return future.get();
+}
+
+void exercise(filesystem::Engine& engine, const std::string& name) {
+  auto dir = std::filesystem::temp_directory_path() /
+             (name + "-" + std::to_string(getpid()));
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directory(dir);
+  auto file = (dir / "a").string();
+  auto renamed = (dir / "b").string();
+
+  auto fd = wait([&](auto done) {
+    engine.open(file, O_CREAT | O_RDWR | O_CLOEXEC, 0600, done);
+  });
+  ASSERT_GE(fd, 0);
+
+  std::string text = "hello engine";
+  EXPECT_EQ(wait([&](auto done) {
+              engine.write(fd, reinterpret_cast<std::uint8_t*>(text.data()),
+                           text.size(), 3, done);
+            }),
+            text.size());
+  std::vector<std::uint8_t> data(64);
+  EXPECT_EQ(wait([&](auto done) {
+              engine.read(fd, data.data(), data.size(), 3, done);
+            }),
+            text.size());
+  EXPECT_EQ(std::memcmp(data.data(), text.data(), text.size()), 0);
+  // Past the end
+  EXPECT_EQ(wait([&](auto done) {
+              engine.read(fd, data.data(), data.size(), 100, done);
+            }),
+            0);
+  EXPECT_EQ(wait([&](auto done) {
+              engine.advise(fd, 0, 0, POSIX_FADV_SEQUENTIAL, done);
+            }),
+            0);
+  ::close(fd);
+
+  EXPECT_EQ(wait([&](auto done) { engine.rename(file, renamed, done); }), 0);
+  EXPECT_TRUE(std::filesystem::exists(renamed));
+  EXPECT_FALSE(std::filesystem::exists(file));
+  EXPECT_EQ(wait([&](auto done) { engine.unlink(renamed, done); }), 0);
+  EXPECT_FALSE(std::filesystem::exists(renamed));
+
+  // Failures complete with -errno
+  EXPECT_EQ(wait([&](auto done) { engine.unlink(renamed, done); }), -ENOENT);
+  EXPECT_EQ(wait([&](auto done) {
+              engine.open(file, O_RDONLY | O_CLOEXEC, 0, done);
+            }),
+            -ENOENT);
+  EXPECT_EQ(wait([&](auto done) {
+              engine.read(-1, data.data(), data.size(), 0, done);
+            }),
+            -EBADF);
+
+  // Completions may submit follow ups without waiting for a free slot
+  std::promise<std::int64_t> chained;
+  engine.open(file, O_CREAT | O_RDWR | O_CLOEXEC, 0600,
+              [&engine, &chained, &file](std::int64_t fd) {
+                ::close(fd);
+                engine.unlink(file, [&chained](std::int64_t result) {
+                  chained.set_value(result);
+                });
+              });
+  EXPECT_EQ(chained.get_future().get(), 0);
+
+  std::filesystem::remove_all(dir);
+}
+} // namespace
+
+TEST(filesystem_engine, uring) {
+  auto engine = filesystem::makeEngine(4);
+  if (std::string{engine->name()} != "io_uring") {
+    GTEST_SKIP() << "io_uring is not available";
+  }
+  exercise(*engine, "engine-uring");
+}
+
+TEST(filesystem_engine, threads) {
+  auto engine = filesystem::makeThreadEngine(4, 2);
+  EXPECT_STREQ(engine->name(), "threads");
+  exercise(*engine, "engine-threads");
+}
@@ -0,0 +1,144 @@
+#include <descriptors.hpp>
+#include <filesystem.hpp>
+#include <filesystem>
+#include <gtest/gtest.h>
+#include <ios>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+namespace {
+constexpr auto readWrite = static_cast<rpc::schema::mode_t>(std::ios_base::in |
+                                                            std::ios_base::out);
+
+// Fresh directory, removed with everything in it
+class TempDir {
+public:
+  TempDir(const std::string& name)
+      : path{std::filesystem::temp_directory_path() /
+             (name + "-" + std::to_string(getpid()))} {
+    std::filesystem::remove_all(this->path);
+    std::filesystem::create_directory(this->path);
+  }
+  ~TempDir() { std::filesystem::remove_all(this->path); }
+
+  const std::filesystem::path path;
+};
+
+rpc::schema::File create(filesystem::Filesystem& fs, const std::string& name,
+                         const std::string& text) {
+  auto desc = fs.open(name, readWrite);
+  EXPECT_NE(desc, 0);
+  std::vector<std::uint8_t> data{text.begin(), text.end()};
+  EXPECT_EQ(fs.pwrite(desc, 0, data.size(), data), data.size());
+  return desc;
+}
+
+std::string preadAll(filesystem::Filesystem& fs, rpc::schema::File desc) {
+  std::vector<std::uint8_t> v;
+  EXPECT_GE(fs.pread(desc, 0, 1 << 10, v), 0);
+  return {v.begin(), v.end()};
+}
+} // namespace
+
+TEST(filesystem_descriptors, generations) {
+  filesystem::DescriptorTable<std::shared_ptr<int>> table;
+  auto first = table.insert(std::make_shared<int>(1));
+  auto second = table.insert(std::make_shared<int>(2));
+  ASSERT_NE(first, 0);
+  ASSERT_NE(second, 0);
+  EXPECT_EQ(*table.find(first), 1);
+  EXPECT_EQ(table.size(), 2);
+
+  // Reused slot gets a new generation, the old descriptor misses it
+  EXPECT_EQ(*table.erase(first), 1);
+  EXPECT_FALSE(table.erase(first));
+  auto reused = table.insert(std::make_shared<int>(3));
+  EXPECT_EQ(reused & (filesystem::maxDescriptors - 1),
+            first & (filesystem::maxDescriptors - 1));
+  EXPECT_NE(reused, first);
+  EXPECT_FALSE(table.find(first));
+  EXPECT_EQ(*table.find(reused), 3);
+  EXPECT_EQ(*table.find(second), 2);
+
+  // Freed slots are reused oldest first
+  table.erase(second);
+  table.erase(reused);
+  auto next = table.insert(std::make_shared<int>(4));
+  EXPECT_EQ(next & (filesystem::maxDescriptors - 1),
+            second & (filesystem::maxDescriptors - 1));
+  EXPECT_FALSE(table.find(rpc::schema::batchRefFlag | next));
+}
+
+TEST(filesystem_streams, evicted_stream_keeps_position) {
+  TempDir dir{"filesystem-evict"};
+  filesystem::Filesystem fs{dir.path, 1};
+
+  auto desc = create(fs, "a", "hello world");
+  ASSERT_EQ(fs.lseek(desc, 6, SEEK_SET), 6);
+  // Only one stream is open at once
+  auto other = create(fs, "b", "other");
+  EXPECT_EQ(preadAll(fs, other), "other");
+
+  std::vector<std::uint8_t> v;
+  ASSERT_EQ(fs.read(desc, 5, v), 5);
+  EXPECT_EQ(std::string(v.begin(), v.end()), "world");
+  EXPECT_EQ(preadAll(fs, other), "other");
+  EXPECT_EQ(fs.close(desc), 0);
+  EXPECT_EQ(fs.close(other), 0);
+}
+
+TEST(filesystem_streams, rename_moves_descriptors) {
+  TempDir dir{"filesystem-rename"};
+  filesystem::Filesystem fs{dir.path, 1};
+
+  auto desc = create(fs, "a", "first");
+  auto other = create(fs, "b", "other");
+  ASSERT_EQ(fs.rename("a", "c"), 0);
+  // Path of the evicted stream is taken by a new file
+  auto replacement = create(fs, "a", "second");
+  EXPECT_EQ(preadAll(fs, desc), "first");
+  EXPECT_EQ(preadAll(fs, replacement), "second");
+
+  // Descriptors follow their directory too
+  std::filesystem::create_directory(dir.path / "d");
+  auto nested = create(fs, "d/e", "nested");
+  EXPECT_EQ(preadAll(fs, other), "other");
+  ASSERT_EQ(fs.rename("d", "f"), 0);
+  EXPECT_EQ(preadAll(fs, nested), "nested");
+}
+
+TEST(filesystem_streams, unlinked_file_stays_open) {
+  TempDir dir{"filesystem-unlink"};
+  filesystem::Filesystem fs{dir.path, 1};
+
+  auto desc = create(fs, "a", "first");
+  auto other = create(fs, "b", "other");
+  ASSERT_EQ(fs.unlink("a"), 0);
+  auto recreated = create(fs, "a", "second");
+  EXPECT_EQ(preadAll(fs, recreated), "second");
+  EXPECT_EQ(preadAll(fs, other), "other");
+  EXPECT_EQ(preadAll(fs, desc), "first");
+
+  // Replaced by a rename
+  ASSERT_EQ(fs.rename("b", "a"), 0);
+  EXPECT_EQ(preadAll(fs, desc), "first");
+  EXPECT_EQ(preadAll(fs, recreated), "second");
+  EXPECT_EQ(preadAll(fs, other), "other");
+}
+
+TEST(filesystem_streams, counts_past_the_buffer) {
+  TempDir dir{"streams-count"};
+  filesystem::Filesystem fs{dir.path};
+
+  auto desc = create(fs, "a", "");
+  // Only bytes the caller gave are written
+  std::vector<std::uint8_t> data{'x', 'y'};
+  EXPECT_EQ(fs.pwrite(desc, 0, 1 << 20, data), 2);
+  EXPECT_EQ(preadAll(fs, desc), "xy");
+  fs.lseek(desc, 2, SEEK_SET);
+  EXPECT_EQ(fs.write(desc, 1 << 20, data), 2);
+  EXPECT_EQ(preadAll(fs, desc), "xyxy");
+}
@@ -0,0 +1,216 @@
+#include <filesystem>
+#include <future>
+#include <gtest/gtest.h>
+#include <ios>
+#include <memory>
+#include <posix.hpp>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+namespace {
+constexpr auto readWrite = static_cast<rpc::schema::mode_t>(std::ios_base::in |
+                                                            std::ios_base::out);
+
+// Fresh directory, removed with everything in it
+class TempDir {
+public:
+  TempDir(const std::string& name)
+      : path{std::filesystem::temp_directory_path() /
+             (name + "-" + std::to_string(getpid()))} {
+    std::filesystem::remove_all(this->path);
+    std::filesystem::create_directory(this->path);
+  }
+  ~TempDir() { std::filesystem::remove_all(this->path); }
+
+  const std::filesystem::path path;
+};
+
+std::vector<std::uint8_t> bytes(const std::string& text) {
+  return {text.begin(), text.end()};
+}
+
+std::string preadAll(filesystem::PosixFilesystem& fs, rpc::schema::File desc) {
+  std::vector<std::uint8_t> v;
+  auto n = fs.pread(desc, 0, 1 << 10, v);
+  EXPECT_GE(n, 0);
+  return {v.begin(), v.end()};
+}
+} // namespace
+
+TEST(filesystem_posix, cache_follows_renamed_file) {
+  TempDir dir{"posix-rename"};
+  filesystem::PosixFilesystem fs{dir.path, {.cacheBytes = 1 << 20}};
+
+  auto first = fs.open("a", readWrite);
+  ASSERT_NE(first, 0);
+  auto data = bytes("old");
+  ASSERT_EQ(fs.pwrite(first, 0, data.size(), data), 3);
+  ASSERT_EQ(fs.rename("a", "b"), 0);
+
+  auto second = fs.open("b", readWrite);
+  ASSERT_NE(second, 0);
+  EXPECT_EQ(preadAll(fs, second), "old");
+  // Written through the descriptor of the old name
+  data = bytes("new");
+  ASSERT_EQ(fs.pwrite(first, 0, data.size(), data), 3);
+  EXPECT_EQ(preadAll(fs, second), "new");
+  EXPECT_EQ(preadAll(fs, first), "new");
+}
+
+TEST(filesystem_posix, cache_forgets_unlinked_file) {
+  TempDir dir{"posix-unlink"};
+  filesystem::PosixFilesystem fs{dir.path, {.cacheBytes = 1 << 20}};
+
+  auto write = [&fs](const std::string& text) {
+    auto desc = fs.open("a", readWrite);
+    EXPECT_NE(desc, 0);
+    auto data = bytes(text);
+    EXPECT_EQ(fs.pwrite(desc, 0, data.size(), data), data.size());
+    return desc;
+  };
+
+  // Closed before unlink
+  auto desc = write("first");
+  EXPECT_EQ(preadAll(fs, desc), "first");
+  EXPECT_EQ(fs.close(desc), 0);
+  ASSERT_EQ(fs.unlink("a"), 0);
+  desc = write("other");
+  EXPECT_EQ(preadAll(fs, desc), "other");
+
+  // Still open after unlink, it keeps reading its own file
+  ASSERT_EQ(fs.unlink("a"), 0);
+  EXPECT_EQ(preadAll(fs, desc), "other");
+  auto recreated = write("third");
+  EXPECT_EQ(preadAll(fs, recreated), "third");
+  EXPECT_EQ(preadAll(fs, desc), "other");
+  EXPECT_EQ(fs.close(desc), 0);
+  EXPECT_EQ(fs.close(recreated), 0);
+  ASSERT_EQ(fs.unlink("a"), 0);
+  desc = write("fourth");
+  EXPECT_EQ(preadAll(fs, desc), "fourth");
+}
+
+TEST(filesystem_posix, offsets) {
+  TempDir dir{"posix-offsets"};
+  filesystem::PosixFilesystem fs{dir.path};
+
+  auto desc = fs.open("a", readWrite);
+  ASSERT_NE(desc, 0);
+  auto data = bytes("0123456789");
+  ASSERT_EQ(fs.write(desc, 4, data), 4);
+  ASSERT_EQ(fs.write(desc, data.size(), data), 10);
+  EXPECT_EQ(fs.lseek(desc, 0, SEEK_CUR), 14);
+
+  // pread and pwrite leave the offset alone
+  data = bytes("ab");
+  ASSERT_EQ(fs.pwrite(desc, 1, data.size(), data), 2);
+  EXPECT_EQ(preadAll(fs, desc), "0ab30123456789");
+  EXPECT_EQ(fs.lseek(desc, 0, SEEK_CUR), 14);
+
+  std::vector<std::uint8_t> v;
+  ASSERT_EQ(fs.lseek(desc, 2, SEEK_SET), 2);
+  ASSERT_EQ(fs.read(desc, 3, v), 3);
+  EXPECT_EQ(std::string(v.begin(), v.end()), "b30");
+  // Short read at the end moves the offset only by what was read
+  ASSERT_EQ(fs.read(desc, 100, v), 9);
+  EXPECT_EQ(fs.lseek(desc, 0, SEEK_CUR), 14);
+  EXPECT_EQ(fs.read(desc, 100, v), 0);
+  EXPECT_EQ(fs.close(desc), 0);
+  EXPECT_EQ(fs.read(desc, 1, v), -1);
+}
+
+TEST(filesystem_posix, direct_bounce) {
+  TempDir dir{"posix-direct"};
+  filesystem::PosixFilesystem fs{dir.path, {.direct = true}};
+
+  auto desc = fs.open("a", readWrite);
+  if (desc == 0) {
+    GTEST_SKIP() << "O_DIRECT is not supported here";
+  }
+  // Caller's buffer need not be aligned, the data is bounced
+  std::vector<std::uint8_t> storage(2 * filesystem::directAlignment + 1);
+  for (std::size_t i = 0; i < storage.size(); i++) {
+    storage[i] = i % 251;
+  }
+  std::vector<std::uint8_t> data(storage.begin() + 1, storage.end());
+  ASSERT_EQ(fs.pwrite(desc, 0, data.size(), data), data.size());
+  std::vector<std::uint8_t> v;
+  ASSERT_EQ(fs.pread(desc, 0, data.size(), v), data.size());
+  EXPECT_EQ(v, data);
+
+  // Unaligned offsets and sizes fail
+  EXPECT_EQ(fs.pread(desc, 1, filesystem::directAlignment, v), -1);
+  EXPECT_EQ(fs.pwrite(desc, 0, 100, data), -1);
+  // Reads past the end are cut short
+  ASSERT_EQ(fs.pread(desc, filesystem::directAlignment,
+                     2 * filesystem::directAlignment, v),
+            filesystem::directAlignment);
+}
+
+class filesystem_posix_engines : public testing::TestWithParam<bool> {};
+
+TEST_P(filesystem_posix_engines, async_claims) {
+  TempDir dir{"posix-async"};
+  filesystem::PosixFilesystem fs{dir.path, {.threadEngine = GetParam()}};
+
+  std::promise<rpc::schema::File> opened;
+  fs.submit(rpc::schema::OpenRequest{.pathname = "a", .mode = readWrite},
+            [&opened](rpc::schema::OpenResponse res) {
+              opened.set_value(res.file);
+            });
+  auto desc = opened.get_future().get();
+  ASSERT_NE(desc, 0);
+
+  // Ranges are claimed on submission, so writes land in submission order
+  std::vector<std::future<std::int64_t>> written;
+  for (auto text : {"one", "two", "six"}) {
+    auto promise = std::make_shared<std::promise<std::int64_t>>();
+    written.push_back(promise->get_future());
+    fs.submit(rpc::schema::WriteRequest{.desc = desc,
+                                        .count = 3,
+                                        .bytes = bytes(text)},
+              [promise](rpc::schema::WriteResponse res) {
+                promise->set_value(res.written);
+              });
+  }
+  for (auto& future : written) {
+    EXPECT_EQ(future.get(), 3);
+  }
+  EXPECT_EQ(preadAll(fs, desc), "onetwosix");
+
+  ASSERT_EQ(fs.lseek(desc, 3, SEEK_SET), 3);
+  std::vector<std::future<rpc::schema::ReadResponse>> read;
+  for (int i = 0; i < 3; i++) {
+    auto promise = std::make_shared<std::promise<rpc::schema::ReadResponse>>();
+    read.push_back(promise->get_future());
+    fs.submit(rpc::schema::ReadRequest{.desc = desc, .count = 4},
+              [promise](rpc::schema::ReadResponse res) {
+                promise->set_value(std::move(res));
+              });
+  }
+  std::vector<std::string> parts;
+  for (auto& future : read) {
+    auto res = future.get();
+    parts.emplace_back(res.bytes.begin(), res.bytes.end());
+  }
+  EXPECT_EQ(parts, (std::vector<std::string>{"twos", "ix", ""}));
+
+  std::promise<std::int64_t> renamed;
+  fs.submit(rpc::schema::RenameRequest{.oldpath = "a", .newpath = "b"},
+            [&renamed](rpc::schema::RenameResponse res) {
+              renamed.set_value(res.result);
+            });
+  EXPECT_EQ(renamed.get_future().get(), 0);
+  std::promise<std::int64_t> unlinked;
+  fs.submit(rpc::schema::UnlinkRequest{.pathname = "b"},
+            [&unlinked](rpc::schema::UnlinkResponse res) {
+              unlinked.set_value(res.result);
+            });
+  EXPECT_EQ(unlinked.get_future().get(), 0);
+  EXPECT_FALSE(std::filesystem::exists(dir.path / "b"));
+  EXPECT_EQ(preadAll(fs, desc), "onetwosix");
+}
+
+INSTANTIATE_TEST_SUITE_P(engines, filesystem_posix_engines, testing::Bool());
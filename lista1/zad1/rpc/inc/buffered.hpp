@@ -0,0 +1,156 @@
+#ifndef RPC_BUFFERED_HPP
+#define RPC_BUFFERED_HPP
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "client.hpp"
+#include "schema.hpp"
+
+namespace rpc {
+namespace client {
+
+constexpr std::size_t defaultBufferBlock = 64 << 10;
+constexpr std::size_t defaultBlocksInFlight = 4;
+constexpr std::size_t defaultReadAhead = 4;
+constexpr std::size_t defaultSequentialReads = 2;
+
+struct BufferOptions {
+  // Writes are collected into blocks of this size
+  std::size_t blockSize = defaultBufferBlock;
+  // Blocks sent and not acknowledged yet, writing more waits for them
+  std::size_t maxInFlight = defaultBlocksInFlight;
+};
+
+// Write-behind handle of a descriptor. Sequential writes are collected into
+// blocks, full blocks are sent as positional writes without waiting for the
+// reply. Blocks in flight may land in any order, so descriptors opened in
+// append mode need maxInFlight = 1. Errors of blocks in flight are thrown
+// by the next call sending a block or waiting for them. Not thread safe,
+// client has to outlive it.
+class BufferedFile {
+public:
+  // Asks the server for the descriptor's offset
+  BufferedFile(Client& client, schema::File desc, BufferOptions options = {});
+  // Flushes, errors are dropped
+  ~BufferedFile();
+
+  BufferedFile(const BufferedFile&) = delete;
+  BufferedFile& operator=(const BufferedFile&) = delete;
+
+  std::int64_t write(std::uint64_t count, const std::vector<std::uint8_t>& v);
+  // Returns once everything written is stored, descriptor's offset on the
+  // server is moved past it
+  void flush();
+  schema::off_t lseek(schema::off_t offset, std::uint32_t whence);
+  std::int64_t close();
+
+  schema::File descriptor() const { return this->desc; }
+
+private:
+  // Completion state, shared with replies of blocks in flight
+  struct State {
+    std::mutex mutex;
+    std::condition_variable done;
+    std::size_t inFlight{0};
+    std::exception_ptr error{};
+  };
+
+  void send();
+  // Waits for blocks in flight, throws the first error
+  void drain();
+
+  Client& client;
+  const schema::File desc;
+  const BufferOptions options;
+  std::shared_ptr<State> state{std::make_shared<State>()};
+  std::vector<std::uint8_t> block{};
+  // Offset the block starts at
+  schema::off_t position;
+  // Whether the server's offset is at position
+  bool synced{true};
+};
+
+struct ReadAheadOptions {
+  // Reads ahead are made in blocks of this size
+  std::size_t blockSize = defaultBufferBlock;
+  // Blocks fetched ahead of the reader
+  std::size_t depth = defaultReadAhead;
+  // Reads in a row after which access is taken as sequential, 0 declares it
+  // sequential from the start
+  std::size_t trigger = defaultSequentialReads;
+};
+
+// Read-ahead handle of a descriptor. Once reads follow each other, the
+// blocks after them are fetched with positional reads before they are asked
+// for, and the server is advised that the file is read sequentially.
+// Seeking elsewhere drops the blocks fetched. Data written by others after
+// its block was fetched is not seen. Not thread safe, client has to outlive
+// it.
+class ReadAheadFile {
+public:
+  // Asks the server for the descriptor's offset
+  ReadAheadFile(Client& client, schema::File desc,
+                ReadAheadOptions options = {});
+  // Syncs the offset, errors are dropped
+  ~ReadAheadFile();
+
+  ReadAheadFile(const ReadAheadFile&) = delete;
+  ReadAheadFile& operator=(const ReadAheadFile&) = delete;
+
+  // Returns number of bytes read, less than count at the end of file
+  std::int64_t read(std::uint64_t count, std::vector<std::uint8_t>& v);
+  // Moves the descriptor's offset on the server past what was read
+  void sync();
+  schema::off_t lseek(schema::off_t offset, std::uint32_t whence);
+  std::int64_t close();
+
+  schema::File descriptor() const { return this->desc; }
+
+private:
+  struct Block {
+    bool done{false};
+    std::int64_t read{0};
+    std::vector<std::uint8_t> bytes{};
+    std::exception_ptr error{};
+  };
+  // Blocks by index, shared with replies of blocks in flight. Replies for
+  // an older generation are dropped.
+  struct State {
+    std::mutex mutex;
+    std::condition_variable done;
+    std::map<std::uint64_t, Block> blocks{};
+    std::uint64_t generation{0};
+  };
+
+  // Requests blocks missing from the depth ahead of position
+  void prefetch();
+  // Forgets fetched blocks and the ones in flight
+  void drop();
+  std::int64_t readAhead(std::uint64_t count, std::vector<std::uint8_t>& v);
+
+  Client& client;
+  const schema::File desc;
+  const ReadAheadOptions options;
+  std::shared_ptr<State> state{std::make_shared<State>()};
+  // Offset the next read starts at
+  schema::off_t position;
+  // Reads since the last seek
+  std::size_t reads{0};
+  // End of file seen in a short block, -1 while unknown
+  schema::off_t end{-1};
+  bool advised{false};
+  // Whether the server's offset is at position
+  bool synced{true};
+};
+
+} // namespace client
+} // namespace rpc
+
+#endif // RPC_BUFFERED_HPP
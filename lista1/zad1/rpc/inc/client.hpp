@@ -1,32 +1,252 @@
 #ifndef RPC_CLIENT_HPP
 #define RPC_CLIENT_HPP
 
+#include <atomic>
+#include <chrono>
 #include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
 #include <limits>
 #include <memory>
+#include <mutex>
 #include <random>
+#include <span>
+#include <stdexcept>
+#include <type_traits>
+#include <variant>
 
+#include <asio.hpp>
+#include <marshalling.hpp>
 #include <protocol.hpp>
 #include <schema.hpp>
 
 namespace rpc {
 namespace client {
+
+constexpr std::size_t defaultWindow = 64;
+// Time a peer gets to answer V2 requests before it is known to speak V2
+constexpr std::chrono::milliseconds defaultProbeTimeout{1000};
+// Requests are sent as V1 this long after a probe timed out, then V2 is
+// probed again
+constexpr std::chrono::milliseconds reprobeInterval = std::chrono::seconds{30};
+
 class Client {
 public:
-  Client(std::uint64_t auth, std::shared_ptr<protocol::Client> client)
-      : auth{auth}, client{client} {}
+  using callback =
+      std::function<void(std::exception_ptr, schema::ResponseBody)>;
+
+  // Window bounds number of asynchronous requests in flight, the rest is
+  // queued until earlier ones complete.
+  // Requests are encoded in the given wire format version. Until the peer
+  // answers a V2 request, V2 requests time out after probeTimeout and are
+  // retried as V1, as peers predating V2 drop them without replying. Later
+  // requests are then sent as V1 for reprobeInterval.
+  Client(std::uint64_t auth, std::shared_ptr<protocol::Client> client,
+         std::size_t window = defaultWindow,
+         marshalling::Version version = marshalling::latest,
+         std::chrono::milliseconds probeTimeout = defaultProbeTimeout)
+      : auth{auth}, client{client}, window{window}, version{version},
+        probeTimeout{probeTimeout} {
+    if (window == 0) {
+      throw std::invalid_argument("window must not be empty");
+    }
+  }
 
   schema::File open(std::string pathname, schema::mode_t mode);
   std::int64_t read(schema::File desc, std::uint64_t count,
                     std::vector<std::uint8_t>& v);
   std::int64_t write(schema::File desc, std::uint64_t count,
                      std::vector<std::uint8_t>& v);
+  // Payloads go straight between the caller's memory and the message
+  // buffers. Reads fill at most data.size() bytes and return how many.
+  std::int64_t read(schema::File desc, std::span<std::uint8_t> data);
+  std::int64_t write(schema::File desc, std::span<const std::uint8_t> data);
   schema::off_t lseek(schema::File desc, schema::off_t offset,
                       std::uint32_t whence);
   std::int64_t chmod(std::string pathname, std::uint32_t mode);
   std::int64_t unlink(std::string pathname);
   std::int64_t rename(std::string oldpath, std::string newpath);
   std::int64_t close(schema::File desc);
+  // Read and write at the given offset without moving the descriptor's one.
+  // Idempotent, so safe to retry and to run in parallel.
+  std::int64_t pread(schema::File desc, schema::off_t offset,
+                     std::uint64_t count, std::vector<std::uint8_t>& v);
+  std::int64_t pwrite(schema::File desc, schema::off_t offset,
+                      std::uint64_t count, std::vector<std::uint8_t>& v);
+  std::int64_t pread(schema::File desc, schema::off_t offset,
+                     std::span<std::uint8_t> data);
+  std::int64_t pwrite(schema::File desc, schema::off_t offset,
+                      std::span<const std::uint8_t> data);
+
+  // Read or write many ranges in a single round trip. Read data of i-th
+  // extent is put into v[i], v of writev holds payloads of all extents back
+  // to back. Return total number of bytes transferred, -1 if any range
+  // failed.
+  std::int64_t readv(schema::File desc, std::vector<schema::Extent> extents,
+                     std::vector<std::vector<std::uint8_t>>& v);
+  std::int64_t writev(schema::File desc, std::vector<schema::Extent> extents,
+                      std::vector<std::uint8_t>& v);
+
+  // Tells the server how a range is going to be read, count 0 reaches the
+  // end of the file
+  std::int64_t advise(schema::File desc, schema::off_t offset,
+                      std::uint64_t count, schema::Advice advice);
+
+  // Leases for caching files, see ReadCache
+  schema::LeaseResponse lease(std::string pathname);
+  schema::RevocationsResponse revocations(std::uint64_t since);
+
+  // Executes requests in order in a single round trip. Descriptor fields may
+  // refer to a file opened earlier in the same batch with schema::batchRef.
+  std::vector<schema::SubResponse>
+  batch(std::vector<schema::SubRequest> requests);
+
+  // Asynchronous variants accept any asio completion token: a callback
+  // void(std::exception_ptr, Result), asio::use_future or
+  // asio::use_awaitable for C++20 coroutines. Handlers are invoked on their
+  // associated executor (transport's thread for plain callbacks).
+
+  template <typename CompletionToken>
+  auto openAsync(std::string pathname, schema::mode_t mode,
+                 CompletionToken&& token) {
+    return this->asyncCall<schema::OpenResponse>(
+        schema::OpenRequest{.pathname = pathname, .mode = mode},
+        [](schema::OpenResponse res) { return res.file; },
+        std::forward<CompletionToken>(token));
+  }
+
+  // Result carries both number of bytes read and the bytes
+  template <typename CompletionToken>
+  auto readAsync(schema::File desc, std::uint64_t count,
+                 CompletionToken&& token) {
+    return this->asyncCall<schema::ReadResponse>(
+        schema::ReadRequest{.desc = desc, .count = count},
+        [](schema::ReadResponse res) { return res; },
+        std::forward<CompletionToken>(token));
+  }
+
+  template <typename CompletionToken>
+  auto writeAsync(schema::File desc, std::vector<std::uint8_t> v,
+                  CompletionToken&& token) {
+    std::uint64_t count = v.size();
+    return this->asyncCall<schema::WriteResponse>(
+        schema::WriteRequest{
+            .desc = desc, .count = count, .bytes = std::move(v)},
+        [](schema::WriteResponse res) { return res.written; },
+        std::forward<CompletionToken>(token));
+  }
+
+  template <typename CompletionToken>
+  auto lseekAsync(schema::File desc, schema::off_t offset,
+                  std::uint32_t whence, CompletionToken&& token) {
+    return this->asyncCall<schema::LSeekResponse>(
+        schema::LSeekRequest{.desc = desc, .offset = offset, .whence = whence},
+        [](schema::LSeekResponse res) { return res.offset; },
+        std::forward<CompletionToken>(token));
+  }
+
+  template <typename CompletionToken>
+  auto chmodAsync(std::string pathname, std::uint32_t mode,
+                  CompletionToken&& token) {
+    return this->asyncCall<schema::ChmodResponse>(
+        schema::ChmodRequest{.pathname = pathname, .mode = mode},
+        [](schema::ChmodResponse res) { return res.result; },
+        std::forward<CompletionToken>(token));
+  }
+
+  template <typename CompletionToken>
+  auto unlinkAsync(std::string pathname, CompletionToken&& token) {
+    return this->asyncCall<schema::UnlinkResponse>(
+        schema::UnlinkRequest{.pathname = pathname},
+        [](schema::UnlinkResponse res) { return res.result; },
+        std::forward<CompletionToken>(token));
+  }
+
+  template <typename CompletionToken>
+  auto renameAsync(std::string oldpath, std::string newpath,
+                   CompletionToken&& token) {
+    return this->asyncCall<schema::RenameResponse>(
+        schema::RenameRequest{.oldpath = oldpath, .newpath = newpath},
+        [](schema::RenameResponse res) { return res.result; },
+        std::forward<CompletionToken>(token));
+  }
+
+  template <typename CompletionToken>
+  auto closeAsync(schema::File desc, CompletionToken&& token) {
+    return this->asyncCall<schema::CloseResponse>(
+        schema::CloseRequest{.desc = desc},
+        [](schema::CloseResponse res) { return res.result; },
+        std::forward<CompletionToken>(token));
+  }
+
+  template <typename CompletionToken>
+  auto preadAsync(schema::File desc, schema::off_t offset, std::uint64_t count,
+                  CompletionToken&& token) {
+    return this->asyncCall<schema::PReadResponse>(
+        schema::PReadRequest{.desc = desc, .offset = offset, .count = count},
+        [](schema::PReadResponse res) { return res; },
+        std::forward<CompletionToken>(token));
+  }
+
+  template <typename CompletionToken>
+  auto pwriteAsync(schema::File desc, schema::off_t offset,
+                   std::vector<std::uint8_t> v, CompletionToken&& token) {
+    std::uint64_t count = v.size();
+    return this->asyncCall<schema::PWriteResponse>(
+        schema::PWriteRequest{.desc = desc,
+                              .offset = offset,
+                              .count = count,
+                              .bytes = std::move(v)},
+        [](schema::PWriteResponse res) { return res.written; },
+        std::forward<CompletionToken>(token));
+  }
+
+  template <typename CompletionToken>
+  auto readvAsync(schema::File desc, std::vector<schema::Extent> extents,
+                  CompletionToken&& token) {
+    return this->asyncCall<schema::ReadVResponse>(
+        schema::ReadVRequest{.desc = desc, .extents = std::move(extents)},
+        [](schema::ReadVResponse res) { return res; },
+        std::forward<CompletionToken>(token));
+  }
+
+  template <typename CompletionToken>
+  auto writevAsync(schema::File desc, std::vector<schema::Extent> extents,
+                   std::vector<std::uint8_t> v, CompletionToken&& token) {
+    std::uint64_t count = v.size();
+    return this->asyncCall<schema::WriteVResponse>(
+        schema::WriteVRequest{.desc = desc,
+                              .extents = std::move(extents),
+                              .count = count,
+                              .bytes = std::move(v)},
+        [](schema::WriteVResponse res) { return res.written; },
+        std::forward<CompletionToken>(token));
+  }
+
+  template <typename CompletionToken>
+  auto adviseAsync(schema::File desc, schema::off_t offset, std::uint64_t count,
+                   schema::Advice advice, CompletionToken&& token) {
+    return this->asyncCall<schema::AdviseResponse>(
+        schema::AdviseRequest{.desc = desc,
+                              .offset = offset,
+                              .count = count,
+                              .advice = static_cast<std::uint32_t>(advice)},
+        [](schema::AdviseResponse res) { return res.result; },
+        std::forward<CompletionToken>(token));
+  }
+
+  template <typename CompletionToken>
+  auto batchAsync(std::vector<schema::SubRequest> requests,
+                  CompletionToken&& token) {
+    return this->asyncCall<schema::BatchResponse>(
+        schema::BatchRequest{.requests = std::move(requests)},
+        [](schema::BatchResponse res) { return std::move(res.responses); },
+        std::forward<CompletionToken>(token));
+  }
+
+  // Low level asynchronous call, response type is not checked
+  void sendBodyAsync(schema::RequestBody body, callback cb);
 
 private:
   const std::uint64_t auth{0};
@@ -35,9 +255,71 @@ private:
   std::default_random_engine rng{std::random_device{}()};
   const std::shared_ptr<protocol::Client> client;
   schema::ResponseBody sendBody(schema::RequestBody);
+  // Header with a fresh id
+  schema::Header header();
+  // Sends a schema or view request and passes the response to handle while
+  // the buffer it points into is alive
+  template <typename Request, typename Handle>
+  void exchange(const Request& req, Handle handle);
+
+  const std::size_t window;
+  std::mutex mutex;
+  std::size_t inFlight{0};
+  std::deque<std::function<void()>> backlog{};
+  void release();
+
+  const marshalling::Version version;
+  const std::chrono::milliseconds probeTimeout;
+  // Set once peer answered a request newer than V1
+  std::atomic<bool> negotiated{false};
+  // Requests are sent as V1 until then, after a probe timed out
+  std::atomic<std::chrono::steady_clock::time_point> legacyUntil{};
+  // Version the next request is sent in
+  marshalling::Version current();
+  bool probing(marshalling::Version version);
+  bool fallback(marshalling::Version used, std::error_code ec);
+  void transmit(std::shared_ptr<const schema::Request> req,
+                marshalling::Version version, callback cb);
+
+  template <typename Response, typename Projection, typename CompletionToken>
+  auto asyncCall(schema::RequestBody body, Projection projection,
+                 CompletionToken&& token) {
+    using Result = std::invoke_result_t<Projection, Response>;
+    return asio::async_initiate<CompletionToken,
+                                void(std::exception_ptr, Result)>(
+        [this](auto handler, schema::RequestBody body, Projection projection) {
+          // Keeps handler's executor (e.g. coroutine's io_context) alive
+          // until the reply arrives
+          auto work =
+              asio::make_work_guard(asio::get_associated_executor(handler));
+          // std::function requires copyable callable
+          auto shared =
+              std::make_shared<decltype(handler)>(std::move(handler));
+          this->sendBodyAsync(
+              std::move(body),
+              [shared, work, projection](std::exception_ptr e,
+                                         schema::ResponseBody resp) {
+                Result result{};
+                if (!e) {
+                  if (auto res = std::get_if<Response>(&resp)) {
+                    result = projection(std::move(*res));
+                  } else {
+                    e = std::make_exception_ptr(
+                        std::invalid_argument("bad response type"));
+                  }
+                }
+                asio::dispatch(
+                    work.get_executor(),
+                    [shared, e, result = std::move(result)]() mutable {
+                      std::move(*shared)(e, std::move(result));
+                    });
+              });
+        },
+        token, std::move(body), std::move(projection));
+  }
 };
 
 } // namespace client
 } // namespace rpc
 
-#endif // RPC_CLIENT_HPP
\ No newline at end of file
+#endif // RPC_CLIENT_HPP
@@ -0,0 +1,249 @@
+#ifndef RPC_CODEC_HPP
+#define RPC_CODEC_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <span>
+#include <stdexcept>
+#include <string_view>
+#include <type_traits>
+
+// Primitive encoders used by marshalling, in one of two formats:
+//  - V1: scalars copied as they are laid out in memory (host endian), lengths
+//    are u64
+//  - V2: fixed width fields are little endian, integer fields and lengths are
+//    LEB128 varints, signed ones zigzag encoded
+// Tags are a single byte in both.
+
+namespace rpc {
+namespace codec {
+
+enum class Version : std::uint8_t {
+  V1 = 1,
+  V2 = 2,
+};
+
+constexpr std::size_t maxVarintSize = 10;
+
+constexpr std::uint64_t zigzag(std::int64_t value) {
+  return (static_cast<std::uint64_t>(value) << 1) ^
+         static_cast<std::uint64_t>(value >> 63);
+}
+
+constexpr std::int64_t unzigzag(std::uint64_t value) {
+  return static_cast<std::int64_t>(value >> 1) ^
+         -static_cast<std::int64_t>(value & 1);
+}
+
+constexpr std::size_t varintSize(std::uint64_t value) {
+  std::size_t result = 1;
+  for (; value >= 0x80; value >>= 7) {
+    result++;
+  }
+  return result;
+}
+
+template <typename T> constexpr std::uint64_t widen(T value) {
+  if constexpr (std::is_signed_v<T>) {
+    return zigzag(value);
+  } else {
+    return value;
+  }
+}
+
+// Writes into caller provided buffer, never past its end
+class Writer {
+public:
+  Writer(std::span<std::uint8_t> out, Version version = Version::V1)
+      : out{out}, format{version} {}
+
+  template <typename T> void tag(T value) {
+    static_assert(sizeof(T) == 1);
+    this->take(1)[0] = static_cast<std::uint8_t>(value);
+  }
+
+  template <typename T> void fixed(T value) {
+    static_assert(std::is_integral_v<T>);
+    auto dst = this->take(sizeof(T));
+    if (this->format == Version::V1) {
+      std::memcpy(dst.data(), &value, sizeof(T));
+      return;
+    }
+    auto bits = static_cast<std::make_unsigned_t<T>>(value);
+    for (std::size_t i = 0; i < sizeof(T); i++) {
+      dst[i] = static_cast<std::uint8_t>(bits >> (8 * i));
+    }
+  }
+
+  template <typename T> void integer(T value) {
+    static_assert(std::is_integral_v<T>);
+    if (this->format == Version::V1) {
+      this->fixed(value);
+      return;
+    }
+    std::uint64_t bits = widen(value);
+    for (auto& byte : this->take(varintSize(bits))) {
+      byte = static_cast<std::uint8_t>(bits >= 0x80 ? (bits & 0x7f) | 0x80
+                                                    : bits);
+      bits >>= 7;
+    }
+  }
+
+  void raw(std::span<const std::uint8_t> data) {
+    auto dst = this->take(data.size());
+    if (!data.empty()) {
+      std::memcpy(dst.data(), data.data(), data.size());
+    }
+  }
+
+  void string(std::string_view str) {
+    this->integer(static_cast<std::uint64_t>(str.size()));
+    this->raw({reinterpret_cast<const std::uint8_t*>(str.data()), str.size()});
+  }
+
+  std::size_t written() const { return this->offset; }
+  Version version() const { return this->format; }
+
+private:
+  std::span<std::uint8_t> take(std::size_t count) {
+    if (count > this->out.size() - this->offset) {
+      throw std::length_error("buffer too small");
+    }
+    auto result = this->out.subspan(this->offset, count);
+    this->offset += count;
+    return result;
+  }
+
+  std::span<std::uint8_t> out;
+  const Version format;
+  std::size_t offset{0};
+};
+
+// Same interface as Writer, only counts bytes. Running an encoder with it
+// gives the exact size of the message.
+class Sizer {
+public:
+  Sizer(Version version = Version::V1) : format{version} {}
+
+  template <typename T> void tag(T) { this->offset += 1; }
+  template <typename T> void fixed(T) { this->offset += sizeof(T); }
+
+  template <typename T> void integer(T value) {
+    this->offset += this->format == Version::V1 ? sizeof(T)
+                                                : varintSize(widen(value));
+  }
+
+  void raw(std::span<const std::uint8_t> data) { this->offset += data.size(); }
+
+  void string(std::string_view str) {
+    this->integer(static_cast<std::uint64_t>(str.size()));
+    this->offset += str.size();
+  }
+
+  std::size_t written() const { return this->offset; }
+  Version version() const { return this->format; }
+
+private:
+  const Version format;
+  std::size_t offset{0};
+};
+
+// Bounds checked reader, strings and byte arrays are returned as views into
+// the input
+class Reader {
+public:
+  Reader(std::span<const std::uint8_t> in, Version version = Version::V1)
+      : in{in}, format{version} {}
+
+  template <typename T> T tag() {
+    static_assert(sizeof(T) == 1);
+    return static_cast<T>(this->take(1)[0]);
+  }
+
+  template <typename T> T fixed() {
+    static_assert(std::is_integral_v<T>);
+    auto src = this->take(sizeof(T));
+    T result;
+    if (this->format == Version::V1) {
+      std::memcpy(&result, src.data(), sizeof(T));
+      return result;
+    }
+    std::make_unsigned_t<T> bits = 0;
+    for (std::size_t i = 0; i < sizeof(T); i++) {
+      bits |= static_cast<std::make_unsigned_t<T>>(src[i]) << (8 * i);
+    }
+    return static_cast<T>(bits);
+  }
+
+  template <typename T> T integer() {
+    static_assert(std::is_integral_v<T>);
+    if (this->format == Version::V1) {
+      return this->fixed<T>();
+    }
+    auto bits = this->varint();
+    if constexpr (std::is_signed_v<T>) {
+      auto value = unzigzag(bits);
+      if (value < std::numeric_limits<T>::min() ||
+          value > std::numeric_limits<T>::max()) {
+        throw std::invalid_argument("integer out of range");
+      }
+      return static_cast<T>(value);
+    } else {
+      if (bits > std::numeric_limits<T>::max()) {
+        throw std::invalid_argument("integer out of range");
+      }
+      return static_cast<T>(bits);
+    }
+  }
+
+  std::span<const std::uint8_t> raw(std::uint64_t count) {
+    return this->take(count);
+  }
+
+  std::string_view string() {
+    auto data = this->take(this->integer<std::uint64_t>());
+    return {reinterpret_cast<const char*>(data.data()), data.size()};
+  }
+
+  std::size_t consumed() const { return this->offset; }
+  std::size_t remaining() const { return this->in.size() - this->offset; }
+  std::span<const std::uint8_t> input() const { return this->in; }
+  Version version() const { return this->format; }
+
+private:
+  std::span<const std::uint8_t> take(std::uint64_t count) {
+    if (count > this->remaining()) {
+      throw std::invalid_argument("truncated message");
+    }
+    auto result = this->in.subspan(this->offset, count);
+    this->offset += count;
+    return result;
+  }
+
+  std::uint64_t varint() {
+    std::uint64_t result = 0;
+    for (std::size_t i = 0; i < maxVarintSize; i++) {
+      auto byte = this->take(1)[0];
+      // Last byte carries only the highest bit
+      if (i == maxVarintSize - 1 && byte > 1) {
+        break;
+      }
+      result |= static_cast<std::uint64_t>(byte & 0x7f) << (7 * i);
+      if ((byte & 0x80) == 0) {
+        return result;
+      }
+    }
+    throw std::invalid_argument("malformed varint");
+  }
+
+  std::span<const std::uint8_t> in;
+  const Version format;
+  std::size_t offset{0};
+};
+
+} // namespace codec
+} // namespace rpc
+
+#endif // RPC_CODEC_HPP
@@ -0,0 +1,91 @@
+#ifndef RPC_LEASES_HPP
+#define RPC_LEASES_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+
+#include "schema.hpp"
+
+namespace rpc {
+namespace server {
+
+constexpr std::chrono::milliseconds defaultLeaseTerm{2000};
+// Revocations kept for polling clients, older ones revoke every lease
+constexpr std::size_t defaultRevocations = 4096;
+// Revocations listed in one response, more revoke every lease
+constexpr std::size_t maxListedRevocations = 256;
+constexpr std::size_t leaseShards = 16;
+
+// Leases granted to clients caching files. Every modification of a leased
+// file bumps its version, and while a lease on it may still last it is
+// logged as a revocation. Files modified within the last term are not
+// leased, they are being written. Thread safe.
+class LeaseTable {
+public:
+  LeaseTable(std::chrono::milliseconds term = defaultLeaseTerm,
+             std::size_t maxRevocations = defaultRevocations);
+
+  schema::LeaseResponse grant(const std::string& pathname);
+  schema::RevocationsResponse revoked(std::uint64_t since);
+
+  // Descriptors are mapped to their files, so writes through them are seen
+  void opened(schema::File desc, const std::string& pathname);
+  void closed(schema::File desc);
+  void modified(const std::string& pathname);
+  void written(schema::File desc);
+  // Revokes the path and, for a directory, every path under it
+  void removed(const std::string& pathname);
+  // After a successful rename, descriptors under the old path write the new
+  void renamed(const std::string& oldpath, const std::string& newpath);
+
+private:
+  using Clock = std::chrono::steady_clock;
+
+  struct File {
+    std::uint64_t version;
+    // Latest expiry of the leases granted
+    Clock::time_point expires;
+    Clock::time_point modified;
+  };
+  struct Shard {
+    std::mutex mutex;
+    std::unordered_map<std::string, File> files{};
+    // Size at which files nobody holds a lease on are dropped
+    std::size_t sweepAt{64};
+  };
+  struct Revocation {
+    std::uint64_t sequence;
+    std::string pathname;
+    std::uint64_t version;
+  };
+
+  Shard& shard(const std::string& path);
+  void revoke(const std::string& path, std::uint64_t version);
+
+  const std::chrono::milliseconds term;
+  const std::size_t maxRevocations;
+  std::unique_ptr<Shard[]> shards;
+  // Versions are never reused, so a file dropped and leased again does not
+  // match blocks cached before
+  std::atomic<std::uint64_t> versions{0};
+
+  std::shared_mutex descsMutex;
+  std::unordered_map<schema::File, std::string> descs{};
+
+  std::mutex revocationsMutex;
+  std::uint64_t sequence{0};
+  std::deque<Revocation> revocations{};
+};
+
+} // namespace server
+} // namespace rpc
+
+#endif // RPC_LEASES_HPP
@@ -1,17 +1,72 @@
 #ifndef RPC_MARSHALLING_HPP
 #define RPC_MARSHALLING_HPP
 
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
 #include <vector>
 
+#include "codec.hpp"
 #include "schema.hpp"
+#include "view.hpp"
 
 namespace rpc {
 namespace marshalling {
-std::vector<std::uint8_t> marshalRequest(schema::Request);
-schema::Request unmarshalRequest(std::vector<std::uint8_t>);
-std::vector<std::uint8_t> marshalResponse(schema::Response);
-schema::Response unmarshalResponse(std::vector<std::uint8_t>);
+using codec::Version;
+
+// Version new messages are encoded with
+constexpr Version latest = Version::V2;
+
+// V2 messages start with magic followed by the version byte. V1 ones start
+// with auth (requests) or id (responses), values starting with magic are
+// read as V2.
+constexpr std::array<std::uint8_t, 3> magic{0xF5, 'R', 'P'};
+
+Version detectVersion(std::span<const std::uint8_t>);
+
+// Exact number of bytes the encoded message takes
+std::size_t requestSize(const schema::Request&, Version = latest);
+std::size_t responseSize(const schema::Response&, Version = latest);
+
+// Encode in a single pass, return number of bytes written. Throw
+// std::length_error when the buffer is too small.
+std::size_t encodeRequest(const schema::Request&, std::span<std::uint8_t>,
+                          Version = latest);
+std::size_t encodeResponse(const schema::Response&, std::span<std::uint8_t>,
+                           Version = latest);
+
+// Decode without allocating, views point into the given buffer. Version is
+// detected from the message. Throw std::invalid_argument on malformed or
+// truncated input.
+view::Request decodeRequest(std::span<const std::uint8_t>);
+view::Response decodeResponse(std::span<const std::uint8_t>);
+// Decode the first message of a batch and advance bytes past it
+view::SubRequest decodeSubRequest(std::span<const std::uint8_t>& bytes,
+                                  Version);
+view::SubResponse decodeSubResponse(std::span<const std::uint8_t>& bytes,
+                                    Version);
+
+schema::Request toOwned(const view::Request&);
+schema::Response toOwned(const view::Response&);
+
+// Views encode like the messages they point into, payloads are copied
+// straight from the memory they refer to. Sequences have to be in the
+// version encoded.
+std::size_t requestSize(const view::Request&, Version = latest);
+std::size_t encodeRequest(const view::Request&, std::span<std::uint8_t>,
+                          Version = latest);
+
+// Buffers are drawn from pool::buffers()
+std::vector<std::uint8_t> marshalRequest(const schema::Request&,
+                                         Version = latest);
+std::vector<std::uint8_t> marshalRequest(const view::Request&,
+                                         Version = latest);
+schema::Request unmarshalRequest(std::span<const std::uint8_t>);
+std::vector<std::uint8_t> marshalResponse(const schema::Response&,
+                                          Version = latest);
+schema::Response unmarshalResponse(std::span<const std::uint8_t>);
 } // namespace marshalling
 } // namespace rpc
 
-#endif // RPC_MARSHALLING_HPP
\ No newline at end of file
+#endif // RPC_MARSHALLING_HPP
@@ -0,0 +1,180 @@
+#ifndef RPC_POOL_HPP
+#define RPC_POOL_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#if defined(__SANITIZE_ADDRESS__)
+#define RPC_POOL_ASAN 1
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define RPC_POOL_ASAN 1
+#endif
+#endif
+
+#ifdef RPC_POOL_ASAN
+#include <sanitizer/asan_interface.h>
+#endif
+
+namespace rpc {
+namespace pool {
+
+// Capacity of fresh buffers, one datagram of a standard ethernet MTU
+constexpr std::size_t slabSize = 1472;
+// Buffers grown past this are returned to the allocator instead
+constexpr std::size_t maxPooledCapacity = std::size_t{1} << 20;
+constexpr std::size_t defaultMaxBuffers = 256;
+// Capacity the pool keeps at most, all buffers together
+constexpr std::size_t defaultMaxBytes = std::size_t{8} << 20;
+// Blocks a RecyclingAllocator keeps per type
+constexpr std::size_t maxRecycledBlocks = 1024;
+
+// Recycles byte buffers between the transports, the codec and the backend,
+// so steady state traffic does not reach the allocator. Released buffers
+// keep their capacity but not their contents: they are zeroed, and under
+// AddressSanitizer poisoned until acquired again, so reading past a
+// message's end never shows an earlier one. Thread safe.
+class BufferPool {
+public:
+  BufferPool(std::size_t maxBuffers = defaultMaxBuffers,
+             std::size_t maxBytes = defaultMaxBytes)
+      : maxBuffers{maxBuffers}, maxBytes{maxBytes} {
+    this->buffers.reserve(maxBuffers);
+  }
+
+  ~BufferPool() {
+#ifdef RPC_POOL_ASAN
+    for (auto& buffer : this->buffers) {
+      ASAN_UNPOISON_MEMORY_REGION(buffer.data(), buffer.capacity());
+    }
+#endif
+  }
+
+  // Empty buffer with at least slabSize capacity
+  std::vector<std::uint8_t> acquire() {
+    {
+      std::lock_guard lock{this->mutex};
+      if (!this->buffers.empty()) {
+        auto result = std::move(this->buffers.back());
+        this->buffers.pop_back();
+        this->bytes -= result.capacity();
+#ifdef RPC_POOL_ASAN
+        ASAN_UNPOISON_MEMORY_REGION(result.data(), result.capacity());
+#endif
+        return result;
+      }
+    }
+    std::vector<std::uint8_t> result;
+    result.reserve(slabSize);
+    return result;
+  }
+
+  void release(std::vector<std::uint8_t>&& buffer) {
+    if (buffer.capacity() < slabSize ||
+        buffer.capacity() > maxPooledCapacity) {
+      return;
+    }
+    {
+      std::lock_guard lock{this->mutex};
+      if (this->buffers.size() >= this->maxBuffers ||
+          this->bytes + buffer.capacity() > this->maxBytes) {
+        return;
+      }
+      this->bytes += buffer.capacity();
+    }
+    // Whole capacity, bytes past the size may be left from longer contents
+    buffer.assign(buffer.capacity(), 0);
+    buffer.clear();
+#ifdef RPC_POOL_ASAN
+    ASAN_POISON_MEMORY_REGION(buffer.data(), buffer.capacity());
+#endif
+    std::lock_guard lock{this->mutex};
+    this->buffers.push_back(std::move(buffer));
+  }
+
+private:
+  const std::size_t maxBuffers;
+  const std::size_t maxBytes;
+  std::mutex mutex;
+  // Capacity of the buffers held, including ones being scrubbed
+  std::size_t bytes{0};
+  std::vector<std::vector<std::uint8_t>> buffers{};
+};
+
+// Allocator for objects made for every request, typically allocated by the
+// transport's thread and freed by a worker. Single objects are kept on a
+// free list shared by all threads, unlike asio's per thread recycling.
+template <typename T> class RecyclingAllocator {
+public:
+  using value_type = T;
+
+  RecyclingAllocator() = default;
+  template <typename U> RecyclingAllocator(const RecyclingAllocator<U>&) {}
+
+  T* allocate(std::size_t n) {
+    if (n == 1) {
+      if (auto block = blocks().pop()) {
+        return static_cast<T*>(block);
+      }
+    }
+    return std::allocator<T>{}.allocate(n);
+  }
+
+  void deallocate(T* p, std::size_t n) {
+    if (n != 1 || !blocks().push(p)) {
+      std::allocator<T>{}.deallocate(p, n);
+    }
+  }
+
+  template <typename U>
+  bool operator==(const RecyclingAllocator<U>&) const {
+    return true;
+  }
+
+private:
+  struct FreeList {
+    FreeList() { this->free.reserve(maxRecycledBlocks); }
+
+    void* pop() {
+      std::lock_guard lock{this->mutex};
+      if (this->free.empty()) {
+        return nullptr;
+      }
+      auto block = this->free.back();
+      this->free.pop_back();
+      return block;
+    }
+
+    bool push(void* block) {
+      std::lock_guard lock{this->mutex};
+      if (this->free.size() >= maxRecycledBlocks) {
+        return false;
+      }
+      this->free.push_back(block);
+      return true;
+    }
+
+    std::mutex mutex;
+    std::vector<void*> free{};
+  };
+
+  // Never destroyed, objects may be freed by other static destructors
+  static FreeList& blocks() {
+    static auto list = new FreeList{};
+    return *list;
+  }
+};
+
+// Pool shared by the whole process
+inline BufferPool& buffers() {
+  static BufferPool pool{};
+  return pool;
+}
+
+} // namespace pool
+} // namespace rpc
+
+#endif // RPC_POOL_HPP
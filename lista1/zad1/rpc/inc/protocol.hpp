@@ -1,26 +1,87 @@
 #ifndef RPC_PROTOCOL_HPP
 #define RPC_PROTOCOL_HPP
 
+#include <chrono>
+#include <cstddef>
 #include <cstdint>
+#include <exception>
 #include <functional>
+#include <future>
+#include <system_error>
 #include <vector>
 
 namespace rpc {
 namespace protocol {
 
+// Largest message transports accept from a peer by default, larger ones are
+// dropped before their payload is buffered
+constexpr std::size_t defaultMaxMessageSize = 64 << 20;
+
+using callback =
+    std::function<void(std::error_code, std::vector<std::uint8_t>)>;
+
 class Client {
 public:
   virtual std::vector<std::uint8_t>
   makeRequest(const std::vector<std::uint8_t>&) = 0;
+
+  // Sends request without waiting for the reply. Callback is called exactly
+  // once, from transport's thread, with the reply matched by id. Id has to be
+  // unique among requests in flight.
+  // Default implementation is synchronous, transports capable of pipelining
+  // should override it.
+  virtual void asyncRequest(std::uint64_t id, std::vector<std::uint8_t> data,
+                            callback cb) {
+    (void)id;
+    std::vector<std::uint8_t> result;
+    try {
+      result = this->makeRequest(data);
+    } catch (const std::exception&) {
+      cb(std::make_error_code(std::errc::timed_out), {});
+      return;
+    }
+    cb({}, std::move(result));
+  }
+
+  // Like asyncRequest, but fails with timed_out after timeout if that comes
+  // before the transport's own timeout. Default implementation ignores it.
+  virtual void asyncRequestFor(std::uint64_t id,
+                               std::vector<std::uint8_t> data,
+                               std::chrono::milliseconds timeout,
+                               callback cb) {
+    (void)timeout;
+    this->asyncRequest(id, std::move(data), std::move(cb));
+  }
+
   virtual ~Client() = default;
 };
 
 using handler =
     std::function<std::vector<std::uint8_t>(std::vector<std::uint8_t>)>;
 
+using responder = std::function<void(std::vector<std::uint8_t>)>;
+// Replies by calling responder exactly once, possibly later and from other
+// thread
+using asyncHandler =
+    std::function<void(std::vector<std::uint8_t>, responder)>;
+
 class Server {
 public:
   virtual void setHandler(handler) = 0;
+
+  // Default implementation waits for the reply, transports able to receive
+  // while requests are handled should override it
+  virtual void setAsyncHandler(asyncHandler h) {
+    this->setHandler([h](std::vector<std::uint8_t> bytes) {
+      std::promise<std::vector<std::uint8_t>> promise;
+      auto future = promise.get_future();
+      h(std::move(bytes), [&promise](std::vector<std::uint8_t> reply) {
+        promise.set_value(std::move(reply));
+      });
+      return future.get();
+    });
+  }
+
   virtual ~Server() = default;
 };
 
@@ -28,4 +89,4 @@ public:
 
 } // namespace rpc
 
-#endif // RPC_PROTOCOL_HPP
\ No newline at end of file
+#endif // RPC_PROTOCOL_HPP
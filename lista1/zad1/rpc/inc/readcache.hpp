@@ -0,0 +1,110 @@
+#ifndef RPC_READCACHE_HPP
+#define RPC_READCACHE_HPP
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "client.hpp"
+#include "schema.hpp"
+
+namespace rpc {
+namespace client {
+
+constexpr std::size_t defaultCacheBytes = 64 << 20;
+constexpr std::size_t defaultCacheBlock = 64 << 10;
+constexpr std::chrono::milliseconds defaultStaleness{100};
+
+struct ReadCacheOptions {
+  // Bytes of blocks kept, least recently used ones are dropped first
+  std::size_t capacity = defaultCacheBytes;
+  // Files are cached in aligned blocks of this size
+  std::size_t blockSize = defaultCacheBlock;
+  // Revocations are polled at most this often while blocks are served, so
+  // no hit is older than that
+  std::chrono::milliseconds staleness = defaultStaleness;
+};
+
+struct ReadCacheStats {
+  std::uint64_t hits;
+  std::uint64_t misses;
+};
+
+// Client side cache of files read with positional reads, keyed by path and
+// block. Blocks are served while the server's lease on the file lasts and
+// its version does not change. Files the server refuses to lease, as others
+// are writing them, are read through. Thread safe, client has to outlive
+// it.
+class ReadCache {
+public:
+  ReadCache(Client& client, ReadCacheOptions options = {});
+
+  // Opens the file and leases it in a single round trip
+  schema::File open(std::string pathname, schema::mode_t mode);
+  std::int64_t pread(schema::File desc, schema::off_t offset,
+                     std::uint64_t count, std::vector<std::uint8_t>& v);
+  // Writes through, blocks of the file cached here are dropped
+  std::int64_t pwrite(schema::File desc, schema::off_t offset,
+                      std::uint64_t count, std::vector<std::uint8_t>& v);
+  std::int64_t close(schema::File desc);
+
+  ReadCacheStats stats() const;
+
+private:
+  using Clock = std::chrono::steady_clock;
+
+  struct Block {
+    std::string path;
+    std::uint64_t index;
+    std::vector<std::uint8_t> bytes;
+  };
+  // Most recently used first
+  using Blocks = std::list<Block>;
+  struct Lease {
+    std::uint64_t version{0};
+    bool granted{false};
+    Clock::time_point expires{};
+    // Bumped when blocks are dropped, fetches started before are not cached
+    std::uint64_t generation{0};
+    std::unordered_map<std::uint64_t, Blocks::iterator> blocks{};
+  };
+
+  // Whether blocks of path may be served, renews the lease and polls
+  // revocations when they are due
+  bool leased(const std::string& path);
+  void poll();
+  // Callers of the rest hold the lock
+  void update(const std::string& path, const schema::LeaseResponse& res,
+              Clock::time_point sent);
+  void drop(Lease& lease);
+  // Copies the range to v when all of its blocks are cached
+  bool cached(Lease& lease, schema::off_t offset, std::uint64_t count,
+              std::vector<std::uint8_t>& v);
+  void insert(const std::string& path, Lease& lease, std::uint64_t index,
+              std::vector<std::uint8_t> bytes);
+
+  Client& client;
+  const ReadCacheOptions options;
+
+  mutable std::mutex mutex;
+  std::unordered_map<schema::File, std::string> files{};
+  std::unordered_map<std::string, Lease> leases{};
+  Blocks blocks{};
+  std::size_t bytes{0};
+  // Revocations seen so far, unset until the first lease
+  std::optional<std::uint64_t> since{};
+  Clock::time_point nextPoll{};
+  std::uint64_t hits{0};
+  std::uint64_t misses{0};
+};
+
+} // namespace client
+} // namespace rpc
+
+#endif // RPC_READCACHE_HPP
@@ -3,6 +3,7 @@
 
 #include <cstdint>
 #include <string>
+#include <tuple>
 #include <variant>
 #include <vector>
 
@@ -12,86 +13,367 @@ using File = uint32_t;
 using off_t = std::int64_t;
 using mode_t = std::uint32_t;
 
+// Messages list their members in wire order with fields(), codecs are
+// generated from these lists. Tag of a message is its index in the variant.
+// Byte arrays are not length prefixed, their size is the value of the
+// preceding integer (none when it is not positive). Other vectors are
+// prefixed with their length.
+
 struct OpenRequest final {
   std::string pathname;
   mode_t mode;
+
+  static constexpr auto fields() {
+    return std::tuple{&OpenRequest::pathname, &OpenRequest::mode};
+  }
 };
 
 struct ReadRequest final {
   File desc;
   std::uint64_t count;
+
+  static constexpr auto fields() {
+    return std::tuple{&ReadRequest::desc, &ReadRequest::count};
+  }
 };
 
 struct WriteRequest final {
   File desc;
   std::uint64_t count;
   std::vector<std::uint8_t> bytes;
+
+  static constexpr auto fields() {
+    return std::tuple{&WriteRequest::desc, &WriteRequest::count,
+                      &WriteRequest::bytes};
+  }
 };
 
 struct LSeekRequest final {
   File desc;
   off_t offset;
   std::uint32_t whence;
+
+  static constexpr auto fields() {
+    return std::tuple{&LSeekRequest::desc, &LSeekRequest::offset,
+                      &LSeekRequest::whence};
+  }
 };
 
 struct ChmodRequest final {
   std::string pathname;
   std::uint32_t mode;
+
+  static constexpr auto fields() {
+    return std::tuple{&ChmodRequest::pathname, &ChmodRequest::mode};
+  }
 };
 
 struct UnlinkRequest final {
   std::string pathname;
+
+  static constexpr auto fields() {
+    return std::tuple{&UnlinkRequest::pathname};
+  }
 };
 
 struct RenameRequest final {
   std::string oldpath;
   std::string newpath;
+
+  static constexpr auto fields() {
+    return std::tuple{&RenameRequest::oldpath, &RenameRequest::newpath};
+  }
 };
 
 struct CloseRequest final {
   File desc;
+
+  static constexpr auto fields() { return std::tuple{&CloseRequest::desc}; }
+};
+
+// Read and write at the given offset. Offset of the descriptor is neither
+// used nor moved, so these can be retried and reordered freely.
+struct PReadRequest final {
+  File desc;
+  off_t offset;
+  std::uint64_t count;
+
+  static constexpr auto fields() {
+    return std::tuple{&PReadRequest::desc, &PReadRequest::offset,
+                      &PReadRequest::count};
+  }
+};
+
+struct PWriteRequest final {
+  File desc;
+  off_t offset;
+  std::uint64_t count;
+  std::vector<std::uint8_t> bytes;
+
+  static constexpr auto fields() {
+    return std::tuple{&PWriteRequest::desc, &PWriteRequest::offset,
+                      &PWriteRequest::count, &PWriteRequest::bytes};
+  }
+};
+
+// Byte range of a file
+struct Extent final {
+  off_t offset;
+  std::uint64_t count;
+
+  static constexpr auto fields() {
+    return std::tuple{&Extent::offset, &Extent::count};
+  }
+};
+
+// Read many ranges of a file at once, in any order and possibly overlapping
+struct ReadVRequest final {
+  File desc;
+  std::vector<Extent> extents;
+
+  static constexpr auto fields() {
+    return std::tuple{&ReadVRequest::desc, &ReadVRequest::extents};
+  }
+};
+
+// Bytes hold payloads of all extents back to back, count is their total
+// size. Extents are written in order.
+struct WriteVRequest final {
+  File desc;
+  std::vector<Extent> extents;
+  std::uint64_t count;
+  std::vector<std::uint8_t> bytes;
+
+  static constexpr auto fields() {
+    return std::tuple{&WriteVRequest::desc, &WriteVRequest::extents,
+                      &WriteVRequest::count, &WriteVRequest::bytes};
+  }
+};
+
+// Access pattern hints, values match POSIX_FADV_*
+enum class Advice : std::uint32_t {
+  NORMAL,
+  RANDOM,
+  SEQUENTIAL,
+  WILLNEED,
+  DONTNEED,
+  NOREUSE,
+};
+
+// Hint about how a range of a file is going to be read, count 0 reaches the
+// end of the file. Backends are free to ignore it, result is 0 then too.
+struct AdviseRequest final {
+  File desc;
+  off_t offset;
+  std::uint64_t count;
+  std::uint32_t advice;
+
+  static constexpr auto fields() {
+    return std::tuple{&AdviseRequest::desc, &AdviseRequest::offset,
+                      &AdviseRequest::count, &AdviseRequest::advice};
+  }
+};
+
+// Lease on a file, blocks of it may be read from a client's cache while it
+// lasts and its version stays the same
+struct LeaseRequest final {
+  std::string pathname;
+
+  static constexpr auto fields() {
+    return std::tuple{&LeaseRequest::pathname};
+  }
+};
+
+// Leases of files modified after revocation sequence since
+struct RevocationsRequest final {
+  std::uint64_t since;
+
+  static constexpr auto fields() {
+    return std::tuple{&RevocationsRequest::since};
+  }
+};
+
+// Descriptor referring to the result of index-th OpenRequest of the same
+// batch, so a file can be opened and used within a single round trip
+constexpr File batchRefFlag = File{1} << 31;
+constexpr File batchRef(std::uint32_t index) { return batchRefFlag | index; }
+
+// New messages are appended, so tags of the existing ones do not change
+using SubRequest =
+    std::variant<OpenRequest, ReadRequest, WriteRequest, LSeekRequest,
+                 ChmodRequest, UnlinkRequest, RenameRequest, CloseRequest,
+                 PReadRequest, PWriteRequest, ReadVRequest, WriteVRequest,
+                 AdviseRequest, LeaseRequest, RevocationsRequest>;
+
+// Sub-requests are executed in order within a single dispatch
+struct BatchRequest final {
+  std::vector<SubRequest> requests;
+
+  static constexpr auto fields() { return std::tuple{&BatchRequest::requests}; }
 };
 
 using RequestBody =
     std::variant<OpenRequest, ReadRequest, WriteRequest, LSeekRequest,
-                 ChmodRequest, UnlinkRequest, RenameRequest, CloseRequest>;
+                 ChmodRequest, UnlinkRequest, RenameRequest, CloseRequest,
+                 BatchRequest, PReadRequest, PWriteRequest, ReadVRequest,
+                 WriteVRequest, AdviseRequest, LeaseRequest,
+                 RevocationsRequest>;
 
 struct OpenResponse final {
   File file;
+
+  static constexpr auto fields() { return std::tuple{&OpenResponse::file}; }
 };
 
 struct ReadResponse final {
   std::int64_t read;
   std::vector<std::uint8_t> bytes;
+
+  static constexpr auto fields() {
+    return std::tuple{&ReadResponse::read, &ReadResponse::bytes};
+  }
 };
 
 struct WriteResponse final {
   std::int64_t written;
+
+  static constexpr auto fields() { return std::tuple{&WriteResponse::written}; }
 };
 
 struct LSeekResponse final {
   off_t offset;
+
+  static constexpr auto fields() { return std::tuple{&LSeekResponse::offset}; }
 };
 
 struct ChmodResponse final {
   std::int64_t result;
+
+  static constexpr auto fields() { return std::tuple{&ChmodResponse::result}; }
 };
 
 struct UnlinkResponse final {
   std::int64_t result;
+
+  static constexpr auto fields() { return std::tuple{&UnlinkResponse::result}; }
 };
 
 struct RenameResponse final {
   std::int64_t result;
+
+  static constexpr auto fields() { return std::tuple{&RenameResponse::result}; }
 };
 
 struct CloseResponse final {
   std::int64_t result;
+
+  static constexpr auto fields() { return std::tuple{&CloseResponse::result}; }
+};
+
+struct PReadResponse final {
+  std::int64_t read;
+  std::vector<std::uint8_t> bytes;
+
+  static constexpr auto fields() {
+    return std::tuple{&PReadResponse::read, &PReadResponse::bytes};
+  }
+};
+
+struct PWriteResponse final {
+  std::int64_t written;
+
+  static constexpr auto fields() {
+    return std::tuple{&PWriteResponse::written};
+  }
+};
+
+// Number of bytes read for every extent (-1 on error), bytes hold them back
+// to back and count is their total size
+struct ReadVResponse final {
+  std::vector<std::int64_t> read;
+  std::uint64_t count;
+  std::vector<std::uint8_t> bytes;
+
+  static constexpr auto fields() {
+    return std::tuple{&ReadVResponse::read, &ReadVResponse::count,
+                      &ReadVResponse::bytes};
+  }
+};
+
+struct WriteVResponse final {
+  std::int64_t written;
+
+  static constexpr auto fields() {
+    return std::tuple{&WriteVResponse::written};
+  }
+};
+
+struct AdviseResponse final {
+  std::int64_t result;
+
+  static constexpr auto fields() {
+    return std::tuple{&AdviseResponse::result};
+  }
+};
+
+// Term is in milliseconds, 0 refuses the lease. Version changes whenever
+// the file is modified. Sequence is where to poll revocations from.
+struct LeaseResponse final {
+  std::uint64_t version;
+  std::uint64_t term;
+  std::uint64_t sequence;
+
+  static constexpr auto fields() {
+    return std::tuple{&LeaseResponse::version, &LeaseResponse::term,
+                      &LeaseResponse::sequence};
+  }
+};
+
+// Leased file modified, version is the one it has since
+struct Revocation final {
+  std::string pathname;
+  std::uint64_t version;
+
+  static constexpr auto fields() {
+    return std::tuple{&Revocation::pathname, &Revocation::version};
+  }
+};
+
+// Revocations up to sequence. Complete is 0 when some of them are not
+// listed anymore, every lease is revoked then.
+struct RevocationsResponse final {
+  std::uint64_t sequence;
+  std::uint8_t complete;
+  std::vector<Revocation> revocations;
+
+  static constexpr auto fields() {
+    return std::tuple{&RevocationsResponse::sequence,
+                      &RevocationsResponse::complete,
+                      &RevocationsResponse::revocations};
+  }
+};
+
+using SubResponse =
+    std::variant<OpenResponse, ReadResponse, WriteResponse, LSeekResponse,
+                 ChmodResponse, UnlinkResponse, RenameResponse, CloseResponse,
+                 PReadResponse, PWriteResponse, ReadVResponse, WriteVResponse,
+                 AdviseResponse, LeaseResponse, RevocationsResponse>;
+
+// One response per sub-request, in the same order
+struct BatchResponse final {
+  std::vector<SubResponse> responses;
+
+  static constexpr auto fields() {
+    return std::tuple{&BatchResponse::responses};
+  }
 };
 
 using ResponseBody =
     std::variant<OpenResponse, ReadResponse, WriteResponse, LSeekResponse,
-                 ChmodResponse, UnlinkResponse, RenameResponse, CloseResponse>;
+                 ChmodResponse, UnlinkResponse, RenameResponse, CloseResponse,
+                 BatchResponse, PReadResponse, PWriteResponse, ReadVResponse,
+                 WriteVResponse, AdviseResponse, LeaseResponse,
+                 RevocationsResponse>;
 
 enum class Code : uint8_t {
   OK,
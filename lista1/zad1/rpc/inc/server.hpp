@@ -1,11 +1,31 @@
 #ifndef RPC_SERVER_HPP
 #define RPC_SERVER_HPP
 
+#include <algorithm>
+#include <array>
+#include <concepts>
+#include <cstdint>
 #include <functional>
+#include <ios>
+#include <iostream>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
 #include <unordered_map>
+#include <utility>
+#include <variant>
+#include <vector>
 
+#include "asio/executor_work_guard.hpp"
 #include "asio/io_context.hpp"
+#include "asio/post.hpp"
+#include "asio/strand.hpp"
+#include "leases.hpp"
+#include "marshalling.hpp"
+#include "pool.hpp"
 #include "protocol.hpp"
 #include "schema.hpp"
 
@@ -33,26 +53,827 @@ struct Handlers {
   std::function<std::int64_t(std::string oldpath, std::string newpath)>
       RenameHandler;
   std::function<std::int64_t(schema::File desc)> CloseHandler;
+  std::function<std::int64_t(schema::File desc, schema::off_t offset,
+                             std::uint64_t count, std::vector<std::uint8_t>&)>
+      PReadHandler;
+  std::function<std::int64_t(schema::File desc, schema::off_t offset,
+                             std::uint64_t count, std::vector<std::uint8_t>&)>
+      PWriteHandler;
+  // Optional, hints are accepted and ignored without it
+  std::function<std::int64_t(schema::File desc, schema::off_t offset,
+                             std::uint64_t count, std::uint32_t advice)>
+      AdviseHandler;
 };
 
+template <typename... Results> using Done = std::function<void(Results...)>;
+
+// Handlers completing through a callback, called exactly once and from any
+// thread, so the transport is free while they run. Byte buffers are passed
+// by value, reads hand theirs back filled.
+struct AsyncHandlers {
+  std::function<void(std::string path, schema::mode_t mode,
+                     Done<schema::File>)>
+      OpenHandler;
+  std::function<void(schema::File desc, std::uint64_t count,
+                     std::vector<std::uint8_t>,
+                     Done<std::int64_t, std::vector<std::uint8_t>>)>
+      ReadHandler;
+  std::function<void(schema::File desc, std::uint64_t count,
+                     std::vector<std::uint8_t>, Done<std::int64_t>)>
+      WriteHandler;
+  std::function<void(schema::File desc, schema::off_t offset,
+                     std::uint32_t whence, Done<schema::off_t>)>
+      LSeekHandler;
+  std::function<void(std::string pathname, std::uint32_t mode,
+                     Done<std::int64_t>)>
+      ChmodHandler;
+  std::function<void(std::string pathname, Done<std::int64_t>)>
+      UnlinkHandler;
+  std::function<void(std::string oldpath, std::string newpath,
+                     Done<std::int64_t>)>
+      RenameHandler;
+  std::function<void(schema::File desc, Done<std::int64_t>)> CloseHandler;
+  std::function<void(schema::File desc, schema::off_t offset,
+                     std::uint64_t count, std::vector<std::uint8_t>,
+                     Done<std::int64_t, std::vector<std::uint8_t>>)>
+      PReadHandler;
+  std::function<void(schema::File desc, schema::off_t offset,
+                     std::uint64_t count, std::vector<std::uint8_t>,
+                     Done<std::int64_t>)>
+      PWriteHandler;
+  // Optional, as in Handlers
+  std::function<void(schema::File desc, schema::off_t offset,
+                     std::uint64_t count, std::uint32_t advice,
+                     Done<std::int64_t>)>
+      AdviseHandler;
+};
+
+// Operations of a backend served by TypedServer, called directly
+template <typename T>
+concept Backend = requires(T& backend, std::string path, schema::File desc,
+                           std::vector<std::uint8_t>& bytes) {
+  { backend.open(path, schema::mode_t{}) } -> std::convertible_to<schema::File>;
+  { backend.read(desc, std::uint64_t{}, bytes) } -> std::integral;
+  { backend.write(desc, std::uint64_t{}, bytes) } -> std::integral;
+  { backend.lseek(desc, schema::off_t{}, std::uint32_t{}) } -> std::integral;
+  { backend.chmod(path, std::uint32_t{}) } -> std::integral;
+  { backend.unlink(path) } -> std::integral;
+  { backend.rename(path, path) } -> std::integral;
+  { backend.close(desc) } -> std::integral;
+  { backend.pread(desc, schema::off_t{}, std::uint64_t{}, bytes) } ->
+      std::integral;
+  { backend.pwrite(desc, schema::off_t{}, std::uint64_t{}, bytes) } ->
+      std::integral;
+};
+
+// Backend may also complete requests of any type asynchronously, with
+// submit(Request, std::function<void(Response)>). Reply is called exactly
+// once, from any thread, possibly before submit returns. Other requests are
+// still made through the calls above.
+template <typename T, typename Request>
+concept Submits = requires(T& backend, Request req) {
+  backend.submit(std::move(req), [](auto) {});
+};
+
+namespace detail {
+template <typename T, typename Body> struct SubmitsAny;
+template <typename T, typename... Requests>
+struct SubmitsAny<T, std::variant<Requests...>>
+    : std::bool_constant<(Submits<T, Requests> || ...)> {};
+} // namespace detail
+
+// Backend acting on access pattern hints, others accept and ignore them
+template <typename T>
+concept Advises = requires(T& backend, schema::File desc) {
+  {
+    backend.advise(desc, schema::off_t{}, std::uint64_t{}, std::uint32_t{})
+  } -> std::integral;
+};
+
+template <typename T>
+concept AsyncBackend =
+    Backend<T> && detail::SubmitsAny<T, schema::RequestBody>::value;
+
 using Permissions = std::array<bool, 8>;
+// Bit i allows requests with variant index i, positional reads and writes
+// are allowed by the bits of ReadRequest and WriteRequest
+using PermissionMask = std::uint32_t;
 
-class Server : public Handlers {
+// Requests on the same descriptor are serialized by one of this many strands
+constexpr std::size_t descriptorShards = 64;
+
+constexpr std::size_t defaultCachedReplies = 1024;
+constexpr std::size_t defaultCachedBytes = 32 << 20;
+
+// Remembers recent replies by (auth, id), so a retransmitted request is
+// answered again instead of being executed twice. Replies are kept in pooled
+// buffers and entries reuse the nodes of evicted ones, so recording a
+// request does not allocate once the cache is full. Thread safe.
+class ReplyCache {
 public:
-  Server(Handlers handlers, std::shared_ptr<rpc::protocol::Server> server,
-         std::unordered_map<std::uint64_t, Permissions> users)
-      : Handlers(handlers), server{server}, perms{users} {
-    this->server->setHandler(this->makeHandler());
+  enum class Lookup { MISS, PENDING, HIT };
+
+  ReplyCache(std::size_t maxReplies = defaultCachedReplies,
+             std::size_t maxBytes = defaultCachedBytes)
+      : maxReplies{maxReplies}, maxBytes{maxBytes} {
+    this->entries.reserve(maxReplies + 1);
+    this->spare.reserve(maxReplies);
+    this->order.reserve(2 * maxReplies + 1);
+  }
+
+  // On MISS the request is recorded as in progress, caller has to finish()
+  // or forget() it. On HIT reply is set to a copy of the cached one.
+  Lookup begin(const schema::Header& header, std::vector<std::uint8_t>& reply);
+  void finish(const schema::Header& header,
+              const std::vector<std::uint8_t>& reply);
+  void forget(const schema::Header& header);
+
+private:
+  using Key = std::pair<std::uint64_t, std::uint64_t>;
+  struct KeyHash {
+    std::size_t operator()(const Key& key) const {
+      return std::hash<std::uint64_t>{}(key.first * 31 + key.second);
+    }
+  };
+  struct Entry {
+    bool done;
+    std::vector<std::uint8_t> reply;
+    // Of the order element the entry was recorded with
+    std::uint64_t sequence;
+  };
+  struct Recorded {
+    Key key;
+    std::uint64_t sequence;
+  };
+
+  using Entries = std::unordered_map<Key, Entry, KeyHash>;
+
+  void evict();
+
+  const std::size_t maxReplies;
+  const std::size_t maxBytes;
+  std::mutex mutex;
+  std::size_t bytes{0};
+  std::uint64_t sequence{0};
+  Entries entries{};
+  std::vector<Entries::node_type> spare{};
+  // Oldest first from head on, may refer to entries already forgotten. A key
+  // forgotten and begun again appears twice, only the element with its
+  // entry's sequence counts. Elements before head are already evicted.
+  std::vector<Recorded> order{};
+  std::size_t head{0};
+
+  // Caller holds the lock
+  bool live(const Recorded& recorded);
+  void drop(Entries::iterator it);
+};
+
+// Descriptors each user holds open. Opens beyond a user's quota fail without
+// reaching the backend, so a client leaking descriptors only runs out of its
+// own. Thread safe.
+class HandleQuotas {
+public:
+  // Users without a quota of their own have the default one, 0 lifts it
+  void limit(std::uint64_t auth, std::size_t handles);
+  void limitDefault(std::size_t handles);
+
+  // Reserves a handle for an open, false over the quota
+  bool reserve(std::uint64_t auth);
+  // Settles the reservation, a failed open (desc 0) gives it back
+  void opened(std::uint64_t auth, schema::File desc);
+  void closed(schema::File desc);
+  std::size_t held(std::uint64_t auth);
+
+private:
+  std::mutex mutex;
+  std::size_t fallback{0};
+  std::unordered_map<std::uint64_t, std::size_t> limits{};
+  std::unordered_map<std::uint64_t, std::size_t> counts{};
+  std::unordered_map<schema::File, std::uint64_t> owners{};
+};
+
+namespace detail {
+std::unordered_map<std::uint64_t, PermissionMask>
+permissionMasks(const std::unordered_map<std::uint64_t, Permissions>& users);
+PermissionMask requiredMask(const schema::RequestBody& body);
+// Descriptor whose requests are kept in order, positional reads and writes
+// have none as they do not depend on each other
+std::optional<schema::File> descriptor(const schema::RequestBody& body);
+// Replaces batchRef descriptors with files opened earlier in the batch
+void resolve(schema::SubRequest& sub,
+             const std::vector<schema::SubResponse>& results);
+// Extents closer than this are read with a single call, reading the gap
+constexpr std::uint64_t extentMergeGap = 4096;
+// Limits of a vectored request, so a small request cannot make the server
+// allocate much or reply with more than the transports accept
+constexpr std::size_t maxExtents = 1024;
+constexpr std::uint64_t maxVectorBytes = 16 << 20;
+// Extents are not merged into runs longer than this
+constexpr std::uint64_t maxRunBytes = 1 << 20;
+
+// Range of a file covering one or more extents
+struct Run {
+  schema::off_t offset;
+  std::uint64_t count;
+};
+// Offset is not negative and the end of the extent fits in off_t
+bool bounded(const schema::Extent& extent);
+// Sum of the counts, nullopt when there are more than maxExtents extents or
+// the sum exceeds limit
+std::optional<std::uint64_t>
+extentsTotal(const std::vector<schema::Extent>& extents, std::uint64_t limit);
+// Sorts extents by offset and merges the ones that overlap or are at most
+// extentMergeGap apart, as long as the run stays within maxRunBytes. runOf
+// receives the run each extent falls into. Extents that are not bounded are
+// left out, their run is runs.size().
+std::vector<Run> mergeExtents(const std::vector<schema::Extent>& extents,
+                              std::vector<std::size_t>& runOf);
+// Returns byte buffers of a handled request and its response to the pool
+void recycle(schema::Request& request, schema::Response& response);
+
+// Task whose operation asio allocates from a pool shared by all threads,
+// tasks are posted by the transport's thread and run by the workers
+template <typename F> struct Pooled {
+  using allocator_type = pool::RecyclingAllocator<void>;
+  allocator_type get_allocator() const { return {}; }
+  void operator()() { this->task(); }
+
+  F task;
+};
+} // namespace detail
+
+// Dispatches requests straight to the backend's member functions. Backend
+// has to outlive the server.
+template <Backend B> class TypedServer {
+public:
+  // With threads == 0 requests are handled inline by the transport's thread.
+  // Otherwise they are dispatched to a pool of threads, then the backend has
+  // to be thread safe. Operations on the same descriptor start in order.
+  // Requests an AsyncBackend submits leave the thread right away, the reply
+  // is sent from the backend's completion.
+  TypedServer(B& backend, std::shared_ptr<rpc::protocol::Server> server,
+              const std::unordered_map<std::uint64_t, Permissions>& users,
+              std::size_t threads = 0)
+      : backend{backend}, server{server},
+        masks{detail::permissionMasks(users)} {
+    if (threads == 0) {
+      if constexpr (AsyncBackend<B>) {
+        this->server->setAsyncHandler(this->makeAsyncHandler());
+      } else {
+        this->server->setHandler(this->makeHandler());
+      }
+      return;
+    }
+
+    this->strands.reserve(descriptorShards);
+    for (std::size_t i = 0; i < descriptorShards; i++) {
+      this->strands.push_back(asio::make_strand(this->ctx));
+    }
+    for (std::size_t i = 0; i < threads; i++) {
+      this->threads.emplace_back([this]() { this->ctx.run(); });
+    }
+    this->server->setAsyncHandler(this->makeAsyncHandler());
+  }
+
+  ~TypedServer() {
+    this->work.reset();
+    this->ctx.stop();
+    for (auto& thread : this->threads) {
+      thread.join();
+    }
+  }
+
+  TypedServer(const TypedServer&) = delete;
+  TypedServer& operator=(const TypedServer&) = delete;
+
+  // Descriptors a user may hold open at once, unlimited by default
+  void setHandleQuota(std::uint64_t auth, std::size_t handles) {
+    this->quotas.limit(auth, handles);
+  }
+  void setDefaultHandleQuota(std::size_t handles) {
+    this->quotas.limitDefault(handles);
+  }
+
+  schema::Response dispatch(schema::Request& request) {
+    using namespace rpc::schema;
+    Response response{.id = request.header.id, .code = Code::OK, .body = {}};
+    if (!this->allowed(request)) {
+      response.code = Code::FORBIDDEN;
+      return response;
+    }
+    response.body =
+        this->execute<ResponseBody>(request.body, request.header.auth);
+    return response;
+  }
+
+  // Like dispatch, but requests the backend submits complete later. Done is
+  // called once with the response.
+  template <typename Done> void dispatch(schema::Request& request, Done done) {
+    using namespace rpc::schema;
+    if (!this->allowed(request)) {
+      done({.id = request.header.id, .code = Code::FORBIDDEN, .body = {}});
+      return;
+    }
+    std::visit(
+        [this, &done, id = request.header.id,
+         auth = request.header.auth](auto& req) {
+          using Request = std::decay_t<decltype(req)>;
+          this->observe(req);
+          if constexpr (std::is_same_v<Request, OpenRequest> &&
+                        Submits<B, Request>) {
+            if (!this->quotas.reserve(auth)) {
+              done({.id = id,
+                    .code = Code::OK,
+                    .body = OpenResponse{.file = 0}});
+              return;
+            }
+            auto path = req.pathname;
+            this->backend.submit(std::move(req), [this, path, id, auth,
+                                                  done](OpenResponse res) {
+              this->quotas.opened(auth, res.file);
+              this->leases.opened(res.file, path);
+              done({.id = id, .code = Code::OK, .body = std::move(res)});
+            });
+          } else if constexpr (std::is_same_v<Request, RenameRequest> &&
+                               Submits<B, Request>) {
+            auto paths = std::pair{req.oldpath, req.newpath};
+            this->backend.submit(std::move(req), [this, paths, id,
+                                                  done](RenameResponse res) {
+              if (res.result == 0) {
+                this->leases.renamed(paths.first, paths.second);
+              }
+              done({.id = id, .code = Code::OK, .body = std::move(res)});
+            });
+          } else if constexpr (std::is_same_v<Request, CloseRequest> &&
+                               Submits<B, Request>) {
+            auto desc = req.desc;
+            this->backend.submit(std::move(req), [this, desc, id,
+                                                  done](CloseResponse res) {
+              this->quotas.closed(desc);
+              done({.id = id, .code = Code::OK, .body = std::move(res)});
+            });
+          } else if constexpr (Submits<B, Request>) {
+            this->backend.submit(std::move(req), [id, done](auto res) {
+              done({.id = id, .code = Code::OK, .body = std::move(res)});
+            });
+          } else {
+            done({.id = id, .code = Code::OK, .body = this->run(req, auth)});
+          }
+        },
+        request.body);
   }
 
 private:
+  // Users without configured permissions are not restricted
+  bool allowed(const schema::Request& request) const {
+    auto it = this->masks.find(request.header.auth);
+    if (it == this->masks.end()) {
+      return true;
+    }
+    auto required = detail::requiredMask(request.body);
+    return (it->second & required) == required;
+  }
+
+  // Returns nullopt for a retransmission of a request still in progress,
+  // it is answered once the original completes
+  std::optional<std::vector<std::uint8_t>>
+  respond(schema::Request& request, rpc::marshalling::Version version) {
+    std::vector<std::uint8_t> reply;
+    switch (this->replies.begin(request.header, reply)) {
+    case ReplyCache::Lookup::HIT:
+      return reply;
+    case ReplyCache::Lookup::PENDING:
+      return std::nullopt;
+    case ReplyCache::Lookup::MISS:
+      break;
+    }
+
+    try {
+      auto response = this->dispatch(request);
+      reply = rpc::marshalling::marshalResponse(response, version);
+      detail::recycle(request, response);
+    } catch (...) {
+      this->replies.forget(request.header);
+      throw;
+    }
+    this->replies.finish(request.header, reply);
+    return reply;
+  }
+
+  // Same as respond, replies through reply unless the request is pending
+  void respond(std::shared_ptr<schema::Request> request,
+               rpc::marshalling::Version version,
+               rpc::protocol::responder reply) {
+    std::vector<std::uint8_t> cached;
+    switch (this->replies.begin(request->header, cached)) {
+    case ReplyCache::Lookup::HIT:
+      reply(std::move(cached));
+      return;
+    case ReplyCache::Lookup::PENDING:
+      return;
+    case ReplyCache::Lookup::MISS:
+      break;
+    }
+
+    auto done = [this, request, version,
+                 reply = std::move(reply)](schema::Response response) {
+      std::vector<std::uint8_t> bytes;
+      try {
+        bytes = rpc::marshalling::marshalResponse(response, version);
+      } catch (std::exception& e) {
+        this->replies.forget(request->header);
+        std::cerr << e.what() << std::endl;
+        return;
+      }
+      detail::recycle(*request, response);
+      this->replies.finish(request->header, bytes);
+      reply(std::move(bytes));
+    };
+    try {
+      this->dispatch(*request, std::move(done));
+    } catch (...) {
+      this->replies.forget(request->header);
+      throw;
+    }
+  }
+
+  rpc::protocol::handler makeHandler() {
+    return [this](std::vector<std::uint8_t> bytes) {
+      // Reply is encoded in the version of the request
+      auto version = rpc::marshalling::detectVersion(bytes);
+      auto request = rpc::marshalling::unmarshalRequest(bytes);
+      pool::buffers().release(std::move(bytes));
+      auto reply = this->respond(request, version);
+      if (!reply) {
+        throw std::runtime_error("request already in progress");
+      }
+      return std::move(*reply);
+    };
+  }
+
+  rpc::protocol::asyncHandler makeAsyncHandler() {
+    return [this](std::vector<std::uint8_t> bytes,
+                  rpc::protocol::responder reply) {
+      using namespace rpc::schema;
+      std::shared_ptr<Request> request;
+      rpc::marshalling::Version version;
+      try {
+        version = rpc::marshalling::detectVersion(bytes);
+        request = std::allocate_shared<Request>(
+            pool::RecyclingAllocator<Request>{},
+            rpc::marshalling::unmarshalRequest(bytes));
+        pool::buffers().release(std::move(bytes));
+      } catch (std::exception& e) {
+        // Malformed request is dropped, as in synchronous mode
+        std::cerr << e.what() << std::endl;
+        return;
+      }
+
+      auto desc = detail::descriptor(request->body);
+      auto task = detail::Pooled{[this, request = std::move(request), version,
+                                  reply = std::move(reply)]() mutable {
+        try {
+          this->respond(std::move(request), version, std::move(reply));
+        } catch (std::exception& e) {
+          std::cerr << e.what() << std::endl;
+        }
+      }};
+
+      // Operations on the same descriptor run in order of arrival,
+      // everything else runs in parallel
+      if (this->strands.empty()) {
+        task();
+      } else if (desc) {
+        asio::post(this->strands[*desc % this->strands.size()],
+                   std::move(task));
+      } else {
+        asio::post(this->ctx, std::move(task));
+      }
+    };
+  }
+
+  template <typename Result, typename Body>
+  Result execute(Body& body, std::uint64_t auth) {
+    return std::visit(
+        [this, auth](auto& req) -> Result {
+          this->observe(req);
+          return this->run(req, auth);
+        },
+        body);
+  }
+
+  // Requests accounted to the user get its auth
+  template <typename Request> auto run(Request& req, std::uint64_t auth) {
+    if constexpr (requires { this->call(req, auth); }) {
+      return this->call(req, auth);
+    } else {
+      return this->call(req);
+    }
+  }
+
+  // Tells leases about modifications before they are made
+  template <typename Request> void observe(const Request& req) {
+    using namespace rpc::schema;
+    if constexpr (std::is_same_v<Request, OpenRequest>) {
+      // Truncating opens, as the backends make them
+      auto mode = static_cast<std::ios_base::openmode>(req.mode);
+      bool out = (mode & (std::ios_base::out | std::ios_base::app)) != 0;
+      if ((mode & std::ios_base::trunc) ||
+          (out && !(mode & (std::ios_base::in | std::ios_base::app)))) {
+        this->leases.modified(req.pathname);
+      }
+    } else if constexpr (std::is_same_v<Request, WriteRequest> ||
+                         std::is_same_v<Request, PWriteRequest> ||
+                         std::is_same_v<Request, WriteVRequest>) {
+      this->leases.written(req.desc);
+    } else if constexpr (std::is_same_v<Request, ChmodRequest>) {
+      this->leases.modified(req.pathname);
+    } else if constexpr (std::is_same_v<Request, UnlinkRequest>) {
+      this->leases.removed(req.pathname);
+    } else if constexpr (std::is_same_v<Request, RenameRequest>) {
+      this->leases.removed(req.oldpath);
+      this->leases.removed(req.newpath);
+    } else if constexpr (std::is_same_v<Request, CloseRequest>) {
+      this->leases.closed(req.desc);
+    }
+  }
+
+  schema::OpenResponse call(schema::OpenRequest& req, std::uint64_t auth) {
+    if (!this->quotas.reserve(auth)) {
+      return {.file = 0};
+    }
+    schema::File file = 0;
+    try {
+      file = this->backend.open(req.pathname, req.mode);
+    } catch (...) {
+      this->quotas.opened(auth, 0);
+      throw;
+    }
+    this->quotas.opened(auth, file);
+    this->leases.opened(file, req.pathname);
+    return {.file = file};
+  }
+
+  schema::ReadResponse call(schema::ReadRequest& req) {
+    schema::ReadResponse res{.read = 0, .bytes = pool::buffers().acquire()};
+    res.read = this->backend.read(req.desc, req.count, res.bytes);
+    return res;
+  }
+
+  schema::WriteResponse call(schema::WriteRequest& req) {
+    return {.written = this->backend.write(req.desc, req.count, req.bytes)};
+  }
+
+  schema::LSeekResponse call(schema::LSeekRequest& req) {
+    return {.offset = this->backend.lseek(req.desc, req.offset, req.whence)};
+  }
+
+  schema::ChmodResponse call(schema::ChmodRequest& req) {
+    return {.result = this->backend.chmod(std::move(req.pathname), req.mode)};
+  }
+
+  schema::UnlinkResponse call(schema::UnlinkRequest& req) {
+    return {.result = this->backend.unlink(std::move(req.pathname))};
+  }
+
+  schema::RenameResponse call(schema::RenameRequest& req) {
+    auto result = this->backend.rename(req.oldpath, req.newpath);
+    if (result == 0) {
+      this->leases.renamed(req.oldpath, req.newpath);
+    }
+    return {.result = result};
+  }
+
+  schema::CloseResponse call(schema::CloseRequest& req) {
+    auto result = this->backend.close(req.desc);
+    this->quotas.closed(req.desc);
+    return {.result = result};
+  }
+
+  schema::PReadResponse call(schema::PReadRequest& req) {
+    schema::PReadResponse res{.read = 0, .bytes = pool::buffers().acquire()};
+    res.read = this->backend.pread(req.desc, req.offset, req.count, res.bytes);
+    return res;
+  }
+
+  schema::PWriteResponse call(schema::PWriteRequest& req) {
+    return {.written = this->backend.pwrite(req.desc, req.offset, req.count,
+                                            req.bytes)};
+  }
+
+  schema::ReadVResponse call(schema::ReadVRequest& req) {
+    const auto& extents = req.extents;
+    schema::ReadVResponse res{.read = std::vector<std::int64_t>(extents.size()),
+                              .count = 0,
+                              .bytes = pool::buffers().acquire()};
+    if (!detail::extentsTotal(extents, detail::maxVectorBytes)) {
+      std::fill(res.read.begin(), res.read.end(), -1);
+      return res;
+    }
+    std::vector<std::size_t> runOf;
+    auto runs = detail::mergeExtents(extents, runOf);
+    std::vector<std::vector<std::uint8_t>> data(runs.size());
+    std::vector<std::int64_t> read(runs.size());
+    for (std::size_t i = 0; i < runs.size(); i++) {
+      data[i] = pool::buffers().acquire();
+      read[i] = this->backend.pread(req.desc, runs[i].offset, runs[i].count,
+                                    data[i]);
+    }
+
+    // Payloads are copied out of the runs in the order of the request
+    for (std::size_t i = 0; i < extents.size(); i++) {
+      auto run = runOf[i];
+      if (run == runs.size() || read[run] < 0) {
+        res.read[i] = -1;
+        continue;
+      }
+      std::uint64_t begin = extents[i].offset - runs[run].offset;
+      std::uint64_t end = std::min<std::uint64_t>(begin + extents[i].count,
+                                                  data[run].size());
+      begin = std::min(begin, end);
+      res.read[i] = end - begin;
+      res.bytes.insert(res.bytes.end(), data[run].begin() + begin,
+                       data[run].begin() + end);
+    }
+    res.count = res.bytes.size();
+    for (auto& buffer : data) {
+      pool::buffers().release(std::move(buffer));
+    }
+    return res;
+  }
+
+  schema::WriteVResponse call(schema::WriteVRequest& req) {
+    schema::WriteVResponse res{.written = 0};
+    // Payloads have to be within bytes, the check cannot wrap around
+    auto available = std::min<std::uint64_t>(req.count, req.bytes.size());
+    if (!detail::extentsTotal(req.extents, available) ||
+        !std::all_of(req.extents.begin(), req.extents.end(),
+                     detail::bounded)) {
+      res.written = -1;
+      return res;
+    }
+
+    // Extents continuing right where the previous one ended are written
+    // together, their payloads are contiguous too. Reordering could change
+    // the result of overlapping writes.
+    auto buffer = pool::buffers().acquire();
+    std::uint64_t position = 0;
+    for (std::size_t i = 0; i < req.extents.size();) {
+      auto offset = req.extents[i].offset;
+      std::uint64_t count = 0;
+      do {
+        count += req.extents[i++].count;
+      } while (i < req.extents.size() &&
+               req.extents[i].offset == offset + static_cast<schema::off_t>(
+                                                     count));
+
+      auto begin = req.bytes.begin() + position;
+      buffer.assign(begin, begin + count);
+      position += count;
+      auto written = this->backend.pwrite(req.desc, offset, count, buffer);
+      if (written < 0) {
+        res.written = -1;
+        break;
+      }
+      res.written += written;
+      if (static_cast<std::uint64_t>(written) < count) {
+        break;
+      }
+    }
+    pool::buffers().release(std::move(buffer));
+    return res;
+  }
+
+  schema::AdviseResponse call(schema::AdviseRequest& req) {
+    if constexpr (Advises<B>) {
+      return {.result = this->backend.advise(req.desc, req.offset, req.count,
+                                             req.advice)};
+    } else {
+      return {.result = 0};
+    }
+  }
+
+  schema::LeaseResponse call(schema::LeaseRequest& req) {
+    return this->leases.grant(req.pathname);
+  }
+
+  schema::RevocationsResponse call(schema::RevocationsRequest& req) {
+    return this->leases.revoked(req.since);
+  }
+
+  schema::BatchResponse call(schema::BatchRequest& req, std::uint64_t auth) {
+    schema::BatchResponse res;
+    res.responses.reserve(req.requests.size());
+    for (auto& sub : req.requests) {
+      detail::resolve(sub, res.responses);
+      res.responses.push_back(this->execute<schema::SubResponse>(sub, auth));
+    }
+    return res;
+  }
+
+  B& backend;
   std::shared_ptr<rpc::protocol::Server> server;
-  std::unordered_map<std::uint64_t, Permissions> perms;
-  rpc::protocol::handler makeHandler();
+  const std::unordered_map<std::uint64_t, PermissionMask> masks;
+  ReplyCache replies{};
+  LeaseTable leases{};
+  HandleQuotas quotas{};
+
   asio::io_context ctx;
+  asio::executor_work_guard<asio::io_context::executor_type> work{
+      ctx.get_executor()};
+  std::vector<asio::strand<asio::io_context::executor_type>> strands{};
+  std::vector<std::thread> threads{};
+};
+
+// Calls through Handlers' std::functions
+class HandlersBackend : public Handlers {
+public:
+  HandlersBackend(Handlers handlers) : Handlers(handlers) {}
+
+  schema::File open(std::string pathname, schema::mode_t mode);
+  std::int64_t read(schema::File desc, std::uint64_t count,
+                    std::vector<std::uint8_t>& v);
+  std::int64_t write(schema::File desc, std::uint64_t count,
+                     std::vector<std::uint8_t>& v);
+  schema::off_t lseek(schema::File desc, schema::off_t offset,
+                      std::uint32_t whence);
+  std::int64_t chmod(std::string pathname, std::uint32_t mode);
+  std::int64_t unlink(std::string pathname);
+  std::int64_t rename(std::string oldpath, std::string newpath);
+  std::int64_t close(schema::File desc);
+  std::int64_t pread(schema::File desc, schema::off_t offset,
+                     std::uint64_t count, std::vector<std::uint8_t>& v);
+  std::int64_t pwrite(schema::File desc, schema::off_t offset,
+                      std::uint64_t count, std::vector<std::uint8_t>& v);
+  std::int64_t advise(schema::File desc, schema::off_t offset,
+                      std::uint64_t count, std::uint32_t advice);
+};
+
+// Submits through AsyncHandlers. Direct calls, made for batches and
+// vectored requests, wait for the callback.
+class AsyncHandlersBackend : public AsyncHandlers {
+public:
+  template <typename Response> using Reply = std::function<void(Response)>;
+
+  AsyncHandlersBackend(AsyncHandlers handlers) : AsyncHandlers(handlers) {}
+
+  schema::File open(std::string pathname, schema::mode_t mode);
+  std::int64_t read(schema::File desc, std::uint64_t count,
+                    std::vector<std::uint8_t>& v);
+  std::int64_t write(schema::File desc, std::uint64_t count,
+                     std::vector<std::uint8_t>& v);
+  schema::off_t lseek(schema::File desc, schema::off_t offset,
+                      std::uint32_t whence);
+  std::int64_t chmod(std::string pathname, std::uint32_t mode);
+  std::int64_t unlink(std::string pathname);
+  std::int64_t rename(std::string oldpath, std::string newpath);
+  std::int64_t close(schema::File desc);
+  std::int64_t pread(schema::File desc, schema::off_t offset,
+                     std::uint64_t count, std::vector<std::uint8_t>& v);
+  std::int64_t pwrite(schema::File desc, schema::off_t offset,
+                      std::uint64_t count, std::vector<std::uint8_t>& v);
+  std::int64_t advise(schema::File desc, schema::off_t offset,
+                      std::uint64_t count, std::uint32_t advice);
+
+  void submit(schema::OpenRequest req, Reply<schema::OpenResponse> reply);
+  void submit(schema::ReadRequest req, Reply<schema::ReadResponse> reply);
+  void submit(schema::WriteRequest req, Reply<schema::WriteResponse> reply);
+  void submit(schema::LSeekRequest req, Reply<schema::LSeekResponse> reply);
+  void submit(schema::ChmodRequest req, Reply<schema::ChmodResponse> reply);
+  void submit(schema::UnlinkRequest req, Reply<schema::UnlinkResponse> reply);
+  void submit(schema::RenameRequest req, Reply<schema::RenameResponse> reply);
+  void submit(schema::CloseRequest req, Reply<schema::CloseResponse> reply);
+  void submit(schema::PReadRequest req, Reply<schema::PReadResponse> reply);
+  void submit(schema::PWriteRequest req, Reply<schema::PWriteResponse> reply);
+  void submit(schema::AdviseRequest req, Reply<schema::AdviseResponse> reply);
+};
+
+// Server built from std::function handlers, for backends that are not
+// classes. TypedServer avoids the indirection.
+class Server : public HandlersBackend, public TypedServer<HandlersBackend> {
+public:
+  Server(Handlers handlers, std::shared_ptr<rpc::protocol::Server> server,
+         std::unordered_map<std::uint64_t, Permissions> users,
+         std::size_t threads = 0)
+      : HandlersBackend(handlers),
+        TypedServer<HandlersBackend>(*this, server, users, threads) {}
+};
+
+// Server built from AsyncHandlers. With threads == 0 the transport's thread
+// only decodes requests and answers cached replies, the handlers decide
+// where the work runs.
+class AsyncServer : public AsyncHandlersBackend,
+                    public TypedServer<AsyncHandlersBackend> {
+public:
+  AsyncServer(AsyncHandlers handlers,
+              std::shared_ptr<rpc::protocol::Server> server,
+              std::unordered_map<std::uint64_t, Permissions> users,
+              std::size_t threads = 0)
+      : AsyncHandlersBackend(handlers),
+        TypedServer<AsyncHandlersBackend>(*this, server, users, threads) {}
 };
 
 } // namespace server
 } // namespace rpc
 
-#endif // RPC_SERVER_HPP
\ No newline at end of file
+#endif // RPC_SERVER_HPP
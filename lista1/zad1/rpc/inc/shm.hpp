@@ -0,0 +1,216 @@
+#ifndef RPC_SHM_HPP
+#define RPC_SHM_HPP
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "protocol.hpp"
+
+// Transport for clients running on the same host as the server. Server
+// creates a shared memory region (shm_open) divided into slots, every client
+// claims one slot holding a pair of single producer, single consumer byte
+// rings - one for requests and one for replies. Marshalled messages are
+// copied straight into the rings, sleeping peers are woken with futexes.
+// Linux only.
+
+namespace rpc {
+namespace shm {
+
+constexpr const char* defaultName = "/rpc-filesystem";
+constexpr std::uint32_t defaultSlots = 16;
+// Capacity of each ring, larger messages are streamed through it
+constexpr std::size_t ringSize = std::size_t{1} << 20;
+constexpr std::chrono::milliseconds defaultTimeout = std::chrono::seconds{20};
+
+namespace detail {
+// Every message is prefixed with its length and the id of the request it
+// belongs to
+constexpr std::size_t frameHeaderSize =
+    sizeof(std::uint32_t) + sizeof(std::uint64_t);
+
+// Futex based wake up, syscalls are made only if someone sleeps
+struct Event {
+  std::atomic<std::uint32_t> seq;
+  std::atomic<std::uint32_t> waiters;
+
+  void notify();
+
+  // Returns false if pred still does not hold after timeout
+  template <typename Pred>
+  bool wait(Pred pred, std::chrono::milliseconds timeout) {
+    using namespace std::chrono;
+    auto deadline = steady_clock::now() + timeout;
+    while (true) {
+      auto seq = this->seq.load();
+      if (pred()) {
+        return true;
+      }
+      auto left = deadline - steady_clock::now();
+      if (left <= steady_clock::duration::zero()) {
+        return false;
+      }
+
+      this->waiters.fetch_add(1);
+      // Notification between load of seq and this point changes seq, so
+      // futex returns immediately instead of missing it
+      if (!pred()) {
+        this->sleep(seq, duration_cast<nanoseconds>(left));
+      }
+      this->waiters.fetch_sub(1);
+    }
+  }
+
+private:
+  void sleep(std::uint32_t seq, std::chrono::nanoseconds timeout);
+};
+
+// Single producer, single consumer byte ring. Positions grow monotonically,
+// so full and empty rings are distinguishable. Both sides can write both
+// positions, so transfers check them instead of trusting the peer.
+struct Ring {
+  alignas(64) std::atomic<std::uint64_t> head;
+  alignas(64) std::atomic<std::uint64_t> tail;
+  alignas(64) Event readable;
+  Event writable;
+  alignas(64) std::uint8_t data[ringSize];
+
+  void reset() {
+    this->head = 0;
+    this->tail = 0;
+  }
+
+  std::size_t available() const { return this->tail - this->head; }
+  std::size_t space() const {
+    return this->corrupted() ? 0 : ringSize - this->available();
+  }
+  // Positions are more than ringSize apart, only a misbehaving peer can
+  // cause it. Exact while the caller's own position does not move.
+  bool corrupted() const;
+
+  // Transfer nothing when the positions are corrupted
+  std::size_t tryWrite(const std::uint8_t* src, std::size_t n);
+  std::size_t tryRead(std::uint8_t* dst, std::size_t n);
+};
+
+struct Region;
+struct Slot;
+} // namespace detail
+
+class Client : public protocol::Client {
+public:
+  Client(std::string name = defaultName,
+         std::chrono::milliseconds timeout = defaultTimeout,
+         std::size_t maxMessageSize = protocol::defaultMaxMessageSize);
+  ~Client();
+
+  virtual std::vector<std::uint8_t>
+  makeRequest(const std::vector<std::uint8_t>& data) override;
+
+  // Blocks while request ring is full
+  virtual void asyncRequest(std::uint64_t id, std::vector<std::uint8_t> data,
+                            protocol::callback cb) override;
+  virtual void asyncRequestFor(std::uint64_t id,
+                               std::vector<std::uint8_t> data,
+                               std::chrono::milliseconds timeout,
+                               protocol::callback cb) override;
+
+private:
+  struct Pending {
+    protocol::callback cb;
+    std::chrono::steady_clock::time_point deadline;
+  };
+
+  void receive();
+  void expire();
+  void complete(std::uint64_t id, std::error_code ec,
+                std::vector<std::uint8_t> bytes);
+
+  const std::chrono::milliseconds timeout;
+  const std::size_t maxMessageSize;
+  std::atomic<std::uint64_t> messageCounter;
+
+  detail::Region* region{nullptr};
+  std::size_t regionSize{0};
+  detail::Slot* slot{nullptr};
+
+  // Request ring has single producer
+  std::mutex writeMutex;
+  std::mutex pendingMutex;
+  std::unordered_map<std::uint64_t, Pending> pending{};
+
+  std::atomic<bool> running{true};
+  std::thread thread;
+};
+
+// Replies are queued per client and copied into its ring as it makes space,
+// a client letting more than maxMessageSize bytes pile up is disconnected.
+// Refuses to take over a region whose server is still running.
+class Server : public protocol::Server {
+public:
+  Server(std::string name = defaultName, std::uint32_t slots = defaultSlots,
+         std::size_t maxMessageSize = protocol::defaultMaxMessageSize);
+  ~Server();
+
+  void run();
+  void stop();
+
+  virtual void setHandler(protocol::handler) override;
+  virtual void setAsyncHandler(protocol::asyncHandler) override;
+
+private:
+  struct Frame {
+    std::array<std::uint8_t, detail::frameHeaderSize> header;
+    std::vector<std::uint8_t> payload;
+    std::size_t written;
+  };
+
+  // Per slot state of the request being read and of replies not sent yet
+  struct Connection {
+    std::uint32_t generation{0};
+    std::vector<std::uint8_t> header{};
+    std::vector<std::uint8_t> payload{};
+    std::size_t read{0};
+    bool haveHeader{false};
+    // Replies may be queued from handler's threads
+    std::mutex writeMutex;
+    std::deque<Frame> replies{};
+    std::atomic<std::size_t> queued{0};
+  };
+
+  bool poll(std::uint32_t index);
+  // Caller holds the connection's writeMutex. Copies as much of queued
+  // replies as fits into the ring, never waits.
+  bool flush(std::uint32_t index);
+  // Caller holds the connection's writeMutex
+  void disconnect(std::uint32_t index);
+  void reclaim(std::uint32_t index);
+  void reply(std::uint32_t index, std::uint32_t generation, std::uint64_t id,
+             std::vector<std::uint8_t> message);
+
+  const std::string name;
+  const std::size_t maxMessageSize;
+  // Locked for the server's lifetime, tells a live owner from a stale region
+  int lockFd{-1};
+  detail::Region* region{nullptr};
+  std::size_t regionSize{0};
+  std::vector<std::unique_ptr<Connection>> connections{};
+
+  protocol::handler handler;
+  protocol::asyncHandler asyncHandler;
+  std::atomic<bool> running{};
+};
+
+} // namespace shm
+} // namespace rpc
+
+#endif // RPC_SHM_HPP
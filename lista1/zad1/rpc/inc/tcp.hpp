@@ -0,0 +1,136 @@
+#ifndef RPC_TCP_HPP
+#define RPC_TCP_HPP
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "protocol.hpp"
+#include <asio.hpp>
+
+namespace rpc {
+namespace tcp {
+
+constexpr std::uint16_t defaultPort = 13;
+constexpr std::chrono::milliseconds defaultTimeout = std::chrono::seconds{20};
+
+// Every message is prefixed with its length and the id of the request it
+// belongs to
+struct FrameHeader {
+  std::uint32_t length;
+  std::uint64_t id;
+};
+
+constexpr std::size_t frameHeaderSize =
+    sizeof(std::uint32_t) + sizeof(std::uint64_t);
+// Larger frames are treated as corrupted stream
+constexpr std::size_t defaultMaxFrameSize = protocol::defaultMaxMessageSize;
+// Payloads are read in chunks of this size, so the buffer only grows with
+// the bytes a peer actually sent
+constexpr std::size_t frameChunkSize = 64 << 10;
+
+using FrameHeaderBytes = std::array<std::uint8_t, frameHeaderSize>;
+
+FrameHeaderBytes writeFrameHeader(const FrameHeader& header);
+FrameHeader readFrameHeader(const FrameHeaderBytes& bytes);
+
+// Keeps a single persistent connection, reconnected on demand after it is
+// lost. Like udp::Client it can be shared by many rpc::client::Client objects
+// and pipelines requests, replies are matched by id.
+class Client : public protocol::Client {
+public:
+  Client(std::string url, bool noDelay = true,
+         std::chrono::milliseconds timeout = defaultTimeout,
+         std::size_t maxFrameSize = defaultMaxFrameSize);
+  ~Client();
+
+  // Must not be called from within a callback, as it would deadlock the
+  // transport's thread
+  virtual std::vector<std::uint8_t>
+  makeRequest(const std::vector<std::uint8_t>& data) override;
+
+  virtual void asyncRequest(std::uint64_t id, std::vector<std::uint8_t> data,
+                            protocol::callback cb) override;
+  virtual void asyncRequestFor(std::uint64_t id,
+                               std::vector<std::uint8_t> data,
+                               std::chrono::milliseconds timeout,
+                               protocol::callback cb) override;
+
+private:
+  struct Pending {
+    protocol::callback cb;
+    std::unique_ptr<asio::steady_timer> timer;
+  };
+
+  struct Frame {
+    FrameHeaderBytes header;
+    std::vector<std::uint8_t> payload;
+  };
+
+  bool connect();
+  void fail(std::error_code ec);
+  void write();
+  void readHeader();
+  void readPayload(FrameHeader header);
+  void complete(std::uint64_t id, std::error_code ec,
+                std::vector<std::uint8_t> bytes);
+
+  const std::string url;
+  const bool noDelay;
+  const std::chrono::milliseconds timeout;
+  const std::size_t maxFrameSize;
+  std::atomic<std::uint64_t> messageCounter;
+
+  asio::io_context ctx;
+  asio::executor_work_guard<asio::io_context::executor_type> work{
+      ctx.get_executor()};
+  asio::ip::tcp::resolver::results_type endpoints;
+  asio::ip::tcp::socket socket{ctx};
+  bool connected{false};
+
+  FrameHeaderBytes headerBuffer{};
+  std::vector<std::uint8_t> readBuffer{};
+  std::deque<Frame> writeQueue{};
+
+  std::unordered_map<std::uint64_t, Pending> pending{};
+  std::thread thread;
+};
+
+// Serves any number of concurrent connections from the thread calling run()
+class Server : public protocol::Server {
+public:
+  Server(std::string address = "127.0.0.1", std::uint16_t port = defaultPort,
+         bool noDelay = true, std::size_t maxFrameSize = defaultMaxFrameSize);
+
+  void run();
+  void stop();
+
+  virtual void setHandler(protocol::handler) override;
+  virtual void setAsyncHandler(protocol::asyncHandler) override;
+
+private:
+  class Session;
+
+  void accept();
+
+  const asio::ip::tcp::endpoint local;
+  const bool noDelay;
+  const std::size_t maxFrameSize;
+  protocol::handler handler;
+  protocol::asyncHandler asyncHandler;
+  asio::io_context ctx;
+  asio::ip::tcp::acceptor acceptor{ctx};
+};
+
+} // namespace tcp
+} // namespace rpc
+
+#endif // RPC_TCP_HPP
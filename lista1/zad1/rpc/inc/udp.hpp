@@ -1,6 +1,20 @@
 #ifndef RPC_UDP_HPP
 #define RPC_UDP_HPP
 
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include "protocol.hpp"
@@ -12,32 +26,240 @@ namespace udp {
 
 using File = schema::File;
 
+// Largest payload of a single IPv4 UDP datagram
+constexpr std::size_t maxDatagramSize = 65507;
+// Fits into standard 1500 byte ethernet MTU (minus IP and UDP headers)
+constexpr std::size_t defaultDatagramSize = 1472;
+
+// Requested kernel socket buffer size, so bursts of fragments and pipelined
+// replies are not dropped. Kernel clamps it to net.core.[rw]mem_max.
+constexpr int socketBufferSize = 4 << 20;
+
+constexpr std::uint16_t defaultPort = 13;
+constexpr std::chrono::milliseconds defaultTimeout = std::chrono::seconds{20};
+
+// Bounds of the retransmission timeout, initial one is used until the first
+// round trip is measured
+constexpr std::chrono::milliseconds initialRto{200};
+constexpr std::chrono::milliseconds minRto{50};
+constexpr std::chrono::milliseconds maxRto{2000};
+
+// Smoothed round trip time and retransmission timeout as in RFC 6298
+class RttEstimator {
+public:
+  using duration = std::chrono::steady_clock::duration;
+
+  // Only round trips of requests sent once are measured (Karn's algorithm)
+  void sample(duration rtt);
+  // Doubles the timeout after a loss, until the next sample
+  void backoff();
+  duration rto() const;
+
+private:
+  std::optional<duration> srtt{};
+  duration rttvar{};
+  unsigned backoffs{0};
+};
+
+// Prepended to every datagram. Messages larger than a single datagram are
+// split into count fragments which are reassembled by the receiver.
+struct FragmentHeader {
+  std::uint64_t message;
+  std::uint32_t index;
+  std::uint32_t count;
+};
+
+constexpr std::size_t fragmentHeaderSize =
+    sizeof(std::uint64_t) + 2 * sizeof(std::uint32_t);
+
+using FragmentHeaderBytes = std::array<std::uint8_t, fragmentHeaderSize>;
+
+// Number of datagrams a message of given size is split into
+std::size_t fragmentCount(std::size_t size, std::size_t datagramSize);
+FragmentHeaderBytes writeFragmentHeader(const FragmentHeader& header);
+
+// Splits data into datagrams of at most datagramSize bytes (header included)
+std::vector<std::vector<std::uint8_t>>
+fragment(std::uint64_t message, const std::vector<std::uint8_t>& data,
+         std::size_t datagramSize);
+
+std::optional<FragmentHeader>
+readFragmentHeader(std::span<const std::uint8_t> datagram);
+
+// Messages reassembled at the same time, fragments of others are dropped
+constexpr std::size_t defaultPendingMessages = 64;
+
+class Reassembler {
+public:
+  using endpoint = asio::ip::udp::endpoint;
+
+  struct Message {
+    endpoint sender;
+    std::uint64_t id;
+    std::vector<std::uint8_t> bytes;
+  };
+
+  // Messages longer than maxMessage are dropped, and so are fragments of
+  // more than it takes to send that many bytes in datagrams of
+  // datagramSize, so peers must not use smaller datagrams. Partial messages
+  // hold at most twice maxMessage bytes together, the stalest ones are
+  // dropped first.
+  Reassembler(std::size_t maxPending = defaultPendingMessages,
+              std::size_t datagramSize = defaultDatagramSize,
+              std::size_t maxMessage = protocol::defaultMaxMessageSize)
+      : maxPending{maxPending}, maxMessage{maxMessage},
+        maxFragments{fragmentCount(maxMessage, datagramSize)} {}
+
+  // Returns message once its last missing fragment arrives
+  std::optional<Message> push(const endpoint& sender,
+                              std::span<const std::uint8_t> datagram);
+
+  // Bytes held by partial messages
+  std::size_t pendingBytes() const { return this->bytes; }
+
+private:
+  struct Partial {
+    std::vector<std::vector<std::uint8_t>> fragments;
+    std::uint32_t received;
+    std::uint64_t age;
+    std::size_t bytes;
+  };
+  using Pending = std::map<std::pair<endpoint, std::uint64_t>, Partial>;
+
+  // Drops the stalest partial message other than keep
+  bool dropOldest(Pending::iterator keep);
+  void drop(Pending::iterator it);
+
+  const std::size_t maxPending;
+  const std::size_t maxMessage;
+  const std::size_t maxFragments;
+  std::uint64_t clock{0};
+  std::size_t bytes{0};
+  Pending pending{};
+};
+
+// Long lived transport. Owns one socket and a thread running its io_context,
+// a single instance can (and should) be shared by many rpc::client::Client
+// objects. Any number of requests may be in flight at the same time, replies
+// are matched by message id. Unanswered requests are retransmitted under the
+// same id with exponential backoff, until timeout passes.
 class Client : public protocol::Client {
 public:
-  Client(std::string url) : url{url} {};
+  Client(std::string url, std::size_t datagramSize = defaultDatagramSize,
+         std::chrono::milliseconds timeout = defaultTimeout,
+         std::size_t maxMessageSize = protocol::defaultMaxMessageSize);
+  ~Client();
 
+  // Must not be called from within a callback, as it would deadlock the
+  // transport's thread
   virtual std::vector<std::uint8_t>
   makeRequest(const std::vector<std::uint8_t>& data) override;
 
+  virtual void asyncRequest(std::uint64_t id, std::vector<std::uint8_t> data,
+                            protocol::callback cb) override;
+  virtual void asyncRequestFor(std::uint64_t id,
+                               std::vector<std::uint8_t> data,
+                               std::chrono::milliseconds timeout,
+                               protocol::callback cb) override;
+
 private:
+  struct Pending {
+    protocol::callback cb;
+    std::unique_ptr<asio::steady_timer> timer;
+    // Kept for retransmission
+    std::vector<std::uint8_t> data;
+    std::chrono::steady_clock::time_point sent;
+    std::chrono::steady_clock::time_point deadline;
+    RttEstimator::duration rto;
+    bool retransmitted;
+  };
+
+  void arm(std::uint64_t id, Pending& request);
+  void expire(std::uint64_t id);
+  void receive();
+  void complete(std::uint64_t id, std::error_code ec,
+                std::vector<std::uint8_t> bytes);
+
   const std::string url;
+  const std::size_t datagramSize;
+  const std::chrono::milliseconds timeout;
+  std::atomic<std::uint64_t> messageCounter;
+
+  asio::io_context ctx;
+  asio::executor_work_guard<asio::io_context::executor_type> work{
+      ctx.get_executor()};
+  asio::ip::udp::socket socket{ctx};
+  asio::ip::udp::endpoint endpoint;
+  asio::ip::udp::endpoint sender;
+  std::vector<std::uint8_t> buffer = std::vector<std::uint8_t>(maxDatagramSize);
+  Reassembler reassembler;
+  RttEstimator estimator{};
+  std::unordered_map<std::uint64_t, Pending> pending{};
+  std::thread thread;
 };
 
+// Datagrams received or sent by a single recvmmsg/sendmmsg call
+constexpr std::size_t datagramBatch = 32;
+// Requests per socket whose replies may come from the async handler at once,
+// a reply that takes longer than this many later requests is dropped
+constexpr std::size_t maxWaitingReplies = 4096;
+
+// Receives datagrams in batches. Requests completed by one batch are handled
+// one after another and their replies are sent together.
 class Server : public protocol::Server {
 public:
+  // With sockets > 1 that many sockets are bound to the same address with
+  // SO_REUSEPORT, kernel spreads peers between them and each one is served
+  // by its own thread. Handler has to be thread safe then.
+  Server(std::string address = "127.0.0.1", std::uint16_t port = defaultPort,
+         std::size_t sockets = 1,
+         std::size_t datagramSize = defaultDatagramSize,
+         std::size_t maxMessageSize = protocol::defaultMaxMessageSize);
+
+  // Blocks until stop() is called
   void run();
   void stop();
 
   virtual void setHandler(
       std::function<std::vector<std::uint8_t>(std::vector<std::uint8_t>)>)
       override;
+  // Receive loop only hands requests over, so the next datagram can be
+  // received while earlier requests are being handled
+  virtual void setAsyncHandler(protocol::asyncHandler) override;
 
 private:
+  // Peer waiting for the reply to a request given to the async handler
+  struct Waiting {
+    asio::ip::udp::endpoint remote;
+    std::uint64_t id;
+    std::uint64_t ticket;
+  };
+
+  struct Socket {
+    asio::ip::udp::socket socket;
+    const std::size_t datagramSize;
+    // Replies may be sent from handler's threads
+    std::mutex sendMutex{};
+    // Ring of waiting peers by ticket, guarded by sendMutex. Responders carry
+    // only the ticket, so they are small enough for std::function to keep
+    // without allocating.
+    std::vector<Waiting> waiting = std::vector<Waiting>(maxWaitingReplies);
+    std::uint64_t tickets{0};
+  };
+
+  void serve(Socket& socket);
+
+  const asio::ip::udp::endpoint local;
+  const std::size_t socketCount;
   protocol::handler handler;
-  bool running{};
+  protocol::asyncHandler asyncHandler;
+  const std::size_t datagramSize;
+  const std::size_t maxMessageSize;
+  std::atomic<bool> running{};
   asio::io_context ctx;
+  std::vector<std::unique_ptr<Socket>> sockets{};
 };
 
 } // namespace udp
 } // namespace rpc
-#endif // RPC_UDP_HPP
\ No newline at end of file
+#endif // RPC_UDP_HPP
@@ -0,0 +1,238 @@
+#ifndef RPC_VIEW_HPP
+#define RPC_VIEW_HPP
+
+#include <cstdint>
+#include <span>
+#include <string_view>
+#include <tuple>
+#include <variant>
+
+#include "codec.hpp"
+#include "schema.hpp"
+
+// Non-owning counterparts of schema messages, pointing into the buffer they
+// were decoded from. Alternatives are in the same order as in schema.
+
+namespace rpc {
+namespace view {
+using schema::AdviseRequest;
+using schema::CloseRequest;
+using schema::LSeekRequest;
+using schema::PReadRequest;
+using schema::ReadRequest;
+using schema::RevocationsRequest;
+
+// Elements of a sequence are left encoded, messages of a batch can be decoded
+// with marshalling::decodeSubRequest
+template <typename T> struct Sequence final {
+  using Message = T;
+
+  std::uint64_t count;
+  std::span<const std::uint8_t> bytes;
+  codec::Version version;
+};
+
+struct OpenRequest final {
+  std::string_view pathname;
+  schema::mode_t mode;
+
+  static constexpr auto fields() {
+    return std::tuple{&OpenRequest::pathname, &OpenRequest::mode};
+  }
+};
+
+struct WriteRequest final {
+  schema::File desc;
+  std::uint64_t count;
+  std::span<const std::uint8_t> bytes;
+
+  static constexpr auto fields() {
+    return std::tuple{&WriteRequest::desc, &WriteRequest::count,
+                      &WriteRequest::bytes};
+  }
+};
+
+struct ChmodRequest final {
+  std::string_view pathname;
+  std::uint32_t mode;
+
+  static constexpr auto fields() {
+    return std::tuple{&ChmodRequest::pathname, &ChmodRequest::mode};
+  }
+};
+
+struct UnlinkRequest final {
+  std::string_view pathname;
+
+  static constexpr auto fields() {
+    return std::tuple{&UnlinkRequest::pathname};
+  }
+};
+
+struct RenameRequest final {
+  std::string_view oldpath;
+  std::string_view newpath;
+
+  static constexpr auto fields() {
+    return std::tuple{&RenameRequest::oldpath, &RenameRequest::newpath};
+  }
+};
+
+struct PWriteRequest final {
+  schema::File desc;
+  schema::off_t offset;
+  std::uint64_t count;
+  std::span<const std::uint8_t> bytes;
+
+  static constexpr auto fields() {
+    return std::tuple{&PWriteRequest::desc, &PWriteRequest::offset,
+                      &PWriteRequest::count, &PWriteRequest::bytes};
+  }
+};
+
+struct ReadVRequest final {
+  schema::File desc;
+  Sequence<schema::Extent> extents;
+
+  static constexpr auto fields() {
+    return std::tuple{&ReadVRequest::desc, &ReadVRequest::extents};
+  }
+};
+
+struct WriteVRequest final {
+  schema::File desc;
+  Sequence<schema::Extent> extents;
+  std::uint64_t count;
+  std::span<const std::uint8_t> bytes;
+
+  static constexpr auto fields() {
+    return std::tuple{&WriteVRequest::desc, &WriteVRequest::extents,
+                      &WriteVRequest::count, &WriteVRequest::bytes};
+  }
+};
+
+struct LeaseRequest final {
+  std::string_view pathname;
+
+  static constexpr auto fields() {
+    return std::tuple{&LeaseRequest::pathname};
+  }
+};
+
+using SubRequest =
+    std::variant<OpenRequest, ReadRequest, WriteRequest, LSeekRequest,
+                 ChmodRequest, UnlinkRequest, RenameRequest, CloseRequest,
+                 PReadRequest, PWriteRequest, ReadVRequest, WriteVRequest,
+                 AdviseRequest, LeaseRequest, RevocationsRequest>;
+
+struct BatchRequest final {
+  Sequence<SubRequest> requests;
+
+  static constexpr auto fields() { return std::tuple{&BatchRequest::requests}; }
+};
+
+using RequestBody =
+    std::variant<OpenRequest, ReadRequest, WriteRequest, LSeekRequest,
+                 ChmodRequest, UnlinkRequest, RenameRequest, CloseRequest,
+                 BatchRequest, PReadRequest, PWriteRequest, ReadVRequest,
+                 WriteVRequest, AdviseRequest, LeaseRequest,
+                 RevocationsRequest>;
+
+struct Request final {
+  schema::Header header;
+  RequestBody body;
+};
+
+using schema::AdviseResponse;
+using schema::ChmodResponse;
+using schema::CloseResponse;
+using schema::LeaseResponse;
+using schema::LSeekResponse;
+using schema::OpenResponse;
+using schema::PWriteResponse;
+using schema::WriteVResponse;
+using schema::RenameResponse;
+using schema::UnlinkResponse;
+using schema::WriteResponse;
+
+struct ReadResponse final {
+  std::int64_t read;
+  std::span<const std::uint8_t> bytes;
+
+  static constexpr auto fields() {
+    return std::tuple{&ReadResponse::read, &ReadResponse::bytes};
+  }
+};
+
+struct PReadResponse final {
+  std::int64_t read;
+  std::span<const std::uint8_t> bytes;
+
+  static constexpr auto fields() {
+    return std::tuple{&PReadResponse::read, &PReadResponse::bytes};
+  }
+};
+
+struct ReadVResponse final {
+  Sequence<std::int64_t> read;
+  std::uint64_t count;
+  std::span<const std::uint8_t> bytes;
+
+  static constexpr auto fields() {
+    return std::tuple{&ReadVResponse::read, &ReadVResponse::count,
+                      &ReadVResponse::bytes};
+  }
+};
+
+struct Revocation final {
+  std::string_view pathname;
+  std::uint64_t version;
+
+  static constexpr auto fields() {
+    return std::tuple{&Revocation::pathname, &Revocation::version};
+  }
+};
+
+struct RevocationsResponse final {
+  std::uint64_t sequence;
+  std::uint8_t complete;
+  Sequence<Revocation> revocations;
+
+  static constexpr auto fields() {
+    return std::tuple{&RevocationsResponse::sequence,
+                      &RevocationsResponse::complete,
+                      &RevocationsResponse::revocations};
+  }
+};
+
+using SubResponse =
+    std::variant<OpenResponse, ReadResponse, WriteResponse, LSeekResponse,
+                 ChmodResponse, UnlinkResponse, RenameResponse, CloseResponse,
+                 PReadResponse, PWriteResponse, ReadVResponse, WriteVResponse,
+                 AdviseResponse, LeaseResponse, RevocationsResponse>;
+
+struct BatchResponse final {
+  Sequence<SubResponse> responses;
+
+  static constexpr auto fields() {
+    return std::tuple{&BatchResponse::responses};
+  }
+};
+
+using ResponseBody =
+    std::variant<OpenResponse, ReadResponse, WriteResponse, LSeekResponse,
+                 ChmodResponse, UnlinkResponse, RenameResponse, CloseResponse,
+                 BatchResponse, PReadResponse, PWriteResponse, ReadVResponse,
+                 WriteVResponse, AdviseResponse, LeaseResponse,
+                 RevocationsResponse>;
+
+struct Response final {
+  std::uint64_t id;
+  schema::Code code;
+  ResponseBody body;
+};
+
+} // namespace view
+} // namespace rpc
+
+#endif // RPC_VIEW_HPP
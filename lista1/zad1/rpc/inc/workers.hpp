@@ -0,0 +1,151 @@
+#ifndef RPC_WORKERS_HPP
+#define RPC_WORKERS_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <semaphore>
+#include <thread>
+#include <vector>
+
+namespace rpc {
+namespace workers {
+
+using Task = std::function<void()>;
+
+constexpr std::size_t defaultQueueCapacity = 4096;
+
+// Bounded lock free queue for any number of producers and consumers. Every
+// cell carries a sequence number telling whose turn it is, producers and
+// consumers only contend on their own position counter.
+template <typename T> class Queue {
+public:
+  // Capacity is rounded up to a power of two
+  explicit Queue(std::size_t capacity)
+      : mask{std::bit_ceil(std::max<std::size_t>(capacity, 2)) - 1},
+        cells{std::make_unique<Cell[]>(mask + 1)} {
+    for (std::size_t i = 0; i <= this->mask; i++) {
+      this->cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  // Returns false when full, value is left untouched then
+  bool push(T&& value) {
+    auto position = this->tail.load(std::memory_order_relaxed);
+    Cell* cell;
+    for (;;) {
+      cell = &this->cells[position & this->mask];
+      auto sequence = cell->sequence.load(std::memory_order_acquire);
+      auto diff = static_cast<std::intptr_t>(sequence) -
+                  static_cast<std::intptr_t>(position);
+      if (diff == 0) {
+        if (this->tail.compare_exchange_weak(position, position + 1,
+                                             std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        position = this->tail.load(std::memory_order_relaxed);
+      }
+    }
+    cell->value = std::move(value);
+    cell->sequence.store(position + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Returns false when empty, or while the oldest push is still in progress
+  bool pop(T& value) {
+    auto position = this->head.load(std::memory_order_relaxed);
+    Cell* cell;
+    for (;;) {
+      cell = &this->cells[position & this->mask];
+      auto sequence = cell->sequence.load(std::memory_order_acquire);
+      auto diff = static_cast<std::intptr_t>(sequence) -
+                  static_cast<std::intptr_t>(position + 1);
+      if (diff == 0) {
+        if (this->head.compare_exchange_weak(position, position + 1,
+                                             std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        position = this->head.load(std::memory_order_relaxed);
+      }
+    }
+    value = std::move(cell->value);
+    cell->sequence.store(position + this->mask + 1, std::memory_order_release);
+    return true;
+  }
+
+private:
+  struct Cell {
+    std::atomic<std::size_t> sequence;
+    T value;
+  };
+
+  const std::size_t mask;
+  std::unique_ptr<Cell[]> cells;
+  // On separate cache lines, producers and consumers do not share them
+  alignas(64) std::atomic<std::size_t> tail{0};
+  alignas(64) std::atomic<std::size_t> head{0};
+};
+
+// Fixed number of threads running tasks from a bounded Queue. Tasks still
+// queued when the pool is destroyed are run first.
+class Pool {
+public:
+  Pool(std::size_t threads, std::size_t capacity = defaultQueueCapacity);
+  ~Pool();
+
+  Pool(const Pool&) = delete;
+  Pool& operator=(const Pool&) = delete;
+
+  // Returns false when the queue is full
+  bool tryPost(Task&& task);
+  // Waits while the queue is full
+  void post(Task task);
+
+private:
+  void work();
+
+  Queue<Task> queue;
+  // Number of tasks queued
+  std::counting_semaphore<> queued{0};
+  std::vector<std::thread> threads{};
+};
+
+// Runs tasks posted to it on a Pool, one at a time and in order. Tasks keep
+// running after the Serial is destroyed. Thread safe.
+class Serial {
+public:
+  explicit Serial(Pool& pool) : state{std::make_shared<State>(pool)} {}
+
+  void post(Task task);
+
+private:
+  struct State {
+    State(Pool& pool) : pool{pool} {}
+
+    Pool& pool;
+    std::mutex mutex;
+    std::deque<Task> tasks{};
+    bool running{false};
+  };
+
+  static void drain(std::shared_ptr<State> state);
+
+  std::shared_ptr<State> state;
+};
+
+} // namespace workers
+} // namespace rpc
+
+#endif // RPC_WORKERS_HPP
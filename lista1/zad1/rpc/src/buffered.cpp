@@ -0,0 +1,302 @@
+#include "pool.hpp"
+#include <buffered.hpp>
+
+#include <algorithm>
+#include <ios>
+#include <stdexcept>
+#include <utility>
+
+namespace rpc {
+namespace client {
+
+BufferedFile::BufferedFile(Client& client, schema::File desc,
+                           BufferOptions options)
+    : client{client}, desc{desc}, options{options} {
+  if (options.blockSize == 0 || options.maxInFlight == 0) {
+    throw std::invalid_argument("buffer must not be empty");
+  }
+  this->position = this->client.lseek(desc, 0, std::ios::cur);
+  if (this->position < 0) {
+    throw std::invalid_argument("bad descriptor");
+  }
+  this->block = pool::buffers().acquire();
+  this->block.reserve(options.blockSize);
+}
+
+BufferedFile::~BufferedFile() {
+  try {
+    this->flush();
+  } catch (...) {
+  }
+}
+
+std::int64_t BufferedFile::write(std::uint64_t count,
+                                 const std::vector<std::uint8_t>& v) {
+  count = std::min<std::uint64_t>(count, v.size());
+  std::uint64_t done = 0;
+  while (done < count) {
+    auto room = this->options.blockSize - this->block.size();
+    auto n = std::min<std::uint64_t>(room, count - done);
+    this->block.insert(this->block.end(), v.begin() + done,
+                       v.begin() + done + n);
+    done += n;
+    if (this->block.size() == this->options.blockSize) {
+      this->send();
+    }
+  }
+  return count;
+}
+
+void BufferedFile::flush() {
+  this->send();
+  this->drain();
+  if (!this->synced) {
+    this->client.lseek(this->desc, this->position, std::ios::beg);
+    this->synced = true;
+  }
+}
+
+schema::off_t BufferedFile::lseek(schema::off_t offset, std::uint32_t whence) {
+  this->send();
+  this->drain();
+  // Relative seeks are resolved here, the server's offset may be stale
+  if (whence == std::ios::cur) {
+    offset += this->position;
+    whence = std::ios::beg;
+  }
+  auto result = this->client.lseek(this->desc, offset, whence);
+  if (result >= 0) {
+    this->position = result;
+    this->synced = true;
+  }
+  return result;
+}
+
+std::int64_t BufferedFile::close() {
+  this->send();
+  this->drain();
+  return this->client.close(this->desc);
+}
+
+void BufferedFile::send() {
+  if (this->block.empty()) {
+    return;
+  }
+
+  auto state = this->state;
+  {
+    std::unique_lock lock{state->mutex};
+    state->done.wait(lock, [this, &state]() {
+      return state->inFlight < this->options.maxInFlight;
+    });
+    if (state->error) {
+      std::rethrow_exception(std::exchange(state->error, nullptr));
+    }
+    state->inFlight++;
+  }
+
+  std::uint64_t size = this->block.size();
+  auto offset = this->position;
+  this->position += size;
+  this->synced = false;
+  this->client.pwriteAsync(
+      this->desc, offset, std::exchange(this->block, pool::buffers().acquire()),
+      [state, size](std::exception_ptr e, std::int64_t written) {
+        std::lock_guard lock{state->mutex};
+        state->inFlight--;
+        if (!e && written != static_cast<std::int64_t>(size)) {
+          e = std::make_exception_ptr(std::runtime_error("short write"));
+        }
+        if (e && !state->error) {
+          state->error = e;
+        }
+        state->done.notify_all();
+      });
+  this->block.reserve(this->options.blockSize);
+}
+
+void BufferedFile::drain() {
+  std::unique_lock lock{this->state->mutex};
+  this->state->done.wait(lock, [this]() { return this->state->inFlight == 0; });
+  if (this->state->error) {
+    std::rethrow_exception(std::exchange(this->state->error, nullptr));
+  }
+}
+
+ReadAheadFile::ReadAheadFile(Client& client, schema::File desc,
+                             ReadAheadOptions options)
+    : client{client}, desc{desc}, options{options} {
+  if (options.blockSize == 0 || options.depth == 0) {
+    throw std::invalid_argument("read ahead must not be empty");
+  }
+  this->position = this->client.lseek(desc, 0, std::ios::cur);
+  if (this->position < 0) {
+    throw std::invalid_argument("bad descriptor");
+  }
+}
+
+ReadAheadFile::~ReadAheadFile() {
+  this->drop();
+  try {
+    this->sync();
+  } catch (...) {
+  }
+}
+
+std::int64_t ReadAheadFile::read(std::uint64_t count,
+                                 std::vector<std::uint8_t>& v) {
+  if (this->reads < this->options.trigger) {
+    this->reads++;
+    auto n = this->client.pread(this->desc, this->position, count, v);
+    if (n > 0) {
+      this->position += n;
+      this->synced = false;
+    }
+    return n;
+  }
+
+  if (!this->advised) {
+    // Only a hint, its reply is not waited for
+    this->advised = true;
+    this->client.adviseAsync(this->desc, this->position, 0,
+                             schema::Advice::SEQUENTIAL,
+                             [](std::exception_ptr, std::int64_t) {});
+  }
+  return this->readAhead(count, v);
+}
+
+void ReadAheadFile::sync() {
+  if (!this->synced) {
+    this->client.lseek(this->desc, this->position, std::ios::beg);
+    this->synced = true;
+  }
+}
+
+schema::off_t ReadAheadFile::lseek(schema::off_t offset, std::uint32_t whence) {
+  // Relative seeks are resolved here, the server's offset may be stale
+  if (whence == std::ios::cur) {
+    offset += this->position;
+    whence = std::ios::beg;
+  }
+  auto result = this->client.lseek(this->desc, offset, whence);
+  if (result >= 0) {
+    if (result != this->position) {
+      this->drop();
+      this->reads = 0;
+    }
+    this->position = result;
+    this->synced = true;
+  }
+  return result;
+}
+
+std::int64_t ReadAheadFile::close() {
+  this->drop();
+  this->synced = true;
+  return this->client.close(this->desc);
+}
+
+std::int64_t ReadAheadFile::readAhead(std::uint64_t count,
+                                      std::vector<std::uint8_t>& v) {
+  const std::uint64_t size = this->options.blockSize;
+  v.clear();
+  while (v.size() < count) {
+    if (this->end >= 0 && this->position >= this->end) {
+      // File may grow, the next read asks again. Nothing is fetched ahead
+      // now, the blocks would be past the end.
+      this->drop();
+      return v.size();
+    }
+    this->prefetch();
+
+    auto index = this->position / size;
+    std::unique_lock lock{this->state->mutex};
+    auto& block = this->state->blocks[index];
+    this->state->done.wait(lock, [&block]() { return block.done; });
+    if (block.error) {
+      auto error = block.error;
+      lock.unlock();
+      this->drop();
+      std::rethrow_exception(error);
+    }
+    if (block.read < 0) {
+      lock.unlock();
+      this->drop();
+      return v.empty() ? -1 : static_cast<std::int64_t>(v.size());
+    }
+    if (static_cast<std::uint64_t>(block.read) < size) {
+      this->end = index * size + block.read;
+    }
+
+    std::uint64_t within = this->position - index * size;
+    auto n = std::min<std::uint64_t>(
+        count - v.size(),
+        std::max<std::int64_t>(block.read - within, 0));
+    v.insert(v.end(), block.bytes.begin() + within,
+             block.bytes.begin() + within + n);
+    this->position += n;
+    this->synced = false;
+    if (this->position >= static_cast<schema::off_t>((index + 1) * size)) {
+      pool::buffers().release(std::move(block.bytes));
+      this->state->blocks.erase(index);
+    }
+  }
+  // Keeps the depth full while the caller works on this read
+  this->prefetch();
+  return v.size();
+}
+
+void ReadAheadFile::prefetch() {
+  const std::uint64_t size = this->options.blockSize;
+  auto first = static_cast<std::uint64_t>(this->position) / size;
+  for (auto index = first; index < first + this->options.depth; index++) {
+    auto offset = static_cast<schema::off_t>(index * size);
+    if (this->end >= 0 && offset >= this->end) {
+      return;
+    }
+
+    auto state = this->state;
+    std::uint64_t generation;
+    {
+      std::lock_guard lock{state->mutex};
+      if (!state->blocks.try_emplace(index).second) {
+        continue;
+      }
+      generation = state->generation;
+    }
+    this->client.preadAsync(
+        this->desc, offset, size,
+        [state, generation, index](std::exception_ptr e,
+                                   schema::PReadResponse res) {
+          std::lock_guard lock{state->mutex};
+          if (state->generation != generation) {
+            pool::buffers().release(std::move(res.bytes));
+            return;
+          }
+          auto& block = state->blocks[index];
+          block.done = true;
+          block.error = e;
+          block.read = res.read;
+          block.bytes = std::move(res.bytes);
+          if (!e && res.read >= 0 &&
+              static_cast<std::uint64_t>(res.read) > block.bytes.size()) {
+            block.error =
+                std::make_exception_ptr(std::runtime_error("short reply"));
+          }
+          state->done.notify_all();
+        });
+  }
+}
+
+void ReadAheadFile::drop() {
+  std::lock_guard lock{this->state->mutex};
+  this->state->generation++;
+  for (auto& [index, block] : this->state->blocks) {
+    pool::buffers().release(std::move(block.bytes));
+  }
+  this->state->blocks.clear();
+  this->end = -1;
+}
+
+} // namespace client
+} // namespace rpc
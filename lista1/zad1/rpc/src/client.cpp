@@ -1,84 +1,413 @@
 #include "marshalling.hpp"
+#include "pool.hpp"
 #include "schema.hpp"
 #include <client.hpp>
+#include <algorithm>
+#include <chrono>
+#include <future>
+#include <span>
 #include <stdexcept>
+#include <system_error>
+#include <utility>
 
 namespace rpc {
 namespace client {
-schema::ResponseBody Client::sendBody(schema::RequestBody body) {
-  using namespace schema;
-  Request req{.header =
-                  Header{.auth = this->auth, .id = this->uniform(this->rng)},
-              .body = body};
-  auto bytes = this->client->makeRequest(marshalling::marshalRequest(req));
-  auto resp = marshalling::unmarshalResponse(bytes);
+namespace {
+void check(schema::Code code) {
+  switch (code) {
+  case schema::Code::OK:
+    return;
+  case schema::Code::FORBIDDEN:
+    throw std::system_error(
+        std::make_error_code(std::errc::permission_denied));
+  default:
+    throw std::runtime_error("request failed");
+  }
+}
+
+// First count bytes of the caller's vector
+std::span<const std::uint8_t> payload(const std::vector<std::uint8_t>& v,
+                                      std::uint64_t count) {
+  if (count > v.size()) {
+    throw std::invalid_argument("count exceeds payload");
+  }
+  return std::span{v}.first(count);
+}
+
+// Bytes read into the caller's memory, the rest of it is left alone
+std::int64_t copyRead(std::int64_t read, std::span<const std::uint8_t> bytes,
+                      std::span<std::uint8_t> data) {
+  auto n = std::min(bytes.size(), data.size());
+  std::copy_n(bytes.begin(), n, data.begin());
+  return read < 0 ? read : static_cast<std::int64_t>(n);
+}
+
+// Waits for the reply, throws like makeRequest
+std::vector<std::uint8_t> requestFor(protocol::Client& client,
+                                     std::uint64_t id,
+                                     std::vector<std::uint8_t> data,
+                                     std::chrono::milliseconds timeout) {
+  std::promise<std::vector<std::uint8_t>> promise;
+  auto future = promise.get_future();
+  client.asyncRequestFor(id, std::move(data), timeout,
+                         [&promise](std::error_code ec,
+                                    std::vector<std::uint8_t> bytes) {
+                           if (ec) {
+                             promise.set_exception(std::make_exception_ptr(
+                                 std::system_error(ec)));
+                             return;
+                           }
+                           promise.set_value(std::move(bytes));
+                         });
+  return future.get();
+}
+} // namespace
+
+schema::Header Client::header() {
+  std::lock_guard lock{this->mutex};
+  return {.auth = this->auth, .id = this->uniform(this->rng)};
+}
+
+template <typename Request, typename Handle>
+void Client::exchange(const Request& req, Handle handle) {
+  auto version = this->current();
+  auto send = [this, &req](marshalling::Version version) {
+    auto out = marshalling::marshalRequest(req, version);
+    if (this->probing(version)) {
+      return requestFor(*this->client, req.header.id, std::move(out),
+                        this->probeTimeout);
+    }
+    auto bytes = this->client->makeRequest(out);
+    pool::buffers().release(std::move(out));
+    return bytes;
+  };
+  std::vector<std::uint8_t> bytes;
+  try {
+    bytes = send(version);
+  } catch (std::system_error& e) {
+    if (!this->fallback(version, e.code())) {
+      throw;
+    }
+    version = marshalling::Version::V1;
+    bytes = send(version);
+  }
+  auto resp = marshalling::decodeResponse(bytes);
   if (resp.id != req.header.id) {
     // TODO: improve handling
     throw std::invalid_argument("bad return code");
   }
+  check(resp.code);
+  if (version != marshalling::Version::V1) {
+    this->negotiated = true;
+  }
+  handle(resp);
+  pool::buffers().release(std::move(bytes));
+}
+
+schema::ResponseBody Client::sendBody(schema::RequestBody body) {
+  schema::Request req{.header = this->header(), .body = std::move(body)};
+  schema::ResponseBody result;
+  this->exchange(req, [&result](const view::Response& resp) {
+    result = marshalling::toOwned(resp).body;
+  });
+  return result;
+}
+
+void Client::sendBodyAsync(schema::RequestBody body, callback cb) {
+  using namespace schema;
+  auto req = std::make_shared<const Request>(
+      Request{.header = this->header(), .body = std::move(body)});
+
+  auto launch = [this, req, cb = std::move(cb)]() {
+    this->transmit(req, this->current(), cb);
+  };
+
+  {
+    std::lock_guard lock{this->mutex};
+    if (this->inFlight >= this->window) {
+      this->backlog.push_back(std::move(launch));
+      return;
+    }
+    this->inFlight++;
+  }
+  launch();
+}
 
-  return resp.body;
+void Client::transmit(std::shared_ptr<const schema::Request> req,
+                      marshalling::Version version, callback cb) {
+  auto id = req->header.id;
+  auto data = marshalling::marshalRequest(*req, version);
+  protocol::callback done =
+      [this, req, version, cb](std::error_code ec,
+                               std::vector<std::uint8_t> bytes) {
+        if (ec && this->fallback(version, ec)) {
+          // Retried within the same window slot
+          this->transmit(req, marshalling::Version::V1, cb);
+          return;
+        }
+        // Next request may start before this callback finishes
+        this->release();
+        if (ec) {
+          cb(std::make_exception_ptr(std::system_error(ec)), {});
+          return;
+        }
+        try {
+          auto resp = marshalling::unmarshalResponse(bytes);
+          pool::buffers().release(std::move(bytes));
+          if (resp.id != req->header.id) {
+            throw std::invalid_argument("bad return code");
+          }
+          check(resp.code);
+          if (version != marshalling::Version::V1) {
+            this->negotiated = true;
+          }
+          cb(nullptr, std::move(resp.body));
+        } catch (...) {
+          cb(std::current_exception(), {});
+        }
+      };
+  if (this->probing(version)) {
+    this->client->asyncRequestFor(id, std::move(data), this->probeTimeout,
+                                  std::move(done));
+    return;
+  }
+  this->client->asyncRequest(id, std::move(data), std::move(done));
+}
+
+marshalling::Version Client::current() {
+  if (this->probing(this->version) &&
+      std::chrono::steady_clock::now() < this->legacyUntil.load()) {
+    return marshalling::Version::V1;
+  }
+  return this->version;
+}
+
+bool Client::probing(marshalling::Version version) {
+  return version != marshalling::Version::V1 && !this->negotiated;
+}
+
+bool Client::fallback(marshalling::Version used, std::error_code ec) {
+  // Peers predating V2 drop such requests without replying. Only this
+  // request is retried as V1, V2 is probed again after reprobeInterval.
+  if (!this->probing(used) || ec != std::errc::timed_out) {
+    return false;
+  }
+  this->legacyUntil = std::chrono::steady_clock::now() + reprobeInterval;
+  return true;
+}
+
+void Client::release() {
+  std::function<void()> next;
+  {
+    std::lock_guard lock{this->mutex};
+    if (this->backlog.empty()) {
+      this->inFlight--;
+      return;
+    }
+    // Slot is handed over to the queued request
+    next = std::move(this->backlog.front());
+    this->backlog.pop_front();
+  }
+  next();
 }
 
 schema::File Client::open(std::string pathname, schema::mode_t mode) {
   schema::OpenRequest req{.pathname = pathname, .mode = mode};
-  schema::ResponseBody resp = this->sendBody(req);
+  schema::ResponseBody resp = this->sendBody(std::move(req));
   auto result = std::get<schema::OpenResponse>(resp);
   return result.file;
 }
 
 std::int64_t Client::read(schema::File desc, std::uint64_t count,
                           std::vector<std::uint8_t>& v) {
-  schema::ReadRequest req{.desc = desc, .count = count};
-  schema::ResponseBody resp = this->sendBody(req);
-  auto result = std::get<schema::ReadResponse>(resp);
-  v = result.bytes;
-  return result.read;
+  view::Request req{.header = this->header(),
+                    .body = view::ReadRequest{.desc = desc, .count = count}};
+  std::int64_t read;
+  this->exchange(req, [&](const view::Response& resp) {
+    auto result = std::get<view::ReadResponse>(resp.body);
+    v.assign(result.bytes.begin(), result.bytes.end());
+    read = result.read;
+  });
+  return read;
+}
+
+std::int64_t Client::read(schema::File desc, std::span<std::uint8_t> data) {
+  view::Request req{
+      .header = this->header(),
+      .body = view::ReadRequest{.desc = desc, .count = data.size()}};
+  std::int64_t read;
+  this->exchange(req, [&](const view::Response& resp) {
+    auto result = std::get<view::ReadResponse>(resp.body);
+    read = copyRead(result.read, result.bytes, data);
+  });
+  return read;
 }
 
 std::int64_t Client::write(schema::File desc, std::uint64_t count,
                            std::vector<std::uint8_t>& v) {
-  schema::WriteRequest req{.desc = desc, .count = count, .bytes = v};
-  schema::ResponseBody resp = this->sendBody(req);
-  auto result = std::get<schema::WriteResponse>(resp);
-  return result.written;
+  return this->write(desc, payload(v, count));
+}
+
+std::int64_t Client::write(schema::File desc,
+                           std::span<const std::uint8_t> data) {
+  view::Request req{.header = this->header(),
+                    .body = view::WriteRequest{
+                        .desc = desc, .count = data.size(), .bytes = data}};
+  std::int64_t written;
+  this->exchange(req, [&written](const view::Response& resp) {
+    written = std::get<view::WriteResponse>(resp.body).written;
+  });
+  return written;
 }
 
 schema::off_t Client::lseek(schema::File desc, schema::off_t offset,
                             std::uint32_t whence) {
   schema::LSeekRequest req{.desc = desc, .offset = offset, .whence = whence};
-  schema::ResponseBody resp = this->sendBody(req);
+  schema::ResponseBody resp = this->sendBody(std::move(req));
   auto result = std::get<schema::LSeekResponse>(resp);
   return result.offset;
 }
 
 schema::off_t Client::chmod(std::string pathname, std::uint32_t mode) {
   schema::ChmodRequest req{.pathname = pathname, .mode = mode};
-  schema::ResponseBody resp = this->sendBody(req);
+  schema::ResponseBody resp = this->sendBody(std::move(req));
   auto result = std::get<schema::ChmodResponse>(resp);
   return result.result;
 }
 
 std::int64_t Client::unlink(std::string pathname) {
   schema::UnlinkRequest req{.pathname = pathname};
-  schema::ResponseBody resp = this->sendBody(req);
+  schema::ResponseBody resp = this->sendBody(std::move(req));
   auto result = std::get<schema::UnlinkResponse>(resp);
   return result.result;
 }
 
 std::int64_t Client::rename(std::string oldpath, std::string newpath) {
   schema::RenameRequest req{.oldpath = oldpath, .newpath = newpath};
-  schema::ResponseBody resp = this->sendBody(req);
+  schema::ResponseBody resp = this->sendBody(std::move(req));
   auto result = std::get<schema::RenameResponse>(resp);
   return result.result;
 }
 
 std::int64_t Client::close(schema::File desc) {
   schema::CloseRequest req{.desc = desc};
-  schema::ResponseBody resp = this->sendBody(req);
+  schema::ResponseBody resp = this->sendBody(std::move(req));
   auto result = std::get<schema::CloseResponse>(resp);
   return result.result;
 }
 
+std::int64_t Client::pread(schema::File desc, schema::off_t offset,
+                           std::uint64_t count, std::vector<std::uint8_t>& v) {
+  view::Request req{
+      .header = this->header(),
+      .body = view::PReadRequest{
+          .desc = desc, .offset = offset, .count = count}};
+  std::int64_t read;
+  this->exchange(req, [&](const view::Response& resp) {
+    auto result = std::get<view::PReadResponse>(resp.body);
+    v.assign(result.bytes.begin(), result.bytes.end());
+    read = result.read;
+  });
+  return read;
+}
+
+std::int64_t Client::pread(schema::File desc, schema::off_t offset,
+                           std::span<std::uint8_t> data) {
+  view::Request req{
+      .header = this->header(),
+      .body = view::PReadRequest{
+          .desc = desc, .offset = offset, .count = data.size()}};
+  std::int64_t read;
+  this->exchange(req, [&](const view::Response& resp) {
+    auto result = std::get<view::PReadResponse>(resp.body);
+    read = copyRead(result.read, result.bytes, data);
+  });
+  return read;
+}
+
+std::int64_t Client::pwrite(schema::File desc, schema::off_t offset,
+                            std::uint64_t count, std::vector<std::uint8_t>& v) {
+  return this->pwrite(desc, offset, payload(v, count));
+}
+
+std::int64_t Client::pwrite(schema::File desc, schema::off_t offset,
+                            std::span<const std::uint8_t> data) {
+  view::Request req{.header = this->header(),
+                    .body = view::PWriteRequest{.desc = desc,
+                                                .offset = offset,
+                                                .count = data.size(),
+                                                .bytes = data}};
+  std::int64_t written;
+  this->exchange(req, [&written](const view::Response& resp) {
+    written = std::get<view::PWriteResponse>(resp.body).written;
+  });
+  return written;
+}
+
+std::int64_t Client::readv(schema::File desc,
+                           std::vector<schema::Extent> extents,
+                           std::vector<std::vector<std::uint8_t>>& v) {
+  schema::ReadVRequest req{.desc = desc, .extents = std::move(extents)};
+  schema::ResponseBody resp = this->sendBody(std::move(req));
+  auto result = std::get<schema::ReadVResponse>(std::move(resp));
+
+  v.resize(result.read.size());
+  std::int64_t total = 0;
+  auto it = result.bytes.begin();
+  for (std::size_t i = 0; i < result.read.size(); i++) {
+    auto read = std::max<std::int64_t>(result.read[i], 0);
+    if (read > result.bytes.end() - it) {
+      throw std::invalid_argument("bad response");
+    }
+    v[i].assign(it, it + read);
+    it += read;
+    total = result.read[i] < 0 || total < 0 ? -1 : total + read;
+  }
+  return total;
+}
+
+std::int64_t Client::writev(schema::File desc,
+                            std::vector<schema::Extent> extents,
+                            std::vector<std::uint8_t>& v) {
+  schema::WriteVRequest req{.desc = desc,
+                            .extents = std::move(extents),
+                            .count = v.size(),
+                            .bytes = v};
+  schema::ResponseBody resp = this->sendBody(std::move(req));
+  auto result = std::get<schema::WriteVResponse>(resp);
+  return result.written;
+}
+
+std::int64_t Client::advise(schema::File desc, schema::off_t offset,
+                            std::uint64_t count, schema::Advice advice) {
+  schema::AdviseRequest req{.desc = desc,
+                            .offset = offset,
+                            .count = count,
+                            .advice = static_cast<std::uint32_t>(advice)};
+  schema::ResponseBody resp = this->sendBody(std::move(req));
+  auto result = std::get<schema::AdviseResponse>(resp);
+  return result.result;
+}
+
+schema::LeaseResponse Client::lease(std::string pathname) {
+  schema::LeaseRequest req{.pathname = std::move(pathname)};
+  schema::ResponseBody resp = this->sendBody(std::move(req));
+  return std::get<schema::LeaseResponse>(resp);
+}
+
+schema::RevocationsResponse Client::revocations(std::uint64_t since) {
+  schema::RevocationsRequest req{.since = since};
+  schema::ResponseBody resp = this->sendBody(std::move(req));
+  return std::get<schema::RevocationsResponse>(std::move(resp));
+}
+
+std::vector<schema::SubResponse>
+Client::batch(std::vector<schema::SubRequest> requests) {
+  schema::BatchRequest req{.requests = std::move(requests)};
+  schema::ResponseBody resp = this->sendBody(std::move(req));
+  auto result = std::get<schema::BatchResponse>(std::move(resp));
+  return std::move(result.responses);
+}
+
 } // namespace client
 } // namespace rpc
\ No newline at end of file
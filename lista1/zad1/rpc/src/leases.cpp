@@ -0,0 +1,194 @@
+#include <leases.hpp>
+
+#include <algorithm>
+#include <filesystem>
+#include <functional>
+#include <utility>
+#include <vector>
+
+namespace rpc {
+namespace server {
+namespace {
+// Same file under different spellings has one lease
+std::string normal(const std::string& pathname) {
+  auto path = std::filesystem::path{pathname}.lexically_normal().string();
+  if (path.size() > 1 && path.back() == '/') {
+    path.pop_back();
+  }
+  return path;
+}
+
+// Whether the path is the directory or lies under it
+bool within(const std::string& path, const std::string& dir) {
+  return path.starts_with(dir) &&
+         (path.size() == dir.size() || dir.back() == '/' ||
+          path[dir.size()] == '/');
+}
+} // namespace
+
+LeaseTable::LeaseTable(std::chrono::milliseconds term,
+                       std::size_t maxRevocations)
+    : term{term}, maxRevocations{maxRevocations},
+      shards{std::make_unique<Shard[]>(leaseShards)} {}
+
+schema::LeaseResponse LeaseTable::grant(const std::string& pathname) {
+  auto path = normal(pathname);
+  auto now = Clock::now();
+  schema::LeaseResponse res{.version = 0, .term = 0, .sequence = 0};
+  {
+    // Taken first, so a revocation logged after it is not missed
+    std::lock_guard lock{this->revocationsMutex};
+    res.sequence = this->sequence;
+  }
+
+  auto& shard = this->shard(path);
+  std::lock_guard lock{shard.mutex};
+  if (shard.files.size() >= shard.sweepAt) {
+    std::erase_if(shard.files, [this, now](const auto& entry) {
+      return entry.second.expires < now &&
+             entry.second.modified + this->term < now;
+    });
+    shard.sweepAt = std::max<std::size_t>(2 * shard.files.size(), 64);
+  }
+
+  auto& file = shard.files
+                   .try_emplace(path, File{.version = ++this->versions,
+                                           .expires = now,
+                                           .modified = now - this->term})
+                   .first->second;
+  res.version = file.version;
+  if (file.modified + this->term > now) {
+    return res;
+  }
+  file.expires = std::max(file.expires, now + this->term);
+  res.term = this->term.count();
+  return res;
+}
+
+schema::RevocationsResponse LeaseTable::revoked(std::uint64_t since) {
+  schema::RevocationsResponse res{
+      .sequence = 0, .complete = 1, .revocations = {}};
+  std::lock_guard lock{this->revocationsMutex};
+  res.sequence = this->sequence;
+  if (since >= this->sequence) {
+    return res;
+  }
+  auto oldest = this->revocations.empty()
+                    ? this->sequence + 1
+                    : this->revocations.front().sequence;
+  if (since + 1 < oldest || this->sequence - since > maxListedRevocations) {
+    res.complete = 0;
+    return res;
+  }
+  for (auto it = this->revocations.end() - (this->sequence - since);
+       it != this->revocations.end(); ++it) {
+    res.revocations.push_back(
+        {.pathname = it->pathname, .version = it->version});
+  }
+  return res;
+}
+
+void LeaseTable::opened(schema::File desc, const std::string& pathname) {
+  if (desc == 0) {
+    return;
+  }
+  auto path = normal(pathname);
+  std::unique_lock lock{this->descsMutex};
+  this->descs.insert_or_assign(desc, std::move(path));
+}
+
+void LeaseTable::closed(schema::File desc) {
+  std::unique_lock lock{this->descsMutex};
+  this->descs.erase(desc);
+}
+
+void LeaseTable::modified(const std::string& pathname) {
+  auto path = normal(pathname);
+  auto now = Clock::now();
+  auto& shard = this->shard(path);
+  std::uint64_t version;
+  {
+    std::lock_guard lock{shard.mutex};
+    // Files never leased need no bookkeeping
+    auto it = shard.files.find(path);
+    if (it == shard.files.end()) {
+      return;
+    }
+    auto& file = it->second;
+    file.version = ++this->versions;
+    file.modified = now;
+    if (file.expires < now) {
+      return;
+    }
+    version = file.version;
+  }
+  this->revoke(path, version);
+}
+
+void LeaseTable::written(schema::File desc) {
+  std::string path;
+  {
+    std::shared_lock lock{this->descsMutex};
+    auto it = this->descs.find(desc);
+    if (it == this->descs.end()) {
+      return;
+    }
+    path = it->second;
+  }
+  this->modified(path);
+}
+
+void LeaseTable::removed(const std::string& pathname) {
+  auto dir = normal(pathname);
+  auto now = Clock::now();
+  // Rare enough to look through every shard
+  std::vector<std::pair<std::string, std::uint64_t>> leased;
+  for (std::size_t i = 0; i < leaseShards; i++) {
+    auto& shard = this->shards[i];
+    std::lock_guard lock{shard.mutex};
+    for (auto& [path, file] : shard.files) {
+      if (!within(path, dir)) {
+        continue;
+      }
+      file.version = ++this->versions;
+      file.modified = now;
+      if (file.expires >= now) {
+        leased.emplace_back(path, file.version);
+      }
+    }
+  }
+  for (auto& [path, version] : leased) {
+    this->revoke(path, version);
+  }
+}
+
+void LeaseTable::renamed(const std::string& oldpath,
+                         const std::string& newpath) {
+  auto from = normal(oldpath), to = normal(newpath);
+  {
+    std::unique_lock lock{this->descsMutex};
+    for (auto& [desc, path] : this->descs) {
+      if (within(path, from)) {
+        path = to + path.substr(from.size());
+      }
+    }
+  }
+  // Leases granted between the rename and now were on the new contents
+  this->removed(to);
+}
+
+LeaseTable::Shard& LeaseTable::shard(const std::string& path) {
+  return this->shards[std::hash<std::string>{}(path) % leaseShards];
+}
+
+void LeaseTable::revoke(const std::string& path, std::uint64_t version) {
+  std::lock_guard lock{this->revocationsMutex};
+  this->revocations.push_back(
+      {.sequence = ++this->sequence, .pathname = path, .version = version});
+  while (this->revocations.size() > this->maxRevocations) {
+    this->revocations.pop_front();
+  }
+}
+
+} // namespace server
+} // namespace rpc
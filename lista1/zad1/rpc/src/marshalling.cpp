@@ -1,336 +1,410 @@
 #include <algorithm>
 #include <array>
 #include <cstdint>
-#include <iostream>
+#include <span>
 #include <stdexcept>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
 #include <variant>
 #include <vector>
 
+#include <codec.hpp>
 #include <marshalling.hpp>
+#include <pool.hpp>
 #include <schema.hpp>
+#include <view.hpp>
 
 namespace rpc {
 namespace marshalling {
 namespace {
-enum class Type : std::uint8_t {
-  OPEN,
-  READ,
-  WRITE,
-  LSEEK,
-  CHMOD,
-  UNLINK,
-  RENAME,
-  CLOSE,
-};
-
-// TODO: concept/check for POD?
+template <typename T> struct IsVariant : std::false_type {};
+template <typename... Ts>
+struct IsVariant<std::variant<Ts...>> : std::true_type {};
 
+template <typename T> struct IsSequence : std::false_type {};
 template <typename T>
-constexpr std::array<std::uint8_t, sizeof(T)> toBytes(T obj) {
-  std::array<std::uint8_t, sizeof(T)> result{};
-  std::uint8_t* ptr = result.data();
-  std::uint8_t* objPtr = reinterpret_cast<uint8_t*>(&obj);
+struct IsSequence<view::Sequence<T>> : std::true_type {};
+
+template <typename T, typename Variant> struct IndexOf;
+template <typename T, typename... Ts>
+struct IndexOf<T, std::variant<Ts...>> {
+  static constexpr std::size_t value = [] {
+    std::size_t result = 0;
+    for (bool same : {std::is_same_v<T, Ts>...}) {
+      if (same) {
+        break;
+      }
+      result++;
+    }
+    return result;
+  }();
+};
+template <typename T, typename Variant>
+constexpr std::size_t indexOf = IndexOf<T, Variant>::value;
+
+// Views are decoded by tag and converted by index into owning messages
+static_assert(std::variant_size_v<view::RequestBody> ==
+              std::variant_size_v<schema::RequestBody>);
+static_assert(std::variant_size_v<view::ResponseBody> ==
+              std::variant_size_v<schema::ResponseBody>);
+
+using Bytes = std::vector<std::uint8_t>;
+using BytesView = std::span<const std::uint8_t>;
+
+template <typename Message>
+constexpr std::size_t fieldCount =
+    std::tuple_size_v<decltype(Message::fields())>;
+
+template <typename Message, std::size_t I>
+using FieldType = std::remove_cvref_t<decltype(std::declval<Message&>().*
+                                               std::get<I>(Message::fields()))>;
+
+// Size of the byte array following an integer field
+template <typename T> std::uint64_t lengthOf(T value) {
+  if constexpr (std::is_signed_v<T>) {
+    return value > 0 ? value : 0;
+  } else {
+    return value;
+  }
+}
 
-  std::copy(objPtr, objPtr + sizeof(obj), ptr);
+// First count bytes of the payload
+BytesView prefix(BytesView bytes, std::uint64_t count) {
+  if (count > bytes.size()) {
+    throw std::invalid_argument("count exceeds payload");
+  }
+  return bytes.first(count);
+}
 
-  return result;
+// Out is either codec::Writer or codec::Sizer
+template <typename Out, typename T>
+void writeElement(Out& out, const T& element);
+template <typename Out, typename Variant>
+void writeVariant(Out& out, const Variant& variant);
+
+template <typename Out, typename T>
+void writeField(Out& out, const T& value, std::uint64_t& length) {
+  if constexpr (std::is_integral_v<T>) {
+    out.integer(value);
+    length = lengthOf(value);
+  } else if constexpr (std::is_same_v<T, std::string> ||
+                       std::is_same_v<T, std::string_view>) {
+    out.string(value);
+  } else if constexpr (std::is_same_v<T, Bytes> ||
+                       std::is_same_v<T, BytesView>) {
+    out.raw(prefix(value, length));
+  } else if constexpr (IsSequence<T>::value) {
+    // Elements are copied as they were encoded
+    if (value.count > 0 && value.version != out.version()) {
+      throw std::invalid_argument("sequence of another version");
+    }
+    out.integer(value.count);
+    out.raw(value.bytes);
+  } else {
+    out.integer(static_cast<std::uint64_t>(value.size()));
+    for (const auto& element : value) {
+      writeElement(out, element);
+    }
+  }
 }
 
-template <typename T>
-constexpr void fromBytes(std::array<std::uint8_t, sizeof(T)> arr, T& result) {
-  std::uint8_t* ptr = arr.data();
-  std::uint8_t* objPtr = reinterpret_cast<uint8_t*>(&result);
+template <typename Out, typename Message>
+void writeMessage(Out& out, const Message& message) {
+  std::uint64_t length = 0;
+  std::apply(
+      [&](auto... member) { (writeField(out, message.*member, length), ...); },
+      Message::fields());
+}
 
-  std::copy(ptr, ptr + sizeof(result), objPtr);
+// Element of a sequence: a tagged message, a message or an integer
+template <typename Out, typename T>
+void writeElement(Out& out, const T& element) {
+  if constexpr (IsVariant<T>::value) {
+    writeVariant(out, element);
+  } else if constexpr (std::is_integral_v<T>) {
+    out.integer(element);
+  } else {
+    writeMessage(out, element);
+  }
 }
 
-} // namespace
+template <typename Out, typename Variant>
+void writeVariant(Out& out, const Variant& variant) {
+  out.tag(static_cast<std::uint8_t>(variant.index()));
+  std::visit([&out](const auto& message) { writeMessage(out, message); },
+             variant);
+}
 
-template <typename T>
-void writeScalar(std::vector<std::uint8_t>::iterator& it, const T obj) {
-  auto arr = toBytes(obj);
-  it = std::copy(arr.begin(), arr.end(), it);
+template <typename Out> void writePrefix(Out& out) {
+  if (out.version() == Version::V1) {
+    return;
+  }
+  for (auto byte : magic) {
+    out.tag(byte);
+  }
+  out.tag(out.version());
 }
 
-void writeString(std::vector<std::uint8_t>::iterator& it,
-                 const std::string str) {
-  std::uint64_t len = str.size();
-  auto data = str.data();
+// Request is schema::Request or view::Request
+template <typename Out, typename Request>
+void writeRequest(Out& out, const Request& req) {
+  writePrefix(out);
+  out.fixed(req.header.auth);
+  out.fixed(req.header.id);
+  writeVariant(out, req.body);
+}
 
-  writeScalar(it, len);
-  it = std::copy(data, data + len, it);
+template <typename Out>
+void writeResponse(Out& out, const schema::Response& resp) {
+  writePrefix(out);
+  out.fixed(resp.id);
+  out.tag(resp.code);
+  writeVariant(out, resp.body);
 }
 
+template <typename T> T readElement(codec::Reader& in);
+
 template <typename T>
-void readScalar(std::vector<std::uint8_t>::iterator& it, T& obj) {
-  std::array<std::uint8_t, sizeof(obj)> arr;
-  std::copy(it, it + sizeof(obj), arr.data());
-  it = it + sizeof(obj);
-
-  fromBytes(arr, obj);
-}
-
-void readString(std::vector<std::uint8_t>::iterator& it, std::string& result) {
-  std::uint64_t len;
-  readScalar(it, len);
-
-  std::vector<char> vec(len, 0);
-  std::copy(it, it + len, vec.begin());
-  result = std::string(vec.begin(), vec.end());
-  it = it + len;
-}
-
-std::vector<std::uint8_t> marshalRequest(schema::Request req) {
-  using namespace schema;
-  std::vector<std::uint8_t> result(sizeof(req) + sizeof(Type), 0);
-
-  auto header = req.header;
-  auto resultIt = result.begin();
-
-  writeScalar(resultIt, header.auth);
-  writeScalar(resultIt, header.id);
-
-  if (auto body = std::get_if<OpenRequest>(&req.body)) {
-    writeScalar(resultIt, Type::OPEN);
-    writeString(resultIt, body->pathname);
-    writeScalar(resultIt, body->mode);
-  } else if (auto body = std::get_if<ReadRequest>(&req.body)) {
-    writeScalar(resultIt, Type::READ);
-    writeScalar(resultIt, body->desc);
-    writeScalar(resultIt, body->count);
-  } else if (auto body = std::get_if<WriteRequest>(&req.body)) {
-    writeScalar(resultIt, Type::WRITE);
-    writeScalar(resultIt, body->desc);
-    writeScalar(resultIt, body->count);
-    resultIt = std::copy(body->bytes.begin(), body->bytes.begin() + body->count,
-                         resultIt);
-  } else if (auto body = std::get_if<LSeekRequest>(&req.body)) {
-    writeScalar(resultIt, Type::LSEEK);
-    writeScalar(resultIt, body->desc);
-    writeScalar(resultIt, body->offset);
-    writeScalar(resultIt, body->whence);
-  } else if (auto body = std::get_if<ChmodRequest>(&req.body)) {
-    writeScalar(resultIt, Type::CHMOD);
-    writeString(resultIt, body->pathname);
-    writeScalar(resultIt, body->mode);
-  } else if (auto body = std::get_if<UnlinkRequest>(&req.body)) {
-    writeScalar(resultIt, Type::UNLINK);
-    writeString(resultIt, body->pathname);
-  } else if (auto body = std::get_if<RenameRequest>(&req.body)) {
-    writeScalar(resultIt, Type::RENAME);
-    writeString(resultIt, body->oldpath);
-    writeString(resultIt, body->newpath);
-  } else if (auto body = std::get_if<CloseRequest>(&req.body)) {
-    writeScalar(resultIt, Type::CLOSE);
-    writeScalar(resultIt, body->desc);
+void readField(codec::Reader& in, T& value, std::uint64_t& length) {
+  if constexpr (std::is_integral_v<T>) {
+    value = in.integer<T>();
+    length = lengthOf(value);
+  } else if constexpr (std::is_same_v<T, std::string_view>) {
+    value = in.string();
+  } else if constexpr (std::is_same_v<T, BytesView>) {
+    value = in.raw(length);
   } else {
-    throw std::invalid_argument("Unknown type");
+    static_assert(IsSequence<T>::value);
+    value.count = in.integer<std::uint64_t>();
+    value.version = in.version();
+    // Walk over the messages to validate them and find where they end
+    auto begin = in.consumed();
+    for (std::uint64_t i = 0; i < value.count; i++) {
+      readElement<typename T::Message>(in);
+    }
+    value.bytes = in.input().subspan(begin, in.consumed() - begin);
   }
+}
 
-  return result;
+template <typename Message> Message readMessage(codec::Reader& in) {
+  Message message{};
+  std::uint64_t length = 0;
+  std::apply(
+      [&](auto... member) { (readField(in, message.*member, length), ...); },
+      Message::fields());
+  return message;
 }
 
-std::vector<std::uint8_t> marshalResponse(schema::Response resp) {
-  using namespace schema;
-  std::vector<std::uint8_t> result(sizeof(resp) + sizeof(Type), 0);
-
-  auto resultIt = result.begin();
-
-  writeScalar(resultIt, resp.id);
-  writeScalar(resultIt, resp.code);
-
-  if (auto body = std::get_if<OpenResponse>(&resp.body)) {
-    writeScalar(resultIt, Type::OPEN);
-    writeScalar(resultIt, body->file);
-  } else if (auto body = std::get_if<ReadResponse>(&resp.body)) {
-    writeScalar(resultIt, Type::READ);
-    writeScalar(resultIt, body->read);
-    resultIt = std::copy(body->bytes.begin(), body->bytes.begin() + body->read,
-                         resultIt);
-  } else if (auto body = std::get_if<WriteResponse>(&resp.body)) {
-    writeScalar(resultIt, Type::WRITE);
-    writeScalar(resultIt, body->written);
-  } else if (auto body = std::get_if<LSeekResponse>(&resp.body)) {
-    writeScalar(resultIt, Type::LSEEK);
-    writeScalar(resultIt, body->offset);
-  } else if (auto body = std::get_if<ChmodResponse>(&resp.body)) {
-    writeScalar(resultIt, Type::CHMOD);
-    writeScalar(resultIt, body->result);
-  } else if (auto body = std::get_if<UnlinkResponse>(&resp.body)) {
-    writeScalar(resultIt, Type::UNLINK);
-    writeScalar(resultIt, body->result);
-  } else if (auto body = std::get_if<RenameResponse>(&resp.body)) {
-    writeScalar(resultIt, Type::RENAME);
-    writeScalar(resultIt, body->result);
-  } else if (auto body = std::get_if<CloseResponse>(&resp.body)) {
-    writeScalar(resultIt, Type::CLOSE);
-    writeScalar(resultIt, body->result);
-  } else {
-    throw std::invalid_argument("invalid body");
-  }
+// One decoder per alternative, indexed by tag
+template <typename Variant, std::size_t... I>
+constexpr auto readers(std::index_sequence<I...>) {
+  return std::array<Variant (*)(codec::Reader&), sizeof...(I)>{
+      [](codec::Reader& in) -> Variant {
+        return readMessage<std::variant_alternative_t<I, Variant>>(in);
+      }...};
+}
 
-  return result;
+template <typename Variant> Variant readVariant(codec::Reader& in) {
+  constexpr auto size = std::variant_size_v<Variant>;
+  static constexpr auto table =
+      readers<Variant>(std::make_index_sequence<size>{});
+  auto tag = in.tag<std::uint8_t>();
+  if (tag >= size) {
+    throw std::invalid_argument("Invalid message type");
+  }
+  return table[tag](in);
 }
 
-schema::Request unmarshalRequest(std::vector<std::uint8_t> bytes) {
-  using namespace schema;
-  Request result;
+template <typename T> T readElement(codec::Reader& in) {
+  if constexpr (IsVariant<T>::value) {
+    return readVariant<T>(in);
+  } else if constexpr (std::is_integral_v<T>) {
+    return in.integer<T>();
+  } else {
+    return readMessage<T>(in);
+  }
+}
 
-  auto it = bytes.begin();
+// Converts a decoded view into the owning type
+template <typename Result, typename View> Result own(const View& view) {
+  if constexpr (std::is_same_v<Result, View>) {
+    return view;
+  } else if constexpr (std::is_same_v<Result, std::string>) {
+    return std::string{view};
+  } else if constexpr (std::is_same_v<Result, Bytes>) {
+    auto result = pool::buffers().acquire();
+    result.assign(view.begin(), view.end());
+    return result;
+  } else if constexpr (IsVariant<Result>::value) {
+    return std::visit(
+        [](const auto& message) -> Result {
+          using Message = std::remove_cvref_t<decltype(message)>;
+          constexpr auto index = indexOf<Message, View>;
+          return own<std::variant_alternative_t<index, Result>>(message);
+        },
+        view);
+  } else if constexpr (IsSequence<View>::value) {
+    Result result;
+    auto rest = view.bytes;
+    for (std::uint64_t i = 0; i < view.count; i++) {
+      codec::Reader in{rest, view.version};
+      result.push_back(own<typename Result::value_type>(
+          readElement<typename View::Message>(in)));
+      rest = rest.subspan(in.consumed());
+    }
+    return result;
+  } else {
+    Result result{};
+    [&]<std::size_t... I>(std::index_sequence<I...>) {
+      ((result.*std::get<I>(Result::fields()) =
+            own<FieldType<Result, I>>(view.*std::get<I>(View::fields()))),
+       ...);
+    }(std::make_index_sequence<fieldCount<Result>>{});
+    return result;
+  }
+}
 
-  readScalar(it, result.header.auth);
-  readScalar(it, result.header.id);
+// Reader positioned past the version prefix
+codec::Reader reader(std::span<const std::uint8_t> bytes) {
+  auto version = detectVersion(bytes);
+  if (version != Version::V1) {
+    bytes = bytes.subspan(magic.size() + 1);
+  }
+  return codec::Reader{bytes, version};
+}
 
-  Type type;
-  readScalar(it, type);
-  schema::RequestBody body;
+} // namespace
 
-  switch (type) {
-  case Type::OPEN: {
-    schema::OpenRequest req{};
-    readString(it, req.pathname);
-    readScalar(it, req.mode);
-    body = req;
-    break;
-  }
-  case Type::READ: {
-    schema::ReadRequest req{};
-    readScalar(it, req.desc);
-    readScalar(it, req.count);
-    body = req;
-    break;
-  }
-  case Type::WRITE: {
-    schema::WriteRequest req{};
-    readScalar(it, req.desc);
-    readScalar(it, req.count);
-    req.bytes = std::vector<std::uint8_t>(req.count, 0);
-    std::copy(it, it + req.count, req.bytes.begin());
-    it += req.count;
-    body = req;
-    break;
+Version detectVersion(std::span<const std::uint8_t> bytes) {
+  if (bytes.size() < magic.size() ||
+      !std::equal(magic.begin(), magic.end(), bytes.begin())) {
+    return Version::V1;
   }
-  case Type::LSEEK: {
-    schema::LSeekRequest req{};
-    readScalar(it, req.desc);
-    readScalar(it, req.offset);
-    readScalar(it, req.whence);
-    body = req;
-    break;
-  }
-  case Type::CHMOD: {
-    schema::ChmodRequest req{};
-    readString(it, req.pathname);
-    readScalar(it, req.mode);
-    body = req;
-    break;
-  }
-  case Type::UNLINK: {
-    schema::UnlinkRequest req{};
-    readString(it, req.pathname);
-    body = req;
-    break;
-  }
-  case Type::RENAME: {
-    schema::RenameRequest req{};
-    readString(it, req.oldpath);
-    readString(it, req.newpath);
-    body = req;
-    break;
-  }
-  case Type::CLOSE: {
-    schema::CloseRequest req{};
-    readScalar(it, req.desc);
-    body = req;
-    break;
-  }
-  default:
-    throw std::invalid_argument("Invalid message type");
+  if (bytes.size() == magic.size() ||
+      static_cast<Version>(bytes[magic.size()]) != Version::V2) {
+    throw std::invalid_argument("unsupported version");
   }
+  return Version::V2;
+}
+
+std::size_t requestSize(const schema::Request& req, Version version) {
+  codec::Sizer sizer{version};
+  writeRequest(sizer, req);
+  return sizer.written();
+}
 
-  result.body = body;
+std::size_t requestSize(const view::Request& req, Version version) {
+  codec::Sizer sizer{version};
+  writeRequest(sizer, req);
+  return sizer.written();
+}
+
+std::size_t responseSize(const schema::Response& resp, Version version) {
+  codec::Sizer sizer{version};
+  writeResponse(sizer, resp);
+  return sizer.written();
+}
 
+std::size_t encodeRequest(const schema::Request& req,
+                          std::span<std::uint8_t> out, Version version) {
+  codec::Writer writer{out, version};
+  writeRequest(writer, req);
+  return writer.written();
+}
+
+std::size_t encodeRequest(const view::Request& req,
+                          std::span<std::uint8_t> out, Version version) {
+  codec::Writer writer{out, version};
+  writeRequest(writer, req);
+  return writer.written();
+}
+
+std::size_t encodeResponse(const schema::Response& resp,
+                           std::span<std::uint8_t> out, Version version) {
+  codec::Writer writer{out, version};
+  writeResponse(writer, resp);
+  return writer.written();
+}
+
+view::Request decodeRequest(std::span<const std::uint8_t> bytes) {
+  auto in = reader(bytes);
+  view::Request result{.header = {.auth = in.fixed<std::uint64_t>(),
+                                  .id = in.fixed<std::uint64_t>()},
+                        .body = {}};
+  result.body = readVariant<view::RequestBody>(in);
   return result;
 }
 
-schema::Response unmarshalResponse(std::vector<std::uint8_t> bytes) {
-  using namespace schema;
-  Response result;
+view::Response decodeResponse(std::span<const std::uint8_t> bytes) {
+  auto in = reader(bytes);
+  view::Response result{.id = in.fixed<std::uint64_t>(),
+                        .code = in.tag<schema::Code>(),
+                        .body = {}};
+  result.body = readVariant<view::ResponseBody>(in);
+  return result;
+}
+
+view::SubRequest decodeSubRequest(std::span<const std::uint8_t>& bytes,
+                                  Version version) {
+  codec::Reader in{bytes, version};
+  auto result = readVariant<view::SubRequest>(in);
+  bytes = bytes.subspan(in.consumed());
+  return result;
+}
 
-  auto it = bytes.begin();
+view::SubResponse decodeSubResponse(std::span<const std::uint8_t>& bytes,
+                                    Version version) {
+  codec::Reader in{bytes, version};
+  auto result = readVariant<view::SubResponse>(in);
+  bytes = bytes.subspan(in.consumed());
+  return result;
+}
 
-  readScalar(it, result.id);
-  readScalar(it, result.code);
+schema::Request toOwned(const view::Request& req) {
+  return {.header = req.header,
+          .body = own<schema::RequestBody>(req.body)};
+}
 
-  Type type;
-  readScalar(it, type);
-  schema::ResponseBody body;
+schema::Response toOwned(const view::Response& resp) {
+  return {.id = resp.id,
+          .code = resp.code,
+          .body = own<schema::ResponseBody>(resp.body)};
+}
 
-  switch (type) {
-  case Type::OPEN: {
-    schema::OpenResponse res{};
-    readScalar(it, res.file);
-    body = res;
-    break;
-  }
-  case Type::READ: {
-    schema::ReadResponse res{};
-    readScalar(it, res.read);
-    if (res.read > 0) {
-      res.bytes = std::vector<std::uint8_t>(res.read, 0);
-      std::copy(it, it + res.read, res.bytes.begin());
-      it += res.read;
-    } else {
-      res.bytes = {};
-    }
-    body = res;
-    break;
-  }
-  case Type::WRITE: {
-    schema::WriteResponse res{};
-    readScalar(it, res.written);
-    body = res;
-    break;
-  }
-  case Type::LSEEK: {
-    schema::LSeekResponse res{};
-    readScalar(it, res.offset);
-    body = res;
-    break;
-  }
-  case Type::CHMOD: {
-    schema::ChmodResponse res{};
-    readScalar(it, res.result);
-    body = res;
-    break;
-  }
-  case Type::UNLINK: {
-    schema::UnlinkResponse res{};
-    readScalar(it, res.result);
-    body = res;
-    break;
-  }
-  case Type::RENAME: {
-    schema::RenameResponse res{};
-    readScalar(it, res.result);
-    body = res;
-    break;
-  }
-  case Type::CLOSE: {
-    schema::CloseResponse res{};
-    readScalar(it, res.result);
-    body = res;
-    break;
-  }
-  default:
-    throw std::invalid_argument("Invalid message type");
-  }
+std::vector<std::uint8_t> marshalRequest(const schema::Request& req,
+                                         Version version) {
+  auto result = pool::buffers().acquire();
+  result.resize(requestSize(req, version));
+  encodeRequest(req, result, version);
+  return result;
+}
 
-  result.body = body;
+std::vector<std::uint8_t> marshalRequest(const view::Request& req,
+                                         Version version) {
+  auto result = pool::buffers().acquire();
+  result.resize(requestSize(req, version));
+  encodeRequest(req, result, version);
+  return result;
+}
 
+std::vector<std::uint8_t> marshalResponse(const schema::Response& resp,
+                                          Version version) {
+  auto result = pool::buffers().acquire();
+  result.resize(responseSize(resp, version));
+  encodeResponse(resp, result, version);
   return result;
 }
 
+schema::Request unmarshalRequest(std::span<const std::uint8_t> bytes) {
+  return toOwned(decodeRequest(bytes));
+}
+
+schema::Response unmarshalResponse(std::span<const std::uint8_t> bytes) {
+  return toOwned(decodeResponse(bytes));
+}
+
 } // namespace marshalling
 
-} // namespace rpc
\ No newline at end of file
+} // namespace rpc
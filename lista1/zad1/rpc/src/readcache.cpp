@@ -0,0 +1,271 @@
+#include <readcache.hpp>
+
+#include <algorithm>
+#include <filesystem>
+#include <stdexcept>
+#include <utility>
+#include <variant>
+
+namespace rpc {
+namespace client {
+namespace {
+// Paths are keyed the way the server keys its leases
+std::string normal(const std::string& pathname) {
+  return std::filesystem::path{pathname}.lexically_normal().string();
+}
+} // namespace
+
+ReadCache::ReadCache(Client& client, ReadCacheOptions options)
+    : client{client}, options{options} {
+  if (options.blockSize == 0) {
+    throw std::invalid_argument("block must not be empty");
+  }
+}
+
+schema::File ReadCache::open(std::string pathname, schema::mode_t mode) {
+  auto path = normal(pathname);
+  auto sent = Clock::now();
+  auto responses =
+      this->client.batch({schema::LeaseRequest{.pathname = path},
+                          schema::OpenRequest{.pathname = std::move(pathname),
+                                              .mode = mode}});
+  auto lease = std::get_if<schema::LeaseResponse>(&responses.at(0));
+  auto open = std::get_if<schema::OpenResponse>(&responses.at(1));
+  if (!lease || !open) {
+    throw std::invalid_argument("bad response type");
+  }
+
+  std::lock_guard lock{this->mutex};
+  this->update(path, *lease, sent);
+  if (open->file != 0) {
+    this->files.insert_or_assign(open->file, std::move(path));
+  }
+  return open->file;
+}
+
+std::int64_t ReadCache::pread(schema::File desc, schema::off_t offset,
+                              std::uint64_t count,
+                              std::vector<std::uint8_t>& v) {
+  std::string path;
+  {
+    std::lock_guard lock{this->mutex};
+    auto it = this->files.find(desc);
+    if (it != this->files.end()) {
+      path = it->second;
+    }
+  }
+  if (path.empty() || offset < 0 || count == 0 || !this->leased(path)) {
+    return this->client.pread(desc, offset, count, v);
+  }
+
+  const std::uint64_t size = this->options.blockSize;
+  std::uint64_t first = offset / size;
+  std::uint64_t last = (offset + count - 1) / size;
+  std::uint64_t generation;
+  {
+    std::lock_guard lock{this->mutex};
+    auto& lease = this->leases[path];
+    if (this->cached(lease, offset, count, v)) {
+      this->hits++;
+      return v.size();
+    }
+    this->misses++;
+    generation = lease.generation;
+  }
+
+  // Whole blocks are fetched, so the next reads of them hit
+  std::vector<std::uint8_t> bytes;
+  auto n = this->client.pread(desc, first * size, (last - first + 1) * size,
+                              bytes);
+  if (n < 0) {
+    return n;
+  }
+  bytes.resize(std::min<std::uint64_t>(n, bytes.size()));
+  std::uint64_t begin = offset - first * size;
+  std::uint64_t end = std::min<std::uint64_t>(begin + count, bytes.size());
+  v.assign(bytes.begin() + std::min(begin, end), bytes.begin() + end);
+
+  std::lock_guard lock{this->mutex};
+  auto& lease = this->leases[path];
+  if (lease.generation != generation) {
+    return v.size();
+  }
+  // Block shorter than the others ends the file, it is cached too
+  for (auto index = first; index <= last; index++) {
+    std::uint64_t from = (index - first) * size;
+    auto to = std::min<std::uint64_t>(from + size, bytes.size());
+    if (from > to) {
+      break;
+    }
+    this->insert(path, lease, index,
+                 std::vector<std::uint8_t>(bytes.begin() + from,
+                                           bytes.begin() + to));
+    if (to - from < size) {
+      break;
+    }
+  }
+  return v.size();
+}
+
+std::int64_t ReadCache::pwrite(schema::File desc, schema::off_t offset,
+                               std::uint64_t count,
+                               std::vector<std::uint8_t>& v) {
+  auto written = this->client.pwrite(desc, offset, count, v);
+  std::lock_guard lock{this->mutex};
+  auto it = this->files.find(desc);
+  if (it != this->files.end()) {
+    this->drop(this->leases[it->second]);
+  }
+  return written;
+}
+
+std::int64_t ReadCache::close(schema::File desc) {
+  {
+    std::lock_guard lock{this->mutex};
+    this->files.erase(desc);
+  }
+  return this->client.close(desc);
+}
+
+ReadCacheStats ReadCache::stats() const {
+  std::lock_guard lock{this->mutex};
+  return {.hits = this->hits, .misses = this->misses};
+}
+
+bool ReadCache::leased(const std::string& path) {
+  auto now = Clock::now();
+  bool due;
+  {
+    std::lock_guard lock{this->mutex};
+    due = this->since && now >= this->nextPoll;
+  }
+  if (due) {
+    this->poll();
+  }
+
+  {
+    std::lock_guard lock{this->mutex};
+    auto& lease = this->leases[path];
+    if (now < lease.expires) {
+      return lease.granted;
+    }
+  }
+  auto sent = Clock::now();
+  auto res = this->client.lease(path);
+  std::lock_guard lock{this->mutex};
+  this->update(path, res, sent);
+  return this->leases[path].granted;
+}
+
+void ReadCache::poll() {
+  std::uint64_t from;
+  {
+    std::lock_guard lock{this->mutex};
+    from = *this->since;
+    // Other threads keep serving meanwhile
+    this->nextPoll = Clock::now() + this->options.staleness;
+  }
+  auto res = this->client.revocations(from);
+
+  std::lock_guard lock{this->mutex};
+  auto revoke = [this](Lease& lease) {
+    this->drop(lease);
+    lease.expires = {};
+  };
+  if (!res.complete) {
+    for (auto& [path, lease] : this->leases) {
+      revoke(lease);
+    }
+  } else {
+    for (const auto& revocation : res.revocations) {
+      auto it = this->leases.find(revocation.pathname);
+      if (it != this->leases.end()) {
+        revoke(it->second);
+      }
+    }
+  }
+  this->since = std::max(*this->since, res.sequence);
+}
+
+void ReadCache::update(const std::string& path,
+                       const schema::LeaseResponse& res,
+                       Clock::time_point sent) {
+  auto& lease = this->leases[path];
+  if (res.version != lease.version || res.term == 0) {
+    this->drop(lease);
+  }
+  lease.version = res.version;
+  lease.granted = res.term > 0;
+  // Refused leases are asked for again once polling would notice a change
+  lease.expires = sent + (lease.granted
+                              ? std::chrono::milliseconds{res.term}
+                              : this->options.staleness);
+  if (!this->since) {
+    this->since = res.sequence;
+    this->nextPoll = sent + this->options.staleness;
+  }
+}
+
+void ReadCache::drop(Lease& lease) {
+  lease.generation++;
+  for (auto& [index, it] : lease.blocks) {
+    this->bytes -= it->bytes.size();
+    this->blocks.erase(it);
+  }
+  lease.blocks.clear();
+}
+
+bool ReadCache::cached(Lease& lease, schema::off_t offset, std::uint64_t count,
+                       std::vector<std::uint8_t>& v) {
+  const std::uint64_t size = this->options.blockSize;
+  std::vector<Blocks::iterator> found;
+  for (auto index = offset / size; index <= (offset + count - 1) / size;
+       index++) {
+    auto it = lease.blocks.find(index);
+    if (it == lease.blocks.end()) {
+      return false;
+    }
+    found.push_back(it->second);
+    if (it->second->bytes.size() < size) {
+      break;
+    }
+  }
+
+  v.clear();
+  std::uint64_t position = offset;
+  for (auto it : found) {
+    this->blocks.splice(this->blocks.begin(), this->blocks, it);
+    std::uint64_t begin = position - it->index * size;
+    auto end = std::min<std::uint64_t>(it->bytes.size(),
+                                       begin + offset + count - position);
+    if (begin >= end) {
+      break;
+    }
+    v.insert(v.end(), it->bytes.begin() + begin, it->bytes.begin() + end);
+    position += end - begin;
+  }
+  return true;
+}
+
+void ReadCache::insert(const std::string& path, Lease& lease,
+                       std::uint64_t index, std::vector<std::uint8_t> bytes) {
+  if (auto it = lease.blocks.find(index); it != lease.blocks.end()) {
+    this->bytes -= it->second->bytes.size();
+    this->blocks.erase(it->second);
+    lease.blocks.erase(it);
+  }
+  this->bytes += bytes.size();
+  this->blocks.push_front(
+      Block{.path = path, .index = index, .bytes = std::move(bytes)});
+  lease.blocks.emplace(index, this->blocks.begin());
+
+  while (this->bytes > this->options.capacity && !this->blocks.empty()) {
+    auto& oldest = this->blocks.back();
+    this->bytes -= oldest.bytes.size();
+    this->leases[oldest.path].blocks.erase(oldest.index);
+    this->blocks.pop_back();
+  }
+}
+
+} // namespace client
+} // namespace rpc
@@ -1,66 +1,620 @@
-#include "schema.hpp"
 #include <marshalling.hpp>
+#include <pool.hpp>
+#include <schema.hpp>
 #include <server.hpp>
 
-#include <iostream>
+#include <algorithm>
+#include <future>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include <vector>
 
 namespace rpc {
 namespace server {
-rpc::protocol::handler Server::makeHandler() {
-  return [this](std::vector<std::uint8_t> bytes) -> std::vector<std::uint8_t> {
-    using namespace rpc::schema;
-    auto request = rpc::marshalling::unmarshalRequest(bytes);
-    Response response;
-    response.id = request.header.id;
-    response.code = schema::Code::OK;
-    if (this->perms.contains(request.header.auth)) {
-      auto perms = this->perms.at(request.header.auth);
-      auto index = request.body.index();
-      if (perms.size() <= index) {
-        // return unauthorized
+void HandleQuotas::limit(std::uint64_t auth, std::size_t handles) {
+  std::lock_guard lock{this->mutex};
+  this->limits.insert_or_assign(auth, handles);
+}
+
+void HandleQuotas::limitDefault(std::size_t handles) {
+  std::lock_guard lock{this->mutex};
+  this->fallback = handles;
+}
+
+bool HandleQuotas::reserve(std::uint64_t auth) {
+  std::lock_guard lock{this->mutex};
+  auto it = this->limits.find(auth);
+  auto quota = it == this->limits.end() ? this->fallback : it->second;
+  auto& count = this->counts[auth];
+  if (quota > 0 && count >= quota) {
+    return false;
+  }
+  count++;
+  return true;
+}
+
+void HandleQuotas::opened(std::uint64_t auth, schema::File desc) {
+  std::lock_guard lock{this->mutex};
+  if (desc == 0) {
+    if (--this->counts[auth] == 0) {
+      this->counts.erase(auth);
+    }
+    return;
+  }
+  auto [it, inserted] = this->owners.try_emplace(desc, auth);
+  if (!inserted) {
+    // Backend reused a descriptor it was never asked to close
+    auto previous = std::exchange(it->second, auth);
+    if (--this->counts[previous] == 0) {
+      this->counts.erase(previous);
+    }
+  }
+}
+
+void HandleQuotas::closed(schema::File desc) {
+  std::lock_guard lock{this->mutex};
+  auto it = this->owners.find(desc);
+  if (it == this->owners.end()) {
+    return;
+  }
+  if (--this->counts[it->second] == 0) {
+    this->counts.erase(it->second);
+  }
+  this->owners.erase(it);
+}
+
+std::size_t HandleQuotas::held(std::uint64_t auth) {
+  std::lock_guard lock{this->mutex};
+  auto it = this->counts.find(auth);
+  return it == this->counts.end() ? 0 : it->second;
+}
+
+ReplyCache::Lookup ReplyCache::begin(const schema::Header& header,
+                                     std::vector<std::uint8_t>& reply) {
+  Key key{header.auth, header.id};
+  std::lock_guard lock{this->mutex};
+  auto it = this->entries.find(key);
+  if (it == this->entries.end()) {
+    auto sequence = this->sequence++;
+    Entry entry{.done = false, .reply = {}, .sequence = sequence};
+    if (this->spare.empty()) {
+      this->entries.emplace(key, std::move(entry));
+    } else {
+      auto node = std::move(this->spare.back());
+      this->spare.pop_back();
+      node.key() = key;
+      node.mapped() = std::move(entry);
+      this->entries.insert(std::move(node));
+    }
+    this->order.push_back({.key = key, .sequence = sequence});
+    this->evict();
+    return Lookup::MISS;
+  }
+  if (!it->second.done) {
+    return Lookup::PENDING;
+  }
+  reply = pool::buffers().acquire();
+  reply.assign(it->second.reply.begin(), it->second.reply.end());
+  return Lookup::HIT;
+}
+
+void ReplyCache::finish(const schema::Header& header,
+                        const std::vector<std::uint8_t>& reply) {
+  std::lock_guard lock{this->mutex};
+  auto it = this->entries.find({header.auth, header.id});
+  // Evicted while in progress
+  if (it == this->entries.end()) {
+    return;
+  }
+  it->second.done = true;
+  it->second.reply = pool::buffers().acquire();
+  it->second.reply.assign(reply.begin(), reply.end());
+  this->bytes += reply.size();
+  this->evict();
+}
+
+void ReplyCache::forget(const schema::Header& header) {
+  std::lock_guard lock{this->mutex};
+  auto it = this->entries.find({header.auth, header.id});
+  if (it != this->entries.end()) {
+    this->drop(it);
+  }
+}
+
+void ReplyCache::evict() {
+  while (this->head < this->order.size() &&
+         (this->entries.size() > this->maxReplies ||
+          this->bytes > this->maxBytes)) {
+    auto recorded = this->order[this->head++];
+    if (this->live(recorded)) {
+      this->drop(this->entries.find(recorded.key));
+    }
+  }
+  // Keys of forgotten and evicted entries are dropped lazily, in place
+  if (this->order.size() > 2 * this->maxReplies) {
+    std::erase_if(this->order, [this](const Recorded& recorded) {
+      return !this->live(recorded);
+    });
+    this->head = 0;
+  }
+}
+
+void ReplyCache::drop(Entries::iterator it) {
+  this->bytes -= it->second.reply.size();
+  pool::buffers().release(std::move(it->second.reply));
+  if (this->spare.size() < this->maxReplies) {
+    this->spare.push_back(this->entries.extract(it));
+  } else {
+    this->entries.erase(it);
+  }
+}
+
+bool ReplyCache::live(const Recorded& recorded) {
+  auto it = this->entries.find(recorded.key);
+  return it != this->entries.end() &&
+         it->second.sequence == recorded.sequence;
+}
+
+namespace detail {
+static_assert(std::variant_size_v<schema::RequestBody> <=
+              sizeof(PermissionMask) * 8);
+
+std::unordered_map<std::uint64_t, PermissionMask>
+permissionMasks(const std::unordered_map<std::uint64_t, Permissions>& users) {
+  std::unordered_map<std::uint64_t, PermissionMask> result;
+  for (const auto& [auth, perms] : users) {
+    PermissionMask mask = 0;
+    for (std::size_t i = 0; i < perms.size(); i++) {
+      if (perms[i]) {
+        mask |= PermissionMask{1} << i;
       }
-      if (!perms[index]) {
-        // return unauthorized
+    }
+    result.emplace(auth, mask);
+  }
+  return result;
+}
+
+namespace {
+template <typename T, typename... Ts>
+constexpr std::size_t indexIn(const std::variant<Ts...>*) {
+  std::size_t i = 0;
+  ((std::is_same_v<T, Ts> ? false : (++i, true)) && ...);
+  return i;
+}
+
+// Positional operations need the same permission as their plain variants,
+// hints and leases the one of reading
+template <typename T> constexpr std::size_t permission() {
+  using namespace rpc::schema;
+  if constexpr (std::is_same_v<T, PReadRequest> ||
+                std::is_same_v<T, ReadVRequest> ||
+                std::is_same_v<T, AdviseRequest> ||
+                std::is_same_v<T, LeaseRequest> ||
+                std::is_same_v<T, RevocationsRequest>) {
+    return permission<ReadRequest>();
+  } else if constexpr (std::is_same_v<T, PWriteRequest> ||
+                       std::is_same_v<T, WriteVRequest>) {
+    return permission<WriteRequest>();
+  } else {
+    return indexIn<T>(static_cast<const RequestBody*>(nullptr));
+  }
+}
+
+template <typename Variant> PermissionMask maskOf(const Variant& req) {
+  return std::visit(
+      [](const auto& req) {
+        return PermissionMask{1}
+               << permission<std::decay_t<decltype(req)>>();
+      },
+      req);
+}
+
+static_assert(permission<schema::CloseRequest>() <
+              std::tuple_size_v<Permissions>);
+} // namespace
+
+PermissionMask requiredMask(const schema::RequestBody& body) {
+  // Batch needs permissions of the requests it carries
+  if (auto batch = std::get_if<schema::BatchRequest>(&body)) {
+    PermissionMask result = 0;
+    for (const auto& sub : batch->requests) {
+      result |= maskOf(sub);
+    }
+    return result;
+  }
+  return maskOf(body);
+}
+
+std::optional<schema::File> descriptor(const schema::RequestBody& body) {
+  using namespace rpc::schema;
+  if (auto it = std::get_if<ReadRequest>(&body)) {
+    return it->desc;
+  } else if (auto it = std::get_if<WriteRequest>(&body)) {
+    return it->desc;
+  } else if (auto it = std::get_if<LSeekRequest>(&body)) {
+    return it->desc;
+  } else if (auto it = std::get_if<CloseRequest>(&body)) {
+    return it->desc;
+  } else if (auto it = std::get_if<BatchRequest>(&body)) {
+    // Ordered with the first descriptor it uses, references to files opened
+    // by the batch itself are not known yet
+    for (const auto& sub : it->requests) {
+      std::optional<schema::File> desc = std::visit(
+          [](const auto& req) -> std::optional<schema::File> {
+            if constexpr (requires { req.desc; }) {
+              return req.desc;
+            }
+            return std::nullopt;
+          },
+          sub);
+      if (desc && (*desc & schema::batchRefFlag) == 0) {
+        return desc;
       }
     }
-    if (auto it = std::get_if<OpenRequest>(&request.body)) {
-      OpenResponse res;
-      res.file = this->OpenHandler(it->pathname, it->mode);
-      response.body = res;
-    } else if (auto it = std::get_if<ReadRequest>(&request.body)) {
-      ReadResponse res;
-      res.read = this->ReadHandler(it->desc, it->count, res.bytes);
-      response.body = res;
-    } else if (auto it = std::get_if<WriteRequest>(&request.body)) {
-      WriteResponse res;
-      res.written = this->WriteHandler(it->desc, it->count, it->bytes);
-      response.body = res;
-    } else if (auto it = std::get_if<LSeekRequest>(&request.body)) {
-      LSeekResponse res;
-      res.offset = this->LSeekHandler(it->desc, it->offset, it->whence);
-      response.body = res;
-    } else if (auto it = std::get_if<ChmodRequest>(&request.body)) {
-      ChmodResponse res;
-      res.result = this->ChmodHandler(it->pathname, it->mode);
-      response.body = res;
-    } else if (auto it = std::get_if<UnlinkRequest>(&request.body)) {
-      UnlinkResponse res;
-      res.result = this->UnlinkHandler(it->pathname);
-      response.body = res;
-    } else if (auto it = std::get_if<RenameRequest>(&request.body)) {
-      RenameResponse res;
-      res.result = this->RenameHandler(it->oldpath, it->newpath);
-      response.body = res;
-    } else if (auto it = std::get_if<CloseRequest>(&request.body)) {
-      CloseResponse res;
-      res.result = this->CloseHandler(it->desc);
-      response.body = res;
-    } else {
-      throw std::invalid_argument("Invalid request type");
+  }
+  return std::nullopt;
+}
+
+bool bounded(const schema::Extent& extent) {
+  return extent.offset >= 0 &&
+         extent.count <=
+             static_cast<std::uint64_t>(
+                 std::numeric_limits<schema::off_t>::max() - extent.offset);
+}
+
+std::optional<std::uint64_t>
+extentsTotal(const std::vector<schema::Extent>& extents, std::uint64_t limit) {
+  if (extents.size() > maxExtents) {
+    return std::nullopt;
+  }
+  std::uint64_t total = 0;
+  for (const auto& extent : extents) {
+    // Compared with what is left, so the sum never wraps around
+    if (extent.count > limit - total) {
+      return std::nullopt;
     }
+    total += extent.count;
+  }
+  return total;
+}
 
-    return rpc::marshalling::marshalResponse(response);
+std::vector<Run> mergeExtents(const std::vector<schema::Extent>& extents,
+                              std::vector<std::size_t>& runOf) {
+  std::vector<std::size_t> order;
+  order.reserve(extents.size());
+  for (std::size_t i = 0; i < extents.size(); i++) {
+    if (bounded(extents[i])) {
+      order.push_back(i);
+    }
+  }
+  std::sort(order.begin(), order.end(), [&extents](auto a, auto b) {
+    return extents[a].offset < extents[b].offset;
+  });
+
+  std::vector<Run> runs;
+  std::vector<std::size_t> result(extents.size());
+  schema::off_t runEnd = 0;
+  for (auto i : order) {
+    const auto& extent = extents[i];
+    auto end = extent.offset + static_cast<schema::off_t>(extent.count);
+    if (runs.empty() ||
+        extent.offset - runEnd > static_cast<schema::off_t>(extentMergeGap) ||
+        static_cast<std::uint64_t>(std::max(runEnd, end) -
+                                   runs.back().offset) > maxRunBytes) {
+      runs.push_back(Run{.offset = extent.offset, .count = 0});
+      runEnd = end;
+    }
+    runEnd = std::max(runEnd, end);
+    runs.back().count = runEnd - runs.back().offset;
+    result[i] = runs.size() - 1;
+  }
+  // Extents left out refer past the last run
+  for (std::size_t i = 0; i < extents.size(); i++) {
+    if (!bounded(extents[i])) {
+      result[i] = runs.size();
+    }
+  }
+  runOf = std::move(result);
+  return runs;
+}
+
+void resolve(schema::SubRequest& sub,
+             const std::vector<schema::SubResponse>& results) {
+  using namespace rpc::schema;
+  std::visit(
+      [&results](auto& req) {
+        if constexpr (requires { req.desc; }) {
+          if ((req.desc & batchRefFlag) == 0) {
+            return;
+          }
+          auto index = req.desc & ~batchRefFlag;
+          // Only earlier opens can be referred to, anything else is invalid
+          // descriptor
+          req.desc = 0;
+          if (index < results.size()) {
+            if (auto open = std::get_if<OpenResponse>(&results[index])) {
+              req.desc = open->file;
+            }
+          }
+        }
+      },
+      sub);
+}
+
+void recycle(schema::Request& request, schema::Response& response) {
+  using namespace rpc::schema;
+  auto release = [](auto& message) {
+    if constexpr (requires { message.bytes; }) {
+      pool::buffers().release(std::move(message.bytes));
+    }
   };
+  if (auto batch = std::get_if<BatchRequest>(&request.body)) {
+    for (auto& sub : batch->requests) {
+      std::visit(release, sub);
+    }
+  } else {
+    std::visit(release, request.body);
+  }
+  if (auto batch = std::get_if<BatchResponse>(&response.body)) {
+    for (auto& sub : batch->responses) {
+      std::visit(release, sub);
+    }
+  } else {
+    std::visit(release, response.body);
+  }
+}
+
+} // namespace detail
+
+schema::File HandlersBackend::open(std::string pathname, schema::mode_t mode) {
+  return this->OpenHandler(std::move(pathname), mode);
+}
+
+std::int64_t HandlersBackend::read(schema::File desc, std::uint64_t count,
+                                   std::vector<std::uint8_t>& v) {
+  return this->ReadHandler(desc, count, v);
 }
+
+std::int64_t HandlersBackend::write(schema::File desc, std::uint64_t count,
+                                    std::vector<std::uint8_t>& v) {
+  return this->WriteHandler(desc, count, v);
+}
+
+schema::off_t HandlersBackend::lseek(schema::File desc, schema::off_t offset,
+                                     std::uint32_t whence) {
+  return this->LSeekHandler(desc, offset, whence);
+}
+
+std::int64_t HandlersBackend::chmod(std::string pathname, std::uint32_t mode) {
+  return this->ChmodHandler(std::move(pathname), mode);
+}
+
+std::int64_t HandlersBackend::unlink(std::string pathname) {
+  return this->UnlinkHandler(std::move(pathname));
+}
+
+std::int64_t HandlersBackend::rename(std::string oldpath, std::string newpath) {
+  return this->RenameHandler(std::move(oldpath), std::move(newpath));
+}
+
+std::int64_t HandlersBackend::close(schema::File desc) {
+  return this->CloseHandler(desc);
+}
+
+std::int64_t HandlersBackend::pread(schema::File desc, schema::off_t offset,
+                                    std::uint64_t count,
+                                    std::vector<std::uint8_t>& v) {
+  return this->PReadHandler(desc, offset, count, v);
+}
+
+std::int64_t HandlersBackend::pwrite(schema::File desc, schema::off_t offset,
+                                     std::uint64_t count,
+                                     std::vector<std::uint8_t>& v) {
+  return this->PWriteHandler(desc, offset, count, v);
+}
+
+std::int64_t HandlersBackend::advise(schema::File desc, schema::off_t offset,
+                                    std::uint64_t count,
+                                    std::uint32_t advice) {
+  if (!this->AdviseHandler) {
+    return 0;
+  }
+  return this->AdviseHandler(desc, offset, count, advice);
+}
+
+namespace {
+// Calls handler with a callback and waits for what it is called with
+template <typename Result, typename Handler> Result await(Handler handler) {
+  // Callback may outlive this frame
+  auto promise = std::make_shared<std::promise<Result>>();
+  auto future = promise->get_future();
+  handler([promise](auto... results) {
+    promise->set_value(Result{std::move(results)...});
+  });
+  return future.get();
+}
+
+using Bytes = std::vector<std::uint8_t>;
+using Filled = std::pair<std::int64_t, Bytes>;
+} // namespace
+
+schema::File AsyncHandlersBackend::open(std::string pathname,
+                                        schema::mode_t mode) {
+  return await<schema::File>([&](auto done) {
+    this->OpenHandler(std::move(pathname), mode, std::move(done));
+  });
+}
+
+std::int64_t AsyncHandlersBackend::read(schema::File desc, std::uint64_t count,
+                                        std::vector<std::uint8_t>& v) {
+  auto [read, bytes] = await<Filled>([&](auto done) {
+    this->ReadHandler(desc, count, std::move(v), std::move(done));
+  });
+  v = std::move(bytes);
+  return read;
+}
+
+std::int64_t AsyncHandlersBackend::write(schema::File desc,
+                                         std::uint64_t count,
+                                         std::vector<std::uint8_t>& v) {
+  return await<std::int64_t>([&](auto done) {
+    this->WriteHandler(desc, count, std::move(v), std::move(done));
+  });
+}
+
+schema::off_t AsyncHandlersBackend::lseek(schema::File desc,
+                                          schema::off_t offset,
+                                          std::uint32_t whence) {
+  return await<schema::off_t>([&](auto done) {
+    this->LSeekHandler(desc, offset, whence, std::move(done));
+  });
+}
+
+std::int64_t AsyncHandlersBackend::chmod(std::string pathname,
+                                         std::uint32_t mode) {
+  return await<std::int64_t>([&](auto done) {
+    this->ChmodHandler(std::move(pathname), mode, std::move(done));
+  });
+}
+
+std::int64_t AsyncHandlersBackend::unlink(std::string pathname) {
+  return await<std::int64_t>([&](auto done) {
+    this->UnlinkHandler(std::move(pathname), std::move(done));
+  });
+}
+
+std::int64_t AsyncHandlersBackend::rename(std::string oldpath,
+                                          std::string newpath) {
+  return await<std::int64_t>([&](auto done) {
+    this->RenameHandler(std::move(oldpath), std::move(newpath),
+                        std::move(done));
+  });
+}
+
+std::int64_t AsyncHandlersBackend::close(schema::File desc) {
+  return await<std::int64_t>(
+      [&](auto done) { this->CloseHandler(desc, std::move(done)); });
+}
+
+std::int64_t AsyncHandlersBackend::pread(schema::File desc,
+                                         schema::off_t offset,
+                                         std::uint64_t count,
+                                         std::vector<std::uint8_t>& v) {
+  auto [read, bytes] = await<Filled>([&](auto done) {
+    this->PReadHandler(desc, offset, count, std::move(v), std::move(done));
+  });
+  v = std::move(bytes);
+  return read;
+}
+
+std::int64_t AsyncHandlersBackend::pwrite(schema::File desc,
+                                          schema::off_t offset,
+                                          std::uint64_t count,
+                                          std::vector<std::uint8_t>& v) {
+  return await<std::int64_t>([&](auto done) {
+    this->PWriteHandler(desc, offset, count, std::move(v), std::move(done));
+  });
+}
+
+std::int64_t AsyncHandlersBackend::advise(schema::File desc,
+                                          schema::off_t offset,
+                                          std::uint64_t count,
+                                          std::uint32_t advice) {
+  if (!this->AdviseHandler) {
+    return 0;
+  }
+  return await<std::int64_t>([&](auto done) {
+    this->AdviseHandler(desc, offset, count, advice, std::move(done));
+  });
+}
+
+void AsyncHandlersBackend::submit(schema::OpenRequest req,
+                                  Reply<schema::OpenResponse> reply) {
+  this->OpenHandler(std::move(req.pathname), req.mode,
+                    [reply](schema::File file) { reply({.file = file}); });
+}
+
+void AsyncHandlersBackend::submit(schema::ReadRequest req,
+                                  Reply<schema::ReadResponse> reply) {
+  this->ReadHandler(req.desc, req.count, pool::buffers().acquire(),
+                    [reply](std::int64_t read, Bytes bytes) {
+                      reply({.read = read, .bytes = std::move(bytes)});
+                    });
+}
+
+void AsyncHandlersBackend::submit(schema::WriteRequest req,
+                                  Reply<schema::WriteResponse> reply) {
+  this->WriteHandler(
+      req.desc, req.count, std::move(req.bytes),
+      [reply](std::int64_t written) { reply({.written = written}); });
+}
+
+void AsyncHandlersBackend::submit(schema::LSeekRequest req,
+                                  Reply<schema::LSeekResponse> reply) {
+  this->LSeekHandler(
+      req.desc, req.offset, req.whence,
+      [reply](schema::off_t offset) { reply({.offset = offset}); });
+}
+
+void AsyncHandlersBackend::submit(schema::ChmodRequest req,
+                                  Reply<schema::ChmodResponse> reply) {
+  this->ChmodHandler(
+      std::move(req.pathname), req.mode,
+      [reply](std::int64_t result) { reply({.result = result}); });
+}
+
+void AsyncHandlersBackend::submit(schema::UnlinkRequest req,
+                                  Reply<schema::UnlinkResponse> reply) {
+  this->UnlinkHandler(std::move(req.pathname), [reply](std::int64_t result) {
+    reply({.result = result});
+  });
+}
+
+void AsyncHandlersBackend::submit(schema::RenameRequest req,
+                                  Reply<schema::RenameResponse> reply) {
+  this->RenameHandler(
+      std::move(req.oldpath), std::move(req.newpath),
+      [reply](std::int64_t result) { reply({.result = result}); });
+}
+
+void AsyncHandlersBackend::submit(schema::CloseRequest req,
+                                  Reply<schema::CloseResponse> reply) {
+  this->CloseHandler(req.desc, [reply](std::int64_t result) {
+    reply({.result = result});
+  });
+}
+
+void AsyncHandlersBackend::submit(schema::PReadRequest req,
+                                  Reply<schema::PReadResponse> reply) {
+  this->PReadHandler(req.desc, req.offset, req.count,
+                     pool::buffers().acquire(),
+                     [reply](std::int64_t read, Bytes bytes) {
+                       reply({.read = read, .bytes = std::move(bytes)});
+                     });
+}
+
+void AsyncHandlersBackend::submit(schema::PWriteRequest req,
+                                  Reply<schema::PWriteResponse> reply) {
+  this->PWriteHandler(
+      req.desc, req.offset, req.count, std::move(req.bytes),
+      [reply](std::int64_t written) { reply({.written = written}); });
+}
+
+void AsyncHandlersBackend::submit(schema::AdviseRequest req,
+                                  Reply<schema::AdviseResponse> reply) {
+  if (!this->AdviseHandler) {
+    reply({.result = 0});
+    return;
+  }
+  this->AdviseHandler(
+      req.desc, req.offset, req.count, req.advice,
+      [reply](std::int64_t result) { reply({.result = result}); });
+}
+
 } // namespace server
-} // namespace rpc
\ No newline at end of file
+} // namespace rpc
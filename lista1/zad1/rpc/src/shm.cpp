@@ -0,0 +1,710 @@
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <future>
+#include <iostream>
+#include <limits>
+#include <new>
+#include <random>
+#include <shm.hpp>
+#include <stdexcept>
+#include <system_error>
+#include <vector>
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace rpc {
+namespace shm {
+namespace detail {
+
+constexpr std::uint64_t magic = 0x6d68732d637072; // "rpc-shm"
+constexpr std::uint32_t version = 1;
+
+enum State : std::uint32_t {
+  FREE,
+  CLAIMING,
+  ACTIVE,
+  // Released by client, waits for server to reclaim it
+  CLOSING,
+  // Dropped by server, still held by client until it releases it
+  DISCONNECTED,
+};
+
+void Event::notify() {
+  this->seq.fetch_add(1);
+  if (this->waiters.load() > 0) {
+    syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(&this->seq),
+            FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+  }
+}
+
+void Event::sleep(std::uint32_t seq, std::chrono::nanoseconds timeout) {
+  auto ns = timeout.count();
+  timespec ts{.tv_sec = static_cast<time_t>(ns / 1'000'000'000),
+              .tv_nsec = static_cast<long>(ns % 1'000'000'000)};
+  syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(&this->seq),
+          FUTEX_WAIT, seq, &ts, nullptr, 0);
+}
+
+bool Ring::corrupted() const { return this->tail - this->head > ringSize; }
+
+std::size_t Ring::tryWrite(const std::uint8_t* src, std::size_t n) {
+  auto tail = this->tail.load();
+  auto used = tail - this->head.load();
+  // Positions are read once, so a peer changing them meanwhile cannot make
+  // the copy leave the ring
+  if (used > ringSize) {
+    return 0;
+  }
+  n = std::min(n, ringSize - used);
+  auto pos = tail % ringSize;
+  auto first = std::min(n, ringSize - pos);
+  std::memcpy(this->data + pos, src, first);
+  std::memcpy(this->data, src + first, n - first);
+  this->tail.store(tail + n);
+  return n;
+}
+
+std::size_t Ring::tryRead(std::uint8_t* dst, std::size_t n) {
+  auto head = this->head.load();
+  auto used = this->tail.load() - head;
+  if (used > ringSize) {
+    return 0;
+  }
+  n = std::min<std::size_t>(n, used);
+  auto pos = head % ringSize;
+  auto first = std::min(n, ringSize - pos);
+  std::memcpy(dst, this->data + pos, first);
+  std::memcpy(dst + first, this->data, n - first);
+  this->head.store(head + n);
+  return n;
+}
+
+struct Slot {
+  alignas(64) std::atomic<std::uint32_t> state;
+  // Bumped on every claim, so replies for previous owner are dropped
+  std::atomic<std::uint32_t> generation;
+  std::atomic<std::int32_t> owner;
+  Ring requests;
+  Ring responses;
+};
+
+struct Region {
+  std::uint64_t magic;
+  std::uint32_t version;
+  std::uint32_t slots;
+  std::uint64_t ringSize;
+  alignas(64) Event doorbell;
+
+  Slot& slot(std::uint32_t index) {
+    auto base = reinterpret_cast<std::uint8_t*>(this) + sizeof(Region);
+    return reinterpret_cast<Slot*>(base)[index];
+  }
+};
+
+std::size_t regionSize(std::uint32_t slots) {
+  return sizeof(Region) + slots * sizeof(Slot);
+}
+
+// Writes whole buffer, waiting for consumer to make space while alive holds
+template <typename Alive>
+bool writeAll(Ring& ring, const std::uint8_t* src, std::size_t n,
+              Event& notify, Alive alive) {
+  while (n > 0) {
+    auto written = ring.tryWrite(src, n);
+    if (written > 0) {
+      src += written;
+      n -= written;
+      notify.notify();
+      continue;
+    }
+    if (!alive()) {
+      return false;
+    }
+    ring.writable.wait([&]() { return ring.space() > 0 || !alive(); },
+                       std::chrono::milliseconds{100});
+  }
+  return true;
+}
+
+std::array<std::uint8_t, frameHeaderSize>
+writeFrameHeader(std::uint32_t length, std::uint64_t id) {
+  std::array<std::uint8_t, frameHeaderSize> result{};
+  std::memcpy(result.data(), &length, sizeof(length));
+  std::memcpy(result.data() + sizeof(length), &id, sizeof(id));
+  return result;
+}
+
+} // namespace detail
+
+Client::Client(std::string name, std::chrono::milliseconds timeout,
+               std::size_t maxMessageSize)
+    : timeout{timeout}, maxMessageSize{maxMessageSize},
+      messageCounter{std::random_device{}()} {
+  using namespace detail;
+
+  int fd = shm_open(name.c_str(), O_RDWR, 0);
+  if (fd < 0) {
+    throw std::system_error(errno, std::generic_category(), name);
+  }
+  struct stat st {};
+  if (fstat(fd, &st) < 0 ||
+      static_cast<std::size_t>(st.st_size) < sizeof(Region)) {
+    ::close(fd);
+    throw std::runtime_error("invalid shared memory region " + name);
+  }
+  this->regionSize = st.st_size;
+  void* ptr = mmap(nullptr, this->regionSize, PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (ptr == MAP_FAILED) {
+    throw std::system_error(errno, std::generic_category(), name);
+  }
+  this->region = static_cast<Region*>(ptr);
+
+  if (this->region->magic != magic || this->region->version != version ||
+      this->region->ringSize != ringSize ||
+      detail::regionSize(this->region->slots) > this->regionSize) {
+    munmap(ptr, this->regionSize);
+    throw std::runtime_error("incompatible shared memory region " + name);
+  }
+
+  for (std::uint32_t i = 0; i < this->region->slots; i++) {
+    auto& slot = this->region->slot(i);
+    std::uint32_t expected = FREE;
+    if (slot.state.compare_exchange_strong(expected, CLAIMING)) {
+      slot.requests.reset();
+      slot.responses.reset();
+      slot.owner = getpid();
+      slot.generation++;
+      slot.state = ACTIVE;
+      this->slot = &slot;
+      break;
+    }
+  }
+  if (!this->slot) {
+    munmap(ptr, this->regionSize);
+    throw std::runtime_error("no free slot in " + name);
+  }
+
+  this->thread = std::thread{[this]() { this->receive(); }};
+}
+
+Client::~Client() {
+  this->running = false;
+  this->slot->responses.readable.notify();
+  this->thread.join();
+
+  this->slot->state = detail::CLOSING;
+  this->region->doorbell.notify();
+  munmap(this->region, this->regionSize);
+
+  for (auto& [id, request] : this->pending) {
+    request.cb(std::make_error_code(std::errc::operation_canceled), {});
+  }
+}
+
+std::vector<std::uint8_t>
+Client::makeRequest(const std::vector<std::uint8_t>& data) {
+  std::promise<std::vector<std::uint8_t>> promise;
+  auto future = promise.get_future();
+
+  this->asyncRequest(this->messageCounter++, data,
+                     [&promise](std::error_code ec,
+                                std::vector<std::uint8_t> bytes) {
+                       if (ec) {
+                         promise.set_exception(std::make_exception_ptr(
+                             std::system_error(ec)));
+                         return;
+                       }
+                       promise.set_value(std::move(bytes));
+                     });
+
+  return future.get();
+}
+
+void Client::asyncRequest(std::uint64_t id, std::vector<std::uint8_t> data,
+                          protocol::callback cb) {
+  this->asyncRequestFor(id, std::move(data), this->timeout, std::move(cb));
+}
+
+void Client::asyncRequestFor(std::uint64_t id, std::vector<std::uint8_t> data,
+                             std::chrono::milliseconds timeout,
+                             protocol::callback cb) {
+  timeout = std::min(timeout, this->timeout);
+  using namespace detail;
+  if (data.size() > this->maxMessageSize ||
+      data.size() > std::numeric_limits<std::uint32_t>::max()) {
+    cb(std::make_error_code(std::errc::message_size), {});
+    return;
+  }
+
+  {
+    std::lock_guard lock{this->pendingMutex};
+    // Checked under the lock, so receive() fails every request it misses
+    if (!this->running) {
+      cb(std::make_error_code(std::errc::connection_reset), {});
+      return;
+    }
+    if (this->pending.contains(id)) {
+      cb(std::make_error_code(std::errc::device_or_resource_busy), {});
+      return;
+    }
+    this->pending.emplace(
+        id, Pending{.cb = std::move(cb),
+                    .deadline = std::chrono::steady_clock::now() + timeout});
+  }
+
+  auto header = writeFrameHeader(data.size(), id);
+  auto& ring = this->slot->requests;
+  auto& doorbell = this->region->doorbell;
+  auto deadline = std::chrono::steady_clock::now() + timeout;
+  auto connected = [&]() {
+    return this->running && this->slot->state == ACTIVE;
+  };
+  auto alive = [&]() {
+    return connected() && std::chrono::steady_clock::now() < deadline;
+  };
+
+  std::lock_guard lock{this->writeMutex};
+  if (!writeAll(ring, header.data(), header.size(), doorbell, alive) ||
+      !writeAll(ring, data.data(), data.size(), doorbell, alive)) {
+    // Server does not consume requests, stream is most likely broken anyway
+    this->complete(id,
+                   std::make_error_code(connected()
+                                            ? std::errc::timed_out
+                                            : std::errc::connection_reset),
+                   {});
+  }
+}
+
+void Client::receive() {
+  using namespace detail;
+  auto& ring = this->slot->responses;
+
+  auto readAll = [&](std::uint8_t* dst, std::size_t n) {
+    while (n > 0) {
+      auto read = ring.tryRead(dst, n);
+      if (read > 0) {
+        dst += read;
+        n -= read;
+        // Server waits on the doorbell for space for queued replies
+        this->region->doorbell.notify();
+        continue;
+      }
+      if (!this->running || this->slot->state != ACTIVE) {
+        return false;
+      }
+      ring.readable.wait(
+          [&]() {
+            return ring.available() > 0 || !this->running ||
+                   this->slot->state != ACTIVE;
+          },
+          std::chrono::milliseconds{100});
+      this->expire();
+    }
+    return true;
+  };
+  // Stream cannot be resumed, nothing sent before is going to be answered
+  auto fail = [&]() {
+    std::unordered_map<std::uint64_t, Pending> failed;
+    {
+      std::lock_guard lock{this->pendingMutex};
+      this->running = false;
+      failed = std::move(this->pending);
+      this->pending.clear();
+    }
+    for (auto& [id, request] : failed) {
+      request.cb(std::make_error_code(std::errc::connection_reset), {});
+    }
+  };
+
+  while (this->running) {
+    std::array<std::uint8_t, frameHeaderSize> header{};
+    if (!readAll(header.data(), header.size())) {
+      break;
+    }
+    std::uint32_t length;
+    std::uint64_t id;
+    std::memcpy(&length, header.data(), sizeof(length));
+    std::memcpy(&id, header.data() + sizeof(length), sizeof(id));
+    if (length > this->maxMessageSize) {
+      std::cerr << "reply too long" << std::endl;
+      break;
+    }
+
+    std::vector<std::uint8_t> payload(length);
+    if (!readAll(payload.data(), payload.size())) {
+      break;
+    }
+    this->complete(id, {}, std::move(payload));
+  }
+  // Destructor stopped the thread, it cancels pending requests itself
+  if (this->running) {
+    fail();
+  }
+}
+
+void Client::expire() {
+  auto now = std::chrono::steady_clock::now();
+  std::vector<protocol::callback> expired;
+  {
+    std::lock_guard lock{this->pendingMutex};
+    std::erase_if(this->pending, [&](auto& item) {
+      if (item.second.deadline > now) {
+        return false;
+      }
+      expired.push_back(std::move(item.second.cb));
+      return true;
+    });
+  }
+  for (auto& cb : expired) {
+    cb(std::make_error_code(std::errc::timed_out), {});
+  }
+}
+
+void Client::complete(std::uint64_t id, std::error_code ec,
+                      std::vector<std::uint8_t> bytes) {
+  protocol::callback cb;
+  {
+    std::lock_guard lock{this->pendingMutex};
+    // Late replies to requests that already timed out are dropped
+    auto it = this->pending.find(id);
+    if (it == this->pending.end()) {
+      return;
+    }
+    cb = std::move(it->second.cb);
+    this->pending.erase(it);
+  }
+  cb(ec, std::move(bytes));
+}
+
+Server::Server(std::string name, std::uint32_t slots,
+               std::size_t maxMessageSize)
+    : name{name}, maxMessageSize{maxMessageSize} {
+  using namespace detail;
+
+  // Running server holds a lock on its region, a region nobody holds it on
+  // was left behind by a crashed one
+  int fd = shm_open(name.c_str(), O_RDWR, 0);
+  if (fd >= 0) {
+    bool live = flock(fd, LOCK_EX | LOCK_NB) < 0 && errno == EWOULDBLOCK;
+    ::close(fd);
+    if (live) {
+      throw std::runtime_error("shared memory region " + name +
+                               " is in use");
+    }
+    shm_unlink(name.c_str());
+  }
+  fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+  if (fd < 0) {
+    throw std::system_error(errno, std::generic_category(), name);
+  }
+  auto fail = [&]() {
+    int error = errno;
+    ::close(fd);
+    shm_unlink(name.c_str());
+    throw std::system_error(error, std::generic_category(), name);
+  };
+  if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+    fail();
+  }
+  this->regionSize = detail::regionSize(slots);
+  if (ftruncate(fd, this->regionSize) < 0) {
+    fail();
+  }
+  void* ptr = mmap(nullptr, this->regionSize, PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, 0);
+  if (ptr == MAP_FAILED) {
+    fail();
+  }
+  this->lockFd = fd;
+
+  this->region = new (ptr) Region{};
+  for (std::uint32_t i = 0; i < slots; i++) {
+    new (&this->region->slot(i)) Slot{};
+    this->connections.push_back(std::make_unique<Connection>());
+  }
+  this->region->slots = slots;
+  this->region->ringSize = ringSize;
+  this->region->version = version;
+  this->region->magic = magic;
+}
+
+Server::~Server() {
+  munmap(this->region, this->regionSize);
+  shm_unlink(this->name.c_str());
+  ::close(this->lockFd);
+}
+
+void Server::setHandler(protocol::handler handler) {
+  this->handler = handler;
+  this->asyncHandler = nullptr;
+}
+
+void Server::setAsyncHandler(protocol::asyncHandler handler) {
+  this->asyncHandler = handler;
+  this->handler = nullptr;
+}
+
+void Server::run() {
+  using namespace detail;
+  if (this->running) {
+    return;
+  }
+  this->running = true;
+
+  auto pending = [this]() {
+    if (!this->running) {
+      return true;
+    }
+    for (std::uint32_t i = 0; i < this->region->slots; i++) {
+      auto& slot = this->region->slot(i);
+      if (slot.state == CLOSING ||
+          (slot.state == ACTIVE && slot.requests.available() > 0) ||
+          (this->connections[i]->queued > 0 && slot.responses.space() > 0)) {
+        return true;
+      }
+    }
+    return false;
+  };
+
+  while (this->running) {
+    bool progress = false;
+    for (std::uint32_t i = 0; i < this->region->slots; i++) {
+      progress |= this->poll(i);
+    }
+    if (progress) {
+      continue;
+    }
+
+    if (!this->region->doorbell.wait(pending, std::chrono::seconds{1})) {
+      // Idle, good time to look for crashed clients
+      for (std::uint32_t i = 0; i < this->region->slots; i++) {
+        auto& slot = this->region->slot(i);
+        if ((slot.state == ACTIVE || slot.state == DISCONNECTED) &&
+            kill(slot.owner, 0) < 0 && errno == ESRCH) {
+          slot.state = CLOSING;
+        }
+      }
+    }
+  }
+}
+
+void Server::stop() {
+  this->running = false;
+  this->region->doorbell.notify();
+}
+
+bool Server::poll(std::uint32_t index) {
+  using namespace detail;
+  auto& slot = this->region->slot(index);
+  auto& conn = *this->connections[index];
+
+  auto state = slot.state.load();
+  if (state == CLOSING) {
+    this->reclaim(index);
+    return true;
+  }
+  if (state != ACTIVE) {
+    return false;
+  }
+  if (conn.generation != slot.generation) {
+    // New client, partial request of previous one is discarded
+    std::lock_guard lock{conn.writeMutex};
+    conn.generation = slot.generation;
+    conn.haveHeader = false;
+    conn.read = 0;
+    conn.replies.clear();
+    conn.queued = 0;
+  }
+
+  bool progress = false;
+  {
+    // Positions of the response ring only move under the lock
+    std::lock_guard lock{conn.writeMutex};
+    if (slot.requests.corrupted() || slot.responses.corrupted()) {
+      std::cerr << "client " << slot.owner
+                << " corrupted its rings, disconnecting" << std::endl;
+      this->disconnect(index);
+      return true;
+    }
+    if (conn.queued > 0) {
+      progress = this->flush(index);
+    }
+  }
+  if (!conn.haveHeader) {
+    conn.header.resize(frameHeaderSize);
+    auto read = slot.requests.tryRead(conn.header.data() + conn.read,
+                                      frameHeaderSize - conn.read);
+    conn.read += read;
+    progress = read > 0;
+    if (conn.read < frameHeaderSize) {
+      if (progress) {
+        slot.requests.writable.notify();
+      }
+      return progress;
+    }
+    std::uint32_t length;
+    std::memcpy(&length, conn.header.data(), sizeof(length));
+    if (length > this->maxMessageSize) {
+      // Request stream cannot be resynchronised past a corrupted header
+      std::lock_guard lock{conn.writeMutex};
+      this->disconnect(index);
+      return true;
+    }
+    conn.payload.resize(length);
+    conn.haveHeader = true;
+    conn.read = 0;
+  }
+
+  auto read = slot.requests.tryRead(conn.payload.data() + conn.read,
+                                    conn.payload.size() - conn.read);
+  conn.read += read;
+  progress |= read > 0;
+  if (progress) {
+    slot.requests.writable.notify();
+  }
+  if (conn.read < conn.payload.size()) {
+    return progress;
+  }
+
+  std::uint64_t id;
+  std::memcpy(&id, conn.header.data() + sizeof(std::uint32_t), sizeof(id));
+  auto request = std::move(conn.payload);
+  conn.payload = {};
+  conn.haveHeader = false;
+  conn.read = 0;
+  auto generation = conn.generation;
+
+  if (this->asyncHandler) {
+    this->asyncHandler(std::move(request),
+                       [this, index, generation,
+                        id](std::vector<std::uint8_t> message) {
+                         this->reply(index, generation, id,
+                                     std::move(message));
+                       });
+    return true;
+  }
+
+  try {
+    this->reply(index, generation, id, this->handler(std::move(request)));
+  } catch (std::exception& e) {
+    // Malformed request must not bring down the server
+    std::cerr << e.what() << std::endl;
+  }
+  return true;
+}
+
+bool Server::flush(std::uint32_t index) {
+  auto& ring = this->region->slot(index).responses;
+  auto& conn = *this->connections[index];
+  bool progress = false;
+  while (!conn.replies.empty()) {
+    auto& frame = conn.replies.front();
+    auto total = frame.header.size() + frame.payload.size();
+    auto before = frame.written;
+    while (frame.written < frame.header.size()) {
+      auto written =
+          ring.tryWrite(frame.header.data() + frame.written,
+                        frame.header.size() - frame.written);
+      if (written == 0) {
+        break;
+      }
+      frame.written += written;
+    }
+    while (frame.written >= frame.header.size() && frame.written < total) {
+      auto offset = frame.written - frame.header.size();
+      auto written = ring.tryWrite(frame.payload.data() + offset,
+                                   frame.payload.size() - offset);
+      if (written == 0) {
+        break;
+      }
+      frame.written += written;
+    }
+    progress |= frame.written > before;
+    if (frame.written < total) {
+      break;
+    }
+    conn.queued -= total;
+    conn.replies.pop_front();
+  }
+  if (progress) {
+    ring.readable.notify();
+  }
+  return progress;
+}
+
+void Server::disconnect(std::uint32_t index) {
+  auto& slot = this->region->slot(index);
+  auto& conn = *this->connections[index];
+  std::uint32_t expected = detail::ACTIVE;
+  slot.state.compare_exchange_strong(expected, detail::DISCONNECTED);
+  conn.haveHeader = false;
+  conn.read = 0;
+  conn.payload = {};
+  conn.replies.clear();
+  conn.queued = 0;
+  // Client may be waiting for a reply
+  slot.responses.readable.notify();
+}
+
+void Server::reclaim(std::uint32_t index) {
+  auto& conn = *this->connections[index];
+  std::lock_guard lock{conn.writeMutex};
+  conn.haveHeader = false;
+  conn.read = 0;
+  conn.payload = {};
+  conn.replies.clear();
+  conn.queued = 0;
+  this->region->slot(index).state = detail::FREE;
+}
+
+void Server::reply(std::uint32_t index, std::uint32_t generation,
+                   std::uint64_t id, std::vector<std::uint8_t> message) {
+  using namespace detail;
+  auto& slot = this->region->slot(index);
+  auto& conn = *this->connections[index];
+
+  std::lock_guard lock{conn.writeMutex};
+  if (slot.state != ACTIVE || slot.generation != generation) {
+    return;
+  }
+  if (message.size() > this->maxMessageSize ||
+      message.size() > std::numeric_limits<std::uint32_t>::max()) {
+    std::cerr << "reply too long" << std::endl;
+    return;
+  }
+  auto size = frameHeaderSize + message.size();
+  if (conn.queued > 0 && conn.queued + size > this->maxMessageSize) {
+    // Client does not read its replies, serving thread must not wait for it
+    std::cerr << "client " << slot.owner << " is too slow, disconnecting"
+              << std::endl;
+    this->disconnect(index);
+    return;
+  }
+  conn.replies.push_back(Frame{.header = writeFrameHeader(message.size(), id),
+                               .payload = std::move(message),
+                               .written = 0});
+  conn.queued += size;
+  this->flush(index);
+  if (conn.queued > 0) {
+    // Rest is sent by run() as the client makes space
+    this->region->doorbell.notify();
+  }
+}
+
+} // namespace shm
+} // namespace rpc
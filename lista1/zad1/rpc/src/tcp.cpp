@@ -0,0 +1,432 @@
+#include <algorithm>
+#include <array>
+#include <asio.hpp>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <pool.hpp>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <tcp.hpp>
+#include <vector>
+
+namespace rpc {
+namespace tcp {
+
+FrameHeaderBytes writeFrameHeader(const FrameHeader& header) {
+  FrameHeaderBytes result{};
+  std::memcpy(result.data(), &header.length, sizeof(header.length));
+  std::memcpy(result.data() + sizeof(header.length), &header.id,
+              sizeof(header.id));
+  return result;
+}
+
+FrameHeader readFrameHeader(const FrameHeaderBytes& bytes) {
+  FrameHeader result{};
+  std::memcpy(&result.length, bytes.data(), sizeof(result.length));
+  std::memcpy(&result.id, bytes.data() + sizeof(result.length),
+              sizeof(result.id));
+  return result;
+}
+
+Client::Client(std::string url, bool noDelay,
+               std::chrono::milliseconds timeout, std::size_t maxFrameSize)
+    : url{url}, noDelay{noDelay}, timeout{timeout},
+      maxFrameSize{maxFrameSize}, messageCounter{std::random_device{}()} {
+  // Accept both "host" and "host:port"
+  std::string host = url;
+  std::string port = std::to_string(defaultPort);
+  if (auto pos = url.rfind(':');
+      pos != std::string::npos && url.find(':') == pos) {
+    host = url.substr(0, pos);
+    port = url.substr(pos + 1);
+  }
+
+  asio::ip::tcp::resolver resolver{this->ctx};
+  this->endpoints = resolver.resolve(host, port);
+  if (this->endpoints.empty()) {
+    throw std::invalid_argument("could not resolve " + url);
+  }
+
+  this->thread = std::thread{[this]() {
+    while (true) {
+      try {
+        this->ctx.run();
+        return;
+      } catch (std::exception& e) {
+        std::cerr << e.what() << std::endl;
+      }
+    }
+  }};
+}
+
+Client::~Client() {
+  this->work.reset();
+  this->ctx.stop();
+  this->thread.join();
+
+  for (auto& [id, request] : this->pending) {
+    request.cb(std::make_error_code(std::errc::operation_canceled), {});
+  }
+}
+
+std::vector<std::uint8_t>
+Client::makeRequest(const std::vector<std::uint8_t>& data) {
+  std::promise<std::vector<std::uint8_t>> promise;
+  auto future = promise.get_future();
+
+  this->asyncRequest(this->messageCounter++, data,
+                     [&promise](std::error_code ec,
+                                std::vector<std::uint8_t> bytes) {
+                       if (ec) {
+                         promise.set_exception(std::make_exception_ptr(
+                             std::system_error(ec)));
+                         return;
+                       }
+                       promise.set_value(std::move(bytes));
+                     });
+
+  return future.get();
+}
+
+void Client::asyncRequest(std::uint64_t id, std::vector<std::uint8_t> data,
+                          protocol::callback cb) {
+  this->asyncRequestFor(id, std::move(data), this->timeout, std::move(cb));
+}
+
+void Client::asyncRequestFor(std::uint64_t id, std::vector<std::uint8_t> data,
+                             std::chrono::milliseconds timeout,
+                             protocol::callback cb) {
+  timeout = std::min(timeout, this->timeout);
+  if (data.size() > this->maxFrameSize) {
+    cb(std::make_error_code(std::errc::message_size), {});
+    return;
+  }
+
+  // Socket and pending requests are only touched from the transport thread
+  asio::post(this->ctx, [this, id, data = std::move(data), timeout,
+                         cb = std::move(cb)]() mutable {
+    if (this->pending.contains(id)) {
+      cb(std::make_error_code(std::errc::device_or_resource_busy), {});
+      return;
+    }
+    if (!this->connected && !this->connect()) {
+      cb(std::make_error_code(std::errc::connection_refused), {});
+      return;
+    }
+
+    auto timer = std::make_unique<asio::steady_timer>(this->ctx, timeout);
+    timer->async_wait([this, id](asio::error_code ec) {
+      if (!ec) {
+        this->complete(id, std::make_error_code(std::errc::timed_out), {});
+      }
+    });
+    this->pending.emplace(
+        id, Pending{.cb = std::move(cb), .timer = std::move(timer)});
+
+    FrameHeader header{.length = static_cast<std::uint32_t>(data.size()),
+                       .id = id};
+    this->writeQueue.push_back(
+        Frame{.header = writeFrameHeader(header), .payload = std::move(data)});
+    if (this->writeQueue.size() == 1) {
+      this->write();
+    }
+  });
+}
+
+bool Client::connect() {
+  asio::error_code ec;
+  asio::connect(this->socket, this->endpoints, ec);
+  if (ec) {
+    std::cerr << "could not connect to " << this->url << ": " << ec.message()
+              << std::endl;
+    return false;
+  }
+  this->socket.set_option(asio::ip::tcp::no_delay{this->noDelay});
+  this->connected = true;
+  this->readHeader();
+  return true;
+}
+
+void Client::fail(std::error_code ec) {
+  if (!this->connected) {
+    return;
+  }
+  this->connected = false;
+  asio::error_code ignored_error;
+  this->socket.close(ignored_error);
+  this->writeQueue.clear();
+
+  // Requests sent over lost connection will never be answered
+  auto failed = std::move(this->pending);
+  this->pending.clear();
+  for (auto& [id, request] : failed) {
+    request.timer->cancel();
+    request.cb(ec, {});
+  }
+}
+
+void Client::write() {
+  auto& frame = this->writeQueue.front();
+  std::array<asio::const_buffer, 2> buffers{asio::buffer(frame.header),
+                                            asio::buffer(frame.payload)};
+  asio::async_write(this->socket, buffers,
+                    [this](asio::error_code ec, std::size_t) {
+                      if (ec) {
+                        if (ec != asio::error::operation_aborted) {
+                          this->fail(ec);
+                        }
+                        return;
+                      }
+                      pool::buffers().release(
+                          std::move(this->writeQueue.front().payload));
+                      this->writeQueue.pop_front();
+                      if (!this->writeQueue.empty()) {
+                        this->write();
+                      }
+                    });
+}
+
+void Client::readHeader() {
+  asio::async_read(this->socket, asio::buffer(this->headerBuffer),
+                   [this](asio::error_code ec, std::size_t) {
+                     if (ec) {
+                       if (ec != asio::error::operation_aborted) {
+                         this->fail(ec);
+                       }
+                       return;
+                     }
+                     auto header = readFrameHeader(this->headerBuffer);
+                     if (header.length > this->maxFrameSize) {
+                       this->fail(std::make_error_code(std::errc::bad_message));
+                       return;
+                     }
+                     this->readBuffer.clear();
+                     this->readPayload(header);
+                   });
+}
+
+void Client::readPayload(FrameHeader header) {
+  auto done = this->readBuffer.size();
+  if (done == header.length) {
+    // Ownership of the payload is handed over to the caller
+    this->complete(header.id, {}, std::move(this->readBuffer));
+    this->readBuffer = pool::buffers().acquire();
+    this->readHeader();
+    return;
+  }
+  this->readBuffer.resize(
+      std::min<std::size_t>(header.length, done + frameChunkSize));
+  asio::async_read(
+      this->socket,
+      asio::buffer(this->readBuffer.data() + done,
+                   this->readBuffer.size() - done),
+      [this, header](asio::error_code ec, std::size_t) {
+        if (ec) {
+          if (ec != asio::error::operation_aborted) {
+            this->fail(ec);
+          }
+          return;
+        }
+        this->readPayload(header);
+      });
+}
+
+void Client::complete(std::uint64_t id, std::error_code ec,
+                      std::vector<std::uint8_t> bytes) {
+  // Late replies to requests that already timed out are dropped
+  auto it = this->pending.find(id);
+  if (it == this->pending.end()) {
+    return;
+  }
+  auto request = std::move(it->second);
+  this->pending.erase(it);
+  request.timer->cancel();
+
+  request.cb(ec, std::move(bytes));
+}
+
+// Connection state. Kept alive by its own pending operations and by replies
+// not sent yet.
+class Server::Session : public std::enable_shared_from_this<Session> {
+public:
+  Session(Server& server, asio::ip::tcp::socket socket)
+      : server{server}, socket{std::move(socket)} {}
+
+  void start() { this->readHeader(); }
+
+  void send(std::uint64_t id, std::vector<std::uint8_t> message) {
+    if (message.size() > this->server.maxFrameSize) {
+      std::cerr << "reply too long" << std::endl;
+      return;
+    }
+    FrameHeader header{.length = static_cast<std::uint32_t>(message.size()),
+                       .id = id};
+    this->writeQueue.push_back(Frame{.header = writeFrameHeader(header),
+                                     .payload = std::move(message)});
+    if (this->writeQueue.size() == 1) {
+      this->write();
+    }
+  }
+
+private:
+  struct Frame {
+    FrameHeaderBytes header;
+    std::vector<std::uint8_t> payload;
+  };
+
+  void readHeader() {
+    asio::async_read(
+        this->socket, asio::buffer(this->headerBuffer),
+        [self = this->shared_from_this()](asio::error_code ec, std::size_t) {
+          if (ec) {
+            self->close();
+            return;
+          }
+          auto header = readFrameHeader(self->headerBuffer);
+          if (header.length > self->server.maxFrameSize) {
+            self->close();
+            return;
+          }
+          self->readBuffer.clear();
+          self->readPayload(header);
+        });
+  }
+
+  // Grows the buffer a chunk at a time, as in Client::readPayload
+  void readPayload(FrameHeader header) {
+    auto done = this->readBuffer.size();
+    if (done == header.length) {
+      this->handle(header.id);
+      this->readHeader();
+      return;
+    }
+    this->readBuffer.resize(
+        std::min<std::size_t>(header.length, done + frameChunkSize));
+    asio::async_read(
+        this->socket,
+        asio::buffer(this->readBuffer.data() + done,
+                     this->readBuffer.size() - done),
+        [self = this->shared_from_this(), header](asio::error_code ec,
+                                                  std::size_t) {
+          if (ec) {
+            self->close();
+            return;
+          }
+          self->readPayload(header);
+        });
+  }
+
+  void handle(std::uint64_t id) {
+    auto request = std::move(this->readBuffer);
+    this->readBuffer = pool::buffers().acquire();
+
+    if (this->server.asyncHandler) {
+      // Reply may come from any thread, socket is only used by run()'s thread
+      this->server.asyncHandler(
+          std::move(request),
+          [self = this->shared_from_this(),
+           id](std::vector<std::uint8_t> message) {
+            asio::post(self->socket.get_executor(),
+                       [self, id, message = std::move(message)]() mutable {
+                         self->send(id, std::move(message));
+                       });
+          });
+      return;
+    }
+
+    try {
+      this->send(id, this->server.handler(std::move(request)));
+    } catch (std::exception& e) {
+      // Malformed request must not bring down the connection
+      std::cerr << e.what() << std::endl;
+    }
+  }
+
+  void write() {
+    auto& frame = this->writeQueue.front();
+    std::array<asio::const_buffer, 2> buffers{asio::buffer(frame.header),
+                                              asio::buffer(frame.payload)};
+    asio::async_write(
+        this->socket, buffers,
+        [self = this->shared_from_this()](asio::error_code ec, std::size_t) {
+          if (ec) {
+            self->close();
+            return;
+          }
+          pool::buffers().release(std::move(self->writeQueue.front().payload));
+          self->writeQueue.pop_front();
+          if (!self->writeQueue.empty()) {
+            self->write();
+          }
+        });
+  }
+
+  void close() {
+    asio::error_code ignored_error;
+    this->socket.close(ignored_error);
+    this->writeQueue.clear();
+  }
+
+  Server& server;
+  asio::ip::tcp::socket socket;
+  FrameHeaderBytes headerBuffer{};
+  std::vector<std::uint8_t> readBuffer{};
+  std::deque<Frame> writeQueue{};
+};
+
+Server::Server(std::string address, std::uint16_t port, bool noDelay,
+               std::size_t maxFrameSize)
+    : local{asio::ip::make_address(address), port}, noDelay{noDelay},
+      maxFrameSize{maxFrameSize} {}
+
+void Server::setHandler(protocol::handler handler) {
+  this->handler = handler;
+  this->asyncHandler = nullptr;
+}
+
+void Server::setAsyncHandler(protocol::asyncHandler handler) {
+  this->asyncHandler = handler;
+  this->handler = nullptr;
+}
+
+void Server::run() {
+  try {
+    this->acceptor.open(this->local.protocol());
+    this->acceptor.set_option(asio::ip::tcp::acceptor::reuse_address{true});
+    this->acceptor.bind(this->local);
+    this->acceptor.listen();
+
+    this->accept();
+    this->ctx.run();
+  } catch (std::exception& e) {
+    std::cerr << e.what() << std::endl;
+  }
+
+  asio::error_code ignored_error;
+  this->acceptor.close(ignored_error);
+}
+
+void Server::stop() { this->ctx.stop(); }
+
+void Server::accept() {
+  this->acceptor.async_accept(
+      [this](asio::error_code ec, asio::ip::tcp::socket socket) {
+        if (ec == asio::error::operation_aborted) {
+          return;
+        }
+        if (!ec) {
+          socket.set_option(asio::ip::tcp::no_delay{this->noDelay}, ec);
+          std::make_shared<Session>(*this, std::move(socket))->start();
+        }
+        this->accept();
+      });
+}
+
+} // namespace tcp
+} // namespace rpc
@@ -1,68 +1,600 @@
 #include "asio/io_context.hpp"
 #include "asio/ip/address_v4.hpp"
+#include <algorithm>
+#include <array>
 #include <asio.hpp>
+#include <cerrno>
 #include <chrono>
 #include <cstdint>
+#include <cstring>
 #include <exception>
 #include <future>
 #include <iostream>
+#include <limits>
+#include <memory>
+#include <pool.hpp>
+#include <random>
 #include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
 #include <udp.hpp>
 #include <vector>
 
+#include <sys/socket.h>
+#include <sys/uio.h>
+
 namespace rpc {
 namespace udp {
+namespace {
+
+std::size_t clampDatagramSize(std::size_t size) {
+  if (size <= fragmentHeaderSize) {
+    throw std::invalid_argument("datagram size too small");
+  }
+  return std::min(size, maxDatagramSize);
+}
+
+template <typename T> std::uint8_t* writeScalar(std::uint8_t* it, T obj) {
+  std::memcpy(it, &obj, sizeof(obj));
+  return it + sizeof(obj);
+}
+
+template <typename T>
+const std::uint8_t* readScalar(const std::uint8_t* it, T& obj) {
+  std::memcpy(&obj, it, sizeof(obj));
+  return it + sizeof(obj);
+}
+
+} // namespace
+
+namespace {
+// Sends header and payload slice of each fragment with a single gathered
+// write, payload is not copied
+asio::error_code sendFragments(asio::ip::udp::socket& socket,
+                               const asio::ip::udp::endpoint& remote,
+                               std::uint64_t message,
+                               std::span<const std::uint8_t> data,
+                               std::size_t datagramSize) {
+  const std::size_t payload =
+      clampDatagramSize(datagramSize) - fragmentHeaderSize;
+  const std::size_t count = fragmentCount(data.size(), datagramSize);
+  for (std::size_t i = 0; i < count; i++) {
+    auto offset = std::min(i * payload, data.size());
+    auto header = writeFragmentHeader(
+        FragmentHeader{.message = message,
+                       .index = static_cast<std::uint32_t>(i),
+                       .count = static_cast<std::uint32_t>(count)});
+    std::array<asio::const_buffer, 2> buffers{
+        asio::buffer(header),
+        asio::buffer(data.data() + offset,
+                     std::min(payload, data.size() - offset))};
+    asio::error_code ec;
+    socket.send_to(buffers, remote, 0, ec);
+    if (ec) {
+      return ec;
+    }
+  }
+  return {};
+}
+
+using ReusePort =
+    asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+
+// Longest pause between receives failing one after another
+constexpr std::chrono::milliseconds maxReceiveBackoff{100};
+
+// Receives up to datagramBatch datagrams with a single recvmmsg call
+class Inbox {
+public:
+  Inbox() {
+    for (std::size_t i = 0; i < datagramBatch; i++) {
+      // Peers may use larger datagrams than we do
+      this->buffers[i].resize(maxDatagramSize);
+      this->iovecs[i] = {.iov_base = this->buffers[i].data(),
+                         .iov_len = this->buffers[i].size()};
+    }
+  }
+
+  // Blocks until at least one datagram arrives, returns number received.
+  // Sets ec on errors other than interruptions.
+  std::size_t receive(asio::ip::udp::socket& socket, std::error_code& ec) {
+    ec.clear();
+    for (std::size_t i = 0; i < datagramBatch; i++) {
+      this->headers[i] = {};
+      this->headers[i].msg_hdr.msg_name = this->senders[i].data();
+      this->headers[i].msg_hdr.msg_namelen = this->senders[i].capacity();
+      this->headers[i].msg_hdr.msg_iov = &this->iovecs[i];
+      this->headers[i].msg_hdr.msg_iovlen = 1;
+    }
+    int count = ::recvmmsg(socket.native_handle(), this->headers.data(),
+                           datagramBatch, MSG_WAITFORONE, nullptr);
+    if (count < 0 && errno != EINTR && errno != EAGAIN) {
+      ec = std::error_code(errno, std::system_category());
+    }
+    if (count <= 0) {
+      return 0;
+    }
+    for (int i = 0; i < count; i++) {
+      this->senders[i].resize(this->headers[i].msg_hdr.msg_namelen);
+    }
+    return count;
+  }
+
+  std::span<const std::uint8_t> datagram(std::size_t i) const {
+    return {this->buffers[i].data(), this->headers[i].msg_len};
+  }
+
+  const asio::ip::udp::endpoint& sender(std::size_t i) const {
+    return this->senders[i];
+  }
+
+private:
+  std::array<std::vector<std::uint8_t>, datagramBatch> buffers{};
+  std::array<iovec, datagramBatch> iovecs{};
+  std::array<mmsghdr, datagramBatch> headers{};
+  std::array<asio::ip::udp::endpoint, datagramBatch> senders{};
+};
+
+// Collects fragments of replies and sends them with as few sendmmsg calls as
+// possible. Payloads are not copied, messages have to outlive flush().
+class Outbox {
+public:
+  Outbox(std::size_t datagramSize) : datagramSize{datagramSize} {}
+
+  void add(const asio::ip::udp::endpoint& remote, std::uint64_t id,
+           std::span<const std::uint8_t> message) {
+    const std::size_t payload = this->datagramSize - fragmentHeaderSize;
+    const std::size_t count = fragmentCount(message.size(), this->datagramSize);
+    for (std::size_t i = 0; i < count; i++) {
+      auto offset = std::min(i * payload, message.size());
+      this->datagrams.push_back(Datagram{
+          .remote = remote,
+          .header = writeFragmentHeader(
+              FragmentHeader{.message = id,
+                             .index = static_cast<std::uint32_t>(i),
+                             .count = static_cast<std::uint32_t>(count)}),
+          .payload = message.subspan(
+              offset, std::min(payload, message.size() - offset))});
+    }
+  }
+
+  void flush(asio::ip::udp::socket& socket) {
+    // Datagrams are not moved any more, pointers into them stay valid
+    this->iovecs.resize(this->datagrams.size());
+    this->headers.resize(this->datagrams.size());
+    for (std::size_t i = 0; i < this->datagrams.size(); i++) {
+      auto& datagram = this->datagrams[i];
+      this->iovecs[i] = {
+          iovec{.iov_base = datagram.header.data(),
+                .iov_len = datagram.header.size()},
+          iovec{.iov_base = const_cast<std::uint8_t*>(datagram.payload.data()),
+                .iov_len = datagram.payload.size()}};
+      this->headers[i] = {};
+      this->headers[i].msg_hdr.msg_name = datagram.remote.data();
+      this->headers[i].msg_hdr.msg_namelen = datagram.remote.size();
+      this->headers[i].msg_hdr.msg_iov = this->iovecs[i].data();
+      this->headers[i].msg_hdr.msg_iovlen = this->iovecs[i].size();
+    }
+
+    std::size_t sent = 0;
+    while (sent < this->headers.size()) {
+      auto chunk = std::min(this->headers.size() - sent, datagramBatch);
+      int count = ::sendmmsg(socket.native_handle(),
+                             this->headers.data() + sent, chunk, 0);
+      // Datagram that could not be sent is dropped, as with send_to
+      sent += count > 0 ? count : 1;
+    }
+    this->datagrams.clear();
+  }
+
+private:
+  struct Datagram {
+    asio::ip::udp::endpoint remote;
+    FragmentHeaderBytes header;
+    std::span<const std::uint8_t> payload;
+  };
+
+  const std::size_t datagramSize;
+  std::vector<Datagram> datagrams{};
+  std::vector<std::array<iovec, 2>> iovecs{};
+  std::vector<mmsghdr> headers{};
+};
+} // namespace
+
+std::size_t fragmentCount(std::size_t size, std::size_t datagramSize) {
+  const std::size_t payload =
+      clampDatagramSize(datagramSize) - fragmentHeaderSize;
+  // Empty message still needs one datagram to carry the header
+  const std::size_t count =
+      std::max<std::size_t>(1, (size + payload - 1) / payload);
+  if (count > std::numeric_limits<std::uint32_t>::max()) {
+    throw std::length_error("message too long");
+  }
+  return count;
+}
+
+FragmentHeaderBytes writeFragmentHeader(const FragmentHeader& header) {
+  FragmentHeaderBytes result{};
+  auto it = result.data();
+  it = writeScalar(it, header.message);
+  it = writeScalar(it, header.index);
+  it = writeScalar(it, header.count);
+  return result;
+}
+
+std::vector<std::vector<std::uint8_t>>
+fragment(std::uint64_t message, const std::vector<std::uint8_t>& data,
+         std::size_t datagramSize) {
+  const std::size_t payload =
+      clampDatagramSize(datagramSize) - fragmentHeaderSize;
+  const std::size_t count = fragmentCount(data.size(), datagramSize);
+
+  std::vector<std::vector<std::uint8_t>> result{};
+  result.reserve(count);
+  for (std::size_t i = 0; i < count; i++) {
+    auto begin = data.begin() + std::min(i * payload, data.size());
+    auto end = data.begin() + std::min((i + 1) * payload, data.size());
+
+    auto header = writeFragmentHeader(
+        FragmentHeader{.message = message,
+                       .index = static_cast<std::uint32_t>(i),
+                       .count = static_cast<std::uint32_t>(count)});
+    std::vector<std::uint8_t> datagram(header.begin(), header.end());
+    datagram.insert(datagram.end(), begin, end);
+    result.push_back(std::move(datagram));
+  }
+
+  return result;
+}
+
+std::optional<FragmentHeader>
+readFragmentHeader(std::span<const std::uint8_t> datagram) {
+  if (datagram.size() < fragmentHeaderSize) {
+    return std::nullopt;
+  }
+  FragmentHeader header{};
+  auto it = datagram.data();
+  it = readScalar(it, header.message);
+  it = readScalar(it, header.index);
+  it = readScalar(it, header.count);
+  if (header.count == 0 || header.index >= header.count) {
+    return std::nullopt;
+  }
+  return header;
+}
+
+std::optional<Reassembler::Message>
+Reassembler::push(const endpoint& sender,
+                  std::span<const std::uint8_t> datagram) {
+  auto header = readFragmentHeader(datagram);
+  if (!header) {
+    return std::nullopt;
+  }
+  auto payload = datagram.subspan(fragmentHeaderSize);
+  if (header->count > this->maxFragments || payload.size() > this->maxMessage) {
+    return std::nullopt;
+  }
+
+  // Fast path - nothing to reassemble
+  if (header->count == 1) {
+    Message result{.sender = sender,
+                   .id = header->message,
+                   .bytes = pool::buffers().acquire()};
+    result.bytes.assign(payload.begin(), payload.end());
+    return result;
+  }
+
+  auto key = std::make_pair(sender, header->message);
+  auto it = this->pending.find(key);
+  if (it == this->pending.end()) {
+    if (this->pending.size() >= this->maxPending) {
+      // Drop the stalest message, its fragments were most likely lost
+      this->dropOldest(this->pending.end());
+    }
+    Partial partial{.fragments = std::vector<std::vector<std::uint8_t>>(
+                        header->count),
+                    .received = 0,
+                    .age = 0,
+                    .bytes = 0};
+    it = this->pending.emplace(key, std::move(partial)).first;
+  }
+
+  auto& partial = it->second;
+  partial.age = this->clock++;
+  if (partial.fragments.size() != header->count) {
+    // Sender reused message id with different layout
+    this->drop(it);
+    return std::nullopt;
+  }
+  auto& slot = partial.fragments[header->index];
+  // Fragments of multi-datagram messages are never empty
+  if (!slot.empty() || payload.empty()) {
+    return std::nullopt;
+  }
+  if (partial.bytes + payload.size() > this->maxMessage) {
+    this->drop(it);
+    return std::nullopt;
+  }
+  slot = pool::buffers().acquire();
+  slot.assign(payload.begin(), payload.end());
+  partial.received++;
+  partial.bytes += payload.size();
+  this->bytes += payload.size();
+  while (this->bytes > 2 * this->maxMessage && this->dropOldest(it)) {
+  }
+
+  if (partial.received < header->count) {
+    return std::nullopt;
+  }
+
+  Message result{.sender = sender,
+                 .id = header->message,
+                 .bytes = pool::buffers().acquire()};
+  result.bytes.reserve(partial.bytes);
+  for (const auto& frag : partial.fragments) {
+    result.bytes.insert(result.bytes.end(), frag.begin(), frag.end());
+  }
+  this->drop(it);
+
+  return result;
+}
+
+bool Reassembler::dropOldest(Pending::iterator keep) {
+  auto oldest = this->pending.end();
+  for (auto it = this->pending.begin(); it != this->pending.end(); ++it) {
+    if (it != keep && (oldest == this->pending.end() ||
+                       it->second.age < oldest->second.age)) {
+      oldest = it;
+    }
+  }
+  if (oldest == this->pending.end()) {
+    return false;
+  }
+  this->drop(oldest);
+  return true;
+}
+
+void Reassembler::drop(Pending::iterator it) {
+  this->bytes -= it->second.bytes;
+  for (auto& frag : it->second.fragments) {
+    if (!frag.empty()) {
+      pool::buffers().release(std::move(frag));
+    }
+  }
+  this->pending.erase(it);
+}
+
+void RttEstimator::sample(duration rtt) {
+  this->backoffs = 0;
+  if (!this->srtt) {
+    this->srtt = rtt;
+    this->rttvar = rtt / 2;
+    return;
+  }
+  auto error = rtt > *this->srtt ? rtt - *this->srtt : *this->srtt - rtt;
+  this->rttvar = (3 * this->rttvar + error) / 4;
+  this->srtt = (7 * *this->srtt + rtt) / 8;
+}
+
+void RttEstimator::backoff() {
+  // Further doubling would not change the result
+  if ((maxRto / minRto) >> this->backoffs) {
+    this->backoffs++;
+  }
+}
+
+RttEstimator::duration RttEstimator::rto() const {
+  duration rto = this->srtt ? *this->srtt + 4 * this->rttvar
+                            : duration{initialRto};
+  rto = std::clamp<duration>(rto, minRto, maxRto);
+  return std::min<duration>(rto * (1 << this->backoffs), maxRto);
+}
+
+Client::Client(std::string url, std::size_t datagramSize,
+               std::chrono::milliseconds timeout, std::size_t maxMessageSize)
+    : url{url}, datagramSize{clampDatagramSize(datagramSize)},
+      timeout{timeout}, messageCounter{std::random_device{}()},
+      reassembler{defaultPendingMessages, this->datagramSize,
+                  maxMessageSize} {
+  using udp = asio::ip::udp;
+
+  // Accept both "host" and "host:port"
+  std::string host = url;
+  std::string port = std::to_string(defaultPort);
+  if (auto pos = url.rfind(':');
+      pos != std::string::npos && url.find(':') == pos) {
+    host = url.substr(0, pos);
+    port = url.substr(pos + 1);
+  }
+
+  udp::resolver resolver{this->ctx};
+  auto endpoints = resolver.resolve(udp::v4(), host, port);
+  if (endpoints.empty()) {
+    throw std::invalid_argument("could not resolve " + url);
+  }
+  this->endpoint = endpoints.begin()->endpoint();
+  this->socket.open(udp::v4());
+  this->socket.set_option(udp::socket::receive_buffer_size{socketBufferSize});
+
+  this->receive();
+  this->thread = std::thread{[this]() {
+    while (true) {
+      try {
+        this->ctx.run();
+        return;
+      } catch (std::exception& e) {
+        std::cerr << e.what() << std::endl;
+      }
+    }
+  }};
+}
+
+Client::~Client() {
+  this->work.reset();
+  this->ctx.stop();
+  this->thread.join();
+
+  for (auto& [id, request] : this->pending) {
+    request.cb(std::make_error_code(std::errc::operation_canceled), {});
+  }
+}
 
 std::vector<std::uint8_t>
 Client::makeRequest(const std::vector<std::uint8_t>& data) {
-  using udp = asio::ip::udp;
+  std::promise<std::vector<std::uint8_t>> promise;
+  auto future = promise.get_future();
 
-  try {
-    asio::io_context io_context;
-    udp::resolver resolver{io_context};
-    udp::endpoint endpoint =
-        udp::endpoint(asio::ip::address_v4{{127, 0, 0, 1}}, 13);
-    udp::socket socket{io_context};
-    socket.open(udp::v4());
-
-    std::cout << "client sent\n";
-    socket.send_to(asio::buffer(data), endpoint);
-
-    std::vector<std::uint8_t> result(1024, 0);
-    udp::endpoint senderEndpoint;
-    auto status = std::async(std::launch::async, [&]() {
-                    socket.receive_from(asio::buffer(result), senderEndpoint);
-                  }).wait_for(std::chrono::seconds{5});
-    if (status == std::future_status::ready) {
-      std::cout << "client received\n";
-      return result;
-    }
-    if (status != std::future_status::timeout) {
-      throw std::logic_error("unknown status");
-    }
-    std::vector<std::uint8_t> result2(1024, 0);
-    status = std::async(std::launch::async, [&]() {
-               socket.receive_from(asio::buffer(result2), senderEndpoint);
-             }).wait_for(std::chrono::seconds{15});
-    if (status == std::future_status::ready) {
-      std::cout << "client received\n";
-      return result;
-    }
-    if (status != std::future_status::timeout) {
-      throw std::logic_error("unknown status");
-    }
-    throw std::runtime_error("timeout");
-  } catch (std::exception& e) {
-    std::cerr << e.what() << std::endl;
+  this->asyncRequest(this->messageCounter++, data,
+                     [&promise](std::error_code ec,
+                                std::vector<std::uint8_t> bytes) {
+                       if (ec) {
+                         promise.set_exception(std::make_exception_ptr(
+                             std::system_error(ec)));
+                         return;
+                       }
+                       promise.set_value(std::move(bytes));
+                     });
+
+  return future.get();
+}
+
+void Client::asyncRequest(std::uint64_t id, std::vector<std::uint8_t> data,
+                          protocol::callback cb) {
+  this->asyncRequestFor(id, std::move(data), this->timeout, std::move(cb));
+}
+
+void Client::asyncRequestFor(std::uint64_t id, std::vector<std::uint8_t> data,
+                             std::chrono::milliseconds timeout,
+                             protocol::callback cb) {
+  timeout = std::min(timeout, this->timeout);
+  // Socket and pending requests are only touched from the transport thread
+  asio::post(this->ctx, [this, id, data = std::move(data), timeout,
+                         cb = std::move(cb)]() mutable {
+    if (this->pending.contains(id)) {
+      cb(std::make_error_code(std::errc::device_or_resource_busy), {});
+      return;
+    }
+
+    auto ec = sendFragments(this->socket, this->endpoint, id, data,
+                            this->datagramSize);
+    if (ec) {
+      pool::buffers().release(std::move(data));
+      cb(ec, {});
+      return;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    Pending request{
+        .cb = std::move(cb),
+        .timer = std::make_unique<asio::steady_timer>(this->ctx),
+        .data = std::move(data),
+        .sent = now,
+        .deadline = now + timeout,
+        .rto = this->estimator.rto(),
+        .retransmitted = false,
+    };
+    auto it = this->pending.emplace(id, std::move(request)).first;
+    this->arm(id, it->second);
+  });
+}
+
+void Client::arm(std::uint64_t id, Pending& request) {
+  request.timer->expires_at(std::min(
+      std::chrono::steady_clock::now() + request.rto, request.deadline));
+  request.timer->async_wait([this, id](asio::error_code ec) {
+    if (!ec) {
+      this->expire(id);
+    }
+  });
+}
+
+void Client::expire(std::uint64_t id) {
+  auto it = this->pending.find(id);
+  if (it == this->pending.end()) {
+    return;
+  }
+  auto& request = it->second;
+  if (std::chrono::steady_clock::now() >= request.deadline) {
+    this->complete(id, std::make_error_code(std::errc::timed_out), {});
+    return;
   }
 
-  return {};
+  // Server recognizes the id and does not execute the request again
+  sendFragments(this->socket, this->endpoint, id, request.data,
+                this->datagramSize);
+  request.retransmitted = true;
+  this->estimator.backoff();
+  request.rto = std::min<RttEstimator::duration>(request.rto * 2, maxRto);
+  this->arm(id, request);
+}
+
+void Client::receive() {
+  this->socket.async_receive_from(
+      asio::buffer(this->buffer), this->sender,
+      [this](asio::error_code ec, std::size_t len) {
+        if (ec == asio::error::operation_aborted) {
+          return;
+        }
+        std::optional<Reassembler::Message> msg;
+        if (!ec) {
+          try {
+            msg = this->reassembler.push(
+                this->sender,
+                std::span<const std::uint8_t>{this->buffer.data(), len});
+          } catch (std::exception& e) {
+            std::cerr << e.what() << std::endl;
+          }
+        }
+        // Late replies to requests that already timed out are dropped
+        if (msg) {
+          this->complete(msg->id, {}, std::move(msg->bytes));
+        }
+        this->receive();
+      });
+}
+
+void Client::complete(std::uint64_t id, std::error_code ec,
+                      std::vector<std::uint8_t> bytes) {
+  auto it = this->pending.find(id);
+  if (it == this->pending.end()) {
+    return;
+  }
+  auto request = std::move(it->second);
+  this->pending.erase(it);
+  request.timer->cancel();
+  if (!ec && !request.retransmitted) {
+    this->estimator.sample(std::chrono::steady_clock::now() - request.sent);
+  }
+  pool::buffers().release(std::move(request.data));
+
+  request.cb(ec, std::move(bytes));
+}
+
+Server::Server(std::string address, std::uint16_t port, std::size_t sockets,
+               std::size_t datagramSize, std::size_t maxMessageSize)
+    : local{asio::ip::make_address(address), port},
+      socketCount{std::max<std::size_t>(1, sockets)},
+      datagramSize{clampDatagramSize(datagramSize)},
+      maxMessageSize{maxMessageSize} {
+  this->sockets.reserve(this->socketCount);
+  for (std::size_t i = 0; i < this->socketCount; i++) {
+    this->sockets.push_back(
+        std::make_unique<Socket>(asio::ip::udp::socket{this->ctx},
+                                 this->datagramSize));
+  }
 }
 
 void Server::setHandler(
     std::function<std::vector<std::uint8_t>(std::vector<std::uint8_t>)>
         handler) {
   this->handler = handler;
+  this->asyncHandler = nullptr;
+}
+
+void Server::setAsyncHandler(protocol::asyncHandler handler) {
+  this->asyncHandler = handler;
+  this->handler = nullptr;
 }
 
 void Server::run() {
@@ -74,33 +606,129 @@ void Server::run() {
   this->running = true;
 
   try {
-    asio::io_context io_context;
+    for (auto& it : this->sockets) {
+      it->socket.open(this->local.protocol());
+      if (this->sockets.size() > 1) {
+        it->socket.set_option(ReusePort{true});
+      }
+      it->socket.bind(this->local);
+      it->socket.set_option(
+          udp::socket::receive_buffer_size{socketBufferSize});
+    }
 
-    udp::socket socket(io_context,
-                       udp::endpoint(asio::ip::address_v4{{127, 0, 0, 1}}, 13));
+    // First socket is served by the calling thread
+    std::vector<std::jthread> threads;
+    for (std::size_t i = 1; i < this->sockets.size(); i++) {
+      threads.emplace_back([this, i]() { this->serve(*this->sockets[i]); });
+    }
+    this->serve(*this->sockets.front());
+  } catch (std::exception& e) {
+    std::cerr << e.what() << std::endl;
+  }
 
-    while (this->running) {
-      std::vector<std::uint8_t> buffer(240, 0);
-      udp::endpoint remote_endpoint;
-      // TODO: add timeout and retry
-      socket.receive_from(asio::buffer(buffer), remote_endpoint);
-      std::cout << "server received\n";
+  for (auto& it : this->sockets) {
+    asio::error_code ignored_error;
+    it->socket.close(ignored_error);
+  }
+}
 
-      std::vector<std::uint8_t> message = handler(buffer);
+void Server::serve(Socket& socket) {
+  // Fragments of a peer always arrive at the same socket
+  Reassembler reassembler{defaultPendingMessages, this->datagramSize,
+                          this->maxMessageSize};
+  Inbox inbox{};
+  Outbox outbox{this->datagramSize};
+  std::vector<std::vector<std::uint8_t>> replies;
+  std::chrono::milliseconds backoff{0};
+  while (this->running) {
+    std::error_code ec;
+    auto count = inbox.receive(socket.socket, ec);
+    if (!this->running) {
+      break;
+    }
+    if (ec) {
+      // Errors like ENOMEM persist for a while, retrying at once would spin
+      if (backoff.count() == 0) {
+        std::cerr << "recvmmsg: " << ec.message() << std::endl;
+      }
+      backoff = std::clamp(2 * backoff, std::chrono::milliseconds{1},
+                           maxReceiveBackoff);
+      std::this_thread::sleep_for(backoff);
+      continue;
+    }
+    backoff = std::chrono::milliseconds{0};
+
+    for (std::size_t i = 0; i < count; i++) {
+      auto remote = inbox.sender(i);
+      std::optional<Reassembler::Message> request;
+      try {
+        request = reassembler.push(remote, inbox.datagram(i));
+      } catch (std::exception& e) {
+        // Neither must a datagram the reassembler cannot take
+        std::cerr << e.what() << std::endl;
+      }
+      if (!request) {
+        continue;
+      }
+
+      if (this->asyncHandler) {
+        std::uint64_t ticket;
+        {
+          std::lock_guard lock{socket.sendMutex};
+          // Tickets start at 1, so unused slots match none
+          ticket = ++socket.tickets;
+          socket.waiting[ticket % socket.waiting.size()] = {
+              .remote = remote, .id = request->id, .ticket = ticket};
+        }
+        this->asyncHandler(
+            std::move(request->bytes),
+            [&socket, ticket](std::vector<std::uint8_t> message) {
+              {
+                std::lock_guard lock{socket.sendMutex};
+                auto& waiting =
+                    socket.waiting[ticket % socket.waiting.size()];
+                // Otherwise taken by a later request, the peer retransmits
+                if (waiting.ticket == ticket) {
+                  waiting.ticket = 0;
+                  sendFragments(socket.socket, waiting.remote, waiting.id,
+                                message, socket.datagramSize);
+                }
+              }
+              pool::buffers().release(std::move(message));
+            });
+        continue;
+      }
 
-      std::error_code ignored_error;
-      socket.send_to(asio::buffer(message), remote_endpoint, 0, ignored_error);
-      std::cout << "server sent\n";
+      try {
+        replies.push_back(this->handler(std::move(request->bytes)));
+        outbox.add(remote, request->id, replies.back());
+      } catch (std::exception& e) {
+        // Malformed request must not bring down the server
+        std::cerr << e.what() << std::endl;
+      }
+    }
+
+    if (!replies.empty()) {
+      {
+        std::lock_guard lock{socket.sendMutex};
+        outbox.flush(socket.socket);
+      }
+      for (auto& reply : replies) {
+        pool::buffers().release(std::move(reply));
+      }
+      replies.clear();
     }
-  } catch (std::exception& e) {
-    std::cerr << e.what() << std::endl;
   }
 }
 
 void Server::stop() {
   this->running = false;
-  this->ctx.stop();
+  // Wakes up blocking receives
+  for (auto& it : this->sockets) {
+    asio::error_code ignored_error;
+    it->socket.shutdown(asio::socket_base::shutdown_both, ignored_error);
+  }
 }
 
 } // namespace udp
-} // namespace rpc
\ No newline at end of file
+} // namespace rpc
@@ -0,0 +1,109 @@
+#include <workers.hpp>
+
+#include <exception>
+#include <iostream>
+#include <thread>
+#include <utility>
+
+namespace rpc {
+namespace workers {
+namespace {
+void run(Task& task) {
+  try {
+    task();
+  } catch (std::exception& e) {
+    std::cerr << e.what() << std::endl;
+  }
+}
+} // namespace
+
+Pool::Pool(std::size_t threads, std::size_t capacity) : queue{capacity} {
+  this->threads.reserve(threads);
+  for (std::size_t i = 0; i < threads; i++) {
+    this->threads.emplace_back([this]() { this->work(); });
+  }
+}
+
+Pool::~Pool() {
+  // Empty task stops one thread, after everything queued before it
+  for (std::size_t i = 0; i < this->threads.size(); i++) {
+    this->post(nullptr);
+  }
+  for (auto& thread : this->threads) {
+    thread.join();
+  }
+}
+
+bool Pool::tryPost(Task&& task) {
+  if (!this->queue.push(std::move(task))) {
+    return false;
+  }
+  this->queued.release();
+  return true;
+}
+
+void Pool::post(Task task) {
+  while (!this->tryPost(std::move(task))) {
+    std::this_thread::yield();
+  }
+}
+
+void Pool::work() {
+  for (;;) {
+    this->queued.acquire();
+    Task task;
+    // Task counted by the semaphore may be behind a push still in progress
+    while (!this->queue.pop(task)) {
+      std::this_thread::yield();
+    }
+    if (!task) {
+      return;
+    }
+    run(task);
+  }
+}
+
+void Serial::post(Task task) {
+  {
+    std::lock_guard lock{this->state->mutex};
+    this->state->tasks.push_back(std::move(task));
+    if (this->state->running) {
+      return;
+    }
+    this->state->running = true;
+  }
+  this->state->pool.post([state = this->state]() { Serial::drain(state); });
+}
+
+void Serial::drain(std::shared_ptr<State> state) {
+  for (;;) {
+    Task task;
+    {
+      std::lock_guard lock{state->mutex};
+      if (state->tasks.empty()) {
+        state->running = false;
+        return;
+      }
+      task = std::move(state->tasks.front());
+      state->tasks.pop_front();
+    }
+    run(task);
+
+    // One task per turn, so other work gets the thread in between. A full
+    // queue cannot be waited on from a worker, the next task runs here then.
+    Task next = [state]() { Serial::drain(state); };
+    {
+      std::lock_guard lock{state->mutex};
+      if (state->tasks.empty()) {
+        state->running = false;
+        return;
+      }
+    }
+    if (state->pool.tryPost(std::move(next))) {
+      return;
+    }
+  }
+}
+
+} // namespace workers
+} // namespace rpc
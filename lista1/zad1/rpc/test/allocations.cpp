@@ -0,0 +1,100 @@
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <gtest/gtest.h>
+#include <marshalling.hpp>
+#include <memory>
+#include <new>
+#include <pool.hpp>
+#include <server.hpp>
+#include <vector>
+
+#include "memory.hpp"
+
+namespace {
+std::atomic<long> allocations{0};
+} // namespace
+
+// Counts every allocation of this binary
+void* operator new(std::size_t size) {
+  allocations++;
+  if (auto p = std::malloc(size ? size : 1)) {
+    return p;
+  }
+  throw std::bad_alloc{};
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+namespace {
+// Transport keeping the handler to call requests through it
+class Capture : public rpc::protocol::Server {
+public:
+  virtual void setHandler(rpc::protocol::handler handler) override {
+    this->handler = std::move(handler);
+  }
+
+  virtual void
+  setAsyncHandler(rpc::protocol::asyncHandler asyncHandler) override {
+    this->asyncHandler = std::move(asyncHandler);
+  }
+
+  rpc::protocol::handler handler;
+  rpc::protocol::asyncHandler asyncHandler;
+};
+
+// Allocations made by the server for the last of many reads and writes
+long steadyAllocations(unsigned threads) {
+  using namespace rpc;
+
+  test::MemoryBackend backend;
+  auto desc = backend.open("file", 0);
+  std::vector<std::uint8_t> data(4096, 1);
+  backend.pwrite(desc, 0, data.size(), data);
+
+  auto transport = std::make_shared<Capture>();
+  server::TypedServer server{backend, transport, {}, threads};
+
+  auto call = [&](std::uint64_t id) {
+    schema::Request request{.header = {.auth = 1, .id = id}, .body = {}};
+    if (id % 2) {
+      std::vector<std::uint8_t> payload(100, 2);
+      request.body = schema::PWriteRequest{
+          .desc = desc, .offset = 0, .count = 100, .bytes = std::move(payload)};
+    } else {
+      request.body =
+          schema::PReadRequest{.desc = desc, .offset = 0, .count = 1000};
+    }
+    auto bytes = marshalling::marshalRequest(request, marshalling::latest);
+
+    auto before = allocations.load();
+    if (transport->handler) {
+      pool::buffers().release(transport->handler(std::move(bytes)));
+    } else {
+      std::atomic<bool> done{false};
+      transport->asyncHandler(std::move(bytes),
+                              [&done](std::vector<std::uint8_t> reply) {
+                                pool::buffers().release(std::move(reply));
+                                done = true;
+                              });
+      while (!done) {
+      }
+    }
+    return allocations.load() - before;
+  };
+
+  // Warms up the pools, reply cache and backend
+  for (std::uint64_t id = 0; id < 3000; id++) {
+    call(id);
+  }
+  return call(3000) + call(3001);
+}
+} // namespace
+
+TEST(rpc_allocations, inline_requests) { EXPECT_EQ(steadyAllocations(0), 0); }
+
+TEST(rpc_allocations, thread_pool_requests) {
+  EXPECT_EQ(steadyAllocations(2), 0);
+}
@@ -0,0 +1,187 @@
+#include <buffered.hpp>
+#include <cstdint>
+#include <gtest/gtest.h>
+#include <marshalling.hpp>
+#include <memory>
+#include <server.hpp>
+#include <stdexcept>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include "memory.hpp"
+
+namespace {
+// Peer serving requests in process, recording the positional ones.
+// Asynchronous calls complete before they return.
+class Direct : public rpc::protocol::Client {
+public:
+  using Range = std::pair<rpc::schema::off_t, std::uint64_t>;
+
+  virtual std::vector<std::uint8_t>
+  makeRequest(const std::vector<std::uint8_t>& data) override {
+    using namespace rpc;
+    auto version = marshalling::detectVersion(data);
+    auto request = marshalling::unmarshalRequest(data);
+    if (auto req = std::get_if<schema::PWriteRequest>(&request.body)) {
+      this->pwrites.emplace_back(req->offset, req->count);
+    } else if (auto req = std::get_if<schema::PReadRequest>(&request.body)) {
+      this->preads.emplace_back(req->offset, req->count);
+    } else if (std::holds_alternative<schema::AdviseRequest>(request.body)) {
+      this->advised++;
+    }
+
+    auto response = this->server.dispatch(request);
+    if (auto res = std::get_if<schema::PWriteResponse>(&response.body);
+        res && this->shortWrites) {
+      res->written--;
+    }
+    return marshalling::marshalResponse(response, version);
+  }
+
+  test::MemoryBackend backend{};
+  rpc::server::TypedServer<test::MemoryBackend> server{
+      backend, std::make_shared<test::NoTransport>(), {}};
+  std::vector<Range> pwrites{};
+  std::vector<Range> preads{};
+  int advised{0};
+  // Stores one byte less than asked for
+  bool shortWrites{false};
+};
+
+constexpr auto readWrite = static_cast<rpc::schema::mode_t>(std::ios_base::in |
+                                                            std::ios_base::out);
+
+std::vector<std::uint8_t> bytes(std::uint8_t first, std::size_t count) {
+  std::vector<std::uint8_t> v(count);
+  for (std::size_t i = 0; i < count; i++) {
+    v[i] = first + i;
+  }
+  return v;
+}
+} // namespace
+
+TEST(rpc_buffered, coalescing) {
+  using namespace rpc;
+  using Range = Direct::Range;
+  auto peer = std::make_shared<Direct>();
+  client::Client client{1, peer};
+  auto desc = client.open("f", readWrite);
+  client::BufferedFile file{client, desc, {.blockSize = 4, .maxInFlight = 2}};
+
+  // Small writes are sent as full blocks
+  EXPECT_EQ(file.write(3, bytes(0, 3)), 3);
+  EXPECT_TRUE(peer->pwrites.empty());
+  EXPECT_EQ(file.write(3, bytes(3, 3)), 3);
+  EXPECT_EQ(peer->pwrites, (std::vector<Range>{{0, 4}}));
+
+  // Flush sends the rest and moves the server's offset past it
+  file.flush();
+  EXPECT_EQ(peer->pwrites, (std::vector<Range>{{0, 4}, {4, 2}}));
+  EXPECT_EQ(client.lseek(desc, 0, SEEK_CUR), 6);
+  EXPECT_EQ(peer->backend.contents("f"), bytes(0, 6));
+
+  // Relative seeks count the bytes still buffered
+  file.write(2, bytes(6, 2));
+  EXPECT_EQ(file.lseek(1, SEEK_CUR), 9);
+  file.write(1, bytes(9, 1));
+  EXPECT_EQ(file.close(), 0);
+  auto expected = bytes(0, 10);
+  expected[8] = 0;
+  EXPECT_EQ(peer->backend.contents("f"), expected);
+}
+
+TEST(rpc_buffered, short_write) {
+  using namespace rpc;
+  auto peer = std::make_shared<Direct>();
+  client::Client client{1, peer};
+  auto desc = client.open("f", readWrite);
+  client::BufferedFile file{client, desc, {.blockSize = 4, .maxInFlight = 2}};
+
+  // Reply of the full block reports a short write, the next send throws it
+  peer->shortWrites = true;
+  EXPECT_EQ(file.write(4, bytes(0, 4)), 4);
+  peer->shortWrites = false;
+  EXPECT_THROW(file.write(4, bytes(4, 4)), std::runtime_error);
+  EXPECT_EQ(peer->pwrites.size(), 1u);
+
+  // Thrown once, later blocks go through
+  file.flush();
+  EXPECT_EQ(peer->pwrites.size(), 2u);
+}
+
+TEST(rpc_read_ahead, trigger_and_end) {
+  using namespace rpc;
+  using Range = Direct::Range;
+  auto peer = std::make_shared<Direct>();
+  client::Client client{1, peer};
+  auto desc = client.open("f", readWrite);
+  auto data = bytes(0, 10);
+  client.write(desc, data);
+  client.lseek(desc, 0, SEEK_SET);
+  client::ReadAheadFile file{
+      client, desc, {.blockSize = 4, .depth = 2, .trigger = 2}};
+
+  // Reads before the trigger go straight to the server
+  std::vector<std::uint8_t> v;
+  EXPECT_EQ(file.read(2, v), 2);
+  EXPECT_EQ(file.read(2, v), 2);
+  EXPECT_EQ(v, bytes(2, 2));
+  EXPECT_EQ(peer->preads, (std::vector<Range>{{0, 2}, {2, 2}}));
+  EXPECT_EQ(peer->advised, 0);
+
+  // Then whole blocks are fetched ahead and the server is advised
+  EXPECT_EQ(file.read(2, v), 2);
+  EXPECT_EQ(v, bytes(4, 2));
+  EXPECT_EQ(peer->advised, 1);
+  EXPECT_EQ(peer->preads,
+            (std::vector<Range>{{0, 2}, {2, 2}, {4, 4}, {8, 4}}));
+
+  // File ends inside a fetched block, the read stops there without
+  // fetching again
+  EXPECT_EQ(file.read(10, v), 4);
+  EXPECT_EQ(v, bytes(6, 4));
+  EXPECT_EQ(peer->preads.size(), 5u);
+  EXPECT_EQ(peer->preads.back(), (Range{12, 4}));
+
+  // At the end the next read asks again, the file may have grown
+  EXPECT_EQ(file.read(10, v), 0);
+  EXPECT_EQ(peer->preads.size(), 7u);
+  EXPECT_EQ(peer->preads[5], (Range{8, 4}));
+
+  file.sync();
+  EXPECT_EQ(client.lseek(desc, 0, SEEK_CUR), 10);
+}
+
+TEST(rpc_read_ahead, seek_drops_blocks) {
+  using namespace rpc;
+  using Range = Direct::Range;
+  auto peer = std::make_shared<Direct>();
+  client::Client client{1, peer};
+  auto desc = client.open("f", readWrite);
+  auto data = bytes(0, 12);
+  client.write(desc, data);
+  client.lseek(desc, 0, SEEK_SET);
+  client::ReadAheadFile file{
+      client, desc, {.blockSize = 4, .depth = 2, .trigger = 0}};
+
+  std::vector<std::uint8_t> v;
+  EXPECT_EQ(file.read(1, v), 1);
+  EXPECT_EQ(peer->preads, (std::vector<Range>{{0, 4}, {4, 4}}));
+
+  // Blocks fetched before the seek are not served after it
+  std::vector<std::uint8_t> changed{42};
+  client.pwrite(desc, 4, 1, changed);
+  EXPECT_EQ(file.lseek(4, SEEK_SET), 4);
+  EXPECT_EQ(file.read(1, v), 1);
+  EXPECT_EQ(v, changed);
+  EXPECT_EQ(peer->preads,
+            (std::vector<Range>{{0, 4}, {4, 4}, {4, 4}, {8, 4}}));
+
+  // Seeking to where the reader already is keeps them
+  EXPECT_EQ(file.lseek(0, SEEK_CUR), 5);
+  EXPECT_EQ(file.read(3, v), 3);
+  EXPECT_EQ(v, bytes(5, 3));
+  EXPECT_EQ(peer->preads.size(), 5u);
+  EXPECT_EQ(file.close(), 0);
+}
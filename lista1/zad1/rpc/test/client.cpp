@@ -0,0 +1,225 @@
+#include <atomic>
+#include <chrono>
+#include <client.hpp>
+#include <exception>
+#include <future>
+#include <gtest/gtest.h>
+#include <ios>
+#include <marshalling.hpp>
+#include <memory>
+#include <server.hpp>
+#include <span>
+#include <system_error>
+#include <thread>
+#include <udp.hpp>
+#include <variant>
+#include <vector>
+
+#include "memory.hpp"
+
+namespace {
+// Peer predating V2, drops such requests without replying
+class LegacyPeer : public rpc::protocol::Client {
+public:
+  virtual std::vector<std::uint8_t>
+  makeRequest(const std::vector<std::uint8_t>& data) override {
+    using namespace rpc;
+    if (marshalling::detectVersion(data) != marshalling::Version::V1) {
+      this->dropped++;
+      throw std::system_error(std::make_error_code(std::errc::timed_out));
+    }
+    this->answered++;
+    auto req = marshalling::unmarshalRequest(data);
+    return marshalling::marshalResponse(
+        {.id = req.header.id,
+         .code = schema::Code::OK,
+         .body = schema::CloseResponse{.result = 0}},
+        marshalling::Version::V1);
+  }
+
+  virtual void asyncRequestFor(std::uint64_t id,
+                               std::vector<std::uint8_t> data,
+                               std::chrono::milliseconds timeout,
+                               rpc::protocol::callback cb) override {
+    this->timeout = timeout;
+    this->asyncRequest(id, std::move(data), std::move(cb));
+  }
+
+  int dropped{0};
+  int answered{0};
+  std::chrono::milliseconds timeout{};
+};
+
+// Peer answering every read with more bytes than were asked for
+class Oversized : public rpc::protocol::Client {
+public:
+  virtual std::vector<std::uint8_t>
+  makeRequest(const std::vector<std::uint8_t>& data) override {
+    using namespace rpc;
+    auto version = marshalling::detectVersion(data);
+    auto req = marshalling::unmarshalRequest(data);
+    std::vector<std::uint8_t> bytes(16, 9);
+    schema::ResponseBody body;
+    if (std::holds_alternative<schema::ReadRequest>(req.body)) {
+      body = schema::ReadResponse{.read = 16, .bytes = bytes};
+    } else {
+      body = schema::PReadResponse{.read = 16, .bytes = bytes};
+    }
+    return marshalling::marshalResponse(
+        {.id = req.header.id, .code = schema::Code::OK, .body = body},
+        version);
+  }
+};
+
+constexpr auto readWrite = static_cast<rpc::schema::mode_t>(std::ios_base::in |
+                                                            std::ios_base::out);
+
+// Server on a loopback UDP port, backed by memory
+class Loopback {
+public:
+  Loopback(std::uint16_t port, std::size_t threads = 4)
+      : transport{std::make_shared<rpc::udp::Server>("127.0.0.1", port)},
+        server{backend, transport, {}, threads},
+        thread{[this]() { this->transport->run(); }} {
+    // Socket is bound by run()
+    std::this_thread::sleep_for(std::chrono::milliseconds{100});
+  }
+  ~Loopback() {
+    this->transport->stop();
+    this->thread.join();
+  }
+
+  test::MemoryBackend backend{};
+  std::shared_ptr<rpc::udp::Server> transport;
+  rpc::server::TypedServer<test::MemoryBackend> server;
+  std::thread thread;
+};
+
+// Block i of a file holds i in all of its bytes
+std::vector<std::uint8_t> block(std::size_t i, std::size_t size) {
+  return std::vector<std::uint8_t>(size, i % 251);
+}
+} // namespace
+
+TEST(rpc_client, version_fallback) {
+  using namespace rpc;
+  using namespace std::chrono_literals;
+
+  auto peer = std::make_shared<LegacyPeer>();
+  client::Client client{1, peer, client::defaultWindow, marshalling::latest,
+                        50ms};
+  // Probe is given its own timeout, the call is retried as V1
+  EXPECT_EQ(client.close(3), 0);
+  EXPECT_EQ(peer->dropped, 1);
+  EXPECT_EQ(peer->answered, 1);
+  EXPECT_EQ(peer->timeout, 50ms);
+
+  // Later calls skip the probe until it is due again
+  EXPECT_EQ(client.close(3), 0);
+  EXPECT_EQ(peer->dropped, 1);
+  EXPECT_EQ(peer->answered, 2);
+
+  // Fallback belongs to the client that probed, not to the transport
+  client::Client other{1, peer};
+  std::int64_t result = -1;
+  other.closeAsync(3, [&result](std::exception_ptr e, std::int64_t r) {
+    EXPECT_FALSE(e);
+    result = r;
+  });
+  EXPECT_EQ(result, 0);
+  EXPECT_EQ(peer->dropped, 2);
+  EXPECT_EQ(peer->answered, 3);
+  EXPECT_EQ(peer->timeout, client::defaultProbeTimeout);
+}
+
+TEST(rpc_client, pipelining) {
+  using namespace rpc;
+  using namespace std::chrono_literals;
+  constexpr std::size_t blocks = 500;
+  constexpr std::size_t blockSize = 16;
+
+  Loopback loopback{15741};
+  auto transport = std::make_shared<udp::Client>("127.0.0.1:15741");
+  // Far fewer requests in flight than issued, the rest waits in the backlog
+  client::Client client{1, transport, 8};
+  auto desc = client.open("f", readWrite);
+  ASSERT_NE(desc, 0u);
+
+  // Completed by callbacks, from the transport's thread
+  std::atomic<std::size_t> written{0};
+  std::promise<void> writes;
+  for (std::size_t i = 0; i < blocks; i++) {
+    client.pwriteAsync(desc, i * blockSize, block(i, blockSize),
+                       [&](std::exception_ptr e, std::int64_t n) {
+                         EXPECT_FALSE(e);
+                         EXPECT_EQ(n, static_cast<std::int64_t>(blockSize));
+                         if (++written == blocks) {
+                           writes.set_value();
+                         }
+                       });
+  }
+  ASSERT_EQ(writes.get_future().wait_for(20s), std::future_status::ready);
+
+  // Replies are matched to requests by id, whatever order they come in
+  std::vector<std::future<schema::PReadResponse>> reads;
+  for (std::size_t i = 0; i < blocks; i++) {
+    reads.push_back(
+        client.preadAsync(desc, i * blockSize, blockSize, asio::use_future));
+  }
+  for (std::size_t i = 0; i < blocks; i++) {
+    auto res = reads[i].get();
+    EXPECT_EQ(res.read, static_cast<std::int64_t>(blockSize));
+    EXPECT_EQ(res.bytes, block(i, blockSize));
+  }
+
+  // Coroutines resume on their own executor
+  asio::io_context ctx;
+  std::int64_t read = -1;
+  asio::co_spawn(
+      ctx,
+      [&]() -> asio::awaitable<void> {
+        auto res = co_await client.preadAsync(desc, 7 * blockSize, blockSize,
+                                              asio::use_awaitable);
+        EXPECT_EQ(res.bytes, block(7, blockSize));
+        read = co_await client.closeAsync(desc, asio::use_awaitable);
+      },
+      asio::detached);
+  ctx.run();
+  EXPECT_EQ(read, 0);
+}
+
+TEST(rpc_client, spans) {
+  using namespace rpc;
+
+  // Reads fill no more than the span, whatever the reply holds
+  client::Client oversized{1, std::make_shared<Oversized>()};
+  std::vector<std::uint8_t> buffer(8, 0);
+  EXPECT_EQ(oversized.read(3, std::span{buffer}.first(4)), 4);
+  EXPECT_EQ(buffer, (std::vector<std::uint8_t>{9, 9, 9, 9, 0, 0, 0, 0}));
+  buffer.assign(8, 0);
+  EXPECT_EQ(oversized.pread(3, 0, std::span{buffer}.subspan(2, 3)), 3);
+  EXPECT_EQ(buffer, (std::vector<std::uint8_t>{0, 0, 9, 9, 9, 0, 0, 0}));
+
+  Loopback loopback{15742, 0};
+  client::Client client{1, std::make_shared<udp::Client>("127.0.0.1:15742")};
+  auto desc = client.open("f", readWrite);
+  ASSERT_NE(desc, 0u);
+
+  // Writes send just the sub-span
+  std::vector<std::uint8_t> data{1, 2, 3, 4, 5, 6, 7, 8};
+  std::span<const std::uint8_t> all{data};
+  EXPECT_EQ(client.write(desc, all.subspan(2, 3)), 3);
+  EXPECT_EQ(client.pwrite(desc, 1, all.last(2)), 2);
+  EXPECT_EQ(loopback.backend.contents("f"),
+            (std::vector<std::uint8_t>{3, 7, 8}));
+
+  // Short file fills the front of the span only
+  buffer.assign(8, 0);
+  EXPECT_EQ(client.lseek(desc, 1, SEEK_SET), 1);
+  EXPECT_EQ(client.read(desc, buffer), 2);
+  EXPECT_EQ(buffer, (std::vector<std::uint8_t>{7, 8, 0, 0, 0, 0, 0, 0}));
+  buffer.assign(8, 0);
+  EXPECT_EQ(client.pread(desc, 0, std::span{buffer}.last(4)), 3);
+  EXPECT_EQ(buffer, (std::vector<std::uint8_t>{0, 0, 0, 0, 3, 7, 8, 0}));
+  EXPECT_EQ(client.close(desc), 0);
+}
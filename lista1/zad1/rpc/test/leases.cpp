@@ -0,0 +1,84 @@
+#include <chrono>
+#include <gtest/gtest.h>
+#include <leases.hpp>
+#include <thread>
+
+using namespace std::chrono_literals;
+
+TEST(rpc_leases, revocations) {
+  rpc::server::LeaseTable leases{10s};
+  // Nobody holds a lease, nothing to revoke
+  leases.modified("a");
+  auto lease = leases.grant("a");
+  EXPECT_EQ(lease.term, 10000u);
+  EXPECT_EQ(lease.sequence, 0u);
+  EXPECT_EQ(leases.revoked(0).revocations.size(), 0u);
+
+  // Writes through a descriptor revoke the lease of its path
+  leases.opened(3, "dir/../a");
+  leases.written(3);
+  auto res = leases.revoked(lease.sequence);
+  EXPECT_EQ(res.complete, 1u);
+  ASSERT_EQ(res.revocations.size(), 1u);
+  EXPECT_EQ(res.revocations[0].pathname, "a");
+  EXPECT_NE(res.revocations[0].version, lease.version);
+  EXPECT_EQ(leases.revoked(res.sequence).revocations.size(), 0u);
+
+  // File being written is not leased again within the term
+  EXPECT_EQ(leases.grant("./a").term, 0u);
+  leases.closed(3);
+  leases.written(3);
+  EXPECT_EQ(leases.revoked(res.sequence).revocations.size(), 0u);
+}
+
+TEST(rpc_leases, expiry) {
+  rpc::server::LeaseTable leases{50ms, 2};
+  auto lease = leases.grant("b");
+  std::this_thread::sleep_for(60ms);
+  // Expired lease is not revoked, a new one gets the new version
+  leases.modified("b");
+  EXPECT_EQ(leases.revoked(lease.sequence).sequence, lease.sequence);
+  std::this_thread::sleep_for(60ms);
+  auto renewed = leases.grant("b");
+  EXPECT_EQ(renewed.term, 50u);
+  EXPECT_NE(renewed.version, lease.version);
+
+  // Revocations dropped from the log revoke everything
+  for (int i = 0; i < 3; i++) {
+    leases.grant("c");
+    leases.modified("c");
+    std::this_thread::sleep_for(60ms);
+  }
+  EXPECT_EQ(leases.revoked(renewed.sequence).complete, 0u);
+  EXPECT_EQ(leases.revoked(renewed.sequence + 1).complete, 1u);
+}
+
+TEST(rpc_leases, renames) {
+  rpc::server::LeaseTable leases{10s};
+  auto old = leases.grant("dir/a");
+  leases.grant("dirt/a");
+  leases.opened(3, "dir/a");
+
+  // Renamed directory revokes the paths under it, not its namesakes
+  leases.removed("dir/");
+  leases.removed("moved");
+  leases.renamed("dir", "moved");
+  auto res = leases.revoked(old.sequence);
+  ASSERT_EQ(res.revocations.size(), 1u);
+  EXPECT_EQ(res.revocations[0].pathname, "dir/a");
+
+  // Descriptor writes revoke the new name
+  auto moved = leases.grant("moved/a");
+  leases.written(3);
+  auto after = leases.revoked(res.sequence);
+  ASSERT_EQ(after.revocations.size(), 1u);
+  EXPECT_EQ(after.revocations[0].pathname, "moved/a");
+  EXPECT_NE(after.revocations[0].version, moved.version);
+
+  // Unlinked directory revokes its files
+  leases.grant("gone/b");
+  leases.removed("gone");
+  auto unlinked = leases.revoked(after.sequence);
+  ASSERT_EQ(unlinked.revocations.size(), 1u);
+  EXPECT_EQ(unlinked.revocations[0].pathname, "gone/b");
+}
@@ -1,7 +1,125 @@
 #include "schema.hpp"
+#include <cstdint>
 #include <gtest/gtest.h>
+#include <limits>
 #include <marshalling.hpp>
+#include <pool.hpp>
+#include <set>
+#include <string>
+#include <tuple>
+#include <type_traits>
 #include <variant>
+#include <vector>
+
+namespace {
+// Compares messages field by field, they have no operator==
+template <typename T> bool same(const T& a, const T& b) {
+  if constexpr (requires { T::fields(); }) {
+    return std::apply(
+        [&](auto... field) { return (same(a.*field, b.*field) && ...); },
+        T::fields());
+  } else if constexpr (requires { std::variant_size<T>::value; }) {
+    return a.index() == b.index() &&
+           std::visit(
+               [&b](const auto& value) {
+                 return same(value,
+                             std::get<std::decay_t<decltype(value)>>(b));
+               },
+               a);
+  } else if constexpr (requires { a.begin(); } &&
+                       !std::is_same_v<T, std::string>) {
+    return std::equal(a.begin(), a.end(), b.begin(), b.end(),
+                      [](const auto& x, const auto& y) { return same(x, y); });
+  } else {
+    return a == b;
+  }
+}
+
+// One message of every kind, with values wide enough to need every byte of
+// their fields
+std::vector<rpc::schema::RequestBody> requestBodies() {
+  using namespace rpc::schema;
+  constexpr auto huge = std::numeric_limits<std::uint64_t>::max();
+  constexpr auto lowest = std::numeric_limits<off_t>::min();
+  std::vector<RequestBody> bodies{
+      OpenRequest{.pathname = "dir/file", .mode = 0x80000001},
+      ReadRequest{.desc = 0xffffffff, .count = huge},
+      WriteRequest{.desc = 1, .count = 3, .bytes = {0, 0x80, 0xff}},
+      LSeekRequest{.desc = 2, .offset = lowest, .whence = 2},
+      ChmodRequest{.pathname = "", .mode = 0755},
+      UnlinkRequest{.pathname = std::string(300, 'u')},
+      RenameRequest{.oldpath = "old", .newpath = "new"},
+      CloseRequest{.desc = batchRef(7)},
+      PReadRequest{.desc = 3, .offset = -1, .count = 1 << 20},
+      PWriteRequest{.desc = 4, .offset = 1ll << 40, .count = 1, .bytes = {9}},
+      ReadVRequest{.desc = 5,
+                   .extents = {{.offset = 0, .count = 0},
+                               {.offset = -128, .count = huge}}},
+      WriteVRequest{.desc = 6,
+                    .extents = {{.offset = 127, .count = 2}},
+                    .count = 2,
+                    .bytes = {1, 2}},
+      AdviseRequest{.desc = 7,
+                    .offset = 128,
+                    .count = 0,
+                    .advice = static_cast<std::uint32_t>(Advice::NOREUSE)},
+      LeaseRequest{.pathname = "leased"},
+      RevocationsRequest{.since = huge - 1},
+  };
+  BatchRequest batch{.requests = {}};
+  for (const auto& body : bodies) {
+    std::visit(
+        [&batch](const auto& req) {
+          if constexpr (std::is_constructible_v<SubRequest, decltype(req)>) {
+            batch.requests.push_back(req);
+          }
+        },
+        body);
+  }
+  bodies.push_back(std::move(batch));
+  return bodies;
+}
+
+std::vector<rpc::schema::ResponseBody> responseBodies() {
+  using namespace rpc::schema;
+  constexpr auto huge = std::numeric_limits<std::uint64_t>::max();
+  constexpr auto lowest = std::numeric_limits<std::int64_t>::min();
+  std::vector<ResponseBody> bodies{
+      OpenResponse{.file = 0xffffffff},
+      ReadResponse{.read = 3, .bytes = {0, 0x80, 0xff}},
+      WriteResponse{.written = -1},
+      LSeekResponse{.offset = lowest},
+      ChmodResponse{.result = 0},
+      UnlinkResponse{.result = -2},
+      RenameResponse{.result = 1ll << 40},
+      CloseResponse{.result = -128},
+      PReadResponse{.read = 0, .bytes = {}},
+      PWriteResponse{.written = 1 << 20},
+      ReadVResponse{.read = {2, -1, 0}, .count = 2, .bytes = {4, 5}},
+      WriteVResponse{.written = 127},
+      AdviseResponse{.result = 0},
+      LeaseResponse{.version = huge, .term = 2000, .sequence = 1},
+      RevocationsResponse{
+          .sequence = huge,
+          .complete = 1,
+          .revocations = {{.pathname = "a", .version = 1},
+                          {.pathname = std::string(200, 'r'),
+                           .version = huge}}},
+  };
+  BatchResponse batch{.responses = {}};
+  for (const auto& body : bodies) {
+    std::visit(
+        [&batch](const auto& res) {
+          if constexpr (std::is_constructible_v<SubResponse, decltype(res)>) {
+            batch.responses.push_back(res);
+          }
+        },
+        body);
+  }
+  bodies.push_back(std::move(batch));
+  return bodies;
+}
+} // namespace
 
 TEST(rpc_marshalling, request) {
   using namespace rpc;
@@ -76,6 +194,21 @@ TEST(rpc_marshalling, request) {
     EXPECT_EQ(ptr->pathname, body.pathname);
   }
 
+  // WriteRequest larger than the message struct
+  {
+    schema::WriteRequest body{
+        .desc = 3, .count = 4096, .bytes = std::vector<std::uint8_t>(4096, 7)};
+    schema::Request req{.header = {.auth = 4, .id = 41}, .body = body};
+    auto bytes = marshalling::marshalRequest(req);
+    auto unmarshaled = marshalling::unmarshalRequest(bytes);
+    EXPECT_EQ(req.header.id, unmarshaled.header.id);
+    auto ptr = std::get_if<schema::WriteRequest>(&unmarshaled.body);
+    ASSERT_TRUE(ptr);
+    EXPECT_EQ(ptr->desc, body.desc);
+    EXPECT_EQ(ptr->count, body.count);
+    EXPECT_EQ(ptr->bytes, body.bytes);
+  }
+
   // UnlinkRequest
   {
     schema::UnlinkRequest body{.pathname = "test"};
@@ -88,6 +221,41 @@ TEST(rpc_marshalling, request) {
     ASSERT_TRUE(ptr);
     EXPECT_EQ(ptr->pathname, body.pathname);
   }
+
+  // PWriteRequest, offset precedes the byte count
+  {
+    schema::PWriteRequest body{
+        .desc = 3, .offset = 1 << 20, .count = 3, .bytes = {1, 2, 3}};
+    for (auto version : {marshalling::Version::V1, marshalling::Version::V2}) {
+      schema::Request req{.header = {.auth = 4, .id = 42}, .body = body};
+      auto bytes = marshalling::marshalRequest(req, version);
+      EXPECT_EQ(bytes.size(), marshalling::requestSize(req, version));
+      auto unmarshaled = marshalling::unmarshalRequest(bytes);
+      auto ptr = std::get_if<schema::PWriteRequest>(&unmarshaled.body);
+      ASSERT_TRUE(ptr);
+      EXPECT_EQ(ptr->desc, body.desc);
+      EXPECT_EQ(ptr->offset, body.offset);
+      EXPECT_EQ(ptr->bytes, body.bytes);
+    }
+  }
+
+  // WriteVRequest, sequence of messages
+  {
+    schema::WriteVRequest body{
+        .desc = 3,
+        .extents = {{.offset = 10, .count = 1}, {.offset = 0, .count = 2}},
+        .count = 3,
+        .bytes = {1, 2, 3}};
+    schema::Request req{.header = {.auth = 4, .id = 43}, .body = body};
+    auto unmarshaled =
+        marshalling::unmarshalRequest(marshalling::marshalRequest(req));
+    auto ptr = std::get_if<schema::WriteVRequest>(&unmarshaled.body);
+    ASSERT_TRUE(ptr);
+    ASSERT_EQ(ptr->extents.size(), 2);
+    EXPECT_EQ(ptr->extents[0].offset, 10);
+    EXPECT_EQ(ptr->extents[1].count, 2);
+    EXPECT_EQ(ptr->bytes, body.bytes);
+  }
 }
 
 TEST(rpc_marshalling, response) {
@@ -109,4 +277,195 @@ TEST(rpc_marshalling, response) {
     EXPECT_EQ(ptr->read, body.read);
     EXPECT_EQ(ptr->bytes, body.bytes);
   }
-}
\ No newline at end of file
+
+  // ReadVResponse, sequence of integers
+  {
+    schema::ReadVResponse body{.read = {2, -1, 0, 1}, .count = 3,
+                               .bytes = {1, 2, 3}};
+    schema::Response resp{.id = 6, .code = schema::Code::OK, .body = body};
+    for (auto version : {marshalling::Version::V1, marshalling::Version::V2}) {
+      auto bytes = marshalling::marshalResponse(resp, version);
+      auto unmarshaled = marshalling::unmarshalResponse(bytes);
+      auto ptr = std::get_if<schema::ReadVResponse>(&unmarshaled.body);
+      ASSERT_TRUE(ptr);
+      EXPECT_EQ(ptr->read, body.read);
+      EXPECT_EQ(ptr->bytes, body.bytes);
+    }
+  }
+}
+TEST(rpc_marshalling, batch) {
+  using namespace rpc;
+
+  auto ref = schema::batchRef(0);
+  schema::BatchRequest body{.requests = {
+                                schema::OpenRequest{.pathname = "file",
+                                                    .mode = 3},
+                                schema::WriteRequest{
+                                    .desc = ref, .count = 2, .bytes = {1, 2}},
+                                schema::CloseRequest{.desc = ref},
+                            }};
+  schema::Request req{.header = {.auth = 1, .id = 2}, .body = body};
+  auto unmarshaled =
+      marshalling::unmarshalRequest(marshalling::marshalRequest(req));
+  auto batch = std::get_if<schema::BatchRequest>(&unmarshaled.body);
+  ASSERT_TRUE(batch);
+  ASSERT_EQ(batch->requests.size(), 3);
+  auto open = std::get_if<schema::OpenRequest>(&batch->requests[0]);
+  ASSERT_TRUE(open);
+  EXPECT_EQ(open->pathname, "file");
+  auto write = std::get_if<schema::WriteRequest>(&batch->requests[1]);
+  ASSERT_TRUE(write);
+  EXPECT_EQ(write->desc, ref);
+  EXPECT_EQ(write->bytes, std::vector<std::uint8_t>({1, 2}));
+  EXPECT_TRUE(std::holds_alternative<schema::CloseRequest>(batch->requests[2]));
+
+  schema::BatchResponse resBody{.responses = {
+                                    schema::OpenResponse{.file = 7},
+                                    schema::WriteResponse{.written = 2},
+                                }};
+  schema::Response resp{.id = 2, .code = schema::Code::OK, .body = resBody};
+  auto result =
+      marshalling::unmarshalResponse(marshalling::marshalResponse(resp));
+  auto res = std::get_if<schema::BatchResponse>(&result.body);
+  ASSERT_TRUE(res);
+  ASSERT_EQ(res->responses.size(), 2);
+  EXPECT_EQ(std::get<schema::OpenResponse>(res->responses[0]).file, 7);
+  EXPECT_EQ(std::get<schema::WriteResponse>(res->responses[1]).written, 2);
+}
+
+TEST(rpc_marshalling, views) {
+  using namespace rpc;
+
+  schema::Request req{
+      .header = {.auth = 1, .id = 2},
+      .body = schema::WriteRequest{.desc = 3, .count = 2, .bytes = {7, 8, 9}},
+  };
+  auto size = marshalling::requestSize(req);
+  std::vector<std::uint8_t> buffer(size);
+  EXPECT_EQ(marshalling::encodeRequest(req, buffer), size);
+  EXPECT_THROW(marshalling::encodeRequest(
+                   req, std::span{buffer}.first(size - 1)),
+               std::length_error);
+
+  auto view = marshalling::decodeRequest(buffer);
+  auto write = std::get_if<view::WriteRequest>(&view.body);
+  ASSERT_TRUE(write);
+  EXPECT_EQ(write->bytes.size(), 2);
+  // Payload is not copied
+  EXPECT_EQ(write->bytes.data(), buffer.data() + size - 2);
+
+  EXPECT_THROW(marshalling::decodeRequest(std::span{buffer}.first(size - 1)),
+               std::invalid_argument);
+}
+
+TEST(rpc_marshalling, versions) {
+  using namespace rpc;
+
+  schema::Request req{
+      .header = {.auth = 1, .id = 0x0102030405060708},
+      .body = schema::LSeekRequest{.desc = 3, .offset = -2, .whence = 1},
+  };
+  auto v1 = marshalling::marshalRequest(req, marshalling::Version::V1);
+  auto v2 = marshalling::marshalRequest(req, marshalling::Version::V2);
+  EXPECT_LT(v2.size(), v1.size());
+  EXPECT_EQ(marshalling::detectVersion(v1), marshalling::Version::V1);
+  EXPECT_EQ(marshalling::detectVersion(v2), marshalling::Version::V2);
+  // Fixed width fields are little endian regardless of host
+  EXPECT_EQ(v2[4], 1);
+  EXPECT_EQ(v2[12], 0x08);
+  EXPECT_EQ(v2[19], 0x01);
+
+  for (const auto& bytes : {v1, v2}) {
+    auto unmarshaled = marshalling::unmarshalRequest(bytes);
+    EXPECT_EQ(unmarshaled.header.id, req.header.id);
+    auto lseek = std::get_if<schema::LSeekRequest>(&unmarshaled.body);
+    ASSERT_TRUE(lseek);
+    EXPECT_EQ(lseek->desc, 3);
+    EXPECT_EQ(lseek->offset, -2);
+    EXPECT_EQ(lseek->whence, 1);
+  }
+
+  schema::Response resp{
+      .id = 5,
+      .code = schema::Code::OK,
+      .body = schema::BatchResponse{.responses = {
+                                        schema::OpenResponse{.file = 300},
+                                        schema::CloseResponse{.result = -1},
+                                    }}};
+  auto result = marshalling::unmarshalResponse(marshalling::marshalResponse(
+      resp, marshalling::Version::V2));
+  auto batch = std::get_if<schema::BatchResponse>(&result.body);
+  ASSERT_TRUE(batch);
+  ASSERT_EQ(batch->responses.size(), 2);
+  EXPECT_EQ(std::get<schema::OpenResponse>(batch->responses[0]).file, 300);
+  EXPECT_EQ(std::get<schema::CloseResponse>(batch->responses[1]).result, -1);
+}
+
+TEST(rpc_marshalling, pool) {
+  using namespace rpc;
+
+  pool::BufferPool buffers{1};
+  auto buffer = buffers.acquire();
+  EXPECT_GE(buffer.capacity(), pool::slabSize);
+  buffer.assign(100, 1);
+  auto data = buffer.data();
+  buffers.release(std::move(buffer));
+
+  // Released buffer comes back empty with its storage kept
+  auto reused = buffers.acquire();
+  EXPECT_TRUE(reused.empty());
+  EXPECT_EQ(reused.data(), data);
+
+  // Buffers too small to be worth keeping are dropped
+  buffers.release(std::vector<std::uint8_t>(10));
+  EXPECT_NE(buffers.acquire().capacity(), 10);
+}
+
+TEST(rpc_marshalling, round_trip) {
+  using namespace rpc;
+
+  // Every alternative is covered, batches carry every sub-message
+  auto requests = requestBodies();
+  auto responses = responseBodies();
+  std::set<std::size_t> kinds;
+  for (const auto& body : requests) {
+    kinds.insert(body.index());
+  }
+  EXPECT_EQ(kinds.size(), std::variant_size_v<schema::RequestBody>);
+  kinds.clear();
+  for (const auto& body : responses) {
+    kinds.insert(body.index());
+  }
+  EXPECT_EQ(kinds.size(), std::variant_size_v<schema::ResponseBody>);
+  EXPECT_EQ(std::get<schema::BatchRequest>(requests.back()).requests.size(),
+            std::variant_size_v<schema::SubRequest>);
+  EXPECT_EQ(std::get<schema::BatchResponse>(responses.back()).responses.size(),
+            std::variant_size_v<schema::SubResponse>);
+
+  for (auto version : {marshalling::Version::V1, marshalling::Version::V2}) {
+    for (const auto& body : requests) {
+      SCOPED_TRACE(body.index());
+      schema::Request req{.header = {.auth = 0xfedcba9876543210, .id = 300},
+                          .body = body};
+      auto bytes = marshalling::marshalRequest(req, version);
+      EXPECT_EQ(bytes.size(), marshalling::requestSize(req, version));
+      EXPECT_EQ(marshalling::detectVersion(bytes), version);
+      auto unmarshaled = marshalling::unmarshalRequest(bytes);
+      EXPECT_EQ(unmarshaled.header.auth, req.header.auth);
+      EXPECT_EQ(unmarshaled.header.id, req.header.id);
+      EXPECT_TRUE(same(unmarshaled.body, req.body));
+    }
+
+    for (const auto& body : responses) {
+      SCOPED_TRACE(body.index());
+      schema::Response resp{
+          .id = 1ull << 63, .code = schema::Code::FORBIDDEN, .body = body};
+      auto bytes = marshalling::marshalResponse(resp, version);
+      EXPECT_EQ(bytes.size(), marshalling::responseSize(resp, version));
+      auto unmarshaled = marshalling::unmarshalResponse(bytes);
+      EXPECT_EQ(unmarshaled.id, resp.id);
+      EXPECT_EQ(unmarshaled.code, resp.code);
+      EXPECT_TRUE(same(unmarshaled.body, resp.body));
+    }
+  }
+}
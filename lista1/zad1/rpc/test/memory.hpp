@@ -0,0 +1,187 @@
+#ifndef RPC_TEST_MEMORY_HPP
+#define RPC_TEST_MEMORY_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <protocol.hpp>
+#include <schema.hpp>
+
+#include <stdio.h>
+
+namespace test {
+
+// Backend keeping files in memory, for servers under test. Safe to use from
+// many threads. Records how many writes it made and the largest transfer it
+// was asked for.
+class MemoryBackend {
+public:
+  using File = rpc::schema::File;
+  using off_t = rpc::schema::off_t;
+
+  File open(std::string pathname, rpc::schema::mode_t) {
+    std::lock_guard lock{this->mutex};
+    auto& file = this->files[pathname];
+    if (!file) {
+      file = std::make_shared<std::vector<std::uint8_t>>();
+    }
+    auto desc = this->next++;
+    this->descs.emplace(desc, Open{.file = file, .position = 0});
+    return desc;
+  }
+
+  std::int64_t read(File desc, std::uint64_t count,
+                    std::vector<std::uint8_t>& v) {
+    std::lock_guard lock{this->mutex};
+    auto it = this->descs.find(desc);
+    if (it == this->descs.end()) {
+      return -1;
+    }
+    auto n = this->transfer(*it->second.file, it->second.position, count, v);
+    it->second.position += n;
+    return n;
+  }
+
+  std::int64_t write(File desc, std::uint64_t count,
+                     std::vector<std::uint8_t>& v) {
+    std::lock_guard lock{this->mutex};
+    auto it = this->descs.find(desc);
+    if (it == this->descs.end()) {
+      return -1;
+    }
+    auto n = this->store(*it->second.file, it->second.position, count, v);
+    it->second.position += n;
+    return n;
+  }
+
+  off_t lseek(File desc, off_t offset, std::uint32_t whence) {
+    std::lock_guard lock{this->mutex};
+    auto it = this->descs.find(desc);
+    if (it == this->descs.end()) {
+      return -1;
+    }
+    auto& position = it->second.position;
+    if (whence == SEEK_CUR) {
+      offset += position;
+    } else if (whence == SEEK_END) {
+      offset += it->second.file->size();
+    }
+    if (offset < 0) {
+      return -1;
+    }
+    return position = offset;
+  }
+
+  std::int64_t chmod(std::string pathname, std::uint32_t) {
+    std::lock_guard lock{this->mutex};
+    return this->files.contains(pathname) ? 0 : -1;
+  }
+
+  std::int64_t unlink(std::string pathname) {
+    std::lock_guard lock{this->mutex};
+    return this->files.erase(pathname) > 0 ? 0 : -1;
+  }
+
+  std::int64_t rename(std::string oldpath, std::string newpath) {
+    std::lock_guard lock{this->mutex};
+    auto node = this->files.extract(oldpath);
+    if (!node) {
+      return -1;
+    }
+    this->files.insert_or_assign(newpath, std::move(node.mapped()));
+    return 0;
+  }
+
+  std::int64_t close(File desc) {
+    std::lock_guard lock{this->mutex};
+    return this->descs.erase(desc) > 0 ? 0 : -1;
+  }
+
+  std::int64_t pread(File desc, off_t offset, std::uint64_t count,
+                     std::vector<std::uint8_t>& v) {
+    std::lock_guard lock{this->mutex};
+    auto it = this->descs.find(desc);
+    if (it == this->descs.end() || offset < 0) {
+      return -1;
+    }
+    return this->transfer(*it->second.file, offset, count, v);
+  }
+
+  std::int64_t pwrite(File desc, off_t offset, std::uint64_t count,
+                      std::vector<std::uint8_t>& v) {
+    std::lock_guard lock{this->mutex};
+    auto it = this->descs.find(desc);
+    if (it == this->descs.end() || offset < 0) {
+      return -1;
+    }
+    return this->store(*it->second.file, offset, count, v);
+  }
+
+  // Empty for a missing file
+  std::vector<std::uint8_t> contents(const std::string& pathname) {
+    std::lock_guard lock{this->mutex};
+    auto it = this->files.find(pathname);
+    return it == this->files.end() ? std::vector<std::uint8_t>{}
+                                   : *it->second;
+  }
+
+  std::uint64_t largest() {
+    std::lock_guard lock{this->mutex};
+    return this->largestTransfer;
+  }
+
+  int writes() {
+    std::lock_guard lock{this->mutex};
+    return this->writeCount;
+  }
+
+private:
+  struct Open {
+    std::shared_ptr<std::vector<std::uint8_t>> file;
+    off_t position;
+  };
+
+  std::int64_t transfer(const std::vector<std::uint8_t>& file, off_t offset,
+                        std::uint64_t count, std::vector<std::uint8_t>& v) {
+    this->largestTransfer = std::max(this->largestTransfer, count);
+    auto begin = std::min<std::uint64_t>(offset, file.size());
+    auto end = begin + std::min<std::uint64_t>(count, file.size() - begin);
+    v.assign(file.begin() + begin, file.begin() + end);
+    return end - begin;
+  }
+
+  std::int64_t store(std::vector<std::uint8_t>& file, off_t offset,
+                     std::uint64_t count, std::vector<std::uint8_t>& v) {
+    count = std::min<std::uint64_t>(count, v.size());
+    this->largestTransfer = std::max(this->largestTransfer, count);
+    this->writeCount++;
+    if (file.size() < offset + count) {
+      file.resize(offset + count);
+    }
+    std::copy_n(v.begin(), count, file.begin() + offset);
+    return count;
+  }
+
+  std::mutex mutex;
+  std::map<std::string, std::shared_ptr<std::vector<std::uint8_t>>> files{};
+  std::unordered_map<File, Open> descs{};
+  File next{1};
+  std::uint64_t largestTransfer{0};
+  int writeCount{0};
+};
+
+// Transport of a server whose requests are dispatched directly
+class NoTransport : public rpc::protocol::Server {
+public:
+  virtual void setHandler(rpc::protocol::handler) override {}
+};
+
+} // namespace test
+
+#endif // RPC_TEST_MEMORY_HPP
@@ -0,0 +1,203 @@
+#include <cstdint>
+#include <gtest/gtest.h>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <server.hpp>
+#include <vector>
+
+#include "memory.hpp"
+
+namespace {
+template <typename Response>
+Response dispatch(rpc::server::TypedServer<test::MemoryBackend>& server,
+                  rpc::schema::RequestBody body, std::uint64_t auth = 1) {
+  rpc::schema::Request request{.header = {.auth = auth, .id = 1},
+                               .body = std::move(body)};
+  auto response = server.dispatch(request);
+  EXPECT_EQ(response.code, rpc::schema::Code::OK);
+  return std::get<Response>(response.body);
+}
+} // namespace
+
+TEST(rpc_server, reply_cache_order) {
+  using namespace rpc;
+  using Lookup = server::ReplyCache::Lookup;
+
+  server::ReplyCache cache{2};
+  schema::Header a{.auth = 1, .id = 1}, b{.auth = 1, .id = 2},
+      c{.auth = 1, .id = 3};
+  std::vector<std::uint8_t> reply;
+  EXPECT_EQ(cache.begin(a, reply), Lookup::MISS);
+  cache.forget(a);
+  EXPECT_EQ(cache.begin(b, reply), Lookup::MISS);
+  // Begun again, a is now newer than b
+  EXPECT_EQ(cache.begin(a, reply), Lookup::MISS);
+  cache.finish(a, {1});
+
+  // Oldest live entry goes first, stale place of a does not count
+  EXPECT_EQ(cache.begin(c, reply), Lookup::MISS);
+  EXPECT_EQ(cache.begin(a, reply), Lookup::HIT);
+  EXPECT_EQ(reply, std::vector<std::uint8_t>{1});
+  EXPECT_EQ(cache.begin(b, reply), Lookup::MISS);
+}
+
+TEST(rpc_server, handle_quotas) {
+  rpc::server::HandleQuotas quotas;
+  quotas.limitDefault(2);
+  quotas.limit(7, 0);
+
+  EXPECT_TRUE(quotas.reserve(1));
+  quotas.opened(1, 10);
+  EXPECT_TRUE(quotas.reserve(1));
+  quotas.opened(1, 11);
+  // Over the default quota, other users are not affected
+  EXPECT_FALSE(quotas.reserve(1));
+  EXPECT_TRUE(quotas.reserve(2));
+  quotas.opened(2, 0);
+  EXPECT_EQ(quotas.held(2), 0);
+  EXPECT_EQ(quotas.held(1), 2);
+
+  // Closing releases the handle
+  quotas.closed(10);
+  EXPECT_EQ(quotas.held(1), 1);
+  EXPECT_TRUE(quotas.reserve(1));
+  quotas.opened(1, 12);
+  EXPECT_FALSE(quotas.reserve(1));
+
+  // Own quota of 0 lifts the default one
+  for (rpc::schema::File desc = 20; desc < 25; desc++) {
+    EXPECT_TRUE(quotas.reserve(7));
+    quotas.opened(7, desc);
+  }
+  EXPECT_EQ(quotas.held(7), 5);
+}
+
+TEST(rpc_server, vectored_bounds) {
+  using namespace rpc;
+  test::MemoryBackend backend;
+  std::vector<std::uint8_t> data(10000, 1);
+  ASSERT_EQ(backend.open("a", 0), 1u);
+  backend.pwrite(1, 0, data.size(), data);
+  server::TypedServer server{backend, std::make_shared<test::NoTransport>(),
+                             {}};
+
+  // Counts summing past 2^64 to the payload's size are refused
+  constexpr auto wrap = std::numeric_limits<std::uint64_t>::max() - 98;
+  auto res = dispatch<schema::WriteVResponse>(
+      server,
+      schema::WriteVRequest{.desc = 1,
+                            .extents = {{.offset = 0, .count = 100},
+                                        {.offset = 5000, .count = wrap}},
+                            .count = 1,
+                            .bytes = {7}});
+  EXPECT_EQ(res.written, -1);
+  EXPECT_EQ(backend.writes(), 1);
+  // So are extents ending past the largest offset
+  res = dispatch<schema::WriteVResponse>(
+      server,
+      schema::WriteVRequest{
+          .desc = 1,
+          .extents = {{.offset = std::numeric_limits<schema::off_t>::max(),
+                       .count = 1}},
+          .count = 1,
+          .bytes = {7}});
+  EXPECT_EQ(res.written, -1);
+  EXPECT_EQ(backend.writes(), 1);
+
+  // Such an extent fails alone when read
+  auto read = dispatch<schema::ReadVResponse>(
+      server,
+      schema::ReadVRequest{
+          .desc = 1,
+          .extents = {{.offset = std::numeric_limits<schema::off_t>::max() - 1,
+                       .count = 10},
+                      {.offset = 0, .count = 2}}});
+  EXPECT_EQ(read.read, (std::vector<std::int64_t>{-1, 2}));
+  EXPECT_EQ(read.bytes, (std::vector<std::uint8_t>{1, 1}));
+
+  // Many small extents just far enough apart to merge do not make one huge
+  // read
+  std::vector<schema::Extent> extents;
+  for (std::size_t i = 0; i < server::detail::maxExtents; i++) {
+    extents.push_back({.offset = static_cast<schema::off_t>(
+                           i * server::detail::extentMergeGap),
+                       .count = 1});
+  }
+  read = dispatch<schema::ReadVResponse>(
+      server, schema::ReadVRequest{.desc = 1, .extents = extents});
+  EXPECT_LE(backend.largest(), server::detail::maxRunBytes);
+  EXPECT_EQ(read.read[0], 1);
+
+  // Too many extents or bytes are refused
+  extents.push_back({.offset = 0, .count = 1});
+  read = dispatch<schema::ReadVResponse>(
+      server, schema::ReadVRequest{.desc = 1, .extents = extents});
+  EXPECT_EQ(read.read, std::vector<std::int64_t>(extents.size(), -1));
+  auto largest = backend.largest();
+  read = dispatch<schema::ReadVResponse>(
+      server, schema::ReadVRequest{
+                  .desc = 1,
+                  .extents = {{.offset = 0,
+                               .count = server::detail::maxVectorBytes + 1}}});
+  EXPECT_EQ(read.read, std::vector<std::int64_t>{-1});
+  EXPECT_EQ(backend.largest(), largest);
+}
+
+TEST(rpc_server, permissions) {
+  using namespace rpc;
+  test::MemoryBackend backend;
+  ASSERT_EQ(backend.open("a", 0), 1u);
+  std::vector<std::uint8_t> data(10, 1);
+  backend.pwrite(1, 0, data.size(), data);
+
+  // User 5 lacks the bit of WriteRequest, user 1 is not restricted
+  server::Permissions readOnly{};
+  readOnly.fill(true);
+  readOnly[2] = false;
+  server::TypedServer server{
+      backend, std::make_shared<test::NoTransport>(), {{5, readOnly}}};
+
+  auto forbidden = [&](schema::RequestBody body) {
+    schema::Request request{.header = {.auth = 5, .id = 1},
+                            .body = std::move(body)};
+    auto response = server.dispatch(request);
+    EXPECT_EQ(response.code, schema::Code::FORBIDDEN);
+    EXPECT_EQ(response.id, 1u);
+
+    // Refused alike when dispatched asynchronously
+    std::optional<schema::Response> async;
+    server.dispatch(request, [&](schema::Response res) { async = res; });
+    ASSERT_TRUE(async);
+    EXPECT_EQ(async->code, schema::Code::FORBIDDEN);
+  };
+  forbidden(schema::WriteRequest{.desc = 1, .count = 1, .bytes = {7}});
+  forbidden(
+      schema::PWriteRequest{.desc = 1, .offset = 0, .count = 1, .bytes = {7}});
+  forbidden(schema::WriteVRequest{.desc = 1,
+                                  .extents = {{.offset = 0, .count = 1}},
+                                  .count = 1,
+                                  .bytes = {7}});
+  // So is a batch carrying a write
+  forbidden(schema::BatchRequest{
+      .requests = {schema::PReadRequest{.desc = 1, .offset = 0, .count = 1},
+                   schema::PWriteRequest{
+                       .desc = 1, .offset = 0, .count = 1, .bytes = {7}}}});
+  EXPECT_EQ(backend.writes(), 1);
+  EXPECT_EQ(backend.contents("a"), data);
+
+  // Reads still pass
+  auto read = dispatch<schema::ReadResponse>(
+      server, schema::ReadRequest{.desc = 1, .count = 4}, 5);
+  EXPECT_EQ(read.bytes, std::vector<std::uint8_t>(4, 1));
+  auto pread = dispatch<schema::PReadResponse>(
+      server, schema::PReadRequest{.desc = 1, .offset = 8, .count = 4}, 5);
+  EXPECT_EQ(pread.bytes, std::vector<std::uint8_t>(2, 1));
+
+  // Writes of other users pass
+  auto written = dispatch<schema::PWriteResponse>(
+      server,
+      schema::PWriteRequest{.desc = 1, .offset = 0, .count = 1, .bytes = {7}});
+  EXPECT_EQ(written.written, 1);
+  EXPECT_EQ(backend.writes(), 2);
+}
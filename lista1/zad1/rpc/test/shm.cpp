@@ -0,0 +1,82 @@
+#include <algorithm>
+#include <gtest/gtest.h>
+#include <memory>
+#include <shm.hpp>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+TEST(rpc_shm, live_owner) {
+  using namespace rpc;
+
+  auto name = "/rpc-shm-test-" + std::to_string(getpid());
+  {
+    shm::Server server{name, 2};
+    // Region of a running server is not taken over
+    EXPECT_THROW(shm::Server(name, 2), std::runtime_error);
+  }
+  // Nobody holds it any more
+  EXPECT_NO_THROW(shm::Server(name, 2));
+}
+
+TEST(rpc_shm, round_trip) {
+  using namespace rpc;
+  using namespace std::chrono_literals;
+
+  auto name = "/rpc-shm-test-" + std::to_string(getpid());
+  constexpr std::size_t maxMessage = 4 << 20;
+  shm::Server server{name, 2, maxMessage};
+  server.setHandler([](std::vector<std::uint8_t> request) {
+    std::reverse(request.begin(), request.end());
+    return request;
+  });
+  std::thread thread{[&server]() { server.run(); }};
+
+  {
+    shm::Client client{name, 5s, maxMessage};
+    // Longer than a ring, both ways
+    std::vector<std::uint8_t> data(3 * shm::ringSize);
+    for (std::size_t i = 0; i < data.size(); i++) {
+      data[i] = i % 251;
+    }
+    auto reply = client.makeRequest(data);
+    std::reverse(data.begin(), data.end());
+    EXPECT_EQ(reply, data);
+    EXPECT_TRUE(client.makeRequest({}).empty());
+
+    std::vector<std::uint8_t> oversize(maxMessage + 1);
+    EXPECT_THROW(client.makeRequest(oversize), std::system_error);
+    EXPECT_EQ(client.makeRequest({1, 2}), (std::vector<std::uint8_t>{2, 1}));
+  }
+
+  server.stop();
+  thread.join();
+}
+
+TEST(rpc_shm, corrupted_ring) {
+  using namespace rpc;
+
+  auto ring = std::make_unique<shm::detail::Ring>();
+  ring->reset();
+  std::vector<std::uint8_t> data(100, 1);
+  EXPECT_EQ(ring->tryWrite(data.data(), data.size()), 100u);
+  EXPECT_FALSE(ring->corrupted());
+
+  // Head moved past the tail by the peer
+  ring->head = ring->tail + 1;
+  EXPECT_TRUE(ring->corrupted());
+  EXPECT_EQ(ring->space(), 0u);
+  EXPECT_EQ(ring->tryWrite(data.data(), data.size()), 0u);
+  EXPECT_EQ(ring->tryRead(data.data(), data.size()), 0u);
+
+  // Tail announcing more than the ring holds
+  ring->head = 0;
+  ring->tail = shm::ringSize + 1;
+  EXPECT_TRUE(ring->corrupted());
+  EXPECT_EQ(ring->tryRead(data.data(), data.size()), 0u);
+  EXPECT_EQ(ring->head, 0u);
+}
@@ -0,0 +1,70 @@
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <gtest/gtest.h>
+#include <numeric>
+#include <string>
+#include <system_error>
+#include <tcp.hpp>
+#include <thread>
+#include <vector>
+
+TEST(rpc_tcp, frame_header) {
+  using namespace rpc;
+
+  auto bytes = tcp::writeFrameHeader({.length = 42, .id = 7});
+  auto header = tcp::readFrameHeader(bytes);
+  EXPECT_EQ(header.length, 42u);
+  EXPECT_EQ(header.id, 7u);
+}
+
+TEST(rpc_tcp, loopback) {
+  using namespace rpc;
+  using namespace std::chrono_literals;
+
+  tcp::Server server{"127.0.0.1", 15731, true, 1 << 20};
+  server.setHandler([](std::vector<std::uint8_t> request) {
+    std::reverse(request.begin(), request.end());
+    return request;
+  });
+  std::thread thread{[&server]() { server.run(); }};
+  std::this_thread::sleep_for(100ms);
+
+  {
+    tcp::Client client{"127.0.0.1:15731", true, 5s};
+    // Payload spans many read chunks
+    std::vector<std::uint8_t> data(3 * tcp::frameChunkSize + 5);
+    std::iota(data.begin(), data.end(), 0);
+    auto reply = client.makeRequest(data);
+    std::reverse(data.begin(), data.end());
+    EXPECT_EQ(reply, data);
+    EXPECT_TRUE(client.makeRequest({}).empty());
+
+    // Frames over the limit are refused before they are sent
+    std::vector<std::uint8_t> large((1 << 20) + 1);
+    EXPECT_THROW(tcp::Client(std::string{"127.0.0.1:15731"}, true, 5s,
+                             1 << 20)
+                     .makeRequest(large),
+                 std::system_error);
+  }
+
+  {
+    // Header announcing an oversized frame drops the connection, the server
+    // keeps serving others
+    asio::io_context ctx;
+    asio::ip::tcp::socket socket{ctx};
+    socket.connect({asio::ip::make_address("127.0.0.1"), 15731});
+    auto header = tcp::writeFrameHeader({.length = 0xFFFFFFFF, .id = 1});
+    asio::write(socket, asio::buffer(header));
+    std::array<std::uint8_t, 1> byte{};
+    asio::error_code ec;
+    asio::read(socket, asio::buffer(byte), ec);
+    EXPECT_TRUE(ec);
+
+    tcp::Client client{"127.0.0.1:15731", true, 5s};
+    EXPECT_EQ(client.makeRequest({1, 2}), (std::vector<std::uint8_t>{2, 1}));
+  }
+
+  server.stop();
+  thread.join();
+}
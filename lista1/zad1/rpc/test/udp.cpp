@@ -0,0 +1,299 @@
+#include <algorithm>
+#include <chrono>
+#include <client.hpp>
+#include <future>
+#include <gtest/gtest.h>
+#include <ios>
+#include <marshalling.hpp>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <set>
+#include <server.hpp>
+#include <thread>
+#include <udp.hpp>
+#include <vector>
+
+#include "memory.hpp"
+
+namespace {
+constexpr auto readWrite = static_cast<rpc::schema::mode_t>(std::ios_base::in |
+                                                            std::ios_base::out);
+
+void send(asio::ip::udp::socket& socket,
+          const asio::ip::udp::endpoint& endpoint, std::uint64_t id,
+          const std::vector<std::uint8_t>& message) {
+  for (const auto& datagram :
+       rpc::udp::fragment(id, message, rpc::udp::defaultDatagramSize)) {
+    socket.send_to(asio::buffer(datagram), endpoint);
+  }
+}
+
+// Messages used here fit in a single datagram
+std::vector<std::uint8_t> receive(asio::ip::udp::socket& socket,
+                                  asio::ip::udp::endpoint& sender) {
+  std::vector<std::uint8_t> datagram(rpc::udp::maxDatagramSize);
+  datagram.resize(socket.receive_from(asio::buffer(datagram), sender));
+  return datagram;
+}
+} // namespace
+
+TEST(rpc_udp, fragmentation) {
+  using namespace rpc;
+
+  std::vector<std::uint8_t> data(10000, 0);
+  std::iota(data.begin(), data.end(), 0);
+  auto datagrams = udp::fragment(7, data, 1000);
+  ASSERT_EQ(datagrams.size(), 11);
+  for (const auto& datagram : datagrams) {
+    EXPECT_LE(datagram.size(), 1000);
+  }
+
+  // Reassembly does not depend on arrival order
+  std::reverse(datagrams.begin(), datagrams.end());
+  udp::Reassembler reassembler{};
+  udp::Reassembler::endpoint sender{asio::ip::address_v4::loopback(), 13};
+  std::optional<udp::Reassembler::Message> message{};
+  for (std::size_t i = 0; i < datagrams.size(); i++) {
+    EXPECT_FALSE(message);
+    message = reassembler.push(sender, datagrams[i]);
+    // Duplicates are ignored
+    if (i == 0) {
+      EXPECT_FALSE(reassembler.push(sender, datagrams[i]));
+    }
+  }
+  ASSERT_TRUE(message);
+  EXPECT_EQ(message->id, 7);
+  EXPECT_EQ(message->bytes, data);
+}
+
+TEST(rpc_udp, empty_message) {
+  using namespace rpc;
+
+  auto datagrams = udp::fragment(3, {}, udp::defaultDatagramSize);
+  ASSERT_EQ(datagrams.size(), 1);
+
+  udp::Reassembler reassembler{};
+  auto message = reassembler.push({}, datagrams[0]);
+  ASSERT_TRUE(message);
+  EXPECT_EQ(message->id, 3);
+  EXPECT_TRUE(message->bytes.empty());
+}
+
+TEST(rpc_udp, reassembly_bounds) {
+  using namespace rpc;
+
+  udp::Reassembler reassembler{4, 1000, 10000};
+  udp::Reassembler::endpoint sender{asio::ip::address_v4::loopback(), 13};
+  // Forged count is dropped before anything is allocated for it
+  auto forged = udp::writeFragmentHeader(
+      {.message = 1, .index = 0, .count = 0xFFFFFFFF});
+  std::vector<std::uint8_t> datagram(forged.begin(), forged.end());
+  datagram.resize(100, 1);
+  EXPECT_FALSE(reassembler.push(sender, datagram));
+  EXPECT_EQ(reassembler.pendingBytes(), 0u);
+
+  // Longest message allowed still gets through
+  std::vector<std::uint8_t> data(10000, 2);
+  auto datagrams = udp::fragment(2, data, 1000);
+  std::optional<udp::Reassembler::Message> message{};
+  for (const auto& fragment : datagrams) {
+    message = reassembler.push(sender, fragment);
+  }
+  ASSERT_TRUE(message);
+  EXPECT_EQ(message->bytes, data);
+
+  // Partial messages together stay within twice the limit
+  for (std::uint64_t id = 10; id < 14; id++) {
+    auto parts = udp::fragment(id, data, 1000);
+    parts.pop_back();
+    for (const auto& fragment : parts) {
+      EXPECT_FALSE(reassembler.push(sender, fragment));
+    }
+  }
+  EXPECT_LE(reassembler.pendingBytes(), 20000u);
+}
+
+TEST(rpc_udp, rtt_estimator) {
+  using namespace rpc;
+  using namespace std::chrono_literals;
+
+  udp::RttEstimator estimator{};
+  EXPECT_EQ(estimator.rto(), udp::initialRto);
+
+  // Steady round trips bring the timeout down to the lower bound
+  for (int i = 0; i < 100; i++) {
+    estimator.sample(1ms);
+  }
+  EXPECT_EQ(estimator.rto(), udp::minRto);
+
+  // Losses back off until the next measured round trip
+  estimator.backoff();
+  estimator.backoff();
+  EXPECT_EQ(estimator.rto(), 4 * udp::minRto);
+  estimator.sample(1ms);
+  EXPECT_EQ(estimator.rto(), udp::minRto);
+
+  // Slow round trips raise it, but never past the upper bound
+  estimator.sample(50ms);
+  EXPECT_GT(estimator.rto(), 50ms);
+  for (int i = 0; i < 100; i++) {
+    estimator.sample(10s);
+  }
+  EXPECT_EQ(estimator.rto(), udp::maxRto);
+}
+
+TEST(rpc_udp, retransmission) {
+  using namespace rpc;
+  using namespace std::chrono;
+  using namespace std::chrono_literals;
+
+  asio::io_context ctx;
+  asio::ip::udp::socket peer{
+      ctx, {asio::ip::address_v4::loopback(), 15751}};
+  udp::Client client{"127.0.0.1:15751", udp::defaultDatagramSize, 5s};
+  std::promise<std::vector<std::uint8_t>> reply;
+  client.asyncRequest(9, {1, 2, 3},
+                      [&reply](std::error_code ec,
+                               std::vector<std::uint8_t> bytes) {
+                        EXPECT_FALSE(ec);
+                        reply.set_value(std::move(bytes));
+                      });
+
+  // Unanswered request is sent again under the same id, waiting twice as
+  // long after every loss
+  asio::ip::udp::endpoint sender;
+  std::vector<steady_clock::time_point> arrivals;
+  for (int i = 0; i < 3; i++) {
+    auto datagram = receive(peer, sender);
+    arrivals.push_back(steady_clock::now());
+    auto header = udp::readFragmentHeader(datagram);
+    ASSERT_TRUE(header);
+    EXPECT_EQ(header->message, 9u);
+  }
+  // Timers do not fire early, some slack is left for the receiving side
+  EXPECT_GE(arrivals[1] - arrivals[0], udp::initialRto - 20ms);
+  EXPECT_GE(arrivals[2] - arrivals[1], 2 * udp::initialRto - 20ms);
+
+  send(peer, sender, 9, {4, 5});
+  auto future = reply.get_future();
+  ASSERT_EQ(future.wait_for(5s), std::future_status::ready);
+  EXPECT_EQ(future.get(), (std::vector<std::uint8_t>{4, 5}));
+}
+
+TEST(rpc_udp, retried_write_applied_once) {
+  using namespace rpc;
+  using namespace std::chrono_literals;
+
+  test::MemoryBackend backend;
+  auto transport = std::make_shared<udp::Server>("127.0.0.1", 15752);
+  server::TypedServer server{backend, transport, {}, 2};
+  std::thread thread{[transport]() { transport->run(); }};
+  std::this_thread::sleep_for(100ms);
+  asio::ip::udp::endpoint target{asio::ip::address_v4::loopback(), 15752};
+
+  // Same request sent twice, as after a lost reply
+  asio::io_context ctx;
+  asio::ip::udp::socket socket{ctx, {asio::ip::address_v4::loopback(), 0}};
+  asio::ip::udp::endpoint sender;
+  auto desc = backend.open("f", readWrite);
+  auto request = marshalling::marshalRequest(
+      schema::Request{.header = {.auth = 1, .id = 5},
+                      .body = schema::WriteRequest{
+                          .desc = desc, .count = 3, .bytes = {1, 2, 3}}},
+      marshalling::latest);
+  send(socket, target, 5, request);
+  auto first = receive(socket, sender);
+  send(socket, target, 5, request);
+  auto second = receive(socket, sender);
+
+  // Second one is answered from the cache
+  EXPECT_EQ(first, second);
+  EXPECT_EQ(backend.writes(), 1);
+  EXPECT_EQ(backend.contents("f"), (std::vector<std::uint8_t>{1, 2, 3}));
+
+  // Client retransmitting after the relay dropped the reply to its write
+  asio::ip::udp::socket relay{ctx, {asio::ip::address_v4::loopback(), 15753}};
+  std::thread proxy{[&]() {
+    asio::ip::udp::endpoint client, from;
+    for (int i = 0; i < 3; i++) {
+      auto datagram = receive(relay, client);
+      socket.send_to(asio::buffer(datagram), target);
+      auto answer = receive(socket, from);
+      // Reply to the first try of the write is lost
+      if (i != 1) {
+        relay.send_to(asio::buffer(answer), client);
+      }
+    }
+  }};
+  {
+    client::Client client{1, std::make_shared<udp::Client>(
+                                 "127.0.0.1:15753", udp::defaultDatagramSize,
+                                 5s)};
+    EXPECT_EQ(client.lseek(desc, 0, SEEK_END), 3);
+    std::vector<std::uint8_t> data{4, 5};
+    EXPECT_EQ(client.write(desc, data.size(), data), 2);
+  }
+  proxy.join();
+  EXPECT_EQ(backend.writes(), 2);
+  EXPECT_EQ(backend.contents("f"),
+            (std::vector<std::uint8_t>{1, 2, 3, 4, 5}));
+
+  transport->stop();
+  thread.join();
+}
+
+TEST(rpc_udp, shared_port) {
+  using namespace rpc;
+  using namespace std::chrono_literals;
+  constexpr std::size_t clients = 8;
+  constexpr std::size_t requests = 200;
+
+  udp::Server server{"127.0.0.1", 15754, 4};
+  std::mutex mutex;
+  std::set<std::thread::id> threads;
+  server.setHandler([&](std::vector<std::uint8_t> request) {
+    {
+      std::lock_guard lock{mutex};
+      threads.insert(std::this_thread::get_id());
+    }
+    std::reverse(request.begin(), request.end());
+    return request;
+  });
+  std::thread thread{[&server]() { server.run(); }};
+  std::this_thread::sleep_for(100ms);
+
+  // Pipelined requests arrive in bursts, which are received and answered
+  // in batches
+  std::vector<std::unique_ptr<udp::Client>> transports;
+  std::vector<std::future<std::vector<std::uint8_t>>> replies;
+  for (std::size_t i = 0; i < clients; i++) {
+    transports.push_back(std::make_unique<udp::Client>("127.0.0.1:15754"));
+    for (std::size_t j = 0; j < requests; j++) {
+      auto promise =
+          std::make_shared<std::promise<std::vector<std::uint8_t>>>();
+      replies.push_back(promise->get_future());
+      transports.back()->asyncRequest(
+          j, {static_cast<std::uint8_t>(i), static_cast<std::uint8_t>(j)},
+          [promise](std::error_code ec, std::vector<std::uint8_t> bytes) {
+            EXPECT_FALSE(ec);
+            promise->set_value(std::move(bytes));
+          });
+    }
+  }
+  for (std::size_t i = 0; i < replies.size(); i++) {
+    EXPECT_EQ(replies[i].get(),
+              (std::vector<std::uint8_t>{
+                  static_cast<std::uint8_t>(i % requests),
+                  static_cast<std::uint8_t>(i / requests)}));
+  }
+  {
+    // Peers are spread between the sockets
+    std::lock_guard lock{mutex};
+    EXPECT_GT(threads.size(), 1u);
+  }
+
+  transports.clear();
+  server.stop();
+  thread.join();
+}
@@ -0,0 +1,76 @@
+#include <atomic>
+#include <gtest/gtest.h>
+#include <latch>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <workers.hpp>
+
+TEST(rpc_workers, queue) {
+  rpc::workers::Queue<int> queue{3};
+  int value;
+  EXPECT_FALSE(queue.pop(value));
+  // Capacity is rounded up to 4
+  for (int i = 0; i < 4; i++) {
+    EXPECT_TRUE(queue.push(int{i}));
+  }
+  EXPECT_FALSE(queue.push(4));
+  for (int i = 0; i < 4; i++) {
+    ASSERT_TRUE(queue.pop(value));
+    EXPECT_EQ(value, i);
+  }
+  EXPECT_FALSE(queue.pop(value));
+
+  // Every value pushed by the producers is popped exactly once
+  constexpr int producers = 4, perProducer = 10000;
+  rpc::workers::Queue<int> shared{64};
+  std::vector<std::atomic<int>> seen(producers * perProducer);
+  std::vector<std::jthread> threads;
+  for (int p = 0; p < producers; p++) {
+    threads.emplace_back([&shared, p]() {
+      for (int i = 0; i < perProducer; i++) {
+        while (!shared.push(p * perProducer + i)) {
+          std::this_thread::yield();
+        }
+      }
+    });
+  }
+  std::atomic<int> popped{0};
+  for (int c = 0; c < 4; c++) {
+    threads.emplace_back([&]() {
+      int value;
+      while (popped.load() < producers * perProducer) {
+        if (shared.pop(value)) {
+          seen[value]++;
+          popped++;
+        }
+      }
+    });
+  }
+  threads.clear();
+  for (auto& count : seen) {
+    EXPECT_EQ(count.load(), 1);
+  }
+}
+
+TEST(rpc_workers, serial) {
+  std::vector<int> order;
+  std::mutex mutex;
+  std::latch done{1000};
+  {
+    rpc::workers::Pool pool{4, 16};
+    rpc::workers::Serial serial{pool};
+    for (int i = 0; i < 1000; i++) {
+      serial.post([&order, &mutex, &done, i]() {
+        std::lock_guard lock{mutex};
+        order.push_back(i);
+        done.count_down();
+      });
+    }
+    done.wait();
+  }
+  ASSERT_EQ(order.size(), 1000u);
+  for (int i = 0; i < 1000; i++) {
+    EXPECT_EQ(order[i], i);
+  }
+}